@@ -5,6 +5,30 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RUN_KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define RUN_KERNELS_NEON 1
+#endif
+
+// Decode kernels only use instructions every CPU of the target has
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DECODE_KERNELS_SSE2 1
+#elif defined(__aarch64__)
+#define DECODE_KERNELS_NEON 1
+#endif
 
 /**
  * Combined Compression Algorithms Implementation
@@ -15,71 +39,305 @@
  * 3. Comprehensive performance testing suite
  */
 
+// ALLOCATOR
+// Every buffer the codecs allocate for themselves goes through codec_alloc and
+// codec_free, which call the installed CodecAllocator: malloc and free until
+// codec_set_allocator replaces them. A process that can't use the general
+// allocator on its hot path installs a BumpArena, or its own pool, and resets
+// it between frames. The hooks are process-wide, so install them before the
+// first codec call, and make sure they are thread-safe if codecs run on
+// several threads. Thread stacks and buffers the caller passes in are not
+// allocated through them.
+
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);   // NULL on failure
+    void (*free)(void* ctx, void* ptr);       // never called with NULL
+    void* ctx;
+} CodecAllocator;
+
+static void* default_alloc(void* ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void default_free(void* ctx, void* ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+static CodecAllocator codec_allocator = {default_alloc, default_free, NULL};
+
+// NULL puts malloc and free back
+void codec_set_allocator(const CodecAllocator* allocator) {
+    if (allocator && allocator->alloc && allocator->free) {
+        codec_allocator = *allocator;
+    } else {
+        codec_allocator = (CodecAllocator){default_alloc, default_free, NULL};
+    }
+}
+
+static void* codec_alloc(size_t size) {
+    return codec_allocator.alloc(codec_allocator.ctx, size);
+}
+
+static void* codec_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+    void* ptr = codec_alloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static void codec_free(void* ptr) {
+    if (ptr) codec_allocator.free(codec_allocator.ctx, ptr);
+}
+
+// BumpArena: hands out 16-byte aligned slices of one caller-provided block
+// and frees nothing until bump_arena_reset. Allocation is a single atomic
+// compare-and-swap, so parallel workers can share one arena. peak is the
+// highest the arena has been filled since bump_arena_init.
+#define BUMP_ARENA_ALIGN 16
+
+typedef struct {
+    uint8_t* memory;
+    size_t capacity;
+    size_t used;
+    size_t peak;
+} BumpArena;
+
+void bump_arena_init(BumpArena* arena, void* memory, size_t capacity) {
+    arena->memory = (uint8_t*)memory;
+    arena->capacity = memory ? capacity : 0;
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+// Only call between frames, when no codec call is using the arena
+void bump_arena_reset(BumpArena* arena) {
+    arena->used = 0;
+}
+
+static void* bump_arena_alloc(void* ctx, size_t size) {
+    BumpArena* arena = (BumpArena*)ctx;
+    size_t used = __atomic_load_n(&arena->used, __ATOMIC_RELAXED);
+    size_t offset, end;
+    
+    do {
+        offset = (used + BUMP_ARENA_ALIGN - 1) & ~(size_t)(BUMP_ARENA_ALIGN - 1);
+        if (offset > arena->capacity || size > arena->capacity - offset) return NULL;
+        end = offset + size;
+    } while (!__atomic_compare_exchange_n(&arena->used, &used, end, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    size_t peak = __atomic_load_n(&arena->peak, __ATOMIC_RELAXED);
+    while (end > peak && !__atomic_compare_exchange_n(&arena->peak, &peak, end, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    return arena->memory + offset;
+}
+
+static void bump_arena_free(void* ctx, void* ptr) {
+    (void)ctx;
+    (void)ptr;
+}
+
+CodecAllocator bump_arena_allocator(BumpArena* arena) {
+    return (CodecAllocator){bump_arena_alloc, bump_arena_free, arena};
+}
+
+// RUN DETECTION KERNELS
+// count_run(p, limit) counts how many bytes from p equal p[0], stopping at
+// limit (limit >= 1). Every kernel gives the same answer; the vector ones
+// compare 16 or 32 bytes per step. The best kernel the CPU supports is picked
+// once, on first use.
+
+typedef size_t (*RunLengthFn)(const uint8_t* p, size_t limit);
+
+static size_t run_length_scalar(const uint8_t* p, size_t limit) {
+    size_t length = 1;
+    while (length < limit && p[length] == p[0]) length++;
+    return length;
+}
+
+#if defined(RUN_KERNELS_X86)
+__attribute__((target("sse2")))
+static size_t run_length_sse2(const uint8_t* p, size_t limit) {
+    __m128i value = _mm_set1_epi8((char)p[0]);
+    size_t length = 1;
+    
+    while (length + 16 <= limit) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(p + length));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, value));
+        if (mask != 0xFFFF) return length + (size_t)__builtin_ctz(~mask);
+        length += 16;
+    }
+    while (length < limit && p[length] == p[0]) length++;
+    return length;
+}
+
+__attribute__((target("avx2")))
+static size_t run_length_avx2(const uint8_t* p, size_t limit) {
+    __m256i value = _mm256_set1_epi8((char)p[0]);
+    size_t length = 1;
+    
+    while (length + 32 <= limit) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(p + length));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, value));
+        if (mask != 0xFFFFFFFFu) return length + (size_t)__builtin_ctz(~mask);
+        length += 32;
+    }
+    while (length < limit && p[length] == p[0]) length++;
+    return length;
+}
+#endif
+
+#if defined(RUN_KERNELS_NEON)
+static size_t run_length_neon(const uint8_t* p, size_t limit) {
+    uint8x16_t value = vdupq_n_u8(p[0]);
+    size_t length = 1;
+    
+    // Whole blocks only; the scalar tail finds the exact end
+    while (length + 16 <= limit) {
+        uint8x16_t block = vld1q_u8(p + length);
+        if (vminvq_u8(vceqq_u8(block, value)) != 0xFF) break;
+        length += 16;
+    }
+    while (length < limit && p[length] == p[0]) length++;
+    return length;
+}
+#endif
+
+static RunLengthFn run_length_impl = run_length_scalar;
+static const char* run_length_kernel = "scalar";
+static pthread_once_t run_length_once = PTHREAD_ONCE_INIT;
+
+static void run_length_select(void) {
+#if defined(RUN_KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        run_length_impl = run_length_avx2;
+        run_length_kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        run_length_impl = run_length_sse2;
+        run_length_kernel = "sse2";
+    }
+#elif defined(RUN_KERNELS_NEON)
+    run_length_impl = run_length_neon;
+    run_length_kernel = "neon";
+#endif
+}
+
+static inline size_t count_run(const uint8_t* p, size_t limit) {
+    pthread_once(&run_length_once, run_length_select);
+    return run_length_impl(p, limit);
+}
+
 // SIMPLE RLE COMPRESSION (Baseline Algorithm)
 
 #define RLE_FLAG 0x80
 #define MIN_RUN_LENGTH 2
 #define MAX_RUN_LENGTH 127
 
-size_t simple_rle_compress(uint8_t* data_ptr, size_t data_size) {
-    if (!data_ptr || data_size == 0) return 0;
-    
-    uint8_t* temp_buffer = (uint8_t*)malloc(data_size * 2);
-    if (!temp_buffer) return data_size;
+// Worst case is a 1-byte literal followed by a 2-byte run: 3 bytes become 4.
+size_t simple_rle_compress_bound(size_t data_size) {
+    return data_size + (data_size + 2) / 3;
+}
+
+// The _to variants read from one buffer and write into another. They return
+// the number of bytes written, or 0 if the input is empty or the output
+// buffer is too small.
+size_t simple_rle_compress_to(const uint8_t* data_ptr, size_t data_size,
+                              uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || data_size == 0) return 0;
     
     size_t write_pos = 0;
     size_t read_pos = 0;
     
     while (read_pos < data_size) {
-        size_t run_length = 1;
         uint8_t current_byte = data_ptr[read_pos];
-        
-        while (read_pos + run_length < data_size && 
-               data_ptr[read_pos + run_length] == current_byte &&
-               run_length < MAX_RUN_LENGTH) {
-            run_length++;
-        }
+        size_t remaining = data_size - read_pos;
+        size_t run_length = count_run(&data_ptr[read_pos],
+                                      remaining < MAX_RUN_LENGTH ? remaining : MAX_RUN_LENGTH);
         
         if (run_length >= MIN_RUN_LENGTH) {
-            temp_buffer[write_pos++] = RLE_FLAG | (uint8_t)run_length;
-            temp_buffer[write_pos++] = current_byte;
+            if (write_pos + 2 > output_capacity) return 0;
+            output[write_pos++] = RLE_FLAG | (uint8_t)run_length;
+            output[write_pos++] = current_byte;
             read_pos += run_length;
         } else {
             size_t literal_start = read_pos;
             size_t literal_count = 0;
             
+            // Only whether a run starts matters here, not how long it is
             while (read_pos < data_size && literal_count < MAX_RUN_LENGTH) {
-                size_t ahead_run = 1;
-                if (read_pos + 1 < data_size) {
-                    while (read_pos + ahead_run < data_size && 
-                           data_ptr[read_pos + ahead_run] == data_ptr[read_pos] &&
-                           ahead_run < MAX_RUN_LENGTH) {
-                        ahead_run++;
-                    }
-                }
+                if (read_pos + 1 < data_size && data_ptr[read_pos + 1] == data_ptr[read_pos]) break;
                 
-                if (ahead_run >= MIN_RUN_LENGTH) break;
-                
-                read_pos += ahead_run;
-                literal_count += ahead_run;
+                read_pos++;
+                literal_count++;
             }
             
-            temp_buffer[write_pos++] = (uint8_t)literal_count;
-            memcpy(&temp_buffer[write_pos], &data_ptr[literal_start], literal_count);
+            if (write_pos + 1 + literal_count > output_capacity) return 0;
+            output[write_pos++] = (uint8_t)literal_count;
+            memcpy(&output[write_pos], &data_ptr[literal_start], literal_count);
             write_pos += literal_count;
         }
     }
     
-    memcpy(data_ptr, temp_buffer, write_pos);
-    free(temp_buffer);
     return write_pos;
 }
 
-size_t simple_rle_decompress(uint8_t* data_ptr, size_t compressed_size) {
-    if (!data_ptr || compressed_size == 0) return 0;
+// The _ex variants stage their output in a caller-provided scratch buffer
+// instead of allocating one. If the scratch buffer runs out they return the
+// input size and leave data_ptr untouched, just like a failed malloc.
+size_t simple_rle_compress_ex(uint8_t* data_ptr, size_t data_size,
+                              uint8_t* scratch, size_t scratch_capacity) {
+    if (!data_ptr || data_size == 0) return 0;
     
-    uint8_t* temp_buffer = (uint8_t*)malloc(compressed_size * MAX_RUN_LENGTH);
-    if (!temp_buffer) return compressed_size;
+    size_t result = simple_rle_compress_to(data_ptr, data_size, scratch, scratch_capacity);
+    if (result == 0) return data_size;
+    
+    memcpy(data_ptr, scratch, result);
+    return result;
+}
+
+size_t simple_rle_compress(uint8_t* data_ptr, size_t data_size) {
+    if (!data_ptr || data_size == 0) return 0;
+    
+    size_t bound = simple_rle_compress_bound(data_size);
+    uint8_t* temp_buffer = (uint8_t*)codec_alloc(bound);
+    if (!temp_buffer) return data_size;
+    
+    size_t result = simple_rle_compress_ex(data_ptr, data_size, temp_buffer, bound);
+    codec_free(temp_buffer);
+    return result;
+}
+
+// Walks the token stream and sums the run and literal lengths without
+// decoding anything. Returns 0 for an empty or truncated stream.
+size_t simple_rle_decompressed_size(const uint8_t* data_ptr, size_t compressed_size) {
+    if (!data_ptr) return 0;
+    
+    size_t total = 0;
+    size_t read_pos = 0;
+    
+    while (read_pos < compressed_size) {
+        uint8_t control_byte = data_ptr[read_pos++];
+        
+        if (control_byte & RLE_FLAG) {
+            if (read_pos >= compressed_size) return 0;
+            total += control_byte & 0x7F;
+            read_pos++;
+        } else {
+            if (read_pos + control_byte > compressed_size) return 0;
+            total += control_byte;
+            read_pos += control_byte;
+        }
+    }
+    
+    return total;
+}
+
+size_t simple_rle_decompress_to(const uint8_t* data_ptr, size_t compressed_size,
+                                uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || compressed_size == 0) return 0;
     
     size_t write_pos = 0;
     size_t read_pos = 0;
@@ -90,24 +348,50 @@ size_t simple_rle_decompress(uint8_t* data_ptr, size_t compressed_size) {
         if (control_byte & RLE_FLAG) {
             size_t run_length = control_byte & 0x7F;
             if (read_pos < compressed_size) {
+                if (write_pos + run_length > output_capacity) return 0;
                 uint8_t value = data_ptr[read_pos++];
                 for (size_t i = 0; i < run_length; i++) {
-                    temp_buffer[write_pos++] = value;
+                    output[write_pos++] = value;
                 }
             }
         } else {
             size_t literal_count = control_byte;
+            if (write_pos + literal_count > output_capacity) return 0;
             for (size_t i = 0; i < literal_count && read_pos < compressed_size; i++) {
-                temp_buffer[write_pos++] = data_ptr[read_pos++];
+                output[write_pos++] = data_ptr[read_pos++];
             }
         }
     }
     
-    memcpy(data_ptr, temp_buffer, write_pos);
-    free(temp_buffer);
     return write_pos;
 }
 
+size_t simple_rle_decompress_ex(uint8_t* data_ptr, size_t compressed_size,
+                                uint8_t* scratch, size_t scratch_capacity) {
+    if (!data_ptr || compressed_size == 0) return 0;
+    
+    size_t result = simple_rle_decompress_to(data_ptr, compressed_size, scratch, scratch_capacity);
+    if (result == 0) return compressed_size;
+    
+    memcpy(data_ptr, scratch, result);
+    return result;
+}
+
+size_t simple_rle_decompress(uint8_t* data_ptr, size_t compressed_size) {
+    if (!data_ptr || compressed_size == 0) return 0;
+    
+    // Size the buffer from the token stream rather than the worst-case expansion
+    size_t decoded_size = simple_rle_decompressed_size(data_ptr, compressed_size);
+    if (decoded_size == 0) return compressed_size;
+    
+    uint8_t* temp_buffer = (uint8_t*)codec_alloc(decoded_size);
+    if (!temp_buffer) return compressed_size;
+    
+    size_t result = simple_rle_decompress_ex(data_ptr, compressed_size, temp_buffer, decoded_size);
+    codec_free(temp_buffer);
+    return result;
+}
+
 // ADVANCED MULTI-STRATEGY COMPRESSION
 
 #define MODE_RLE        0x80
@@ -121,52 +405,319 @@ size_t simple_rle_decompress(uint8_t* data_ptr, size_t compressed_size) {
 #define EXT_ZERO_RUN    0xF0
 #define EXT_INCR_SEQ    0xF1
 #define EXT_COMMON_VAL  0xF2
+#define EXT_MATCH       0xF3
 
 static const uint8_t common_values[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0xFF, 0x7F, 0x20};
 #define NUM_COMMON_VALUES 8
 
+// Token kinds, as counted by the encoder statistics and looked up by the
+// control byte table below. Format v2 bit-pack tokens count as nibbles.
+typedef enum {
+    TOKEN_LITERAL,
+    TOKEN_NIBBLE,
+    TOKEN_RLE,
+    TOKEN_DELTA,
+    TOKEN_ZERO_RUN,
+    TOKEN_PATTERN,
+    TOKEN_COMMON_VAL,
+    TOKEN_MATCH,
+    TOKEN_KIND_COUNT
+} TokenKind;
+
+// ENCODER STATISTICS
+// Built with -DCODEC_STATS, the advanced encoders (v1 and v2, every level,
+// one-shot and streaming) count what they emit into the EncoderStats attached
+// to the calling thread: tokens, input bytes covered and bytes written per
+// TokenKind, and attempts, hits and cycles per stage. Without CODEC_STATS the
+// hooks compile to nothing and encoder_stats_attach returns false.
+//
+// Every encode on the thread counts, including the block analyzer's sample
+// trial and the discarded candidate of a level 3 v2 block, so for a frame the
+// numbers describe the work done rather than the frame written. Blocks that
+// frame_compress hands to worker threads are not counted; measure frames
+// with threads = 1.
+//
+// Cycles are timestamp counter ticks (nanoseconds where there's no counter).
+// The literal scan includes its match probes; level 3's reach probes are all
+// inside STAGE_OPTIMAL.
+
+typedef enum {
+    STAGE_MATCH_SEARCH,     // hit: a match of MATCH_MIN_LENGTH or more
+    STAGE_DELTA,            // hit: a delta run of 3 or more
+    STAGE_NIBBLE,           // hit: enough bytes below 16 for a nibble token
+    STAGE_BITPACK,          // hit: enough bytes below 128 for a bit-pack token
+    STAGE_MATCH_PROBE,      // hit: a literal ended in front of a match
+    STAGE_LITERAL_SCAN,     // one attempt per literal token
+    STAGE_OPTIMAL,          // one attempt per optimal parse segment
+    STAGE_COUNT
+} EncoderStage;
+
+typedef struct {
+    uint64_t tokens[TOKEN_KIND_COUNT];
+    uint64_t bytes_covered[TOKEN_KIND_COUNT];
+    uint64_t bytes_written[TOKEN_KIND_COUNT];
+    uint64_t attempts[STAGE_COUNT];
+    uint64_t hits[STAGE_COUNT];
+    uint64_t cycles[STAGE_COUNT];
+    uint64_t dedup_lookups;     // frames looked up in a DedupCache
+    uint64_t dedup_hits;        // ... and found, skipping the encoder
+    uint64_t dedup_bytes;       // input bytes those hits covered
+} EncoderStats;
+
+static const char* const token_kind_names[TOKEN_KIND_COUNT] = {
+    "literal", "nibble", "rle", "delta", "zero_run", "pattern", "common_value", "match"
+};
+static const char* const encoder_stage_names[STAGE_COUNT] = {
+    "match_search", "delta", "nibble", "bitpack", "match_probe", "literal_scan", "optimal"
+};
+
+#if defined(CODEC_STATS)
+static _Thread_local EncoderStats* encoder_stats_current;
+
+static inline uint64_t stats_clock(void) {
+    if (!encoder_stats_current) return 0;
+#if defined(RUN_KERNELS_X86)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void stats_token(TokenKind kind, size_t covered, size_t written) {
+    EncoderStats* stats = encoder_stats_current;
+    if (!stats) return;
+    stats->tokens[kind]++;
+    stats->bytes_covered[kind] += covered;
+    stats->bytes_written[kind] += written;
+}
+
+static inline void stats_count(EncoderStage stage, bool hit) {
+    EncoderStats* stats = encoder_stats_current;
+    if (!stats) return;
+    stats->attempts[stage]++;
+    stats->hits[stage] += hit;
+}
+
+static inline void stats_dedup(bool hit, size_t covered) {
+    EncoderStats* stats = encoder_stats_current;
+    if (!stats) return;
+    stats->dedup_lookups++;
+    stats->dedup_hits += hit;
+    stats->dedup_bytes += hit ? covered : 0;
+}
+
+static inline void stats_stage(EncoderStage stage, uint64_t start, bool hit) {
+    EncoderStats* stats = encoder_stats_current;
+    if (!stats) return;
+    stats_count(stage, hit);
+    stats->cycles[stage] += stats_clock() - start;
+}
+
+// start = STATS_CLOCK() before a stage, STATS_STAGE(stage, start, hit) after.
+// STATS_COUNT counts an attempt without timing it.
+#define STATS_CLOCK()                          stats_clock()
+#define STATS_STAGE(stage, start, hit)         stats_stage(stage, start, hit)
+#define STATS_COUNT(stage, hit)                stats_count(stage, hit)
+#define STATS_TOKEN(kind, covered, written)    stats_token(kind, covered, written)
+#define STATS_DEDUP(hit, covered)              stats_dedup(hit, covered)
+#else
+#define STATS_CLOCK()                          0
+#define STATS_STAGE(stage, start, hit)         ((void)(start))
+#define STATS_COUNT(stage, hit)                ((void)0)
+#define STATS_TOKEN(kind, covered, written)    ((void)0)
+#define STATS_DEDUP(hit, covered)              ((void)0)
+#endif
+
+void encoder_stats_reset(EncoderStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Collects this thread's encodes into stats from now on (NULL stops). Counts
+// add up until encoder_stats_reset. Returns false if built without
+// CODEC_STATS.
+bool encoder_stats_attach(EncoderStats* stats) {
+#if defined(CODEC_STATS)
+    encoder_stats_current = stats;
+    return true;
+#else
+    (void)stats;
+    return false;
+#endif
+}
+
+void encoder_stats_print(const EncoderStats* stats, FILE* out) {
+    uint64_t covered = 0;
+    for (int k = 0; k < TOKEN_KIND_COUNT; k++) covered += stats->bytes_covered[k];
+    
+    fprintf(out, "%-14s %12s %14s %14s %8s\n", "Token", "Count", "Bytes in", "Bytes out", "Share");
+    for (int k = 0; k < TOKEN_KIND_COUNT; k++) {
+        fprintf(out, "%-14s %12llu %14llu %14llu %7.1f%%\n", token_kind_names[k],
+                (unsigned long long)stats->tokens[k], (unsigned long long)stats->bytes_covered[k],
+                (unsigned long long)stats->bytes_written[k],
+                covered ? 100.0 * stats->bytes_covered[k] / covered : 0.0);
+    }
+    fprintf(out, "%-14s %12s %14s %14s %8s\n", "Stage", "Attempts", "Hits", "Cycles", "Per try");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        fprintf(out, "%-14s %12llu %14llu %14llu %8.1f\n", encoder_stage_names[s],
+                (unsigned long long)stats->attempts[s], (unsigned long long)stats->hits[s],
+                (unsigned long long)stats->cycles[s],
+                stats->attempts[s] ? (double)stats->cycles[s] / stats->attempts[s] : 0.0);
+    }
+    if (stats->dedup_lookups) {
+        fprintf(out, "%-14s %12llu %14llu %14llu %7.1f%%\n", "dedup", (unsigned long long)stats->dedup_lookups,
+                (unsigned long long)stats->dedup_hits, (unsigned long long)stats->dedup_bytes,
+                100.0 * stats->dedup_hits / stats->dedup_lookups);
+    }
+}
+
+// MATCH FINDER
+// Back-references to earlier input: [EXT_MATCH] [length] [offset lo] [offset hi].
+// Positions are hashed on their first 4 bytes; head holds the latest position
+// per hash and prev chains each position to the previous one with the same
+// hash, as distances over a 32 KB sliding window. Candidates are only ever
+// followed MATCH_CHAIN_DEPTH deep, so a search costs a bounded amount of work.
+
+#define MATCH_MIN_LENGTH   6
+#define MATCH_MAX_LENGTH   255
+#define MATCH_WINDOW_SIZE  32768
+#define MATCH_HASH_BITS    12
+#define MATCH_CHAIN_DEPTH  8
+
+typedef struct {
+    uint32_t head[1 << MATCH_HASH_BITS];
+    uint16_t prev[MATCH_WINDOW_SIZE];
+    size_t base;            // stream position of data[0]
+    size_t next_insert;     // stream positions below this are in the table
+} MatchFinder;
+
 typedef struct {
-    uint8_t pattern[16];
     size_t length;
-    size_t count;
-} Pattern;
+    size_t offset;
+} Match;
+
+void match_finder_init(MatchFinder* mf) {
+    // prev needs no clearing: a slot is always written before it is followed
+    memset(mf->head, 0, sizeof(mf->head));
+    mf->base = 0;
+    mf->next_insert = 0;
+}
+
+static inline uint32_t match_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - MATCH_HASH_BITS);
+}
+
+// Adds every position before pos to the table. Callers only search where at
+// least MATCH_MIN_LENGTH bytes remain, so each inserted position has 4.
+static void match_finder_insert(MatchFinder* mf, const uint8_t* data, size_t pos) {
+    for (size_t abs = mf->next_insert; abs < mf->base + pos; abs++) {
+        uint32_t h = match_hash(data + (abs - mf->base));
+        uint32_t distance = (uint32_t)abs - mf->head[h];
+        mf->prev[abs & (MATCH_WINDOW_SIZE - 1)] =
+            (distance > 0 && distance < MATCH_WINDOW_SIZE) ? (uint16_t)distance : 0;
+        mf->head[h] = (uint32_t)abs;
+    }
+    if (mf->next_insert < mf->base + pos) mf->next_insert = mf->base + pos;
+}
 
-Pattern find_pattern(uint8_t* data, size_t start, size_t data_size) {
-    Pattern best = {0};
+// Returns mf to its just-initialised state after a buffer of data. For a
+// small buffer, clearing the heads it touched is far cheaper than a memset of
+// the whole table.
+static void match_finder_reset(MatchFinder* mf, const uint8_t* data) {
+    size_t inserted = mf->next_insert - mf->base;
+    if (mf->base != 0 || inserted > (1 << MATCH_HASH_BITS) / 4) {
+        match_finder_init(mf);
+        return;
+    }
+    for (size_t pos = 0; pos < inserted; pos++) {
+        mf->head[match_hash(data + pos)] = 0;
+    }
+    mf->next_insert = 0;
+}
+
+// Longest earlier match for the bytes at pos, up to max_length. Stops at the
+// first candidate reaching max_length. Returns a zero-length match if none
+// has MATCH_MIN_LENGTH bytes.
+static Match match_finder_search(MatchFinder* mf, const uint8_t* data, size_t pos,
+                                 size_t data_size, size_t max_length, int depth) {
+    Match best = {0, 0};
+    if (pos + MATCH_MIN_LENGTH > data_size) return best;
+    if (max_length > data_size - pos) max_length = data_size - pos;
     
-    for (size_t pattern_len = 2; pattern_len <= 16 && start + pattern_len * 2 <= data_size; pattern_len++) {
-        size_t matches = 1;
-        
-        for (size_t i = start + pattern_len; i + pattern_len <= data_size; i += pattern_len) {
-            if (memcmp(&data[start], &data[i], pattern_len) == 0) {
-                matches++;
-            } else {
-                break;
-            }
-        }
+    match_finder_insert(mf, data, pos);
+    
+    size_t abs = mf->base + pos;
+    size_t distance = (uint32_t)abs - mf->head[match_hash(data + pos)];
+    size_t best_length = MATCH_MIN_LENGTH - 1;
+    
+    // A probe may already have inserted pos itself
+    if (distance == 0 && mf->next_insert > abs) distance = mf->prev[abs & (MATCH_WINDOW_SIZE - 1)];
+    
+    while (depth-- > 0 && distance > 0 && distance < MATCH_WINDOW_SIZE && distance <= pos) {
+        const uint8_t* candidate = data + pos - distance;
         
-        if (matches >= 2) {
-            size_t saved = (matches * pattern_len) - (2 + pattern_len);
-            size_t best_saved = (best.count * best.length) - (2 + best.length);
+        // Only a candidate that beats the best so far is worth comparing
+        if (candidate[best_length] == data[pos + best_length]) {
+            size_t length = 0;
+            while (length < max_length && candidate[length] == data[pos + length]) length++;
             
-            if (saved > best_saved) {
-                memcpy(best.pattern, &data[start], pattern_len);
-                best.length = pattern_len;
-                best.count = matches;
+            if (length > best_length) {
+                best_length = length;
+                best.length = length;
+                best.offset = distance;
+                if (length == max_length) break;
             }
         }
+        
+        uint16_t step = mf->prev[(abs - distance) & (MATCH_WINDOW_SIZE - 1)];
+        if (step == 0) break;
+        distance += step;
     }
     
     return best;
 }
 
-bool is_delta_sequence(uint8_t* data, size_t start, size_t data_size, int* delta, size_t* length) {
+// Cheap check used inside literals: does the newest candidate for pos match
+// at least MATCH_MIN_LENGTH bytes? Inserts pos on the way, reusing its hash.
+static inline bool match_finder_probe(MatchFinder* mf, const uint8_t* data, size_t pos,
+                                      size_t data_size) {
+    if (pos + MATCH_MIN_LENGTH > data_size) return false;
+    match_finder_insert(mf, data, pos);
+    
+    size_t abs = mf->base + pos;
+    uint32_t h = match_hash(data + pos);
+    uint32_t distance = (uint32_t)abs - mf->head[h];
+    bool valid = distance > 0 && distance < MATCH_WINDOW_SIZE;
+    
+    mf->prev[abs & (MATCH_WINDOW_SIZE - 1)] = valid ? (uint16_t)distance : 0;
+    mf->head[h] = (uint32_t)abs;
+    mf->next_insert = abs + 1;
+    
+    return valid && distance <= pos &&
+           memcmp(data + pos - distance, data + pos, MATCH_MIN_LENGTH) == 0;
+}
+
+// Delta runs stop at 31 so MODE_DELTA | length never reaches the 0xE0-0xFF
+// range used by EXT_PATTERN / EXT_ZERO_RUN / EXT_COMMON_VAL. The decoder masks
+// every output byte with 0x7F, so the first two bytes must already be 7-bit.
+#define MAX_DELTA_LENGTH 31
+
+static bool delta_sequence(const uint8_t* data, size_t start, size_t data_size, size_t max_length,
+                           int* delta, size_t* length) {
     if (start + 2 > data_size) return false;
+    if ((data[start] | data[start + 1]) & 0x80) return false;
     
     *delta = (int)data[start + 1] - (int)data[start];
     *length = 2;
     
-    for (size_t i = start + 2; i < data_size && *length < 63; i++) {
+    for (size_t i = start + 2; i < data_size && *length < max_length; i++) {
         int expected = (data[i-1] + *delta) & 0x7F;
         if (data[i] != expected) break;
         (*length)++;
@@ -175,7 +726,20 @@ bool is_delta_sequence(uint8_t* data, size_t start, size_t data_size, int* delta
     return (*length >= 3) && (*delta >= -15 && *delta <= 15);
 }
 
-bool can_nibble_pack(uint8_t* data, size_t start, size_t data_size, size_t* length) {
+bool is_delta_sequence(const uint8_t* data, size_t start, size_t data_size, int* delta, size_t* length) {
+    return delta_sequence(data, start, data_size, MAX_DELTA_LENGTH, delta, length);
+}
+
+// Same answer as is_delta_sequence without measuring the run: true if a, b, c
+// begin a delta run the decoder can reproduce. Branch-free, since on noisy
+// data each test is close to a coin flip.
+static inline bool starts_delta_sequence(uint8_t a, uint8_t b, uint8_t c) {
+    int delta = (int)b - (int)a;
+    return (((a | b) & 0x80) == 0) & ((unsigned)(delta + 15) <= 30) &
+           (c == ((b + delta) & 0x7F));
+}
+
+bool can_nibble_pack(const uint8_t* data, size_t start, size_t data_size, size_t* length) {
     *length = 0;
     
     for (size_t i = start; i < data_size && i < start + 62; i++) {
@@ -186,516 +750,8469 @@ bool can_nibble_pack(uint8_t* data, size_t start, size_t data_size, size_t* leng
     return *length >= 4;
 }
 
-size_t advanced_compress(uint8_t* data_ptr, size_t data_size) {
-    if (!data_ptr || data_size == 0) return 0;
+// Every strategy except literal mode emits at most as many bytes as it covers,
+// and a literal only stops early in front of a token of 3+ bytes. The worst
+// case is a 1-byte literal followed by a 3-byte delta run: 4 bytes become 5.
+size_t advanced_compress_bound(size_t data_size) {
+    return data_size + (data_size + 3) / 4;
+}
+
+// Longest reach of any probe: a zero run or a match (255 bytes), or a 63-byte
+// literal that checks a few bytes ahead of its last byte
+#define ADVANCED_LOOKAHEAD 256
+
+// Strategies the encoder may try besides runs and literals. The block
+// analyzer turns off the ones a sample of the block shows never win.
+#define PROBE_DELTA  0x01
+#define PROBE_NIBBLE 0x02
+#define PROBE_MATCH  0x04
+#define PROBE_BITPACK 0x08      // format v2 only
+#define PROBE_ALL    (PROBE_DELTA | PROBE_NIBBLE | PROBE_MATCH | PROBE_BITPACK)
+
+// SPECIALIZED PIPELINES
+// The v1 token encoder reads its configuration from an AdvancedPipeline that
+// it takes by value and is always inlined into its caller. The generic
+// encoder passes the runtime probes and everything else on; a pipeline built
+// by ADVANCED_PIPELINE passes constants, so the compiler folds every test on
+// them and drops the strategies it leaves out, match finder included. Either
+// way the output is an ordinary v1 stream for advanced_decompress_to.
+//
+// The common-value table belongs to the format, since EXT_COMMON_VAL tokens
+// carry an index into it, so a pipeline can only choose which entries to use.
+
+#if defined(__GNUC__)
+#define CODEC_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define CODEC_ALWAYS_INLINE inline
+#endif
+
+typedef struct {
+    unsigned probes;            // PROBE_DELTA, PROBE_NIBBLE and PROBE_MATCH
+    bool zero_runs;             // EXT_ZERO_RUN tokens
+    bool runs;                  // MODE_RLE and EXT_COMMON_VAL tokens
+    uint8_t common_values;      // bit i: runs of common_values[i] may use EXT_COMMON_VAL
+    uint8_t literal_cap;        // longest literal, 1-63
+} AdvancedPipeline;
+
+#define ADVANCED_PIPELINE_ALL(probe_mask) ((AdvancedPipeline){(probe_mask), true, true, 0xFF, 63})
+
+// True if a match is cheaper per input byte than a token of cost bytes
+// covering covered bytes
+static inline bool match_beats(Match match, size_t cost, size_t covered) {
+    return match.length > 0 && 4 * covered < cost * match.length;
+}
+
+// Chooses and writes the single token that starts at in_pos. The decision
+// never reads more than ADVANCED_LOOKAHEAD bytes past in_pos, which is what
+// lets the streaming encoder reproduce one-shot output exactly. Returns the
+// number of input bytes covered, or 0 if the token doesn't fit in output.
+static CODEC_ALWAYS_INLINE size_t pipeline_encode_token(const uint8_t* data_ptr, size_t in_pos, size_t data_size,
+                                                        uint8_t* output, size_t* out_pos, size_t output_capacity,
+                                                        MatchFinder* mf, const AdvancedPipeline pipe) {
+    unsigned probes = pipe.probes;
+    size_t pos = *out_pos;
+    uint8_t current = data_ptr[in_pos];
+    Match match = {0, 0};
+    if (probes & PROBE_MATCH) {
+        uint64_t start = STATS_CLOCK();
+        match = match_finder_search(mf, data_ptr, in_pos, data_size, MATCH_MAX_LENGTH, MATCH_CHAIN_DEPTH);
+        STATS_STAGE(STAGE_MATCH_SEARCH, start, match.length > 0);
+    }
     
-    uint8_t* output = (uint8_t*)malloc(data_size * 2);
-    if (!output) return data_size;
+    // Check for zero runs
+    size_t remaining = data_size - in_pos;
+    if (pipe.zero_runs && current == 0x00) {
+        size_t zero_count = count_run(&data_ptr[in_pos], remaining < 255 ? remaining : 255);
+        
+        if (zero_count >= 3 && !match_beats(match, 2, zero_count)) {
+            if (pos + 2 > output_capacity) return 0;
+            output[pos++] = EXT_ZERO_RUN;
+            output[pos++] = (uint8_t)zero_count;
+            STATS_TOKEN(TOKEN_ZERO_RUN, zero_count, 2);
+            *out_pos = pos;
+            return zero_count;
+        }
+    }
     
-    size_t out_pos = 0;
-    size_t in_pos = 0;
+    // Check for delta sequences
+    int delta;
+    size_t delta_length;
+    bool is_delta = false;
+    if (probes & PROBE_DELTA) {
+        uint64_t start = STATS_CLOCK();
+        is_delta = is_delta_sequence(data_ptr, in_pos, data_size, &delta, &delta_length);
+        STATS_STAGE(STAGE_DELTA, start, is_delta);
+    }
+    if (is_delta && !match_beats(match, 3, delta_length)) {
+        if (pos + 3 > output_capacity) return 0;
+        output[pos++] = MODE_DELTA | (uint8_t)delta_length;
+        output[pos++] = data_ptr[in_pos];
+        output[pos++] = (uint8_t)(delta + 16);
+        STATS_TOKEN(TOKEN_DELTA, delta_length, 3);
+        *out_pos = pos;
+        return delta_length;
+    }
     
-    while (in_pos < data_size) {
-        uint8_t current = data_ptr[in_pos];
+    // Check for nibble packing
+    size_t nibble_length;
+    bool is_nibble = false;
+    if (probes & PROBE_NIBBLE) {
+        uint64_t start = STATS_CLOCK();
+        is_nibble = can_nibble_pack(data_ptr, in_pos, data_size, &nibble_length);
+        STATS_STAGE(STAGE_NIBBLE, start, is_nibble);
+    }
+    if (is_nibble && !match_beats(match, 1 + (nibble_length + 1) / 2, nibble_length)) {
+        size_t pairs = nibble_length / 2;
+        if (pos + 1 + (nibble_length + 1) / 2 > output_capacity) return 0;
+        output[pos++] = MODE_NIBBLE | (uint8_t)nibble_length;
         
-        // Check for zero runs
-        if (current == 0x00) {
-            size_t zero_count = 1;
-            while (in_pos + zero_count < data_size && 
-                   data_ptr[in_pos + zero_count] == 0x00 && 
-                   zero_count < 255) {
-                zero_count++;
-            }
-            
-            if (zero_count >= 3) {
-                output[out_pos++] = EXT_ZERO_RUN;
-                output[out_pos++] = (uint8_t)zero_count;
-                in_pos += zero_count;
-                continue;
-            }
+        for (size_t i = 0; i < pairs; i++) {
+            uint8_t packed = (data_ptr[in_pos + i*2] << 4) | 
+                            data_ptr[in_pos + i*2 + 1];
+            output[pos++] = packed;
         }
         
-        // Check for delta sequences
-        int delta;
-        size_t delta_length;
-        if (is_delta_sequence(data_ptr, in_pos, data_size, &delta, &delta_length)) {
-            output[out_pos++] = MODE_DELTA | (uint8_t)delta_length;
-            output[out_pos++] = data_ptr[in_pos];
-            output[out_pos++] = (uint8_t)(delta + 16);
-            in_pos += delta_length;
-            continue;
+        if (nibble_length % 2) {
+            output[pos++] = data_ptr[in_pos + nibble_length - 1] << 4;
         }
         
-        // Check for nibble packing
-        size_t nibble_length;
-        if (can_nibble_pack(data_ptr, in_pos, data_size, &nibble_length)) {
-            size_t pairs = nibble_length / 2;
-            output[out_pos++] = MODE_NIBBLE | (uint8_t)nibble_length;
-            
-            for (size_t i = 0; i < pairs; i++) {
-                uint8_t packed = (data_ptr[in_pos + i*2] << 4) | 
-                                data_ptr[in_pos + i*2 + 1];
-                output[out_pos++] = packed;
-            }
-            
-            if (nibble_length % 2) {
-                output[out_pos++] = data_ptr[in_pos + nibble_length - 1] << 4;
+        STATS_TOKEN(TOKEN_NIBBLE, nibble_length, 1 + (nibble_length + 1) / 2);
+        *out_pos = pos;
+        return nibble_length;
+    }
+    
+    // Standard RLE
+    size_t run_length = pipe.runs ? count_run(&data_ptr[in_pos], remaining < 63 ? remaining : 63) : 0;
+    
+    if (run_length >= 3 && !match_beats(match, 2, run_length)) {
+        if (pos + 2 > output_capacity) return 0;
+        int common_idx = -1;
+        for (int i = 0; i < NUM_COMMON_VALUES; i++) {
+            if ((pipe.common_values >> i & 1) && common_values[i] == current) {
+                common_idx = i;
+                break;
             }
-            
-            in_pos += nibble_length;
-            continue;
-        }
-        
-        // Pattern matching
-        Pattern pattern = find_pattern(data_ptr, in_pos, data_size);
-        if (pattern.count >= 2 && pattern.length >= 2) {
-            output[out_pos++] = EXT_PATTERN;
-            output[out_pos++] = (uint8_t)((pattern.length << 4) | (pattern.count & 0x0F));
-            memcpy(&output[out_pos], pattern.pattern, pattern.length);
-            out_pos += pattern.length;
-            in_pos += pattern.length * pattern.count;
-            continue;
         }
         
-        // Standard RLE
-        size_t run_length = 1;
-        while (in_pos + run_length < data_size && 
-               data_ptr[in_pos + run_length] == current &&
-               run_length < 63) {
-            run_length++;
-        }
-        
-        if (run_length >= 3) {
-            int common_idx = -1;
-            for (int i = 0; i < NUM_COMMON_VALUES; i++) {
-                if (common_values[i] == current) {
-                    common_idx = i;
-                    break;
-                }
-            }
-            
-            if (common_idx >= 0 && run_length <= 15) {
-                output[out_pos++] = EXT_COMMON_VAL;
-                output[out_pos++] = (uint8_t)((run_length << 4) | common_idx);
-            } else {
-                output[out_pos++] = MODE_RLE | (uint8_t)run_length;
-                output[out_pos++] = current;
-            }
-            in_pos += run_length;
+        if (common_idx >= 0 && run_length <= 15) {
+            output[pos++] = EXT_COMMON_VAL;
+            output[pos++] = (uint8_t)((run_length << 4) | common_idx);
+            STATS_TOKEN(TOKEN_COMMON_VAL, run_length, 2);
         } else {
-            // Literal mode
-            size_t literal_count = 0;
-            size_t literal_start = in_pos;
-            
-            while (in_pos < data_size && literal_count < 63) {
-                size_t ahead_run = 1;
-                if (in_pos + 1 < data_size) {
-                    while (in_pos + ahead_run < data_size && 
-                           data_ptr[in_pos + ahead_run] == data_ptr[in_pos]) {
-                        ahead_run++;
-                    }
-                }
-                
-                if (ahead_run >= 3) break;
-                
-                int test_delta;
-                size_t test_length;
-                if (is_delta_sequence(data_ptr, in_pos, data_size, &test_delta, &test_length)) {
-                    break;
-                }
-                
-                in_pos++;
-                literal_count++;
-            }
+            output[pos++] = MODE_RLE | (uint8_t)run_length;
+            output[pos++] = current;
+            STATS_TOKEN(TOKEN_RLE, run_length, 2);
+        }
+        *out_pos = pos;
+        return run_length;
+    }
+    
+    // Back-reference
+    if (match.length > 0) {
+        if (pos + 4 > output_capacity) return 0;
+        output[pos++] = EXT_MATCH;
+        output[pos++] = (uint8_t)match.length;
+        output[pos++] = (uint8_t)(match.offset & 0xFF);
+        output[pos++] = (uint8_t)(match.offset >> 8);
+        STATS_TOKEN(TOKEN_MATCH, match.length, 4);
+        *out_pos = pos;
+        return match.length;
+    }
+    
+    // Literal mode
+    size_t literal_count = 0;
+    size_t literal_start = in_pos;
+    
+    // A literal ends in front of a run of 3+ bytes, a delta run or a match.
+    // Runs and deltas are decided by the next three bytes and the match probe
+    // looks at one candidate, so every byte costs a bounded amount of work no
+    // matter how long the run behind it is. Strategies that are switched off
+    // don't end a literal.
+    bool stop_for_delta = probes & PROBE_DELTA;
+    bool stop_for_match = probes & PROBE_MATCH;
+    uint64_t scan_start = STATS_CLOCK();
+    while (in_pos < data_size && literal_count < pipe.literal_cap) {
+        if (in_pos + 2 < data_size) {
+            uint8_t a = data_ptr[in_pos];
+            uint8_t b = data_ptr[in_pos + 1];
+            uint8_t c = data_ptr[in_pos + 2];
+            bool run = (a == b) & (b == c) & (pipe.runs | (pipe.zero_runs & (a == 0)));
             
-            output[out_pos++] = MODE_LITERAL | (uint8_t)literal_count;
-            memcpy(&output[out_pos], &data_ptr[literal_start], literal_count);
-            out_pos += literal_count;
+            if (run | (stop_for_delta & starts_delta_sequence(a, b, c))) break;
         }
+        if (stop_for_match && literal_count > 0) {
+            bool found = match_finder_probe(mf, data_ptr, in_pos, data_size);
+            STATS_COUNT(STAGE_MATCH_PROBE, found);
+            if (found) break;
+        }
+        
+        in_pos++;
+        literal_count++;
     }
+    STATS_STAGE(STAGE_LITERAL_SCAN, scan_start, false);
     
-    memcpy(data_ptr, output, out_pos);
-    free(output);
-    return out_pos;
+    if (pos + 1 + literal_count > output_capacity) return 0;
+    output[pos++] = MODE_LITERAL | (uint8_t)literal_count;
+    memcpy(&output[pos], &data_ptr[literal_start], literal_count);
+    pos += literal_count;
+    
+    STATS_TOKEN(TOKEN_LITERAL, literal_count, 1 + literal_count);
+    *out_pos = pos;
+    return literal_count;
 }
 
-size_t advanced_decompress(uint8_t* data_ptr, size_t compressed_size) {
-    if (!data_ptr || compressed_size == 0) return 0;
+static size_t advanced_encode_token(const uint8_t* data_ptr, size_t in_pos, size_t data_size,
+                                    uint8_t* output, size_t* out_pos, size_t output_capacity,
+                                    MatchFinder* mf, unsigned probes) {
+    return pipeline_encode_token(data_ptr, in_pos, data_size, output, out_pos, output_capacity, mf,
+                                 ADVANCED_PIPELINE_ALL(probes));
+}
+
+// Encodes data_ptr[in_pos..data_size); anything before in_pos is history
+// that back-references may reach into. Returns the bytes written, or 0 if the
+// output doesn't fit.
+static size_t advanced_encode_range(const uint8_t* data_ptr, size_t in_pos, size_t data_size,
+                                    uint8_t* output, size_t output_capacity,
+                                    MatchFinder* mf, unsigned probes) {
+    size_t out_pos = 0;
     
-    uint8_t* output = (uint8_t*)malloc(compressed_size * 256);
-    if (!output) return compressed_size;
+    while (in_pos < data_size) {
+        size_t consumed = advanced_encode_token(data_ptr, in_pos, data_size,
+                                                output, &out_pos, output_capacity, mf, probes);
+        if (consumed == 0) return 0;
+        in_pos += consumed;
+    }
     
-    size_t out_pos = 0;
-    size_t in_pos = 0;
+    return out_pos;
+}
+
+// advanced_compress_to with only the given strategies enabled. The output is
+// an ordinary advanced stream.
+static size_t advanced_compress_probes(const uint8_t* data_ptr, size_t data_size,
+                                       uint8_t* output, size_t output_capacity, unsigned probes) {
+    if (!data_ptr || !output || data_size == 0) return 0;
     
-    while (in_pos < compressed_size) {
-        uint8_t control = data_ptr[in_pos++];
-        
-        if (control == EXT_ZERO_RUN) {
-            size_t count = data_ptr[in_pos++];
-            memset(&output[out_pos], 0, count);
-            out_pos += count;
-        } 
-        else if (control == EXT_PATTERN) {
-            uint8_t info = data_ptr[in_pos++];
-            size_t pattern_len = info >> 4;
-            size_t repeat_count = info & 0x0F;
+    MatchFinder mf;
+    match_finder_init(&mf);
+    return advanced_encode_range(data_ptr, 0, data_size, output, output_capacity, &mf, probes);
+}
+
+size_t advanced_compress_to(const uint8_t* data_ptr, size_t data_size,
+                            uint8_t* output, size_t output_capacity) {
+    return advanced_compress_probes(data_ptr, data_size, output, output_capacity, PROBE_ALL);
+}
+
+// Defines name(data_ptr, data_size, output, output_capacity) with the
+// signature and results of advanced_compress_to, encoding with a constant
+// pipeline. Prefix with static for a file-local pipeline.
+#define ADVANCED_PIPELINE(name, probe_mask, zero_run_tokens, run_tokens, common_mask, literal_max)     \
+    size_t name(const uint8_t* data_ptr, size_t data_size, uint8_t* output, size_t output_capacity) { \
+        _Static_assert((literal_max) >= 1 && (literal_max) <= 63, "literal cap must be 1-63");        \
+        const AdvancedPipeline pipe = {(probe_mask), (zero_run_tokens), (run_tokens),                  \
+                                       (common_mask), (literal_max)};                                  \
+        if (!data_ptr || !output || data_size == 0) return 0;                                          \
+                                                                                                       \
+        MatchFinder mf;                                                                                \
+        if (pipe.probes & PROBE_MATCH) match_finder_init(&mf);                                         \
+        size_t out_pos = 0;                                                                            \
+        for (size_t in_pos = 0; in_pos < data_size;) {                                                 \
+            size_t consumed = pipeline_encode_token(data_ptr, in_pos, data_size, output, &out_pos,     \
+                                                    output_capacity, &mf, pipe);                       \
+            if (consumed == 0) return 0;                                                               \
+            in_pos += consumed;                                                                        \
+        }                                                                                              \
+        return out_pos;                                                                                \
+    }
+
+// For data that is only ever zero runs and small values, such as sparse
+// sensor bitmaps: zero runs and nibbles, no match finder
+ADVANCED_PIPELINE(advanced_compress_zero_nibble_to, PROBE_NIBBLE, true, false, 0x00, 63)
+
+size_t advanced_compress_ex(uint8_t* data_ptr, size_t data_size,
+                            uint8_t* scratch, size_t scratch_capacity) {
+    if (!data_ptr || data_size == 0) return 0;
+    
+    size_t result = advanced_compress_to(data_ptr, data_size, scratch, scratch_capacity);
+    if (result == 0) return data_size;
+    
+    memcpy(data_ptr, scratch, result);
+    return result;
+}
+
+size_t advanced_compress(uint8_t* data_ptr, size_t data_size) {
+    if (!data_ptr || data_size == 0) return 0;
+    
+    size_t bound = advanced_compress_bound(data_size);
+    uint8_t* output = (uint8_t*)codec_alloc(bound);
+    if (!output) return data_size;
+    
+    size_t result = advanced_compress_ex(data_ptr, data_size, output, bound);
+    codec_free(output);
+    return result;
+}
+
+// Largest encoded token (a 63-byte literal) and largest decoded token
+// (a 255-byte zero run)
+#define ADVANCED_MAX_TOKEN_SIZE   64
+#define ADVANCED_MAX_TOKEN_OUTPUT 255
+
+// CONTROL BYTE TABLE
+// One entry per control byte, built by the preprocessor, giving each token's
+// kind, length and encoded size with a single load. The token walkers and the
+// careful decode tail use it; the fast decode loop keeps its compare chain, which measured faster than a
+// jump through this table on mixed data. Control bytes no encoder emits
+// (0xE1-0xEF, 0xF1, 0xF4-0xFF) keep decoding as delta tokens, as they always
+// have.
+
+typedef struct {
+    uint8_t kind;       // TokenKind
+    uint8_t length;     // output bytes for the four base modes
+    uint8_t size;       // token bytes; for EXT_PATTERN, before the pattern itself
+} TokenEntry;
+
+#define TOKEN_KIND(c) \
+    ((c) == EXT_ZERO_RUN ? TOKEN_ZERO_RUN : \
+     (c) == EXT_PATTERN ? TOKEN_PATTERN : \
+     (c) == EXT_COMMON_VAL ? TOKEN_COMMON_VAL : \
+     (c) == EXT_MATCH ? TOKEN_MATCH : \
+     ((c) & MODE_MASK) == MODE_RLE ? TOKEN_RLE : \
+     ((c) & MODE_MASK) == MODE_DELTA ? TOKEN_DELTA : \
+     ((c) & MODE_MASK) == MODE_NIBBLE ? TOKEN_NIBBLE : TOKEN_LITERAL)
+
+#define TOKEN_SIZE(c) \
+    (TOKEN_KIND(c) == TOKEN_MATCH ? 4 : \
+     TOKEN_KIND(c) == TOKEN_DELTA ? 3 : \
+     TOKEN_KIND(c) == TOKEN_NIBBLE ? 1 + (((c) & LENGTH_MASK) + 1) / 2 : \
+     TOKEN_KIND(c) == TOKEN_LITERAL ? 1 + ((c) & LENGTH_MASK) : 2)
+
+#define TOKEN_ENTRY(c) {TOKEN_KIND(c), (c) & LENGTH_MASK, TOKEN_SIZE(c)}
+#define TOKEN_ROW(c) \
+    TOKEN_ENTRY((c) + 0x0), TOKEN_ENTRY((c) + 0x1), TOKEN_ENTRY((c) + 0x2), TOKEN_ENTRY((c) + 0x3), \
+    TOKEN_ENTRY((c) + 0x4), TOKEN_ENTRY((c) + 0x5), TOKEN_ENTRY((c) + 0x6), TOKEN_ENTRY((c) + 0x7), \
+    TOKEN_ENTRY((c) + 0x8), TOKEN_ENTRY((c) + 0x9), TOKEN_ENTRY((c) + 0xA), TOKEN_ENTRY((c) + 0xB), \
+    TOKEN_ENTRY((c) + 0xC), TOKEN_ENTRY((c) + 0xD), TOKEN_ENTRY((c) + 0xE), TOKEN_ENTRY((c) + 0xF)
+
+static const TokenEntry token_table[256] = {
+    TOKEN_ROW(0x00), TOKEN_ROW(0x10), TOKEN_ROW(0x20), TOKEN_ROW(0x30),
+    TOKEN_ROW(0x40), TOKEN_ROW(0x50), TOKEN_ROW(0x60), TOKEN_ROW(0x70),
+    TOKEN_ROW(0x80), TOKEN_ROW(0x90), TOKEN_ROW(0xA0), TOKEN_ROW(0xB0),
+    TOKEN_ROW(0xC0), TOKEN_ROW(0xD0), TOKEN_ROW(0xE0), TOKEN_ROW(0xF0)
+};
+
+// Reports the encoded size of the token at p and how many bytes it decodes
+// to. Returns false if fewer bytes are available than needed to tell; the
+// token itself may still extend past available.
+static bool advanced_token_info(const uint8_t* p, size_t available,
+                                size_t* token_size, size_t* output_size) {
+    if (available < 1) return false;
+    TokenEntry entry = token_table[p[0]];
+    *token_size = entry.size;
+    
+    if (entry.kind < TOKEN_ZERO_RUN) {
+        *output_size = entry.length;
+        return true;
+    }
+    
+    if (available < 2) return false;
+    uint8_t info = p[1];
+    
+    if (entry.kind == TOKEN_PATTERN) {
+        *token_size += info >> 4;
+        *output_size = (size_t)(info >> 4) * (info & 0x0F);
+    } else if (entry.kind == TOKEN_COMMON_VAL) {
+        *output_size = info >> 4;
+    } else {
+        *output_size = info;
+    }
+    return true;
+}
+
+// BYTE ORDER
+// Every multi-byte field in the entropy stage and the framed format is
+// little-endian, and so are format v2 bit-pack groups and the elements the
+// block filters work on.
+
+static void write_le16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t read_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_le64(uint8_t* p, uint64_t v) {
+    write_le32(p, (uint32_t)v);
+    write_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// FORMAT V2
+// The v1 token format above caps every length at 6 bits or one byte, so a
+// 1 MB zero region takes over 4,000 zero-run tokens, and its control bytes
+// share ranges: unused ones decode as deltas. A format v2 stream starts with
+// [0x00 0x02], a zero-length literal no v1 encoder emits followed by the
+// version, and advanced_decompress_to / advanced_decompressed_size read either
+// format, so v1 archives stay readable. Every other control byte is
+// [kind: 3 bits][n: 5 bits], one kind per range:
+//
+//   0x00-0x1F literal    length >= 1   [bytes]
+//   0x20-0x3F nibble     length >= 4   [ceil(length / 2) packed bytes]
+//   0x40-0x5F run        length >= 3   [value]
+//   0x60-0x7F zero run   length >= 3
+//   0x80-0x9F delta      length >= 3   [start] [delta + 16]
+//   0xA0-0xBF match      length >= 6   [offset lo] [offset hi]
+//   0xC0-0xDF bit-pack   length >= 8   [width 1-7] [ceil(length * width / 8) bytes]
+//   0xE0-0xFF reserved, rejected by the decoder
+//
+// The length is the kind's minimum plus n. n = 31 means a LEB128 varint
+// follows the control byte and is added on top, so a run, literal or
+// back-reference of any length is one token. There are no pattern or
+// common-value tokens: a literal plus a long back-reference covers a
+// repeated pattern, and a zero run costs a single byte. A bit-pack token
+// stores each byte in its low width bits, least significant bit first, so
+// every 8 bytes take width bytes; it reaches the small values a delta or
+// shuffle filter leaves behind that nibbles don't.
+
+#define ADVANCED_FORMAT_V1 1
+#define ADVANCED_FORMAT_V2 2
+
+#define V2_HEADER_SIZE  2
+#define V2_LITERAL      0x00
+#define V2_NIBBLE       0x20
+#define V2_RUN          0x40
+#define V2_ZERO_RUN     0x60
+#define V2_DELTA        0x80
+#define V2_MATCH        0xA0
+#define V2_BITPACK      0xC0
+#define V2_RESERVED     0xE0
+#define V2_KIND_SHIFT   5
+#define V2_LENGTH_MASK  0x1F
+#define V2_MAX_VARINT   9       // lengths below 2^63
+
+static const uint8_t v2_min_length[7] = {1, 4, 3, 3, 3, MATCH_MIN_LENGTH, 8};
+
+static inline bool is_v2_stream(const uint8_t* data_ptr, size_t compressed_size) {
+    return compressed_size >= V2_HEADER_SIZE && data_ptr[0] == MODE_LITERAL &&
+           data_ptr[1] == ADVANCED_FORMAT_V2;
+}
+
+// Bytes taken by the control byte and varint of a token of length bytes
+static inline size_t v2_control_size(uint8_t kind, size_t length) {
+    size_t n = length - v2_min_length[kind >> V2_KIND_SHIFT];
+    if (n < V2_LENGTH_MASK) return 1;
+    
+    size_t size = 2;
+    for (n -= V2_LENGTH_MASK; n >= 0x80; n >>= 7) size++;
+    return size;
+}
+
+static inline size_t v2_put_control(uint8_t* p, uint8_t kind, size_t length) {
+    size_t n = length - v2_min_length[kind >> V2_KIND_SHIFT];
+    if (n < V2_LENGTH_MASK) {
+        p[0] = kind | (uint8_t)n;
+        return 1;
+    }
+    
+    p[0] = kind | V2_LENGTH_MASK;
+    size_t size = 1;
+    for (n -= V2_LENGTH_MASK; n >= 0x80; n >>= 7) p[size++] = (uint8_t)(n | 0x80);
+    p[size++] = (uint8_t)n;
+    return size;
+}
+
+// advanced_token_info for a v2 token, which also reports the size of its
+// control byte and varint, which for a bit-pack token includes its width
+// byte. Returns false for a reserved control byte, a varint that is truncated
+// or too long, or a bit-pack width outside 1-7.
+static bool v2_token_info(const uint8_t* p, size_t available, size_t* control_size,
+                          size_t* token_size, size_t* output_size) {
+    if (available < 1 || p[0] >= V2_RESERVED) return false;
+    
+    uint8_t kind = p[0] & ~V2_LENGTH_MASK;
+    size_t length = v2_min_length[kind >> V2_KIND_SHIFT] + (p[0] & V2_LENGTH_MASK);
+    size_t size = 1;
+    if ((p[0] & V2_LENGTH_MASK) == V2_LENGTH_MASK) {
+        uint64_t extra = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (size >= available || size > V2_MAX_VARINT) return false;
+            uint8_t b = p[size++];
+            extra |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        if (extra > SIZE_MAX / 2 - length) return false;
+        length += (size_t)extra;
+    }
+    
+    if (kind == V2_BITPACK) {
+        if (size >= available || p[size] == 0 || p[size] >= 8) return false;
+        size_t width = p[size++];
+        *control_size = size;
+        *token_size = size + length / 8 * width + (length % 8 * width + 7) / 8;
+        *output_size = length;
+        return true;
+    }
+    
+    size_t payload = kind == V2_LITERAL ? length :
+                     kind == V2_NIBBLE ? (length + 1) / 2 :
+                     kind == V2_RUN ? 1 :
+                     kind == V2_ZERO_RUN ? 0 : 2;
+    *control_size = size;
+    *token_size = size + payload;
+    *output_size = length;
+    return true;
+}
+
+// Like can_nibble_pack without the cap, but the stretch ends in front of
+// V2_NIBBLE_RUN_BREAK equal bytes: past that a run token plus a fresh nibble
+// control byte cost less than the packed run
+#define V2_NIBBLE_RUN_BREAK 8
+
+static bool v2_nibble_sequence(const uint8_t* data, size_t start, size_t data_size, size_t* length) {
+    size_t run = 0;
+    size_t i = start;
+    for (; i < data_size && data[i] < 16; i++) {
+        run = (i > start && data[i] == data[i - 1]) ? run + 1 : 1;
+        if (run == V2_NIBBLE_RUN_BREAK) {
+            i -= run - 1;
+            break;
+        }
+    }
+    
+    *length = i - start;
+    return *length >= 4;
+}
+
+// Bit-pack stretch at start: the width is set by its first 8 bytes, and the
+// stretch ends at the first byte that doesn't fit or, like a literal, in
+// front of a run or a delta sequence the other tokens cover for less
+#define V2_BITPACK_MIN  8
+#define V2_BITPACK_STOP 16
+
+static bool v2_bitpack_sequence(const uint8_t* data, size_t start, size_t data_size, bool stop_for_delta,
+                                unsigned* width, size_t* length) {
+    if (data_size - start < V2_BITPACK_MIN) return false;
+    
+    uint8_t lead = 0;
+    for (size_t i = 0; i < V2_BITPACK_MIN; i++) lead |= data[start + i];
+    if (lead >= 0x80) return false;
+    
+    unsigned w = 1;
+    while (lead >> w) w++;
+    
+    size_t i = start;
+    for (; i < data_size && data[i] >> w == 0; i++) {
+        if (i + 2 < data_size) {
+            uint8_t a = data[i];
+            uint8_t b = data[i + 1];
+            uint8_t c = data[i + 2];
             
-            for (size_t i = 0; i < repeat_count; i++) {
-                memcpy(&output[out_pos], &data_ptr[in_pos], pattern_len);
-                out_pos += pattern_len;
-            }
-            in_pos += pattern_len;
+            if (((a == b) & (b == c)) | (stop_for_delta & starts_delta_sequence(a, b, c))) break;
         }
-        else if (control == EXT_COMMON_VAL) {
-            uint8_t info = data_ptr[in_pos++];
-            size_t count = info >> 4;
-            uint8_t val_idx = info & 0x0F;
-            uint8_t value = common_values[val_idx];
+    }
+    
+    *width = w;
+    *length = i - start;
+    return *length >= V2_BITPACK_MIN;
+}
+
+static inline size_t v2_bitpack_cost(unsigned width, size_t length) {
+    return v2_control_size(V2_BITPACK, length) + 1 + length / 8 * width + (length % 8 * width + 7) / 8;
+}
+
+// Packs length bytes of in into their low width bits, 8 bytes per width bytes
+static void bit_pack(const uint8_t* in, size_t length, unsigned width, uint8_t* out) {
+    for (size_t i = 0; i < length; i += 8) {
+        size_t count = length - i < 8 ? length - i : 8;
+        uint64_t bits = 0;
+        for (size_t j = 0; j < count; j++) bits |= (uint64_t)in[i + j] << (j * width);
+        size_t bytes = (count * width + 7) / 8;
+        for (size_t b = 0; b < bytes; b++) *out++ = (uint8_t)(bits >> (8 * b));
+    }
+}
+
+// Spreads the low 8 * width bits into eight bytes, halving the field each
+// step: four values to each 32-bit half, two to each 16-bit lane, one to each
+// byte. Called with a constant width the shifts and masks are constants too.
+static inline uint64_t bit_unpack_spread(uint64_t bits, unsigned width) {
+    uint64_t m4 = (1ULL << (4 * width)) - 1;
+    uint64_t m2 = ((1ULL << (2 * width)) - 1) * 0x0000000100000001ULL;
+    uint64_t m1 = ((1ULL << width) - 1) * 0x0001000100010001ULL;
+    bits = (bits & m4) | ((bits >> (4 * width)) & m4) << 32;
+    bits = (bits & m2) | ((bits >> (2 * width)) & m2) << 16;
+    return (bits & m1) | ((bits >> width) & m1) << 8;
+}
+
+static inline void bit_unpack_group(uint64_t bits, unsigned width, uint8_t* out) {
+    write_le64(out, bit_unpack_spread(bits, width));
+}
+
+static inline void bit_unpack_width(const uint8_t* in, size_t length, unsigned width, uint8_t* out) {
+    size_t groups = length / 8;
+    size_t g = 0;
+    // Whole 8-byte loads while the last one stays inside the packed bytes
+    for (; g < groups && g * width + 8 <= groups * width; g++) {
+        bit_unpack_group(read_le64(in + g * width), width, out + g * 8);
+    }
+    for (; g * 8 < length; g++) {
+        size_t count = length - g * 8 < 8 ? length - g * 8 : 8;
+        size_t bytes = (count * width + 7) / 8;
+        uint64_t bits = 0;
+        for (size_t b = 0; b < bytes; b++) bits |= (uint64_t)in[g * width + b] << (8 * b);
+        uint8_t group[8];
+        bit_unpack_group(bits, width, group);
+        memcpy(out + g * 8, group, count);
+    }
+}
+
+// For the unchecked decode loop: whole 8-byte loads and stores for every
+// group, the last ones reaching up to 7 bytes past the token on both sides
+static inline void bit_unpack_groups(const uint8_t* in, size_t length, unsigned width, uint8_t* out) {
+    for (size_t g = 0; g * 8 < length; g++) bit_unpack_group(read_le64(in + g * width), width, out + g * 8);
+}
+
+static void bit_unpack(const uint8_t* in, size_t length, unsigned width, uint8_t* out) {
+    switch (width) {
+    case 1: bit_unpack_width(in, length, 1, out); break;
+    case 2: bit_unpack_width(in, length, 2, out); break;
+    case 3: bit_unpack_width(in, length, 3, out); break;
+    case 4: bit_unpack_width(in, length, 4, out); break;
+    case 5: bit_unpack_width(in, length, 5, out); break;
+    case 6: bit_unpack_width(in, length, 6, out); break;
+    default: bit_unpack_width(in, length, 7, out); break;
+    }
+}
+
+// True if a match costing match_cost bytes is cheaper per input byte than a
+// token of cost bytes covering covered bytes
+static inline bool v2_match_beats(Match match, size_t match_cost, size_t cost, size_t covered) {
+    return match.length > 0 && match_cost * covered < cost * match.length;
+}
+
+// advanced_encode_token for format v2. With no length caps every strategy
+// takes as much as it can reach, so the choices follow the v1 encoder's but
+// runs come before deltas: a run is the cheaper token for the same bytes.
+static size_t v2_encode_token(const uint8_t* data_ptr, size_t in_pos, size_t data_size,
+                              uint8_t* output, size_t* out_pos, size_t output_capacity,
+                              MatchFinder* mf, unsigned probes) {
+    size_t pos = *out_pos;
+    size_t remaining = data_size - in_pos;
+    uint8_t current = data_ptr[in_pos];
+    Match match = {0, 0};
+    size_t match_cost = 0;
+    if (probes & PROBE_MATCH) {
+        uint64_t start = STATS_CLOCK();
+        match = match_finder_search(mf, data_ptr, in_pos, data_size, remaining, MATCH_CHAIN_DEPTH);
+        STATS_STAGE(STAGE_MATCH_SEARCH, start, match.length > 0);
+        if (match.length > 0) match_cost = v2_control_size(V2_MATCH, match.length) + 2;
+    }
+    
+    // Runs, zero runs without a value byte
+    size_t run_length = count_run(&data_ptr[in_pos], remaining);
+    if (run_length >= 3) {
+        uint8_t kind = current == 0 ? V2_ZERO_RUN : V2_RUN;
+        size_t cost = v2_control_size(kind, run_length) + (current != 0);
+        if (!v2_match_beats(match, match_cost, cost, run_length)) {
+            if (pos + cost > output_capacity) return 0;
+            pos += v2_put_control(&output[pos], kind, run_length);
+            if (current != 0) output[pos++] = current;
+            STATS_TOKEN(current == 0 ? TOKEN_ZERO_RUN : TOKEN_RLE, run_length, cost);
+            *out_pos = pos;
+            return run_length;
+        }
+    }
+    
+    // Delta sequences
+    int delta;
+    size_t delta_length;
+    bool is_delta = false;
+    if (probes & PROBE_DELTA) {
+        uint64_t start = STATS_CLOCK();
+        is_delta = delta_sequence(data_ptr, in_pos, data_size, remaining, &delta, &delta_length);
+        STATS_STAGE(STAGE_DELTA, start, is_delta);
+    }
+    if (is_delta) {
+        size_t cost = v2_control_size(V2_DELTA, delta_length) + 2;
+        if (!v2_match_beats(match, match_cost, cost, delta_length)) {
+            if (pos + cost > output_capacity) return 0;
+            pos += v2_put_control(&output[pos], V2_DELTA, delta_length);
+            output[pos++] = data_ptr[in_pos];
+            output[pos++] = (uint8_t)(delta + 16);
+            STATS_TOKEN(TOKEN_DELTA, delta_length, cost);
+            *out_pos = pos;
+            return delta_length;
+        }
+    }
+    
+    // Nibble packing, or bit packing where that's cheaper per byte
+    size_t nibble_length = 0;
+    bool is_nibble = false;
+    if (probes & PROBE_NIBBLE) {
+        uint64_t start = STATS_CLOCK();
+        is_nibble = v2_nibble_sequence(data_ptr, in_pos, data_size, &nibble_length);
+        STATS_STAGE(STAGE_NIBBLE, start, is_nibble);
+    }
+    size_t nibble_cost = is_nibble ? v2_control_size(V2_NIBBLE, nibble_length) + (nibble_length + 1) / 2 : 0;
+    
+    unsigned width;
+    size_t bitpack_length;
+    bool is_bitpack = false;
+    if (probes & PROBE_BITPACK) {
+        uint64_t start = STATS_CLOCK();
+        is_bitpack = v2_bitpack_sequence(data_ptr, in_pos, data_size, probes & PROBE_DELTA,
+                                         &width, &bitpack_length);
+        STATS_STAGE(STAGE_BITPACK, start, is_bitpack);
+    }
+    if (is_bitpack) {
+        size_t cost = v2_bitpack_cost(width, bitpack_length);
+        if (cost < bitpack_length && (!is_nibble || cost * nibble_length < nibble_cost * bitpack_length) &&
+            !v2_match_beats(match, match_cost, cost, bitpack_length)) {
+            if (pos + cost > output_capacity) return 0;
+            pos += v2_put_control(&output[pos], V2_BITPACK, bitpack_length);
+            output[pos++] = (uint8_t)width;
+            bit_pack(&data_ptr[in_pos], bitpack_length, width, &output[pos]);
+            pos += cost - v2_control_size(V2_BITPACK, bitpack_length) - 1;
             
-            memset(&output[out_pos], value, count);
-            out_pos += count;
+            STATS_TOKEN(TOKEN_NIBBLE, bitpack_length, cost);
+            *out_pos = pos;
+            return bitpack_length;
         }
-        else {
-            uint8_t mode = control & MODE_MASK;
-            size_t length = control & LENGTH_MASK;
+    }
+    
+    if (is_nibble) {
+        size_t cost = nibble_cost;
+        if (!v2_match_beats(match, match_cost, cost, nibble_length)) {
+            if (pos + cost > output_capacity) return 0;
+            pos += v2_put_control(&output[pos], V2_NIBBLE, nibble_length);
             
-            if (mode == MODE_RLE) {
-                uint8_t value = data_ptr[in_pos++];
-                memset(&output[out_pos], value, length);
-                out_pos += length;
+            const uint8_t* in = &data_ptr[in_pos];
+            for (size_t i = 0; i < nibble_length / 2; i++) {
+                output[pos++] = (uint8_t)((in[i * 2] << 4) | in[i * 2 + 1]);
             }
-            else if (mode == MODE_DELTA) {
-                uint8_t start = data_ptr[in_pos++];
-                int delta = (int)data_ptr[in_pos++] - 16;
-                
-                for (size_t i = 0; i < length; i++) {
-                    output[out_pos++] = (start + i * delta) & 0x7F;
-                }
-            }
-            else if (mode == MODE_NIBBLE) {
-                size_t pairs = length / 2;
-                for (size_t i = 0; i < pairs; i++) {
-                    uint8_t packed = data_ptr[in_pos++];
-                    output[out_pos++] = packed >> 4;
-                    output[out_pos++] = packed & 0x0F;
-                }
-                if (length % 2) {
-                    output[out_pos++] = data_ptr[in_pos++] >> 4;
-                }
-            }
-            else {
-                memcpy(&output[out_pos], &data_ptr[in_pos], length);
-                out_pos += length;
-                in_pos += length;
+            if (nibble_length % 2) output[pos++] = (uint8_t)(in[nibble_length - 1] << 4);
+            
+            STATS_TOKEN(TOKEN_NIBBLE, nibble_length, cost);
+            *out_pos = pos;
+            return nibble_length;
+        }
+    }
+    
+    // Back-reference
+    if (match.length > 0) {
+        if (pos + match_cost > output_capacity) return 0;
+        pos += v2_put_control(&output[pos], V2_MATCH, match.length);
+        output[pos++] = (uint8_t)(match.offset & 0xFF);
+        output[pos++] = (uint8_t)(match.offset >> 8);
+        STATS_TOKEN(TOKEN_MATCH, match.length, match_cost);
+        *out_pos = pos;
+        return match.length;
+    }
+    
+    // Literal: ends where the v1 literal would, minus the 63-byte cap, or in
+    // front of V2_BITPACK_STOP bytes that would bit-pack into 5 bits or less
+    size_t literal_count = 0;
+    size_t literal_start = in_pos;
+    bool stop_for_delta = probes & PROBE_DELTA;
+    bool stop_for_match = probes & PROBE_MATCH;
+    bool stop_for_bitpack = probes & PROBE_BITPACK;
+    size_t small = 0;
+    uint64_t scan_start = STATS_CLOCK();
+    while (in_pos < data_size) {
+        if (stop_for_bitpack) {
+            small = data_ptr[in_pos] < 32 ? small + 1 : 0;
+            if (small == V2_BITPACK_STOP && literal_count >= small) {
+                in_pos -= small - 1;
+                literal_count -= small - 1;
+                break;
             }
         }
+        if (in_pos + 2 < data_size) {
+            uint8_t a = data_ptr[in_pos];
+            uint8_t b = data_ptr[in_pos + 1];
+            uint8_t c = data_ptr[in_pos + 2];
+            
+            if (((a == b) & (b == c)) | (stop_for_delta & starts_delta_sequence(a, b, c))) break;
+        }
+        if (stop_for_match && literal_count > 0) {
+            bool found = match_finder_probe(mf, data_ptr, in_pos, data_size);
+            STATS_COUNT(STAGE_MATCH_PROBE, found);
+            if (found) break;
+        }
+        
+        in_pos++;
+        literal_count++;
     }
+    STATS_STAGE(STAGE_LITERAL_SCAN, scan_start, false);
     
-    memcpy(data_ptr, output, out_pos);
-    free(output);
+    size_t control_size = v2_control_size(V2_LITERAL, literal_count);
+    if (pos + control_size + literal_count > output_capacity) return 0;
+    pos += v2_put_control(&output[pos], V2_LITERAL, literal_count);
+    memcpy(&output[pos], &data_ptr[literal_start], literal_count);
+    pos += literal_count;
+    
+    STATS_TOKEN(TOKEN_LITERAL, literal_count, control_size + literal_count);
+    *out_pos = pos;
+    return literal_count;
+}
+
+// The v1 argument holds: every token but a literal costs at most the bytes
+// it covers, and a literal only stops early in front of a token of 3+ bytes.
+// The varint of a literal past 31 bytes fits in the same slack. Plus the
+// header.
+size_t advanced_compress_v2_bound(size_t data_size) {
+    return advanced_compress_bound(data_size) + V2_HEADER_SIZE;
+}
+
+static size_t advanced_v2_compress_probes(const uint8_t* data_ptr, size_t data_size,
+                                          uint8_t* output, size_t output_capacity, unsigned probes) {
+    if (!data_ptr || !output || data_size == 0 || output_capacity < V2_HEADER_SIZE) return 0;
+    
+    output[0] = MODE_LITERAL;
+    output[1] = ADVANCED_FORMAT_V2;
+    size_t out_pos = V2_HEADER_SIZE;
+    
+    MatchFinder mf;
+    match_finder_init(&mf);
+    for (size_t in_pos = 0; in_pos < data_size;) {
+        size_t consumed = v2_encode_token(data_ptr, in_pos, data_size,
+                                          output, &out_pos, output_capacity, &mf, probes);
+        if (consumed == 0) return 0;
+        in_pos += consumed;
+    }
     return out_pos;
 }
 
-// INTERFACE FUNCTIONS
-size_t byte_compress(uint8_t* data_ptr, size_t data_size) {
-    return advanced_compress(data_ptr, data_size);
+// Compresses into a format v2 stream. Returns the bytes written, or 0 if the
+// output doesn't fit.
+size_t advanced_compress_v2_to(const uint8_t* data_ptr, size_t data_size,
+                               uint8_t* output, size_t output_capacity) {
+    return advanced_v2_compress_probes(data_ptr, data_size, output, output_capacity, PROBE_ALL);
 }
-size_t byte_decompress(uint8_t* data_ptr, size_t compressed_size) {
-    return advanced_decompress(data_ptr, compressed_size);
+
+static size_t v2_decompressed_size(const uint8_t* data_ptr, size_t compressed_size) {
+    size_t total = 0;
+    for (size_t in_pos = V2_HEADER_SIZE; in_pos < compressed_size;) {
+        size_t control_size, token_size, output_size;
+        if (!v2_token_info(data_ptr + in_pos, compressed_size - in_pos,
+                           &control_size, &token_size, &output_size)) return 0;
+        if (token_size > compressed_size - in_pos || output_size > SIZE_MAX - total) return 0;
+        
+        total += output_size;
+        in_pos += token_size;
+    }
+    return total;
 }
 
-// COMPREHENSIVE TESTING SUITE
+// Sums the output length of every token without decoding anything, in
+// either format. Returns 0 for an empty or truncated stream.
+size_t advanced_decompressed_size(const uint8_t* data_ptr, size_t compressed_size) {
+    if (!data_ptr) return 0;
+    if (is_v2_stream(data_ptr, compressed_size)) return v2_decompressed_size(data_ptr, compressed_size);
+    
+    size_t total = 0;
+    size_t in_pos = 0;
+    
+    while (in_pos < compressed_size) {
+        size_t token_size;
+        size_t output_size;
+        if (!advanced_token_info(data_ptr + in_pos, compressed_size - in_pos,
+                                 &token_size, &output_size)) return 0;
+        if (token_size > compressed_size - in_pos) return 0;
+        
+        total += output_size;
+        in_pos += token_size;
+    }
+    
+    return total;
+}
+
+// OPTIMAL PARSE
+// The high level picks the cheapest token sequence instead of the first
+// strategy that applies. Input is parsed in OPTIMAL_SEGMENT pieces: a forward
+// pass records what every strategy could cover at each position (feeding the
+// match finder in order, with a deeper chain than the greedy parse), then a
+// backward pass computes cost[i], the fewest bytes that encode position i to
+// the end of the window. The window runs OPTIMAL_OVERLAP bytes past the
+// segment, and only the tokens starting inside the segment are written: the
+// next segment starts where the last of them ends, so a run or match crossing
+// the cut is parsed as if there were none. Its reach, measured against the
+// whole input, carries over. Tokens with a fixed cost and any length up to a
+// reach (runs, zero runs, common values, deltas, matches) look up the
+// cheapest end point with a range-minimum table over cost, nibbles with one
+// over 2 * cost + position; literals use a sliding minimum. EXT_PATTERN is not a candidate: back-references cover
+// every repeat it could.
+
+#define OPTIMAL_SEGMENT           65536
+#define OPTIMAL_OVERLAP           4096
+#define OPTIMAL_WINDOW            (OPTIMAL_SEGMENT + OPTIMAL_OVERLAP)
+#define OPTIMAL_CHAIN_DEPTH       16
+#define OPTIMAL_SUFFICIENT_LENGTH 32    // matches this long are followed, not searched
+#define OPTIMAL_RMQ_LEVELS        9     // windows up to 256 positions
 
 typedef struct {
-    const char* name;
-    size_t (*compress)(uint8_t*, size_t);
-    size_t (*decompress)(uint8_t*, size_t);
-} Algorithm;
+    uint8_t run;            // bytes equal to this one, up to 255
+    uint8_t delta_length;   // 0, or a delta run of 3..31
+    uint8_t delta;
+    uint8_t nibble_length;  // bytes below 16, up to 62
+    uint8_t match_length;   // 0, or a match of MATCH_MIN_LENGTH..255
+    uint16_t match_offset;
+} OptimalReach;
 
 typedef struct {
-    const char* name;
-    uint8_t* data;
-    size_t size;
-    const char* description;
-} TestCase;
+    uint8_t kind;           // TokenKind
+    uint8_t length;
+} OptimalChoice;
 
 typedef struct {
-    double compression_ratio;
-    double compression_time_ms;
-    double decompression_time_ms;
-    bool verified;
-    size_t compressed_size;
-    size_t original_size;
-} TestResult;
+    OptimalReach reach[OPTIMAL_WINDOW];
+    OptimalChoice choice[OPTIMAL_WINDOW];
+    uint32_t cost[OPTIMAL_WINDOW + 1];
+    // Minima over the 2^k positions from each position, as key << 32 |
+    // ~position: the key is the cost, for fixed-cost tokens, or 2 * cost +
+    // position, for nibble tokens whose cost grows by half a byte per byte
+    uint64_t rmq_cost[OPTIMAL_WINDOW + 1][OPTIMAL_RMQ_LEVELS];
+    uint64_t rmq_nibble[OPTIMAL_WINDOW + 1][OPTIMAL_RMQ_LEVELS];
+} OptimalState;
 
-// Performance timer
-double get_time_ms() {
-    return (double)clock() / CLOCKS_PER_SEC * 1000.0;
+static void optimal_rmq_add(OptimalState* st, size_t pos, size_t end) {
+    st->rmq_cost[pos][0] = ((uint64_t)st->cost[pos] << 32) | (uint32_t)~pos;
+    st->rmq_nibble[pos][0] = ((uint64_t)(2 * st->cost[pos] + pos) << 32) | (uint32_t)~pos;
+    for (int k = 1; k < OPTIMAL_RMQ_LEVELS; k++) {
+        size_t far = pos + ((size_t)1 << (k - 1));
+        uint64_t a = st->rmq_cost[pos][k - 1];
+        uint64_t b = far <= end ? st->rmq_cost[far][k - 1] : a;
+        st->rmq_cost[pos][k] = b < a ? b : a;
+        
+        a = st->rmq_nibble[pos][k - 1];
+        b = far <= end ? st->rmq_nibble[far][k - 1] : a;
+        st->rmq_nibble[pos][k] = b < a ? b : a;
+    }
 }
 
-// Generate test data patterns
-uint8_t* generate_pattern(const char* type, size_t size) {
-    uint8_t* data = (uint8_t*)malloc(size);
-    if (!data) return NULL;
+// Position of the smallest key in [first, last], both already costed; ties
+// go to the farther one, so a parse cut short by the window end leaves its
+// short token at the end, where the next window parses it again
+static uint32_t optimal_rmq_min(const uint64_t (*rmq)[OPTIMAL_RMQ_LEVELS], size_t first, size_t last) {
+    int k = 31 - __builtin_clz((unsigned)(last - first + 1));
+    uint64_t a = rmq[first][k];
+    uint64_t b = rmq[last - ((size_t)1 << k) + 1][k];
+    return ~(uint32_t)(b < a ? b : a);
+}
+
+static inline void optimal_keep(uint32_t total, uint8_t kind, size_t length,
+                                uint32_t* best, OptimalChoice* choice) {
+    if (total < *best) {
+        *best = total;
+        choice->kind = kind;
+        choice->length = (uint8_t)length;
+    }
+}
+
+// Keeps the best fixed-cost candidate covering first..last more bytes
+static void optimal_consider(const OptimalState* st, size_t pos, size_t first, size_t last,
+                             uint32_t token_cost, uint8_t kind, uint32_t* best, OptimalChoice* choice) {
+    uint32_t end = optimal_rmq_min(st->rmq_cost, pos + first, pos + last);
+    optimal_keep(token_cost + st->cost[end], kind, end - pos, best, choice);
+}
+
+static int common_value_index(uint8_t value) {
+    for (int i = 0; i < NUM_COMMON_VALUES; i++) {
+        if (common_values[i] == value) return i;
+    }
+    return -1;
+}
+
+// Parses the window from start to end, whose first carried reaches are
+// already recorded, and writes the tokens that start before cut. Returns the
+// bytes those tokens cover, or 0 if the output doesn't fit.
+static size_t optimal_parse_segment(const uint8_t* data_ptr, size_t start, size_t end, size_t cut,
+                                    size_t carried, size_t data_size, uint8_t* output, size_t* out_pos,
+                                    size_t output_capacity, MatchFinder* mf, OptimalState* st) {
+    size_t m = end - start;
+    size_t available = data_size - start;
+    const uint8_t* seg = data_ptr + start;
+    uint64_t parse_start = STATS_CLOCK();
     
-    if (strcmp(type, "zeros") == 0) {
-        memset(data, 0x00, size);
+    for (size_t i = carried; i < m; i++) {
+        OptimalReach* r = &st->reach[i];
+        const OptimalReach* prev = i > 0 ? &st->reach[i - 1] : NULL;
+        size_t remaining = available - i;
+        
+        // Inside a run, a delta run, a nibble stretch or a long match, the
+        // reach at i is the one at i - 1 shortened by a byte, plus one more
+        // if that one stopped at the cap
+        if (prev && prev->run > 1) {
+            size_t run = prev->run - 1;
+            if (run == 254 && run < remaining && seg[i + run] == seg[i]) run++;
+            r->run = (uint8_t)run;
+        } else {
+            r->run = (uint8_t)count_run(seg + i, remaining < 255 ? remaining : 255);
+        }
+        
+        int delta;
+        size_t length;
+        if (prev && prev->delta_length > 3 && (int)seg[i + 1] - (int)seg[i] == prev->delta - 16) {
+            length = prev->delta_length - 1;
+            if (length == MAX_DELTA_LENGTH - 1 && length < remaining &&
+                seg[i + length] == ((seg[i + length - 1] + prev->delta - 16) & 0x7F)) length++;
+            r->delta_length = (uint8_t)length;
+            r->delta = prev->delta;
+        } else {
+            bool is_delta = i + 2 < available && is_delta_sequence(seg, i, available, &delta, &length);
+            r->delta_length = is_delta ? (uint8_t)length : 0;
+            r->delta = is_delta ? (uint8_t)(delta + 16) : 0;
+        }
+        
+        if (prev && prev->nibble_length > 1) {
+            length = prev->nibble_length - 1;
+            if (length == 61 && length < remaining && seg[i + length] < 16) length++;
+            r->nibble_length = (uint8_t)length;
+        } else {
+            can_nibble_pack(seg, i, available, &length);
+            r->nibble_length = (uint8_t)length;
+        }
+        
+        size_t max_match = remaining < MATCH_MAX_LENGTH ? remaining : MATCH_MAX_LENGTH;
+        if (prev && prev->match_length > OPTIMAL_SUFFICIENT_LENGTH) {
+            // A match that stopped at the length cap may run one byte further
+            size_t length = prev->match_length - 1;
+            const uint8_t* p = seg + i;
+            if (length < max_match && p[length] == p[length - prev->match_offset]) length++;
+            r->match_length = (uint8_t)length;
+            r->match_offset = prev->match_offset;
+        } else {
+            Match match = match_finder_search(mf, data_ptr, start + i, data_size, max_match,
+                                              OPTIMAL_CHAIN_DEPTH);
+            r->match_length = (uint8_t)match.length;
+            r->match_offset = (uint16_t)match.offset;
+        }
     }
-    else if (strcmp(type, "random") == 0) {
+    
+    // Sliding minimum of (j + cost[j]) over the next 63 positions, for literals
+    size_t window[64];
+    size_t head = 0, tail = 0;
+    
+    st->cost[m] = 0;
+    optimal_rmq_add(st, m, m);
+    
+    for (size_t i = m; i-- > 0;) {
+        // Reaches may run past the window; tokens stop at its end
+        OptimalReach r_window = st->reach[i];
+        const OptimalReach* r = &r_window;
+        size_t left = m - i;
+        if (r_window.run > left) r_window.run = (uint8_t)left;
+        if (r_window.delta_length > left) r_window.delta_length = left < 3 ? 0 : (uint8_t)left;
+        if (r_window.nibble_length > left) r_window.nibble_length = (uint8_t)left;
+        if (r_window.match_length > left) r_window.match_length = left < MATCH_MIN_LENGTH ? 0 : (uint8_t)left;
+        OptimalChoice choice = {TOKEN_LITERAL, 1};
+        
+        size_t j = i + 1;
+        while (tail > head && window[(tail - 1) & 63] + st->cost[window[(tail - 1) & 63]] >= j + st->cost[j]) tail--;
+        window[tail++ & 63] = j;
+        if (window[head & 63] > i + 63) head++;
+        size_t lit_end = window[head & 63];
+        uint32_t best = 1 + (uint32_t)(lit_end - i) + st->cost[lit_end];
+        choice.length = (uint8_t)(lit_end - i);
+        
+        uint8_t value = seg[i];
+        if (value == 0x00) {
+            optimal_consider(st, i, 1, r->run, 2, TOKEN_ZERO_RUN, &best, &choice);
+        } else {
+            optimal_consider(st, i, 1, r->run < 63 ? r->run : 63, 2, TOKEN_RLE, &best, &choice);
+        }
+        if (common_value_index(value) >= 0) {
+            optimal_consider(st, i, 1, r->run < 15 ? r->run : 15, 2, TOKEN_COMMON_VAL, &best, &choice);
+        }
+        if (r->delta_length) {
+            optimal_consider(st, i, 3, r->delta_length, 3, TOKEN_DELTA, &best, &choice);
+        }
+        if (r->match_length) {
+            optimal_consider(st, i, MATCH_MIN_LENGTH, r->match_length, 4, TOKEN_MATCH, &best, &choice);
+        }
+        if (r->nibble_length >= 2) {
+            // The key ignores the rounding up of odd lengths, so the
+            // neighbours either side get a look too
+            size_t end = optimal_rmq_min(st->rmq_nibble, i + 2, i + r->nibble_length);
+            for (size_t k = end - i - 1; k <= end - i + 1; k++) {
+                if (k < 2 || k > r->nibble_length) continue;
+                optimal_keep(1 + (uint32_t)(k + 1) / 2 + st->cost[i + k], TOKEN_NIBBLE, k, &best, &choice);
+            }
+        }
+        
+        st->cost[i] = best;
+        st->choice[i] = choice;
+        optimal_rmq_add(st, i, m);
+    }
+    STATS_STAGE(STAGE_OPTIMAL, parse_start, false);
+    
+    size_t pos = *out_pos;
+    size_t i = 0;
+    while (i < cut) {
+        OptimalChoice c = st->choice[i];
+        size_t length = c.length;
+        size_t token_size = c.kind == TOKEN_LITERAL ? 1 + length :
+                            c.kind == TOKEN_NIBBLE ? 1 + (length + 1) / 2 :
+                            c.kind == TOKEN_DELTA ? 3 : c.kind == TOKEN_MATCH ? 4 : 2;
+        if (pos + token_size > output_capacity) return 0;
+        STATS_TOKEN((TokenKind)c.kind, length, token_size);
+        
+        switch (c.kind) {
+        case TOKEN_LITERAL:
+            output[pos++] = MODE_LITERAL | (uint8_t)length;
+            memcpy(&output[pos], seg + i, length);
+            pos += length;
+            break;
+        case TOKEN_NIBBLE:
+            output[pos++] = MODE_NIBBLE | (uint8_t)length;
+            for (size_t k = 0; k + 1 < length; k += 2) output[pos++] = (uint8_t)((seg[i + k] << 4) | seg[i + k + 1]);
+            if (length % 2) output[pos++] = (uint8_t)(seg[i + length - 1] << 4);
+            break;
+        case TOKEN_RLE:
+            output[pos++] = MODE_RLE | (uint8_t)length;
+            output[pos++] = seg[i];
+            break;
+        case TOKEN_ZERO_RUN:
+            output[pos++] = EXT_ZERO_RUN;
+            output[pos++] = (uint8_t)length;
+            break;
+        case TOKEN_COMMON_VAL:
+            output[pos++] = EXT_COMMON_VAL;
+            output[pos++] = (uint8_t)((length << 4) | common_value_index(seg[i]));
+            break;
+        case TOKEN_DELTA:
+            output[pos++] = MODE_DELTA | (uint8_t)length;
+            output[pos++] = seg[i];
+            output[pos++] = st->reach[i].delta;
+            break;
+        case TOKEN_MATCH:
+            output[pos++] = EXT_MATCH;
+            output[pos++] = (uint8_t)length;
+            output[pos++] = (uint8_t)(st->reach[i].match_offset & 0xFF);
+            output[pos++] = (uint8_t)(st->reach[i].match_offset >> 8);
+            break;
+        }
+        i += length;
+    }
+    *out_pos = pos;
+    return i;
+}
+
+// Smallest advanced stream this parser can find. Allocates about 11 MB of
+// parse state; returns 0 if that fails or the output doesn't fit. A cut can
+// still cost the parse a few bytes the greedy one saves, so that runs too
+// and the smaller stream is kept.
+static size_t advanced_compress_optimal(const uint8_t* data_ptr, size_t data_size,
+                                        uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || data_size == 0) return 0;
+    
+    OptimalState* st = (OptimalState*)codec_alloc(sizeof(OptimalState));
+    MatchFinder* mf = (MatchFinder*)codec_alloc(sizeof(MatchFinder));
+    size_t out_pos = 0;
+    
+    if (st && mf) {
+        match_finder_init(mf);
+        size_t carried = 0;
+        for (size_t start = 0; start < data_size;) {
+            size_t end = data_size - start < OPTIMAL_WINDOW ? data_size : start + OPTIMAL_WINDOW;
+            size_t cut = end == data_size ? end - start : OPTIMAL_SEGMENT;
+            size_t covered = optimal_parse_segment(data_ptr, start, end, cut, carried, data_size,
+                                                   output, &out_pos, output_capacity, mf, st);
+            if (covered == 0) {
+                out_pos = 0;
+                break;
+            }
+            
+            // Reaches past the last token written are kept for the next window
+            carried = end - start - covered;
+            memmove(st->reach, st->reach + covered, carried * sizeof(OptimalReach));
+            start += covered;
+        }
+    }
+    
+    codec_free(st);
+    codec_free(mf);
+    
+    if (out_pos > 1) {
+        uint8_t* greedy = (uint8_t*)codec_alloc(out_pos - 1);
+        size_t greedy_size = greedy ? advanced_compress_to(data_ptr, data_size, greedy, out_pos - 1) : 0;
+        if (greedy_size > 0) {
+            memcpy(output, greedy, greedy_size);
+            out_pos = greedy_size;
+        }
+        codec_free(greedy);
+    }
+    return out_pos;
+}
+
+// COMPRESSION LEVELS
+// All levels write the same advanced stream, so one decoder serves them all.
+// Level 1 only looks for runs and literals, which keeps it at Simple RLE
+// speed; level 2 is the greedy parse above; level 3 is the optimal parse.
+
+#define COMPRESS_LEVEL_FAST    1
+#define COMPRESS_LEVEL_DEFAULT 2
+#define COMPRESS_LEVEL_MAX     3
+
+size_t advanced_compress_level_to(const uint8_t* data_ptr, size_t data_size,
+                                  uint8_t* output, size_t output_capacity, int level) {
+    if (level == COMPRESS_LEVEL_FAST) {
+        return advanced_compress_probes(data_ptr, data_size, output, output_capacity, 0);
+    }
+    if (level >= COMPRESS_LEVEL_MAX) {
+        return advanced_compress_optimal(data_ptr, data_size, output, output_capacity);
+    }
+    return advanced_compress_to(data_ptr, data_size, output, output_capacity);
+}
+
+// DECODE KERNELS
+// Token expansion for the advanced decoder. Every kernel writes exactly the
+// bytes of its token and reads only its payload, so none of them can touch
+// memory past the end of either buffer. The _scalar versions are the
+// reference the vector ones are tested against.
+
+// MODE_NIBBLE: each payload byte holds two output bytes, high nibble first
+static void nibble_unpack_scalar(const uint8_t* in, size_t length, uint8_t* out) {
+    size_t pairs = length / 2;
+    for (size_t i = 0; i < pairs; i++) {
+        out[i * 2] = in[i] >> 4;
+        out[i * 2 + 1] = in[i] & 0x0F;
+    }
+    if (length % 2) out[length - 1] = in[pairs] >> 4;
+}
+
+static void nibble_unpack(const uint8_t* in, size_t length, uint8_t* out) {
+    size_t pairs = length / 2;
+    size_t done = 0;
+
+#if defined(DECODE_KERNELS_SSE2)
+    // 16 packed bytes become 32 output bytes
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    for (; done + 16 <= pairs; done += 16) {
+        __m128i packed = _mm_loadu_si128((const __m128i*)(in + done));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), low_mask);
+        __m128i low = _mm_and_si128(packed, low_mask);
+        _mm_storeu_si128((__m128i*)(out + done * 2), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)(out + done * 2 + 16), _mm_unpackhi_epi8(high, low));
+    }
+    // Remaining pairs: one more block overlapping the last full one
+    if (done >= 16 && done < pairs) {
+        done = pairs - 16;
+        __m128i packed = _mm_loadu_si128((const __m128i*)(in + done));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), low_mask);
+        __m128i low = _mm_and_si128(packed, low_mask);
+        _mm_storeu_si128((__m128i*)(out + done * 2), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)(out + done * 2 + 16), _mm_unpackhi_epi8(high, low));
+        done = pairs;
+    }
+#elif defined(DECODE_KERNELS_NEON)
+    for (; done + 16 <= pairs; done += 16) {
+        uint8x16_t packed = vld1q_u8(in + done);
+        uint8x16x2_t split = {{vshrq_n_u8(packed, 4), vandq_u8(packed, vdupq_n_u8(0x0F))}};
+        vst2q_u8(out + done * 2, split);
+    }
+    if (done >= 16 && done < pairs) {
+        done = pairs - 16;
+        uint8x16_t packed = vld1q_u8(in + done);
+        uint8x16x2_t split = {{vshrq_n_u8(packed, 4), vandq_u8(packed, vdupq_n_u8(0x0F))}};
+        vst2q_u8(out + done * 2, split);
+        done = pairs;
+    }
+#endif
+    
+    nibble_unpack_scalar(in + done, length - done * 2, out + done * 2);
+}
+
+// MODE_DELTA: out[i] = (start + i * delta) & 0x7F
+static void delta_fill_scalar(uint8_t start, int delta, size_t length, uint8_t* out) {
+    for (size_t i = 0; i < length; i++) out[i] = (start + i * delta) & 0x7F;
+}
+
+static void delta_fill(uint8_t start, int delta, size_t length, uint8_t* out) {
+    size_t done = 0;
+
+#if defined(DECODE_KERNELS_SSE2)
+    // i * delta in 16-bit lanes, truncated to bytes: exact modulo 256, and
+    // the final mask reduces modulo 128
+    const __m128i delta16 = _mm_set1_epi16((short)delta);
+    const __m128i byte_mask = _mm_set1_epi16(0xFF);
+    __m128i low = _mm_and_si128(_mm_mullo_epi16(_mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7), delta16), byte_mask);
+    __m128i high = _mm_and_si128(_mm_mullo_epi16(_mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15), delta16),
+                                 byte_mask);
+    __m128i value = _mm_add_epi8(_mm_set1_epi8((char)start), _mm_packus_epi16(low, high));
+    const __m128i step = _mm_set1_epi8((char)(delta * 16));
+    const __m128i mask = _mm_set1_epi8(0x7F);
+    if (length >= 16) {
+        for (; done + 16 <= length; done += 16) {
+            _mm_storeu_si128((__m128i*)(out + done), _mm_and_si128(value, mask));
+            value = _mm_add_epi8(value, step);
+        }
+        // The tail is one more store that overlaps the last full one
+        if (done < length) {
+            size_t back = 16 - (length - done);
+            value = _mm_sub_epi8(value, _mm_set1_epi8((char)(delta * (int)back)));
+            _mm_storeu_si128((__m128i*)(out + length - 16), _mm_and_si128(value, mask));
+            done = length;
+        }
+    }
+#elif defined(DECODE_KERNELS_NEON)
+    static const uint8_t lane_index[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    uint8x16_t value = vmlaq_u8(vdupq_n_u8(start), vld1q_u8(lane_index), vdupq_n_u8((uint8_t)delta));
+    if (length >= 16) {
+        for (; done + 16 <= length; done += 16) {
+            vst1q_u8(out + done, vandq_u8(value, vdupq_n_u8(0x7F)));
+            value = vaddq_u8(value, vdupq_n_u8((uint8_t)(delta * 16)));
+        }
+        if (done < length) {
+            size_t back = 16 - (length - done);
+            value = vsubq_u8(value, vdupq_n_u8((uint8_t)(delta * (int)back)));
+            vst1q_u8(out + length - 16, vandq_u8(value, vdupq_n_u8(0x7F)));
+            done = length;
+        }
+    }
+#endif
+    
+    delta_fill_scalar((uint8_t)(start + done * delta), delta, length - done, out + done);
+}
+
+// EXT_PATTERN: the pattern is doubled into a tile of up to 64 bytes on the
+// stack, then the output is written a whole tile at a time
+static void pattern_fill_scalar(const uint8_t* pattern, size_t length, size_t repeat, uint8_t* out) {
+    for (size_t i = 0; i < repeat; i++) memcpy(out + i * length, pattern, length);
+}
+
+static void pattern_fill(const uint8_t* pattern, size_t length, size_t repeat, uint8_t* out) {
+    if (length == 0 || repeat == 0) return;
+    
+    uint8_t tile[64];
+    size_t tile_len = length;
+    memcpy(tile, pattern, length);
+    while (tile_len * 2 <= sizeof(tile)) {
+        memcpy(tile + tile_len, tile, tile_len);
+        tile_len *= 2;
+    }
+    
+    size_t total = length * repeat;
+    for (size_t done = 0; done < total; done += tile_len) {
+        memcpy(out + done, tile, total - done < tile_len ? total - done : tile_len);
+    }
+}
+
+// EXT_MATCH: repeat the period bytes just before out_pos until length bytes
+// are written. An offset shorter than the length repeats bytes written by
+// the same copy.
+static void repeat_copy_scalar(uint8_t* output, size_t out_pos, size_t period, size_t length) {
+    const uint8_t* from = output + out_pos - period;
+    for (size_t i = 0; i < length; i++) output[out_pos + i] = from[i];
+}
+
+// Each memcpy doubles the span it copies from, so a 1-byte period takes
+// log2(length) copies instead of length
+static void repeat_copy(uint8_t* output, size_t out_pos, size_t period, size_t length) {
+    const uint8_t* source = output + out_pos - period;
+    uint8_t* dest = output + out_pos;
+    size_t copied = 0;
+    
+    while (copied < length) {
+        // dest[0, copied + period) is exactly period-periodic, so it can be
+        // copied again without overlapping itself
+        size_t chunk = copied + period;
+        if (chunk > length - copied) chunk = length - copied;
+        memcpy(dest + copied, source, chunk);
+        copied += chunk;
+    }
+}
+
+static inline void match_copy(uint8_t* output, size_t out_pos, size_t offset, size_t length) {
+    repeat_copy(output, out_pos, offset, length);
+}
+
+// Decodes one token whose bytes and output space the caller has already
+// checked with advanced_token_info, writing exactly its output. Returns false
+// for a back-reference that reaches before the start of the output or a
+// common-value index past the table.
+static bool advanced_decode_token(const uint8_t* token, uint8_t* output, size_t out_pos) {
+    TokenEntry entry = token_table[token[0]];
+    size_t length = entry.length;
+    
+    switch (entry.kind) {
+    case TOKEN_LITERAL:
+        memcpy(&output[out_pos], &token[1], length);
+        break;
+    case TOKEN_NIBBLE:
+        nibble_unpack(&token[1], length, &output[out_pos]);
+        break;
+    case TOKEN_RLE:
+        memset(&output[out_pos], token[1], length);
+        break;
+    case TOKEN_DELTA:
+        delta_fill(token[1], (int)token[2] - 16, length, &output[out_pos]);
+        break;
+    case TOKEN_ZERO_RUN:
+        memset(&output[out_pos], 0, token[1]);
+        break;
+    case TOKEN_PATTERN:
+        pattern_fill(&token[2], token[1] >> 4, token[1] & 0x0F, &output[out_pos]);
+        break;
+    case TOKEN_COMMON_VAL:
+        if ((token[1] & 0x0F) >= NUM_COMMON_VALUES) return false;
+        memset(&output[out_pos], common_values[token[1] & 0x0F], token[1] >> 4);
+        break;
+    case TOKEN_MATCH: {
+        size_t offset = token[2] | ((size_t)token[3] << 8);
+        if (offset == 0 || offset >= MATCH_WINDOW_SIZE || offset > out_pos) return false;
+        match_copy(output, out_pos, offset, token[1]);
+        break;
+    }
+    }
+    return true;
+}
+
+// A v2 token with at most a one-byte varint decodes to at most 166 bytes
+// and is at most 161 bytes long. A bit-pack token's whole-group loads and
+// stores stay within 176 bytes of its start on either side.
+#define V2_SHORT_TOKEN_SLACK 192
+
+// Decodes a format v2 stream. Long tokens are checked against what is left of
+// both buffers, which costs little per output byte. Short ones far from
+// either end skip the checks and write whole vectors, as in the v1 loop.
+static size_t v2_decompress_to(const uint8_t* data_ptr, size_t compressed_size,
+                               uint8_t* output, size_t output_capacity) {
+    size_t out_pos = 0;
+    size_t in_limit = compressed_size > V2_SHORT_TOKEN_SLACK ? compressed_size - V2_SHORT_TOKEN_SLACK : 0;
+    size_t out_limit = output_capacity > V2_SHORT_TOKEN_SLACK ? output_capacity - V2_SHORT_TOKEN_SLACK : 0;
+    
+    for (size_t in_pos = V2_HEADER_SIZE; in_pos < compressed_size;) {
+        const uint8_t* token = &data_ptr[in_pos];
+        uint8_t control = token[0];
+        
+        if (in_pos < in_limit && out_pos < out_limit && control < V2_RESERVED &&
+            ((control & V2_LENGTH_MASK) != V2_LENGTH_MASK || token[1] < 0x80)) {
+            uint8_t kind = control & ~V2_LENGTH_MASK;
+            size_t length = v2_min_length[kind >> V2_KIND_SHIFT] + (control & V2_LENGTH_MASK);
+            uint8_t* dest = &output[out_pos];
+            in_pos++;
+            if ((control & V2_LENGTH_MASK) == V2_LENGTH_MASK) length += data_ptr[in_pos++];
+            
+            switch (kind) {
+            case V2_LITERAL:
+                for (size_t i = 0; i < length; i += 32) memcpy(dest + i, &data_ptr[in_pos + i], 32);
+                in_pos += length;
+                break;
+            case V2_RUN:
+            case V2_ZERO_RUN: {
+                uint8_t value = kind == V2_RUN ? data_ptr[in_pos++] : 0;
+                for (size_t i = 0; i < length; i += 32) memset(dest + i, value, 32);
+                break;
+            }
+            case V2_MATCH: {
+                size_t offset = data_ptr[in_pos] | ((size_t)data_ptr[in_pos + 1] << 8);
+                in_pos += 2;
+                if (offset == 0 || offset >= MATCH_WINDOW_SIZE || offset > out_pos) return 0;
+                if (offset >= 32) {
+                    for (size_t i = 0; i < length; i += 32) memcpy(dest + i, dest - offset + i, 32);
+                } else if (offset >= 16) {
+                    for (size_t i = 0; i < length; i += 16) memcpy(dest + i, dest - offset + i, 16);
+                } else {
+                    match_copy(output, out_pos, offset, length);
+                }
+                break;
+            }
+            case V2_NIBBLE:
+                nibble_unpack(&data_ptr[in_pos], length, dest);
+                in_pos += (length + 1) / 2;
+                break;
+            case V2_BITPACK: {
+                unsigned width = data_ptr[in_pos++];
+                const uint8_t* packed = &data_ptr[in_pos];
+                switch (width) {
+                case 1: bit_unpack_groups(packed, length, 1, dest); break;
+                case 2: bit_unpack_groups(packed, length, 2, dest); break;
+                case 3: bit_unpack_groups(packed, length, 3, dest); break;
+                case 4: bit_unpack_groups(packed, length, 4, dest); break;
+                case 5: bit_unpack_groups(packed, length, 5, dest); break;
+                case 6: bit_unpack_groups(packed, length, 6, dest); break;
+                case 7: bit_unpack_groups(packed, length, 7, dest); break;
+                default: return 0;
+                }
+                in_pos += length / 8 * width + (length % 8 * width + 7) / 8;
+                break;
+            }
+            default:
+                delta_fill(data_ptr[in_pos], (int)data_ptr[in_pos + 1] - 16, length, dest);
+                in_pos += 2;
+                break;
+            }
+            out_pos += length;
+            continue;
+        }
+        
+        size_t control_size, token_size, length;
+        if (!v2_token_info(token, compressed_size - in_pos, &control_size, &token_size, &length) ||
+            token_size > compressed_size - in_pos || length > output_capacity - out_pos) return 0;
+        
+        const uint8_t* payload = token + control_size;
+        uint8_t* dest = &output[out_pos];
+        switch (token[0] & ~V2_LENGTH_MASK) {
+        case V2_LITERAL:
+            memcpy(dest, payload, length);
+            break;
+        case V2_NIBBLE:
+            nibble_unpack(payload, length, dest);
+            break;
+        case V2_RUN:
+            memset(dest, payload[0], length);
+            break;
+        case V2_ZERO_RUN:
+            memset(dest, 0, length);
+            break;
+        case V2_DELTA:
+            delta_fill(payload[0], (int)payload[1] - 16, length, dest);
+            break;
+        case V2_BITPACK:
+            bit_unpack(payload, length, token[control_size - 1], dest);
+            break;
+        default: {
+            size_t offset = payload[0] | ((size_t)payload[1] << 8);
+            if (offset == 0 || offset >= MATCH_WINDOW_SIZE || offset > out_pos) return 0;
+            match_copy(output, out_pos, offset, length);
+            break;
+        }
+        }
+        
+        in_pos += token_size;
+        out_pos += length;
+    }
+    
+    return out_pos;
+}
+
+// While a worst-case token fits on both sides with room to spare, the main
+// loop skips every bounds check and writes whole vectors: literals and runs
+// as one 64-byte store, short zero runs and matches as one 32-byte store,
+// longer matches 16 bytes at a time. The extra bytes stay inside
+// output_capacity and are overwritten by later tokens. The last few hundred
+// bytes of either buffer go through advanced_decode_token instead, which
+// checks each token against what is actually left, so a truncated or corrupt
+// stream is rejected rather than read or written past its end.
+#define DECODE_INPUT_SLACK  (1 + ADVANCED_MAX_TOKEN_SIZE)
+#define DECODE_OUTPUT_SLACK (ADVANCED_MAX_TOKEN_OUTPUT + 16)
+
+size_t advanced_decompress_to(const uint8_t* data_ptr, size_t compressed_size,
+                              uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || compressed_size == 0) return 0;
+    if (is_v2_stream(data_ptr, compressed_size)) {
+        return v2_decompress_to(data_ptr, compressed_size, output, output_capacity);
+    }
+    
+    size_t out_pos = 0;
+    size_t in_pos = 0;
+    size_t in_limit = compressed_size > DECODE_INPUT_SLACK ? compressed_size - DECODE_INPUT_SLACK : 0;
+    size_t out_limit = output_capacity > DECODE_OUTPUT_SLACK ? output_capacity - DECODE_OUTPUT_SLACK : 0;
+    
+    while (in_pos < in_limit && out_pos < out_limit) {
+        uint8_t control = data_ptr[in_pos++];
+        
+        if (control == EXT_ZERO_RUN) {
+            size_t count = data_ptr[in_pos++];
+            if (count <= 32) memset(&output[out_pos], 0, 32);
+            else memset(&output[out_pos], 0, count);
+            out_pos += count;
+        } 
+        else if (control == EXT_PATTERN) {
+            uint8_t info = data_ptr[in_pos++];
+            size_t pattern_len = info >> 4;
+            size_t repeat_count = info & 0x0F;
+            
+            pattern_fill(&data_ptr[in_pos], pattern_len, repeat_count, &output[out_pos]);
+            out_pos += pattern_len * repeat_count;
+            in_pos += pattern_len;
+        }
+        else if (control == EXT_COMMON_VAL) {
+            uint8_t info = data_ptr[in_pos++];
+            size_t count = info >> 4;
+            uint8_t val_idx = info & 0x0F;
+            if (val_idx >= NUM_COMMON_VALUES) return 0;
+            uint8_t value = common_values[val_idx];
+            
+            memset(&output[out_pos], value, 16);
+            out_pos += count;
+        }
+        else if (control == EXT_MATCH) {
+            size_t length = data_ptr[in_pos];
+            size_t offset = data_ptr[in_pos + 1] | ((size_t)data_ptr[in_pos + 2] << 8);
+            in_pos += 3;
+            if (offset == 0 || offset >= MATCH_WINDOW_SIZE || offset > out_pos) return 0;
+            
+            uint8_t* dest = &output[out_pos];
+            const uint8_t* source = dest - offset;
+            if (length <= 32 && offset >= 32) {
+                memcpy(dest, source, 32);
+            } else if (offset >= 16) {
+                for (size_t i = 0; i < length; i += 16) memcpy(dest + i, source + i, 16);
+            } else {
+                match_copy(output, out_pos, offset, length);
+            }
+            out_pos += length;
+        }
+        else {
+            uint8_t mode = control & MODE_MASK;
+            size_t length = control & LENGTH_MASK;
+            
+            if (mode == MODE_RLE) {
+                uint8_t value = data_ptr[in_pos++];
+                memset(&output[out_pos], value, 64);
+                out_pos += length;
+            }
+            else if (mode == MODE_DELTA) {
+                uint8_t start = data_ptr[in_pos++];
+                int delta = (int)data_ptr[in_pos++] - 16;
+                
+                delta_fill(start, delta, length, &output[out_pos]);
+                out_pos += length;
+            }
+            else if (mode == MODE_NIBBLE) {
+                nibble_unpack(&data_ptr[in_pos], length, &output[out_pos]);
+                in_pos += (length + 1) / 2;
+                out_pos += length;
+            }
+            else {
+                memcpy(&output[out_pos], &data_ptr[in_pos], 64);
+                out_pos += length;
+                in_pos += length;
+            }
+        }
+    }
+    
+    while (in_pos < compressed_size) {
+        size_t token_size, output_size;
+        if (!advanced_token_info(&data_ptr[in_pos], compressed_size - in_pos, &token_size, &output_size) ||
+            token_size > compressed_size - in_pos || output_size > output_capacity - out_pos ||
+            !advanced_decode_token(&data_ptr[in_pos], output, out_pos)) return 0;
+        
+        in_pos += token_size;
+        out_pos += output_size;
+    }
+    
+    return out_pos;
+}
+
+size_t advanced_decompress_ex(uint8_t* data_ptr, size_t compressed_size,
+                              uint8_t* scratch, size_t scratch_capacity) {
+    if (!data_ptr || compressed_size == 0) return 0;
+    
+    size_t result = advanced_decompress_to(data_ptr, compressed_size, scratch, scratch_capacity);
+    if (result == 0) return compressed_size;
+    
+    memcpy(data_ptr, scratch, result);
+    return result;
+}
+
+size_t advanced_decompress(uint8_t* data_ptr, size_t compressed_size) {
+    if (!data_ptr || compressed_size == 0) return 0;
+    
+    // A cheap first pass over the tokens gives the exact output size, so
+    // memory scales with the decoded data instead of 256x the input
+    size_t decoded_size = advanced_decompressed_size(data_ptr, compressed_size);
+    if (decoded_size == 0) return compressed_size;
+    
+    uint8_t* output = (uint8_t*)codec_alloc(decoded_size);
+    if (!output) return compressed_size;
+    
+    size_t result = advanced_decompress_ex(data_ptr, compressed_size, output, decoded_size);
+    codec_free(output);
+    return result;
+}
+
+// CODEC CONTEXT
+// Keeps one scratch buffer alive across calls. It only grows, so once it has
+// seen the largest frame the context path does no further heap allocation.
+
+typedef struct {
+    uint8_t* scratch;
+    size_t scratch_capacity;
+} CodecContext;
+
+void codec_context_init(CodecContext* ctx) {
+    ctx->scratch = NULL;
+    ctx->scratch_capacity = 0;
+}
+
+void codec_context_free(CodecContext* ctx) {
+    codec_free(ctx->scratch);
+    ctx->scratch = NULL;
+    ctx->scratch_capacity = 0;
+}
+
+uint8_t* codec_context_reserve(CodecContext* ctx, size_t size) {
+    if (size > ctx->scratch_capacity) {
+        // Scratch contents never outlive a call, so growing needn't copy
+        uint8_t* grown = (uint8_t*)codec_alloc(size);
+        if (!grown) return NULL;
+        codec_free(ctx->scratch);
+        ctx->scratch = grown;
+        ctx->scratch_capacity = size;
+    }
+    return ctx->scratch;
+}
+
+// INTERFACE FUNCTIONS
+size_t byte_compress(uint8_t* data_ptr, size_t data_size) {
+    return advanced_compress(data_ptr, data_size);
+}
+size_t byte_decompress(uint8_t* data_ptr, size_t compressed_size) {
+    return advanced_decompress(data_ptr, compressed_size);
+}
+size_t byte_compress_level(uint8_t* data_ptr, size_t data_size, int level) {
+    if (!data_ptr || data_size == 0) return 0;
+    
+    size_t bound = advanced_compress_bound(data_size);
+    uint8_t* output = (uint8_t*)codec_alloc(bound);
+    if (!output) return data_size;
+    
+    size_t result = advanced_compress_level_to(data_ptr, data_size, output, bound, level);
+    if (result == 0) result = data_size;
+    else memcpy(data_ptr, output, result);
+    codec_free(output);
+    return result;
+}
+size_t byte_compress_bound(size_t data_size) {
+    return advanced_compress_bound(data_size);
+}
+size_t byte_compress_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    return advanced_compress_to(src, src_len, dst, dst_cap);
+}
+size_t byte_compress_level_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap, int level) {
+    return advanced_compress_level_to(src, src_len, dst, dst_cap, level);
+}
+size_t byte_decompress_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    return advanced_decompress_to(src, src_len, dst, dst_cap);
+}
+size_t byte_decompressed_size(const uint8_t* src, size_t src_len) {
+    return advanced_decompressed_size(src, src_len);
+}
+size_t byte_compress_ctx(CodecContext* ctx, uint8_t* data_ptr, size_t data_size) {
+    uint8_t* scratch = codec_context_reserve(ctx, advanced_compress_bound(data_size));
+    return advanced_compress_ex(data_ptr, data_size, scratch, ctx->scratch_capacity);
+}
+size_t byte_decompress_ctx(CodecContext* ctx, uint8_t* data_ptr, size_t compressed_size) {
+    uint8_t* scratch = codec_context_reserve(ctx, advanced_decompressed_size(data_ptr, compressed_size));
+    return advanced_decompress_ex(data_ptr, compressed_size, scratch, ctx->scratch_capacity);
+}
+
+// ENTROPY STAGE
+// An optional second pass behind the advanced codec: the token stream is
+// Huffman coded, so literal fallbacks on skewed data (7-bit telemetry, small
+// counters) still shrink. Layout:
+//   [ENTROPY_RAW] [advanced stream]              when coding doesn't pay
+//   [ENTROPY_HUFFMAN] [stream_size: u32] [code lengths: 128 B, 4 bits each]
+//                     [bit stream sizes: 3 x u32] [4 bit streams]
+// The token stream is cut into four equal segments with a bit stream each,
+// so the decoder runs four independent lookups per step. Codes are
+// canonical, at most HUF_MAX_BITS long and read LSB first; the decode table
+// resolves two symbols per lookup whenever both fit in HUF_MAX_BITS.
+
+#define HUF_MAX_BITS       11
+#define HUF_TABLE_SIZE     (1 << HUF_MAX_BITS)
+#define HUF_STREAMS        4
+#define HUF_LENGTHS_OFFSET 5
+#define HUF_SIZES_OFFSET   (HUF_LENGTHS_OFFSET + 128)
+#define HUF_HEADER_SIZE    (HUF_SIZES_OFFSET + 4 * (HUF_STREAMS - 1))
+
+#define ENTROPY_RAW     0
+#define ENTROPY_HUFFMAN 1
+
+typedef struct {
+    uint8_t symbols[2];
+    uint8_t bits;       // bits consumed by the symbols below
+    uint8_t count;      // symbols resolved by this entry, 1 or 2
+} HufEntry;
+
+static uint64_t read_le64_unaligned(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Length-limited code lengths for the given byte frequencies. Builds an
+// ordinary Huffman tree with the two-queue method, clamps it to HUF_MAX_BITS
+// and rebalances so the code is exactly complete, which the decoder checks.
+static void huf_build_lengths(const uint32_t* freq, uint8_t* lengths) {
+    uint16_t order[256];
+    size_t used = 0;
+    memset(lengths, 0, 256);
+    
+    for (int s = 0; s < 256; s++) {
+        if (freq[s] == 0) continue;
+        // Insertion sort by ascending frequency
+        size_t i = used++;
+        while (i > 0 && freq[order[i - 1]] > freq[s]) {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = (uint16_t)s;
+    }
+    
+    if (used == 0) return;
+    if (used == 1) {
+        // A lone symbol still needs a complete code
+        lengths[order[0]] = 1;
+        lengths[(order[0] + 1) & 0xFF] = 1;
+        return;
+    }
+    
+    uint32_t weight[512];
+    uint16_t parent[512];
+    for (size_t i = 0; i < used; i++) weight[i] = freq[order[i]];
+    
+    size_t leaf = 0;
+    size_t node = used;
+    for (size_t next = used; next < 2 * used - 1; next++) {
+        size_t pick[2];
+        for (int k = 0; k < 2; k++) {
+            if (leaf < used && (node >= next || weight[leaf] <= weight[node])) pick[k] = leaf++;
+            else pick[k] = node++;
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = (uint16_t)next;
+    }
+    
+    // Parents always come after their children, so one backward pass gives
+    // every depth
+    uint8_t depth[512];
+    size_t root = 2 * used - 2;
+    depth[root] = 0;
+    uint32_t count[HUF_MAX_BITS + 1] = {0};
+    for (size_t i = root; i-- > 0;) {
+        depth[i] = (uint8_t)(depth[parent[i]] + 1);
+        if (i < used) count[depth[i] > HUF_MAX_BITS ? HUF_MAX_BITS : depth[i]]++;
+    }
+    
+    // Clamping overfills the code space: lengthen the longest short codes
+    // until it fits, then shorten codes again to fill any gap left behind
+    uint32_t kraft = 0;
+    for (int l = 1; l <= HUF_MAX_BITS; l++) kraft += count[l] << (HUF_MAX_BITS - l);
+    
+    while (kraft > HUF_TABLE_SIZE) {
+        int l = HUF_MAX_BITS - 1;
+        while (count[l] == 0) l--;
+        count[l]--;
+        count[l + 1]++;
+        kraft -= 1u << (HUF_MAX_BITS - l - 1);
+    }
+    while (kraft < HUF_TABLE_SIZE) {
+        int l = HUF_MAX_BITS;
+        while (count[l] == 0 || kraft + (1u << (HUF_MAX_BITS - l)) > HUF_TABLE_SIZE) l--;
+        count[l]--;
+        count[l - 1]++;
+        kraft += 1u << (HUF_MAX_BITS - l);
+    }
+    
+    // Rarest symbols take the longest codes
+    size_t i = 0;
+    for (int l = HUF_MAX_BITS; l >= 1; l--) {
+        for (uint32_t c = 0; c < count[l]; c++) lengths[order[i++]] = (uint8_t)l;
+    }
+}
+
+// Canonical codes for the lengths, bit-reversed for LSB-first output.
+// Returns false unless the lengths form an exactly complete code.
+static bool huf_assign_codes(const uint8_t* lengths, uint16_t* codes) {
+    uint32_t count[HUF_MAX_BITS + 1] = {0};
+    uint32_t kraft = 0;
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] > HUF_MAX_BITS) return false;
+        if (lengths[s] == 0) continue;
+        count[lengths[s]]++;
+        kraft += 1u << (HUF_MAX_BITS - lengths[s]);
+    }
+    if (kraft != HUF_TABLE_SIZE) return false;
+    
+    uint32_t next[HUF_MAX_BITS + 1];
+    uint32_t code = 0;
+    for (int l = 1; l <= HUF_MAX_BITS; l++) {
+        code = (code + count[l - 1]) << 1;
+        next[l] = code;
+    }
+    
+    for (int s = 0; s < 256; s++) {
+        int l = lengths[s];
+        if (l == 0) continue;
+        uint32_t c = next[l]++;
+        uint32_t reversed = 0;
+        for (int b = 0; b < l; b++) reversed |= ((c >> b) & 1) << (l - 1 - b);
+        codes[s] = (uint16_t)reversed;
+    }
+    return true;
+}
+
+static bool huf_build_table(const uint8_t* lengths, HufEntry* table) {
+    uint16_t codes[256];
+    if (!huf_assign_codes(lengths, codes)) return false;
+    
+    uint8_t symbol_at[HUF_TABLE_SIZE];
+    uint8_t bits_at[HUF_TABLE_SIZE];
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] == 0) continue;
+        for (uint32_t i = codes[s]; i < HUF_TABLE_SIZE; i += 1u << lengths[s]) {
+            symbol_at[i] = (uint8_t)s;
+            bits_at[i] = lengths[s];
+        }
+    }
+    
+    // The bits after the first code index the second one; it counts only
+    // if it ends within the bits the lookup actually saw
+    for (uint32_t i = 0; i < HUF_TABLE_SIZE; i++) {
+        uint32_t rest = i >> bits_at[i];
+        HufEntry* e = &table[i];
+        e->symbols[0] = symbol_at[i];
+        e->symbols[1] = symbol_at[rest];
+        if (bits_at[i] + bits_at[rest] <= HUF_MAX_BITS) {
+            e->bits = (uint8_t)(bits_at[i] + bits_at[rest]);
+            e->count = 2;
+        } else {
+            e->bits = bits_at[i];
+            e->count = 1;
+        }
+    }
+    return true;
+}
+
+static size_t huf_segment_end(size_t size, size_t s) {
+    size_t segment = (size + HUF_STREAMS - 1) / HUF_STREAMS;
+    size_t end = segment * (s + 1);
+    return end < size ? end : size;
+}
+
+// Huffman codes src into dst. Returns 0 if the result would not be smaller
+// than limit or does not fit in dst_cap.
+static size_t huf_compress_to(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_cap,
+                              size_t limit) {
+    if (size == 0 || size > UINT32_MAX) return 0;
+    
+    uint32_t freq[256] = {0};
+    for (size_t i = 0; i < size; i++) freq[src[i]]++;
+    
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    huf_build_lengths(freq, lengths);
+    if (!huf_assign_codes(lengths, codes)) return 0;
+    
+    // The exact size is known before coding a single bit
+    uint64_t total_bits = 0;
+    for (int s = 0; s < 256; s++) total_bits += (uint64_t)freq[s] * lengths[s];
+    size_t estimate = HUF_HEADER_SIZE + (size_t)(total_bits / 8) + HUF_STREAMS;
+    if (estimate >= limit || estimate > dst_cap) return 0;
+    
+    dst[0] = ENTROPY_HUFFMAN;
+    write_le32(dst + 1, (uint32_t)size);
+    for (int s = 0; s < 256; s += 2) dst[HUF_LENGTHS_OFFSET + s / 2] = (uint8_t)(lengths[s] | (lengths[s + 1] << 4));
+    
+    size_t out_pos = HUF_HEADER_SIZE;
+    size_t start = 0;
+    for (size_t s = 0; s < HUF_STREAMS; s++) {
+        size_t end = huf_segment_end(size, s);
+        size_t stream_start = out_pos;
+        uint64_t acc = 0;
+        unsigned pending = 0;
+        
+        for (size_t i = start; i < end; i++) {
+            acc |= (uint64_t)codes[src[i]] << pending;
+            pending += lengths[src[i]];
+            if (pending >= 32) {
+                write_le32(dst + out_pos, (uint32_t)acc);
+                out_pos += 4;
+                acc >>= 32;
+                pending -= 32;
+            }
+        }
+        while (pending > 0) {
+            dst[out_pos++] = (uint8_t)acc;
+            acc >>= 8;
+            pending = pending > 8 ? pending - 8 : 0;
+        }
+        
+        if (s + 1 < HUF_STREAMS) write_le32(dst + HUF_SIZES_OFFSET + 4 * s, (uint32_t)(out_pos - stream_start));
+        start = end;
+    }
+    return out_pos;
+}
+
+// Reads up to 8 bytes at bit position bitpos, zero-padded past the end
+static uint64_t huf_peek_tail(const uint8_t* stream, size_t stream_size, size_t bitpos) {
+    size_t byte = bitpos >> 3;
+    uint64_t v = 0;
+    for (size_t k = 0; k < 8 && byte + k < stream_size; k++) v |= (uint64_t)stream[byte + k] << (8 * k);
+    return v >> (bitpos & 7);
+}
+
+// Decodes a huf_compress_to stream into dst. Returns the decoded size, or 0
+// if the stream is malformed or dst is too small.
+static size_t huf_decompress_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    if (src_len < HUF_HEADER_SIZE || src[0] != ENTROPY_HUFFMAN) return 0;
+    
+    size_t size = read_le32(src + 1);
+    if (size == 0 || size > dst_cap) return 0;
+    
+    uint8_t lengths[256];
+    for (int s = 0; s < 256; s += 2) {
+        lengths[s] = src[HUF_LENGTHS_OFFSET + s / 2] & 0x0F;
+        lengths[s + 1] = src[HUF_LENGTHS_OFFSET + s / 2] >> 4;
+    }
+    HufEntry table[HUF_TABLE_SIZE];
+    if (!huf_build_table(lengths, table)) return 0;
+    
+    const uint8_t* stream[HUF_STREAMS];
+    size_t stream_size[HUF_STREAMS];
+    size_t bitpos[HUF_STREAMS] = {0};
+    uint8_t* out[HUF_STREAMS];
+    uint8_t* out_end[HUF_STREAMS];
+    
+    size_t pos = HUF_HEADER_SIZE;
+    for (size_t s = 0; s < HUF_STREAMS; s++) {
+        size_t length = s + 1 < HUF_STREAMS ? read_le32(src + HUF_SIZES_OFFSET + 4 * s) : src_len - pos;
+        if (length > src_len - pos) return 0;
+        stream[s] = src + pos;
+        stream_size[s] = length;
+        pos += length;
+        out[s] = dst + (s == 0 ? 0 : huf_segment_end(size, s - 1));
+        out_end[s] = dst + huf_segment_end(size, s);
+    }
+    
+    // Fast loop: each refill leaves at least 57 bits, enough for five
+    // lookups of up to 11 bits, and each lookup writes at most two symbols.
+    // The streams are spelled out so all four stay in registers.
+    const uint8_t *in0 = stream[0], *in1 = stream[1], *in2 = stream[2], *in3 = stream[3];
+    uint8_t *out0 = out[0], *out1 = out[1], *out2 = out[2], *out3 = out[3];
+    size_t pos0 = 0, pos1 = 0, pos2 = 0, pos3 = 0;
+
+#define HUF_REFILL(n) \
+    window##n = read_le64_unaligned(in##n + (pos##n >> 3)) >> (pos##n & 7)
+#define HUF_STEP(n) do { \
+        HufEntry e = table[window##n & (HUF_TABLE_SIZE - 1)]; \
+        memcpy(out##n, e.symbols, 2); \
+        out##n += e.count; \
+        window##n >>= e.bits; \
+        pos##n += e.bits; \
+    } while (0)
+    
+    while ((pos0 >> 3) + 8 <= stream_size[0] && (pos1 >> 3) + 8 <= stream_size[1] &&
+           (pos2 >> 3) + 8 <= stream_size[2] && (pos3 >> 3) + 8 <= stream_size[3] &&
+           out_end[0] - out0 >= 10 && out_end[1] - out1 >= 10 &&
+           out_end[2] - out2 >= 10 && out_end[3] - out3 >= 10) {
+        uint64_t window0, window1, window2, window3;
+        HUF_REFILL(0); HUF_REFILL(1); HUF_REFILL(2); HUF_REFILL(3);
+        for (int step = 0; step < 5; step++) {
+            HUF_STEP(0); HUF_STEP(1); HUF_STEP(2); HUF_STEP(3);
+        }
+    }
+
+#undef HUF_REFILL
+#undef HUF_STEP
+    
+    out[0] = out0; out[1] = out1; out[2] = out2; out[3] = out3;
+    bitpos[0] = pos0; bitpos[1] = pos1; bitpos[2] = pos2; bitpos[3] = pos3;
+    
+    for (size_t s = 0; s < HUF_STREAMS; s++) {
+        while (out[s] < out_end[s]) {
+            HufEntry e = table[huf_peek_tail(stream[s], stream_size[s], bitpos[s]) & (HUF_TABLE_SIZE - 1)];
+            *out[s]++ = e.symbols[0];
+            bitpos[s] += lengths[e.symbols[0]];
+        }
+        // Running off the end of a stream means it was cut short
+        if (bitpos[s] > stream_size[s] * 8) return 0;
+    }
+    return size;
+}
+
+// Worst case is the advanced stream stored behind its one-byte tag
+size_t entropy_compress_bound(size_t data_size) {
+    return 1 + advanced_compress_bound(data_size);
+}
+
+size_t entropy_compress_to(const uint8_t* data_ptr, size_t data_size,
+                           uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || data_size == 0 || output_capacity < 1) return 0;
+    
+    size_t bound = advanced_compress_bound(data_size);
+    uint8_t* tokens = (uint8_t*)codec_alloc(bound);
+    if (!tokens) return 0;
+    
+    size_t result = 0;
+    size_t token_size = advanced_compress_to(data_ptr, data_size, tokens, bound);
+    if (token_size > 0) {
+        result = huf_compress_to(tokens, token_size, output, output_capacity, 1 + token_size);
+        if (result == 0 && 1 + token_size <= output_capacity) {
+            output[0] = ENTROPY_RAW;
+            memcpy(output + 1, tokens, token_size);
+            result = 1 + token_size;
+        }
+    }
+    
+    codec_free(tokens);
+    return result;
+}
+
+size_t entropy_decompress_to(const uint8_t* data_ptr, size_t compressed_size,
+                             uint8_t* output, size_t output_capacity) {
+    if (!data_ptr || !output || compressed_size < 2) return 0;
+    
+    if (data_ptr[0] == ENTROPY_RAW) {
+        return advanced_decompress_to(data_ptr + 1, compressed_size - 1, output, output_capacity);
+    }
+    if (data_ptr[0] != ENTROPY_HUFFMAN || compressed_size < HUF_HEADER_SIZE) return 0;
+    
+    // No valid stream for this capacity is longer than the advanced bound
+    size_t token_size = read_le32(data_ptr + 1);
+    if (token_size > advanced_compress_bound(output_capacity)) return 0;
+    
+    uint8_t* tokens = (uint8_t*)codec_alloc(token_size);
+    if (!tokens) return 0;
+    
+    size_t result = 0;
+    if (huf_decompress_to(data_ptr, compressed_size, tokens, token_size) == token_size) {
+        result = advanced_decompress_to(tokens, token_size, output, output_capacity);
+    }
+    
+    codec_free(tokens);
+    return result;
+}
+
+// ELEMENT FILTERS
+// Byte codecs see a little-endian u16 or u32 sample array as noise: the low
+// bytes change every element and the high bytes only now and then, so no run,
+// delta or nibble token lines up with it. A filter rewrites a frame block
+// before its codec runs, and the decoder undoes it after:
+//
+//   FILTER_SHUFFLE16/32  transpose the block into byte planes: all first
+//                        bytes, then all second bytes, ... Slow-moving high
+//                        bytes become long runs and zero runs.
+//   FILTER_DELTA16/32    replace each element with the zigzag-coded
+//                        difference from the one before (wrapping), then
+//                        shuffle. A smooth signal becomes small values in
+//                        the low plane, which format v2 bit-packs, and
+//                        zeros above it.
+//
+// Bytes past the last whole element are copied as they are. The _scalar
+// versions are the reference the SSE2 kernels are tested against.
+
+#define FILTER_NONE      0
+#define FILTER_SHUFFLE16 1
+#define FILTER_SHUFFLE32 2
+#define FILTER_DELTA16   3
+#define FILTER_DELTA32   4
+#define FILTER_COUNT     5
+#define FILTER_AUTO      0xFF    // FrameOptions only: chosen per block
+
+static const char* const filter_names[FILTER_COUNT] = {
+    "none", "shuffle16", "shuffle32", "delta16", "delta32"
+};
+
+static inline size_t filter_width(uint8_t filter) {
+    return filter == FILTER_SHUFFLE16 || filter == FILTER_DELTA16 ? 2 : 4;
+}
+
+static inline uint32_t zigzag32(uint32_t d) {
+    return (d << 1) ^ (uint32_t)-(int32_t)(d >> 31);
+}
+
+static inline uint32_t unzigzag32(uint32_t z) {
+    return (z >> 1) ^ (uint32_t)-(int32_t)(z & 1);
+}
+
+// Elements [first, count) of src into planes of count bytes each. prev is
+// the element before first, for deltas.
+static void filter_encode_scalar(const uint8_t* src, size_t first, size_t count, size_t width,
+                                 bool delta, uint32_t prev, uint8_t* dst) {
+    for (size_t i = first; i < count; i++) {
+        uint32_t value = width == 2 ? read_le16(src + i * 2) : read_le32(src + i * 4);
+        uint32_t coded = value;
+        if (delta) {
+            uint32_t d = value - prev;
+            coded = width == 2 ? (uint16_t)((d << 1) ^ (uint32_t)-(int32_t)((d >> 15) & 1)) : zigzag32(d);
+        }
+        prev = value;
+        for (size_t b = 0; b < width; b++) dst[b * count + i] = (uint8_t)(coded >> (8 * b));
+    }
+}
+
+// Inverse of filter_encode_scalar over the same elements
+static void filter_decode_scalar(const uint8_t* src, size_t first, size_t count, size_t width,
+                                 bool delta, uint32_t prev, uint8_t* dst) {
+    for (size_t i = first; i < count; i++) {
+        uint32_t coded = 0;
+        for (size_t b = 0; b < width; b++) coded |= (uint32_t)src[b * count + i] << (8 * b);
+        uint32_t value = coded;
+        if (delta) {
+            uint32_t d = width == 2 ? (uint16_t)((coded >> 1) ^ (uint32_t)-(int32_t)(coded & 1)) : unzigzag32(coded);
+            value = prev + d;
+        }
+        if (width == 2) write_le16(dst + i * 2, (uint16_t)value);
+        else write_le32(dst + i * 4, value);
+        prev = value;
+    }
+}
+
+#if defined(DECODE_KERNELS_SSE2)
+// 16 elements per step: two vectors of u16 or four of u32. Returns the
+// elements done; the scalar loop finishes the rest.
+static size_t filter_encode_sse2(const uint8_t* src, size_t count, size_t width, bool delta,
+                                 uint32_t* prev, uint8_t* dst) {
+    const __m128i byte_mask16 = _mm_set1_epi16(0x00FF);
+    const __m128i byte_mask32 = _mm_set1_epi32(0xFF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const uint8_t* p = src + i * width;
+        if (width == 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)p);
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+            if (delta) {
+                // The previous element of each lane is one lane to the left
+                __m128i carry = _mm_cvtsi32_si128((int)*prev);
+                __m128i pa = _mm_or_si128(_mm_slli_si128(a, 2), carry);
+                __m128i pb = _mm_or_si128(_mm_slli_si128(b, 2), _mm_srli_si128(a, 14));
+                __m128i da = _mm_sub_epi16(a, pa);
+                __m128i db = _mm_sub_epi16(b, pb);
+                *prev = (uint32_t)_mm_extract_epi16(b, 7);
+                a = _mm_xor_si128(_mm_slli_epi16(da, 1), _mm_srai_epi16(da, 15));
+                b = _mm_xor_si128(_mm_slli_epi16(db, 1), _mm_srai_epi16(db, 15));
+            }
+            __m128i low = _mm_packus_epi16(_mm_and_si128(a, byte_mask16), _mm_and_si128(b, byte_mask16));
+            __m128i high = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+            _mm_storeu_si128((__m128i*)(dst + i), low);
+            _mm_storeu_si128((__m128i*)(dst + count + i), high);
+        } else {
+            __m128i v[4];
+            for (int k = 0; k < 4; k++) v[k] = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+            if (delta) {
+                __m128i carry = _mm_cvtsi32_si128((int)*prev);
+                *prev = (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(v[3], 0xFF));
+                for (int k = 0; k < 4; k++) {
+                    __m128i before = _mm_or_si128(_mm_slli_si128(v[k], 4), carry);
+                    carry = _mm_srli_si128(v[k], 12);
+                    __m128i d = _mm_sub_epi32(v[k], before);
+                    v[k] = _mm_xor_si128(_mm_slli_epi32(d, 1), _mm_srai_epi32(d, 31));
+                }
+            }
+            // Values of 0..255 survive the signed saturation of packs_epi32
+            for (int b = 0; b < 4; b++) {
+                __m128i t0 = _mm_and_si128(_mm_srli_epi32(v[0], 8 * b), byte_mask32);
+                __m128i t1 = _mm_and_si128(_mm_srli_epi32(v[1], 8 * b), byte_mask32);
+                __m128i t2 = _mm_and_si128(_mm_srli_epi32(v[2], 8 * b), byte_mask32);
+                __m128i t3 = _mm_and_si128(_mm_srli_epi32(v[3], 8 * b), byte_mask32);
+                __m128i plane = _mm_packus_epi16(_mm_packs_epi32(t0, t1), _mm_packs_epi32(t2, t3));
+                _mm_storeu_si128((__m128i*)(dst + b * count + i), plane);
+            }
+        }
+    }
+    return i;
+}
+
+static size_t filter_decode_sse2(const uint8_t* src, size_t count, size_t width, bool delta,
+                                 uint32_t* prev, uint8_t* dst) {
+    const __m128i one16 = _mm_set1_epi16(1);
+    const __m128i one32 = _mm_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8_t* p = dst + i * width;
+        if (width == 2) {
+            __m128i low = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i high = _mm_loadu_si128((const __m128i*)(src + count + i));
+            __m128i v[2] = {_mm_unpacklo_epi8(low, high), _mm_unpackhi_epi8(low, high)};
+            for (int k = 0; delta && k < 2; k++) {
+                // Undo the zigzag, then a prefix sum across the lanes plus
+                // the last element of the step before
+                __m128i z = v[k];
+                __m128i d = _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, one16)));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+                v[k] = _mm_add_epi16(d, _mm_set1_epi16((short)*prev));
+                *prev = (uint32_t)_mm_extract_epi16(v[k], 7);
+            }
+            _mm_storeu_si128((__m128i*)p, v[0]);
+            _mm_storeu_si128((__m128i*)(p + 16), v[1]);
+        } else {
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(src + count + i));
+            __m128i b2 = _mm_loadu_si128((const __m128i*)(src + 2 * count + i));
+            __m128i b3 = _mm_loadu_si128((const __m128i*)(src + 3 * count + i));
+            __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+            __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+            __m128i v[4] = {_mm_unpacklo_epi16(lo01, lo23), _mm_unpackhi_epi16(lo01, lo23),
+                            _mm_unpacklo_epi16(hi01, hi23), _mm_unpackhi_epi16(hi01, hi23)};
+            for (int k = 0; delta && k < 4; k++) {
+                __m128i z = v[k];
+                __m128i d = _mm_xor_si128(_mm_srli_epi32(z, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(z, one32)));
+                d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+                d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+                v[k] = _mm_add_epi32(d, _mm_set1_epi32((int)*prev));
+                *prev = (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(v[k], 0xFF));
+            }
+            for (int k = 0; k < 4; k++) _mm_storeu_si128((__m128i*)(p + 16 * k), v[k]);
+        }
+    }
+    return i;
+}
+#endif
+
+// Filters size bytes of src into dst, which must not overlap it
+static void filter_apply(uint8_t filter, const uint8_t* src, size_t size, uint8_t* dst) {
+    if (filter == FILTER_NONE) {
+        memcpy(dst, src, size);
+        return;
+    }
+    size_t width = filter_width(filter);
+    size_t count = size / width;
+    bool delta = filter == FILTER_DELTA16 || filter == FILTER_DELTA32;
+    uint32_t prev = 0;
+    size_t done = 0;
+#if defined(DECODE_KERNELS_SSE2)
+    done = filter_encode_sse2(src, count, width, delta, &prev, dst);
+#endif
+    filter_encode_scalar(src, done, count, width, delta, prev, dst);
+    memcpy(dst + count * width, src + count * width, size - count * width);
+}
+
+// Inverse of filter_apply
+static void filter_undo(uint8_t filter, const uint8_t* src, size_t size, uint8_t* dst) {
+    if (filter == FILTER_NONE) {
+        memcpy(dst, src, size);
+        return;
+    }
+    size_t width = filter_width(filter);
+    size_t count = size / width;
+    bool delta = filter == FILTER_DELTA16 || filter == FILTER_DELTA32;
+    uint32_t prev = 0;
+    size_t done = 0;
+#if defined(DECODE_KERNELS_SSE2)
+    done = filter_decode_sse2(src, count, width, delta, &prev, dst);
+#endif
+    filter_decode_scalar(src, done, count, width, delta, prev, dst);
+    memcpy(dst + count * width, src + count * width, size - count * width);
+}
+
+// FRAMED BLOCK FORMAT
+//
+// Frame header (18 bytes):
+//   [0x00 'B' 'C' 'F'] [version] [flags] [block_size: u32] [content_size: u64]
+// The magic starts with a zero-length literal, which no v1 encoder emits and
+// a v2 stream follows with its version byte instead, so a frame can't be
+// mistaken for a raw token stream. Version 2 frames may hold format v2
+// advanced blocks and version 3 frames filtered blocks as well; older
+// versions, which can hold neither, are still read.
+//
+// Each block is decodable on its own:
+//   [original_size: u32] [compressed_size: u32] [filter << 4 | codec] [checksum: u32]? [payload]
+// The payload is the codec's encoding of the filtered block. The checksum
+// (xxHash32 of the original bytes) is present only when the frame has
+// FRAME_FLAG_CHECKSUM set. A block header with original_size 0 ends the
+// frame. All integers are little-endian.
+//
+// With FRAME_FLAG_INDEX the end mark is followed by a block index, so readers
+// can find any block from the end of the frame without walking the others:
+//   [frame_offset: u64] [original_offset: u64] per block
+//   [block_count: u32] ['B' 'C' 'I' 'X']
+
+#define FRAME_MAGIC_0   0x00
+#define FRAME_MAGIC_1   'B'
+#define FRAME_MAGIC_2   'C'
+#define FRAME_MAGIC_3   'F'
+#define FRAME_VERSION_V1 1
+#define FRAME_VERSION   2     // advanced blocks may hold format v2 streams
+#define FRAME_VERSION_FILTERS 3   // and blocks may be filtered
+
+#define FRAME_HEADER_SIZE       18
+#define FRAME_BLOCK_HEADER_SIZE 9
+#define FRAME_CHECKSUM_SIZE     4
+#define FRAME_END_MARK_SIZE     4
+
+#define FRAME_INDEX_ENTRY_SIZE  16
+#define FRAME_INDEX_FOOTER_SIZE 8
+
+#define FRAME_FLAG_CHECKSUM     0x01
+#define FRAME_FLAG_INDEX        0x02
+
+#define FRAME_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+#define CODEC_STORED      0
+#define CODEC_SIMPLE_RLE  1
+#define CODEC_ADVANCED    2
+#define CODEC_ENTROPY     3
+#define CODEC_AUTO        0xFF    // FrameOptions only: chosen per block
+
+typedef struct {
+    size_t block_size;
+    uint8_t codec;
+    int level;              // COMPRESS_LEVEL_* for advanced blocks
+    int format;             // ADVANCED_FORMAT_* for advanced blocks
+    uint8_t filter;         // FILTER_* applied before the codec, or FILTER_AUTO
+    bool checksum;
+    bool index;
+    size_t threads;
+} FrameOptions;
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;
+    size_t block_size;
+    uint64_t content_size;
+} FrameHeader;
+
+typedef struct {
+    size_t original_size;
+    size_t compressed_size;
+    uint8_t codec;
+    uint8_t filter;
+    uint32_t checksum;
+    const uint8_t* payload;
+} FrameBlock;
+
+// xxHash32 with seed 0
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+
+static uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl32(acc, 13) * XXH_PRIME1;
+}
+
+uint32_t checksum32(const uint8_t* data, size_t size) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint32_t h;
+    
+    if (size >= 16) {
+        uint32_t v1 = XXH_PRIME1 + XXH_PRIME2;
+        uint32_t v2 = XXH_PRIME2;
+        uint32_t v3 = 0;
+        uint32_t v4 = 0 - XXH_PRIME1;
+        
+        while (p + 16 <= end) {
+            v1 = xxh32_round(v1, read_le32(p));
+            v2 = xxh32_round(v2, read_le32(p + 4));
+            v3 = xxh32_round(v3, read_le32(p + 8));
+            v4 = xxh32_round(v4, read_le32(p + 12));
+            p += 16;
+        }
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = XXH_PRIME5;
+    }
+    
+    h += (uint32_t)size;
+    
+    while (p + 4 <= end) {
+        h += read_le32(p) * XXH_PRIME3;
+        h = rotl32(h, 17) * XXH_PRIME4;
+        p += 4;
+    }
+    while (p < end) {
+        h += (*p++) * XXH_PRIME5;
+        h = rotl32(h, 11) * XXH_PRIME1;
+    }
+    
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+void frame_options_init(FrameOptions* opts) {
+    opts->block_size = FRAME_DEFAULT_BLOCK_SIZE;
+    opts->codec = CODEC_AUTO;
+    opts->level = COMPRESS_LEVEL_DEFAULT;
+    opts->format = ADVANCED_FORMAT_V2;
+    opts->filter = FILTER_NONE;
+    opts->checksum = true;
+    opts->index = true;
+    opts->threads = 1;
+}
+
+// Incompressible blocks are stored, so a block never grows past its header
+size_t frame_compress_bound(size_t data_size, const FrameOptions* opts) {
+    FrameOptions defaults;
+    if (!opts) {
+        frame_options_init(&defaults);
+        opts = &defaults;
+    }
+    
+    size_t blocks = (data_size + opts->block_size - 1) / opts->block_size;
+    size_t block_overhead = FRAME_BLOCK_HEADER_SIZE + (opts->checksum ? FRAME_CHECKSUM_SIZE : 0);
+    size_t index_size = opts->index ? blocks * FRAME_INDEX_ENTRY_SIZE + FRAME_INDEX_FOOTER_SIZE : 0;
+    return FRAME_HEADER_SIZE + blocks * block_overhead + data_size + FRAME_END_MARK_SIZE + index_size;
+}
+
+size_t frame_write_header(uint8_t* dst, size_t dst_cap, const FrameOptions* opts, uint64_t content_size) {
+    if (dst_cap < FRAME_HEADER_SIZE) return 0;
+    
+    dst[0] = FRAME_MAGIC_0;
+    dst[1] = FRAME_MAGIC_1;
+    dst[2] = FRAME_MAGIC_2;
+    dst[3] = FRAME_MAGIC_3;
+    dst[4] = opts->filter != FILTER_NONE ? FRAME_VERSION_FILTERS :
+             opts->format == ADVANCED_FORMAT_V2 ? FRAME_VERSION : FRAME_VERSION_V1;
+    dst[5] = (opts->checksum ? FRAME_FLAG_CHECKSUM : 0) | (opts->index ? FRAME_FLAG_INDEX : 0);
+    write_le32(dst + 6, (uint32_t)opts->block_size);
+    write_le64(dst + 10, content_size);
+    return FRAME_HEADER_SIZE;
+}
+
+// BLOCK ANALYZER
+// Picks a codec for each frame block from a small sample instead of running
+// every strategy over all of it. BLOCK_SAMPLE_CHUNKS evenly spaced chunks are
+// gathered and trial-encoded with both codecs. The token mix of the advanced
+// trial doubles as the block's run statistics: strategies that covered no
+// sampled bytes are switched off for the whole block. A block whose best
+// trial saves less than BLOCK_STORE_PERCENT is stored without encoding at all.
+// With FILTER_AUTO every element filter is tried on the sample first, in the
+// frame's format, and the profile is taken of the one that encoded smallest. Chunks start on 4-byte
+// boundaries so that the sample keeps the block's element alignment.
+
+#define BLOCK_SAMPLE_CHUNKS 4
+#define BLOCK_SAMPLE_CHUNK  256
+#define BLOCK_SAMPLE_SIZE   (BLOCK_SAMPLE_CHUNKS * BLOCK_SAMPLE_CHUNK)
+#define BLOCK_STORE_PERCENT 97
+
+typedef struct {
+    size_t sampled;         // bytes in the sample
+    size_t simple_size;     // sample encoded by each codec
+    size_t advanced_size;
+    size_t covered[TOKEN_KIND_COUNT];   // sampled bytes per TokenKind in the advanced trial
+    uint8_t codec;          // CODEC_STORED, CODEC_SIMPLE_RLE or CODEC_ADVANCED
+    uint8_t filter;         // FILTER_* the block is encoded through
+    unsigned probes;        // advanced strategies worth running on the block
+} BlockProfile;
+
+// filter is a FILTER_* to profile the block through, or FILTER_AUTO to pick
+// one; format is the ADVANCED_FORMAT_* advanced blocks will be written in
+void block_analyze(const uint8_t* data, size_t size, uint8_t filter, int format, BlockProfile* profile) {
+    uint8_t raw[BLOCK_SAMPLE_SIZE];
+    uint8_t sample[BLOCK_SAMPLE_SIZE];
+    uint8_t trial[BLOCK_SAMPLE_SIZE + BLOCK_SAMPLE_SIZE / 2];
+    
+    if (size <= BLOCK_SAMPLE_SIZE) {
+        memcpy(raw, data, size);
+        profile->sampled = size;
+    } else {
+        size_t stride = (size - BLOCK_SAMPLE_CHUNK) / (BLOCK_SAMPLE_CHUNKS - 1) & ~(size_t)3;
+        for (size_t c = 0; c < BLOCK_SAMPLE_CHUNKS; c++) {
+            memcpy(raw + c * BLOCK_SAMPLE_CHUNK, data + c * stride, BLOCK_SAMPLE_CHUNK);
+        }
+        profile->sampled = BLOCK_SAMPLE_SIZE;
+    }
+    
+    size_t n = profile->sampled;
+    if (filter == FILTER_AUTO) {
+        size_t best_trial = SIZE_MAX;
+        filter = FILTER_NONE;
+        for (uint8_t f = FILTER_NONE; f < FILTER_COUNT; f++) {
+            filter_apply(f, raw, n, sample);
+            size_t trial_size = format == ADVANCED_FORMAT_V2 ?
+                                advanced_v2_compress_probes(sample, n, trial, sizeof(trial), PROBE_ALL) :
+                                advanced_compress_to(sample, n, trial, sizeof(trial));
+            if (trial_size == 0) trial_size = n;
+            if (trial_size < best_trial) {
+                best_trial = trial_size;
+                filter = f;
+            }
+        }
+    }
+    filter_apply(filter, raw, n, sample);
+    profile->filter = filter;
+    
+    profile->simple_size = simple_rle_compress_to(sample, n, trial, sizeof(trial));
+    profile->advanced_size = advanced_compress_to(sample, n, trial, sizeof(trial));
+    
+    memset(profile->covered, 0, sizeof(profile->covered));
+    for (size_t pos = 0; pos < profile->advanced_size;) {
+        size_t token_size, output_size;
+        if (!advanced_token_info(trial + pos, profile->advanced_size - pos, &token_size, &output_size)) break;
+        profile->covered[token_table[trial[pos]].kind] += output_size;
+        pos += token_size;
+    }
+    
+    // Matches reach further back than the sample does, so a sample without
+    // any only rules them out when little of it was left to literals
+    bool literal_heavy = profile->covered[TOKEN_LITERAL] * 8 >= n;
+    profile->probes = (profile->covered[TOKEN_DELTA] ? PROBE_DELTA : 0) |
+                      (profile->covered[TOKEN_NIBBLE] ? PROBE_NIBBLE : 0) |
+                      (profile->covered[TOKEN_MATCH] || literal_heavy ? PROBE_MATCH : 0) |
+                      (profile->covered[TOKEN_NIBBLE] || literal_heavy ? PROBE_BITPACK : 0);
+    
+    // Only v2 bit-packs, which is what a literal-heavy sample may be missing
+    if (format == ADVANCED_FORMAT_V2 && (profile->probes & PROBE_BITPACK)) {
+        size_t v2_size = advanced_v2_compress_probes(sample, n, trial, sizeof(trial), profile->probes);
+        if (v2_size > 0 && v2_size < profile->advanced_size) profile->advanced_size = v2_size;
+    }
+    
+    // Ties go to simple RLE, which is the faster of the two
+    size_t best = profile->simple_size;
+    profile->codec = CODEC_SIMPLE_RLE;
+    if (profile->advanced_size < best) {
+        best = profile->advanced_size;
+        profile->codec = CODEC_ADVANCED;
+    }
+    if (best * 100 >= n * BLOCK_STORE_PERCENT) profile->codec = CODEC_STORED;
+}
+
+// Advanced payload in the frame's format and level. At level 3 a v2 block
+// also tries the optimal parse, which writes v1, and keeps the smaller: each
+// payload names its own format.
+static size_t frame_advanced_payload(const uint8_t* data, size_t size, uint8_t* payload, size_t limit,
+                                     const FrameOptions* opts, unsigned probes) {
+    if (opts->level == COMPRESS_LEVEL_FAST) probes = 0;
+    if (opts->format != ADVANCED_FORMAT_V2) {
+        if (opts->level >= COMPRESS_LEVEL_MAX) return advanced_compress_optimal(data, size, payload, limit);
+        return advanced_compress_probes(data, size, payload, limit, probes);
+    }
+    
+    size_t compressed = advanced_v2_compress_probes(data, size, payload, limit, probes);
+    size_t optimal_cap = compressed > 0 ? compressed - 1 : limit;
+    if (opts->level < COMPRESS_LEVEL_MAX || optimal_cap == 0) return compressed;
+    
+    uint8_t* optimal = (uint8_t*)codec_alloc(optimal_cap);
+    size_t optimal_size = optimal ? advanced_compress_optimal(data, size, optimal, optimal_cap) : 0;
+    if (optimal_size > 0) {
+        memcpy(payload, optimal, optimal_size);
+        compressed = optimal_size;
+    }
+    codec_free(optimal);
+    return compressed;
+}
+
+// Compresses one block with the requested codec and writes header + payload.
+// CODEC_AUTO and FILTER_AUTO let the block analyzer choose. Advanced blocks are
+// encoded at opts->level in opts->format. Falls back to an unfiltered
+// CODEC_STORED block when the codec doesn't shrink the block.
+size_t frame_write_block(const uint8_t* data, size_t size, uint8_t* dst, size_t dst_cap,
+                         const FrameOptions* opts) {
+    size_t header_size = FRAME_BLOCK_HEADER_SIZE + (opts->checksum ? FRAME_CHECKSUM_SIZE : 0);
+    if (size == 0 || dst_cap < header_size) return 0;
+    
+    uint8_t* payload = dst + header_size;
+    size_t room = dst_cap - header_size;
+    size_t limit = room < size - 1 ? room : size - 1;
+    size_t compressed = 0;
+    uint8_t codec = opts->codec;
+    uint8_t filter = opts->filter;
+    unsigned probes = PROBE_ALL;
+    
+    if (codec == CODEC_AUTO || filter == FILTER_AUTO) {
+        BlockProfile profile;
+        block_analyze(data, size, filter, opts->format, &profile);
+        if (codec == CODEC_AUTO) {
+            codec = profile.codec;
+            probes = profile.probes;
+        }
+        filter = profile.filter;
+    }
+    
+    // The codec sees the filtered block; without scratch it sees the raw one
+    const uint8_t* input = data;
+    uint8_t* filtered = NULL;
+    if (codec == CODEC_STORED || filter >= FILTER_COUNT) filter = FILTER_NONE;
+    if (filter != FILTER_NONE) {
+        filtered = (uint8_t*)codec_alloc(size);
+        if (filtered) {
+            filter_apply(filter, data, size, filtered);
+            input = filtered;
+        } else {
+            filter = FILTER_NONE;
+        }
+    }
+    
+    if (codec == CODEC_SIMPLE_RLE) {
+        compressed = simple_rle_compress_to(input, size, payload, limit);
+    } else if (codec == CODEC_ADVANCED) {
+        compressed = frame_advanced_payload(input, size, payload, limit, opts, probes);
+    } else if (codec == CODEC_ENTROPY) {
+        compressed = entropy_compress_to(input, size, payload, limit);
+    }
+    codec_free(filtered);
+    
+    if (compressed == 0) {
+        if (room < size) return 0;
+        codec = CODEC_STORED;
+        filter = FILTER_NONE;
+        memcpy(payload, data, size);
+        compressed = size;
+    }
+    
+    write_le32(dst, (uint32_t)size);
+    write_le32(dst + 4, (uint32_t)compressed);
+    dst[8] = (uint8_t)(filter << 4 | codec);
+    if (opts->checksum) write_le32(dst + 9, checksum32(data, size));
+    
+    return header_size + compressed;
+}
+
+size_t frame_write_end(uint8_t* dst, size_t dst_cap) {
+    if (dst_cap < FRAME_END_MARK_SIZE) return 0;
+    write_le32(dst, 0);
+    return FRAME_END_MARK_SIZE;
+}
+
+bool frame_read_header(const uint8_t* src, size_t src_len, FrameHeader* header) {
+    if (!src || src_len < FRAME_HEADER_SIZE) return false;
+    if (src[0] != FRAME_MAGIC_0 || src[1] != FRAME_MAGIC_1 ||
+        src[2] != FRAME_MAGIC_2 || src[3] != FRAME_MAGIC_3) return false;
+    if (src[4] < FRAME_VERSION_V1 || src[4] > FRAME_VERSION_FILTERS) return false;
+    
+    header->version = src[4];
+    header->flags = src[5];
+    header->block_size = read_le32(src + 6);
+    header->content_size = read_le64(src + 10);
+    return header->block_size > 0;
+}
+
+// Parses the block header at pos. Returns false if it is truncated or
+// malformed; the end mark comes back as a block with original_size 0.
+bool frame_read_block(const uint8_t* src, size_t src_len, size_t pos,
+                      const FrameHeader* header, FrameBlock* block, size_t* next_pos) {
+    if (pos + FRAME_END_MARK_SIZE > src_len) return false;
+    
+    block->original_size = read_le32(src + pos);
+    if (block->original_size == 0) {
+        block->compressed_size = 0;
+        block->codec = CODEC_STORED;
+        block->filter = FILTER_NONE;
+        block->checksum = 0;
+        block->payload = NULL;
+        *next_pos = pos + FRAME_END_MARK_SIZE;
+        return true;
+    }
+    
+    bool has_checksum = header->flags & FRAME_FLAG_CHECKSUM;
+    size_t header_size = FRAME_BLOCK_HEADER_SIZE + (has_checksum ? FRAME_CHECKSUM_SIZE : 0);
+    if (pos + header_size > src_len) return false;
+    
+    block->compressed_size = read_le32(src + pos + 4);
+    block->codec = src[pos + 8] & 0x0F;
+    block->filter = src[pos + 8] >> 4;
+    block->checksum = has_checksum ? read_le32(src + pos + 9) : 0;
+    block->payload = src + pos + header_size;
+    
+    if (block->original_size > header->block_size) return false;
+    if (block->filter >= FILTER_COUNT ||
+        (block->filter != FILTER_NONE && header->version < FRAME_VERSION_FILTERS)) return false;
+    if (block->compressed_size > src_len - pos - header_size) return false;
+    
+    *next_pos = pos + header_size + block->compressed_size;
+    return true;
+}
+
+// Decodes one block into dst. Returns the block's original size, or 0 if
+// the payload is corrupt, fails its checksum, or dst is too small.
+size_t frame_decode_block(const FrameHeader* header, const FrameBlock* block,
+                          uint8_t* dst, size_t dst_cap) {
+    if (block->original_size > dst_cap) return 0;
+    
+    // A filtered block decodes into scratch and is unfiltered into dst
+    uint8_t* filtered = NULL;
+    uint8_t* out = dst;
+    if (block->filter != FILTER_NONE) {
+        filtered = (uint8_t*)codec_alloc(block->original_size);
+        if (!filtered) return 0;
+        out = filtered;
+    }
+    
+    size_t decoded = 0;
+    if (block->codec == CODEC_STORED) {
+        if (block->compressed_size == block->original_size) {
+            memcpy(out, block->payload, block->original_size);
+            decoded = block->original_size;
+        }
+    } else if (block->codec == CODEC_SIMPLE_RLE) {
+        decoded = simple_rle_decompress_to(block->payload, block->compressed_size,
+                                           out, block->original_size);
+    } else if (block->codec == CODEC_ADVANCED) {
+        decoded = advanced_decompress_to(block->payload, block->compressed_size,
+                                         out, block->original_size);
+    } else if (block->codec == CODEC_ENTROPY) {
+        decoded = entropy_decompress_to(block->payload, block->compressed_size,
+                                        out, block->original_size);
+    }
+    
+    if (filtered) {
+        if (decoded == block->original_size) filter_undo(block->filter, filtered, decoded, dst);
+        codec_free(filtered);
+    }
+    if (decoded != block->original_size) return 0;
+    if ((header->flags & FRAME_FLAG_CHECKSUM) &&
+        checksum32(dst, decoded) != block->checksum) return 0;
+    return decoded;
+}
+
+static void frame_write_index_footer(uint8_t* dst, uint32_t block_count) {
+    write_le32(dst, block_count);
+    dst[4] = 'B';
+    dst[5] = 'C';
+    dst[6] = 'I';
+    dst[7] = 'X';
+}
+
+// Appends the block index to a finished frame of frame_len bytes by walking
+// its block headers. Returns the bytes appended, or 0 if they don't fit.
+size_t frame_write_index(uint8_t* frame, size_t frame_len, size_t frame_cap) {
+    FrameHeader header;
+    if (!frame_read_header(frame, frame_len, &header)) return 0;
+    
+    size_t pos = FRAME_HEADER_SIZE;
+    size_t out_pos = frame_len;
+    uint64_t original_offset = 0;
+    uint32_t count = 0;
+    
+    while (true) {
+        size_t block_pos = pos;
+        FrameBlock block;
+        if (!frame_read_block(frame, frame_len, pos, &header, &block, &pos)) return 0;
+        if (block.original_size == 0) break;
+        
+        if (out_pos + FRAME_INDEX_ENTRY_SIZE > frame_cap) return 0;
+        write_le64(frame + out_pos, block_pos);
+        write_le64(frame + out_pos + 8, original_offset);
+        out_pos += FRAME_INDEX_ENTRY_SIZE;
+        original_offset += block.original_size;
+        count++;
+    }
+    
+    if (out_pos + FRAME_INDEX_FOOTER_SIZE > frame_cap) return 0;
+    frame_write_index_footer(frame + out_pos, count);
+    out_pos += FRAME_INDEX_FOOTER_SIZE;
+    
+    return out_pos - frame_len;
+}
+
+typedef struct {
+    FrameHeader header;
+    const uint8_t* src;
+    size_t blocks_end;
+    const uint8_t* entries;
+    size_t block_count;
+} FrameIndex;
+
+// Locates the index through the footer. Returns false if the frame was
+// written without FRAME_FLAG_INDEX or the footer is damaged.
+bool frame_open_index(const uint8_t* src, size_t src_len, FrameIndex* index) {
+    if (!frame_read_header(src, src_len, &index->header)) return false;
+    if (!(index->header.flags & FRAME_FLAG_INDEX)) return false;
+    if (src_len < FRAME_HEADER_SIZE + FRAME_END_MARK_SIZE + FRAME_INDEX_FOOTER_SIZE) return false;
+    
+    const uint8_t* footer = src + src_len - FRAME_INDEX_FOOTER_SIZE;
+    if (footer[4] != 'B' || footer[5] != 'C' || footer[6] != 'I' || footer[7] != 'X') return false;
+    
+    size_t count = read_le32(footer);
+    size_t available = src_len - FRAME_HEADER_SIZE - FRAME_END_MARK_SIZE - FRAME_INDEX_FOOTER_SIZE;
+    if (count > available / FRAME_INDEX_ENTRY_SIZE) return false;
+    
+    index->src = src;
+    index->entries = footer - count * FRAME_INDEX_ENTRY_SIZE;
+    index->blocks_end = (size_t)(index->entries - src) - FRAME_END_MARK_SIZE;
+    index->block_count = count;
+    return true;
+}
+
+static uint64_t frame_index_original_offset(const FrameIndex* index, size_t i) {
+    if (i >= index->block_count) return index->header.content_size;
+    return read_le64(index->entries + i * FRAME_INDEX_ENTRY_SIZE + 8);
+}
+
+// Parses block i through the index and checks that it exactly fills the gap
+// up to the next block, so blocks can never overlap in the output.
+static bool frame_index_block(const FrameIndex* index, size_t i, FrameBlock* block,
+                              uint64_t* original_offset) {
+    if (i >= index->block_count) return false;
+    
+    uint64_t block_pos = read_le64(index->entries + i * FRAME_INDEX_ENTRY_SIZE);
+    if (block_pos < FRAME_HEADER_SIZE || block_pos >= index->blocks_end) return false;
+    
+    size_t next_pos;
+    if (!frame_read_block(index->src, index->blocks_end, (size_t)block_pos,
+                          &index->header, block, &next_pos)) return false;
+    if (block->original_size == 0) return false;
+    
+    *original_offset = frame_index_original_offset(index, i);
+    return frame_index_original_offset(index, i + 1) - *original_offset == block->original_size &&
+           (i > 0 || *original_offset == 0);
+}
+
+// PARALLEL BLOCK COMPRESSION
+// Workers take block numbers from a shared counter and compress into their
+// own slot buffer. Blocks are committed strictly in order: a worker waits for
+// its turn, reserves its output range, then copies outside the lock. Memory
+// stays at one slot per thread no matter how large the input is.
+
+typedef struct {
+    const uint8_t* src;
+    size_t src_len;
+    uint8_t* dst;
+    size_t dst_cap;
+    const FrameOptions* opts;
+    size_t block_count;
+    size_t slot_size;
+    size_t next_block;
+    size_t next_commit;
+    size_t out_pos;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+} ParallelCompressJob;
+
+static void* parallel_compress_worker(void* arg) {
+    ParallelCompressJob* job = (ParallelCompressJob*)arg;
+    uint8_t* slot = (uint8_t*)codec_alloc(job->slot_size);
+    
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        size_t index = job->next_block++;
+        bool stop = job->failed || index >= job->block_count;
+        pthread_mutex_unlock(&job->lock);
+        if (stop) break;
+        
+        size_t in_pos = index * job->opts->block_size;
+        size_t size = job->src_len - in_pos < job->opts->block_size ?
+                      job->src_len - in_pos : job->opts->block_size;
+        size_t written = slot ? frame_write_block(job->src + in_pos, size, slot,
+                                                  job->slot_size, job->opts) : 0;
+        
+        pthread_mutex_lock(&job->lock);
+        while (job->next_commit != index && !job->failed) {
+            pthread_cond_wait(&job->turn, &job->lock);
+        }
+        size_t offset = job->out_pos;
+        bool ok = !job->failed && written > 0 && written <= job->dst_cap - offset;
+        if (ok) {
+            job->out_pos += written;
+            job->next_commit++;
+        } else {
+            job->failed = true;
+        }
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
+        
+        if (!ok) break;
+        memcpy(job->dst + offset, slot, written);
+    }
+    
+    codec_free(slot);
+    return NULL;
+}
+
+// Runs worker(job) on the calling thread plus up to threads - 1 extra ones
+// and waits for all of them. If threads can't be created, fewer run.
+static void run_workers(void* (*worker)(void*), void* job, size_t threads) {
+    pthread_t* workers = threads > 1 ? (pthread_t*)codec_alloc(sizeof(pthread_t) * (threads - 1)) : NULL;
+    size_t started = 0;
+    if (workers) {
+        while (started + 1 < threads &&
+               pthread_create(&workers[started], NULL, worker, job) == 0) {
+            started++;
+        }
+    }
+    
+    worker(job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    codec_free(workers);
+}
+
+// Compresses all blocks of src into dst with opts->threads workers (the
+// calling thread is one of them). Returns the bytes written, or 0 on failure.
+static size_t frame_compress_blocks_parallel(const uint8_t* src, size_t src_len,
+                                             uint8_t* dst, size_t dst_cap,
+                                             const FrameOptions* opts, size_t threads) {
+    ParallelCompressJob job;
+    job.src = src;
+    job.src_len = src_len;
+    job.dst = dst;
+    job.dst_cap = dst_cap;
+    job.opts = opts;
+    job.block_count = (src_len + opts->block_size - 1) / opts->block_size;
+    job.slot_size = frame_compress_bound(opts->block_size, opts);
+    job.next_block = 0;
+    job.next_commit = 0;
+    job.out_pos = 0;
+    job.failed = false;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+    
+    if (threads > job.block_count) threads = job.block_count;
+    run_workers(parallel_compress_worker, &job, threads);
+    
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.turn);
+    
+    if (job.failed || job.next_commit != job.block_count) return 0;
+    return job.out_pos;
+}
+
+size_t frame_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+// Writes the blocks of src back to back, without the frame header or end
+// mark. threads 0 means one per CPU. Returns the bytes written, or 0 if dst
+// is too small.
+static size_t frame_compress_blocks(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                                    const FrameOptions* opts) {
+    size_t threads = opts->threads == 0 ? frame_default_threads() : opts->threads;
+    if (threads > 1 && src_len > opts->block_size) {
+        return frame_compress_blocks_parallel(src, src_len, dst, dst_cap, opts, threads);
+    }
+    
+    size_t out_pos = 0;
+    for (size_t in_pos = 0; in_pos < src_len; in_pos += opts->block_size) {
+        size_t size = src_len - in_pos < opts->block_size ? src_len - in_pos : opts->block_size;
+        size_t written = frame_write_block(src + in_pos, size, dst + out_pos, dst_cap - out_pos, opts);
+        if (written == 0) return 0;
+        out_pos += written;
+    }
+    return out_pos;
+}
+
+// Splits src into opts->block_size blocks (NULL opts means defaults) and
+// compresses them on opts->threads threads; 0 threads means one per CPU.
+// The output is identical for every thread count. Returns the frame size,
+// or 0 if dst is too small.
+size_t frame_compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                      const FrameOptions* opts) {
+    FrameOptions defaults;
+    if (!opts) {
+        frame_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!src || !dst || opts->block_size == 0 || opts->block_size > UINT32_MAX) return 0;
+    
+    size_t out_pos = frame_write_header(dst, dst_cap, opts, src_len);
+    if (out_pos == 0) return 0;
+    
+    if (src_len > 0) {
+        size_t written = frame_compress_blocks(src, src_len, dst + out_pos, dst_cap - out_pos, opts);
+        if (written == 0) return 0;
+        out_pos += written;
+    }
+    
+    size_t end = frame_write_end(dst + out_pos, dst_cap - out_pos);
+    if (end == 0) return 0;
+    out_pos += end;
+    
+    if (opts->index) {
+        size_t index_size = frame_write_index(dst, out_pos, dst_cap);
+        if (index_size == 0) return 0;
+        out_pos += index_size;
+    }
+    return out_pos;
+}
+
+size_t frame_content_size(const uint8_t* src, size_t src_len) {
+    FrameHeader header;
+    if (!frame_read_header(src, src_len, &header)) return 0;
+    return (size_t)header.content_size;
+}
+
+size_t frame_decompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    FrameHeader header;
+    if (!dst || !frame_read_header(src, src_len, &header)) return 0;
+    if (header.content_size > dst_cap) return 0;
+    
+    size_t pos = FRAME_HEADER_SIZE;
+    size_t out_pos = 0;
+    
+    while (true) {
+        FrameBlock block;
+        if (!frame_read_block(src, src_len, pos, &header, &block, &pos)) return 0;
+        if (block.original_size == 0) break;
+        
+        size_t decoded = frame_decode_block(&header, &block, dst + out_pos, dst_cap - out_pos);
+        if (decoded == 0) return 0;
+        out_pos += decoded;
+    }
+    
+    if (out_pos != header.content_size) return 0;
+    return out_pos;
+}
+
+// Decodes only block number block_index. With an index the block is found
+// directly; otherwise earlier blocks are skipped by their headers and their
+// payloads are never read.
+size_t frame_decompress_block(const uint8_t* src, size_t src_len, size_t block_index,
+                              uint8_t* dst, size_t dst_cap) {
+    FrameHeader header;
+    if (!dst || !frame_read_header(src, src_len, &header)) return 0;
+    
+    FrameIndex index;
+    if (frame_open_index(src, src_len, &index)) {
+        FrameBlock block;
+        uint64_t original_offset;
+        if (!frame_index_block(&index, block_index, &block, &original_offset)) return 0;
+        return frame_decode_block(&index.header, &block, dst, dst_cap);
+    }
+    
+    size_t pos = FRAME_HEADER_SIZE;
+    for (size_t i = 0; ; i++) {
+        FrameBlock block;
+        if (!frame_read_block(src, src_len, pos, &header, &block, &pos)) return 0;
+        if (block.original_size == 0) return 0;
+        if (i == block_index) return frame_decode_block(&header, &block, dst, dst_cap);
+    }
+}
+
+// PARALLEL DECOMPRESSION AND RANGE READS
+// Both need the block index: it tells every worker where its block starts in
+// the frame and where it lands in the output, so no ordering is needed.
+
+typedef struct {
+    const FrameIndex* index;
+    uint8_t* dst;
+    size_t dst_cap;
+    size_t next_block;
+    bool failed;
+    pthread_mutex_t lock;
+} ParallelDecompressJob;
+
+static void* parallel_decompress_worker(void* arg) {
+    ParallelDecompressJob* job = (ParallelDecompressJob*)arg;
+    
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next_block++;
+        bool stop = job->failed || i >= job->index->block_count;
+        pthread_mutex_unlock(&job->lock);
+        if (stop) break;
+        
+        FrameBlock block;
+        uint64_t original_offset;
+        bool ok = frame_index_block(job->index, i, &block, &original_offset) &&
+                  original_offset + block.original_size <= job->dst_cap &&
+                  frame_decode_block(&job->index->header, &block, job->dst + original_offset,
+                                     block.original_size) == block.original_size;
+        
+        if (!ok) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = true;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Decodes the whole frame on threads workers (0 = one per CPU). Frames
+// without an index are decoded serially.
+size_t frame_decompress_parallel(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                                 size_t threads) {
+    FrameIndex index;
+    if (threads == 0) threads = frame_default_threads();
+    if (!dst || threads == 1 || !frame_open_index(src, src_len, &index)) {
+        return frame_decompress(src, src_len, dst, dst_cap);
+    }
+    if (index.header.content_size > dst_cap) return 0;
+    if (index.block_count == 0) return 0;
+    
+    ParallelDecompressJob job;
+    job.index = &index;
+    job.dst = dst;
+    job.dst_cap = dst_cap;
+    job.next_block = 0;
+    job.failed = false;
+    pthread_mutex_init(&job.lock, NULL);
+    
+    if (threads > index.block_count) threads = index.block_count;
+    run_workers(parallel_decompress_worker, &job, threads);
+    
+    pthread_mutex_destroy(&job.lock);
+    
+    if (job.failed) return 0;
+    return (size_t)index.header.content_size;
+}
+
+// Binary search for the last block starting at or before original offset
+static size_t frame_index_find(const FrameIndex* index, uint64_t offset) {
+    size_t lo = 0;
+    size_t hi = index->block_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (frame_index_original_offset(index, mid) <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Decodes length bytes starting at original offset into dst, touching only
+// the blocks that overlap the range. Returns length, or 0 if the range is
+// outside the content or the frame has no index.
+size_t frame_decompress_range(const uint8_t* src, size_t src_len, size_t offset, size_t length,
+                              uint8_t* dst) {
+    FrameIndex index;
+    if (!dst || length == 0 || !frame_open_index(src, src_len, &index)) return 0;
+    if (offset > index.header.content_size || length > index.header.content_size - offset) return 0;
+    
+    // Sized from the blocks actually decoded, not the header's block size
+    uint8_t* partial = NULL;
+    size_t partial_cap = 0;
+    size_t copied = 0;
+    
+    for (size_t i = frame_index_find(&index, offset); copied < length; i++) {
+        FrameBlock block;
+        uint64_t block_start;
+        if (!frame_index_block(&index, i, &block, &block_start)) break;
+        
+        size_t skip = offset + copied - (size_t)block_start;
+        size_t take = block.original_size - skip;
+        if (take > length - copied) take = length - copied;
+        
+        if (skip == 0 && take == block.original_size) {
+            // Whole block: decode straight into place
+            if (frame_decode_block(&index.header, &block, dst + copied, take) != take) break;
+        } else {
+            if (block.original_size > partial_cap) {
+                codec_free(partial);
+                partial = (uint8_t*)codec_alloc(block.original_size);
+                partial_cap = partial ? block.original_size : 0;
+            }
+            if (!partial || frame_decode_block(&index.header, &block, partial,
+                                               block.original_size) != block.original_size) break;
+            memcpy(dst + copied, partial + skip, take);
+        }
+        copied += take;
+    }
+    
+    codec_free(partial);
+    return copied == length ? length : 0;
+}
+
+// COMPRESSED-DOMAIN QUERIES
+// Aggregates and point reads straight from the token stream. Every token but
+// a back-reference has its bytes in closed form: a run is a value and a
+// count, a delta sequence a start and a step, a literal or nibble token its
+// own payload. A walk adds each token to a 256-entry histogram, from which
+// the length, any value's count and the sum all follow, without expanding a
+// single run. Back-references need earlier output, so a stream that has one
+// is walked again with recent output decoded into a small history window
+// that never leaves the cache. Even then an overlapping match (offset below
+// its length, as long runs are encoded) is periodic and costs only its
+// offset. Format v2 streams get the same walk; their tokens have no length
+// cap, so a delta sequence is counted over one 128-byte period and a token
+// longer than the match window only puts its last 32 KB in the history.
+// Simple RLE blocks are walked too, a run or a literal per control byte.
+// Filtered or entropy frame blocks are decoded to a scratch buffer and
+// scanned.
+//
+// Every walk stops at a limit on the decoded size: a frame block's
+// original_size, so a block declaring more than that fails before its
+// oversized tokens cost anything.
+//
+// Queries check token structure but not frame checksums, which cover bytes
+// a query never produces.
+
+#define QUERY_HISTORY_SIZE (2 * MATCH_WINDOW_SIZE)
+
+typedef struct {
+    uint64_t length;
+    uint64_t sum;
+    uint64_t histogram[256];    // count of each byte value
+} ByteSummary;
+
+static void summary_add_bytes(uint64_t* histogram, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) histogram[data[i]]++;
+}
+
+static void summary_finish(ByteSummary* summary) {
+    summary->length = 0;
+    summary->sum = 0;
+    for (int v = 0; v < 256; v++) {
+        summary->length += summary->histogram[v];
+        summary->sum += summary->histogram[v] * (uint64_t)v;
+    }
+}
+
+// Byte i of a v1 token other than a back-reference
+static uint8_t query_token_byte(const uint8_t* token, size_t i) {
+    switch (token_table[token[0]].kind) {
+    case TOKEN_LITERAL: return token[1 + i];
+    case TOKEN_NIBBLE: return (uint8_t)(i & 1 ? token[1 + i / 2] & 0x0F : token[1 + i / 2] >> 4);
+    case TOKEN_RLE: return token[1];
+    case TOKEN_DELTA: return (uint8_t)((token[1] + i * ((int)token[2] - 16)) & 0x7F);
+    case TOKEN_PATTERN: return token[2 + i % (token[1] >> 4)];
+    case TOKEN_COMMON_VAL: return common_values[token[1] & 0x0F];
+    default: return 0;
+    }
+}
+
+// Adds a v1 token other than a back-reference to histogram
+static void query_token_histogram(const uint8_t* token, size_t output_size, uint64_t* histogram) {
+    TokenEntry entry = token_table[token[0]];
+    switch (entry.kind) {
+    case TOKEN_LITERAL:
+        summary_add_bytes(histogram, &token[1], output_size);
+        break;
+    case TOKEN_NIBBLE:
+        for (size_t i = 0; i + 1 < output_size; i += 2) {
+            histogram[token[1 + i / 2] >> 4]++;
+            histogram[token[1 + i / 2] & 0x0F]++;
+        }
+        if (output_size & 1) histogram[token[1 + output_size / 2] >> 4]++;
+        break;
+    case TOKEN_DELTA:
+        if (token[2] == 16) {
+            histogram[token[1] & 0x7F] += output_size;
+        } else {
+            unsigned value = token[1];
+            for (size_t i = 0; i < output_size; i++, value += (unsigned)token[2] - 16) histogram[value & 0x7F]++;
+        }
+        break;
+    case TOKEN_PATTERN:
+        for (size_t i = 0; i < (size_t)(token[1] >> 4); i++) histogram[token[2 + i]] += token[1] & 0x0F;
+        break;
+    default:
+        // Runs of one value: zero runs, RLE and common values
+        histogram[query_token_byte(token, 0)] += output_size;
+        break;
+    }
+}
+
+// Walks a v1 stream up to the token holding output offset target, or to the
+// end when target is UINT64_MAX, adding every token passed to histogram if
+// it is set and storing the target byte in *value. With history (a
+// QUERY_HISTORY_SIZE buffer) tokens are also decoded into a sliding window
+// for back-references; without one the first back-reference stops the walk
+// and sets *saw_match. Fails once the output would pass limit bytes.
+static bool query_walk(const uint8_t* src, size_t src_len, uint8_t* history, uint64_t target, uint64_t limit,
+                       uint64_t* histogram, uint8_t* value, bool* saw_match) {
+    uint64_t out_pos = 0;
+    size_t history_len = 0;
+    
+    for (size_t pos = 0; pos < src_len;) {
+        const uint8_t* token = src + pos;
+        size_t token_size, output_size;
+        if (!advanced_token_info(token, src_len - pos, &token_size, &output_size)) return false;
+        if (token_size > src_len - pos || output_size > limit - out_pos) return false;
+        
+        TokenEntry entry = token_table[token[0]];
+        if (entry.kind == TOKEN_COMMON_VAL && (token[1] & 0x0F) >= NUM_COMMON_VALUES) return false;
+        if (entry.kind == TOKEN_MATCH && !history) {
+            *saw_match = true;
+            return false;
+        }
+        
+        if (history) {
+            if (history_len + ADVANCED_MAX_TOKEN_OUTPUT > QUERY_HISTORY_SIZE) {
+                memmove(history, history + history_len - MATCH_WINDOW_SIZE, MATCH_WINDOW_SIZE);
+                history_len = MATCH_WINDOW_SIZE;
+            }
+            // Runs of one value (most of a run-heavy stream) are one memset
+            bool run = entry.kind == TOKEN_RLE || entry.kind == TOKEN_ZERO_RUN ||
+                       entry.kind == TOKEN_COMMON_VAL || (entry.kind == TOKEN_DELTA && token[2] == 16);
+            if (run) memset(history + history_len, query_token_byte(token, 0), output_size);
+            else if (!advanced_decode_token(token, history, history_len)) return false;
+        }
+        
+        if (histogram && entry.kind == TOKEN_MATCH) {
+            // An overlapping copy repeats its last offset bytes
+            size_t offset = token[2] | ((size_t)token[3] << 8);
+            const uint8_t* source = history + history_len - offset;
+            if (offset < output_size) {
+                for (size_t i = 0; i < offset; i++) {
+                    histogram[source[i]] += output_size / offset + (i < output_size % offset);
+                }
+            } else {
+                summary_add_bytes(histogram, source, output_size);
+            }
+        } else if (histogram) {
+            query_token_histogram(token, output_size, histogram);
+        }
+        
+        if (target - out_pos < output_size) {
+            *value = history ? history[history_len + (size_t)(target - out_pos)]
+                             : query_token_byte(token, (size_t)(target - out_pos));
+            return true;
+        }
+        history_len += output_size;
+        out_pos += output_size;
+        pos += token_size;
+    }
+    return target == UINT64_MAX;
+}
+
+// Byte i of a v2 token of length bytes other than a back-reference
+static uint8_t query_v2_byte(const uint8_t* token, size_t control_size, size_t length, size_t i) {
+    const uint8_t* payload = token + control_size;
+    switch (token[0] & ~V2_LENGTH_MASK) {
+    case V2_LITERAL: return payload[i];
+    case V2_NIBBLE: return (uint8_t)(i & 1 ? payload[i / 2] & 0x0F : payload[i / 2] >> 4);
+    case V2_RUN: return payload[0];
+    case V2_ZERO_RUN: return 0;
+    case V2_DELTA: return (uint8_t)((payload[0] + i * ((int)payload[1] - 16)) & 0x7F);
+    default: {
+        // Bit-pack: one little-endian bit stream, value i at bit i * width
+        unsigned width = token[control_size - 1];
+        size_t bit = i * width;
+        unsigned value = payload[bit / 8] >> (bit % 8);
+        if (bit % 8 + width > 8 && (bit + width + 7) / 8 <= (length * width + 7) / 8) {
+            value |= (unsigned)payload[bit / 8 + 1] << (8 - bit % 8);
+        }
+        return (uint8_t)(value & ((1u << width) - 1));
+    }
+    }
+}
+
+// Adds a v2 token other than a back-reference to histogram
+static void query_v2_histogram(const uint8_t* token, size_t control_size, size_t length, uint64_t* histogram) {
+    const uint8_t* payload = token + control_size;
+    switch (token[0] & ~V2_LENGTH_MASK) {
+    case V2_LITERAL:
+        summary_add_bytes(histogram, payload, length);
+        break;
+    case V2_NIBBLE:
+        for (size_t i = 0; i < length / 2; i++) {
+            histogram[payload[i] >> 4]++;
+            histogram[payload[i] & 0x0F]++;
+        }
+        if (length & 1) histogram[payload[length / 2] >> 4]++;
+        break;
+    case V2_RUN:
+        histogram[payload[0]] += length;
+        break;
+    case V2_ZERO_RUN:
+        histogram[0] += length;
+        break;
+    case V2_DELTA: {
+        // Values repeat every 128 bytes
+        size_t period = length < 128 ? length : 128;
+        unsigned value = payload[0];
+        for (size_t i = 0; i < period; i++, value += (unsigned)payload[1] - 16) {
+            histogram[value & 0x7F] += length / 128 + (i < length % 128);
+        }
+        break;
+    }
+    default: {
+        // Bit-pack: unpacked a chunk at a time, 512 values from 64 * width bytes
+        unsigned width = token[control_size - 1];
+        uint8_t chunk[512];
+        for (size_t i = 0; i < length; i += sizeof(chunk)) {
+            size_t count = length - i < sizeof(chunk) ? length - i : sizeof(chunk);
+            bit_unpack(payload + i / 8 * width, count, width, chunk);
+            summary_add_bytes(histogram, chunk, count);
+        }
+        break;
+    }
+    }
+}
+
+// Writes bytes [from, from + count) of a v2 token other than a
+// back-reference to dst
+static void query_v2_emit(const uint8_t* token, size_t control_size, size_t length, size_t from, size_t count,
+                          uint8_t* dst) {
+    const uint8_t* payload = token + control_size;
+    uint8_t kind = token[0] & ~V2_LENGTH_MASK;
+    if (kind == V2_NIBBLE || kind == V2_BITPACK) {
+        // Packed from a group boundary
+        for (; from % 8 && count; from++, count--) *dst++ = query_v2_byte(token, control_size, length, from);
+    }
+    
+    switch (kind) {
+    case V2_LITERAL:
+        memcpy(dst, payload + from, count);
+        break;
+    case V2_NIBBLE:
+        nibble_unpack(payload + from / 2, count, dst);
+        break;
+    case V2_RUN:
+    case V2_ZERO_RUN:
+        memset(dst, query_v2_byte(token, control_size, length, 0), count);
+        break;
+    case V2_DELTA:
+        delta_fill(query_v2_byte(token, control_size, length, from), (int)payload[1] - 16, count, dst);
+        break;
+    default:
+        bit_unpack(payload + from / 8 * token[control_size - 1], count, token[control_size - 1], dst);
+        break;
+    }
+}
+
+// query_walk for a v2 stream. The history keeps the output's last
+// MATCH_WINDOW_SIZE bytes, which is all a back-reference can reach, so a
+// longer token is decoded only from there on.
+static bool query_walk_v2(const uint8_t* src, size_t src_len, uint8_t* history, uint64_t target, uint64_t limit,
+                          uint64_t* histogram, uint8_t* value, bool* saw_match) {
+    uint64_t out_pos = 0;
+    size_t history_len = 0;
+    
+    for (size_t pos = V2_HEADER_SIZE; pos < src_len;) {
+        const uint8_t* token = src + pos;
+        size_t control_size, token_size, length;
+        if (!v2_token_info(token, src_len - pos, &control_size, &token_size, &length)) return false;
+        if (token_size > src_len - pos || length > limit - out_pos) return false;
+        
+        bool match = (token[0] & ~V2_LENGTH_MASK) == V2_MATCH;
+        size_t offset = match ? token[control_size] | ((size_t)token[control_size + 1] << 8) : 0;
+        if (match && !history) {
+            *saw_match = true;
+            return false;
+        }
+        if (match && (offset == 0 || offset >= MATCH_WINDOW_SIZE || offset > out_pos)) return false;
+        
+        // Output byte j of a back-reference is source[j % offset]
+        const uint8_t* source = history ? history + history_len - offset : NULL;
+        if (histogram && match) {
+            if (offset < length) {
+                for (size_t i = 0; i < offset; i++) {
+                    histogram[source[i]] += length / offset + (i < length % offset);
+                }
+            } else {
+                summary_add_bytes(histogram, source, length);
+            }
+        } else if (histogram) {
+            query_v2_histogram(token, control_size, length, histogram);
+        }
+        
+        if (target - out_pos < length) {
+            size_t i = (size_t)(target - out_pos);
+            *value = match ? source[i % offset] : query_v2_byte(token, control_size, length, i);
+            return true;
+        }
+        
+        if (history) {
+            size_t count = length < MATCH_WINDOW_SIZE ? length : MATCH_WINDOW_SIZE;
+            size_t from = length - count;
+            if (history_len + count > QUERY_HISTORY_SIZE) {
+                memmove(history, history + history_len - MATCH_WINDOW_SIZE, MATCH_WINDOW_SIZE);
+                history_len = MATCH_WINDOW_SIZE;
+                source = history + history_len - offset;
+            }
+            uint8_t* dst = history + history_len;
+            if (match) {
+                // One period from the right phase, then the rest repeats it
+                size_t phase = from % offset;
+                size_t head = count < offset - phase ? count : offset - phase;
+                memcpy(dst, source + phase, head);
+                size_t wrapped = count - head < phase ? count - head : phase;
+                memcpy(dst + head, source, wrapped);
+                if (head + wrapped < count) {
+                    repeat_copy(history, history_len + head + wrapped, offset, count - head - wrapped);
+                }
+            } else {
+                query_v2_emit(token, control_size, length, from, count, dst);
+            }
+            history_len += count;
+        }
+        out_pos += length;
+        pos += token_size;
+    }
+    return target == UINT64_MAX;
+}
+
+// Runs the walker without history first, and again with it only if the
+// stream turns out to have back-references
+static bool query_stream(const uint8_t* src, size_t src_len, uint64_t target, uint64_t limit, uint64_t* histogram,
+                         uint8_t* value) {
+    bool (*walk)(const uint8_t*, size_t, uint8_t*, uint64_t, uint64_t, uint64_t*, uint8_t*, bool*) =
+        is_v2_stream(src, src_len) ? query_walk_v2 : query_walk;
+    uint64_t counts[256] = {0};
+    bool saw_match = false;
+    if (walk(src, src_len, NULL, target, limit, histogram ? counts : NULL, value, &saw_match)) {
+        if (histogram) for (int v = 0; v < 256; v++) histogram[v] += counts[v];
+        return true;
+    }
+    if (!saw_match) return false;
+    
+    uint8_t* history = (uint8_t*)codec_alloc(QUERY_HISTORY_SIZE);
+    bool ok = history && walk(src, src_len, history, target, limit, histogram, value, &saw_match);
+    codec_free(history);
+    return ok;
+}
+
+// Length, sum and histogram of what an advanced stream decodes to. Returns
+// false for an empty, truncated or corrupt stream.
+bool advanced_summarize(const uint8_t* src, size_t src_len, ByteSummary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    if (!src || src_len == 0 || !query_stream(src, src_len, UINT64_MAX, UINT64_MAX, summary->histogram, NULL)) {
+        memset(summary, 0, sizeof(*summary));
+        return false;
+    }
+    summary_finish(summary);
+    return true;
+}
+
+// The byte at decoded offset. Returns false past the end or on a corrupt
+// stream.
+bool advanced_byte_at(const uint8_t* src, size_t src_len, uint64_t offset, uint8_t* value) {
+    if (!src || src_len == 0 || offset == UINT64_MAX) return false;
+    return query_stream(src, src_len, offset, UINT64_MAX, NULL, value);
+}
+
+// Walks a simple RLE stream as simple_rle_decompress_to reads it, with the
+// same target, limit and histogram arguments as query_walk
+static bool query_simple_rle(const uint8_t* src, size_t src_len, uint64_t target, uint64_t limit,
+                             uint64_t* histogram, uint8_t* value) {
+    uint64_t out_pos = 0;
+    for (size_t pos = 0; pos < src_len;) {
+        uint8_t control = src[pos++];
+        const uint8_t* bytes = src + pos;
+        size_t length;
+        bool run = control & RLE_FLAG;
+        if (run) {
+            // A run missing its value byte writes nothing
+            length = pos < src_len ? control & 0x7F : 0;
+            pos += pos < src_len;
+        } else {
+            length = control < src_len - pos ? control : src_len - pos;
+            pos += length;
+        }
+        if (length > limit - out_pos) return false;
+        
+        if (length == 0) continue;
+        if (histogram && run) histogram[bytes[0]] += length;
+        else if (histogram) summary_add_bytes(histogram, bytes, length);
+        if (target - out_pos < length) {
+            *value = bytes[run ? 0 : target - out_pos];
+            return true;
+        }
+        out_pos += length;
+    }
+    return target == UINT64_MAX;
+}
+
+// Summarizes every block of a frame. Unfiltered advanced, simple RLE and
+// stored blocks are read in place; others are decoded one at a time into
+// scratch.
+bool frame_summarize(const uint8_t* src, size_t src_len, ByteSummary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    FrameHeader header;
+    if (!src || !frame_read_header(src, src_len, &header)) return false;
+    
+    // Sized from the blocks actually decoded, not the header's block size
+    uint8_t* scratch = NULL;
+    size_t scratch_cap = 0;
+    uint64_t length = 0;
+    bool ok = true;
+    for (size_t pos = FRAME_HEADER_SIZE; ok;) {
+        FrameBlock block;
+        ok = frame_read_block(src, src_len, pos, &header, &block, &pos);
+        if (!ok || block.original_size == 0) break;
+        
+        uint64_t block_counts[256] = {0};
+        if (block.filter == FILTER_NONE && block.codec == CODEC_ADVANCED) {
+            ok = query_stream(block.payload, block.compressed_size, UINT64_MAX, block.original_size, block_counts,
+                              NULL);
+        } else if (block.filter == FILTER_NONE && block.codec == CODEC_SIMPLE_RLE) {
+            ok = query_simple_rle(block.payload, block.compressed_size, UINT64_MAX, block.original_size,
+                                  block_counts, NULL);
+        } else if (block.filter == FILTER_NONE && block.codec == CODEC_STORED) {
+            ok = block.compressed_size == block.original_size;
+            if (ok) summary_add_bytes(block_counts, block.payload, block.original_size);
+        } else {
+            if (block.original_size > scratch_cap) {
+                codec_free(scratch);
+                scratch = (uint8_t*)codec_alloc(block.original_size);
+                scratch_cap = scratch ? block.original_size : 0;
+            }
+            ok = scratch && frame_decode_block(&header, &block, scratch, block.original_size) == block.original_size;
+            if (ok) summary_add_bytes(block_counts, scratch, block.original_size);
+        }
+        
+        // Each block must decode to exactly its declared size
+        uint64_t block_length = 0;
+        for (int v = 0; v < 256; v++) {
+            block_length += block_counts[v];
+            summary->histogram[v] += block_counts[v];
+        }
+        ok = ok && block_length == block.original_size;
+        length += block.original_size;
+    }
+    codec_free(scratch);
+    
+    if (!ok || length != header.content_size) {
+        memset(summary, 0, sizeof(*summary));
+        return false;
+    }
+    summary_finish(summary);
+    return true;
+}
+
+// The byte at original offset, found through the block index. Unfiltered
+// advanced, simple RLE and stored blocks are read in place; others are
+// decoded.
+bool frame_byte_at(const uint8_t* src, size_t src_len, uint64_t offset, uint8_t* value) {
+    FrameIndex index;
+    if (!src || !frame_open_index(src, src_len, &index) || offset >= index.header.content_size) return false;
+    
+    FrameBlock block;
+    uint64_t block_start;
+    if (!frame_index_block(&index, frame_index_find(&index, offset), &block, &block_start)) return false;
+    if (block.filter == FILTER_NONE && block.codec == CODEC_ADVANCED) {
+        return query_stream(block.payload, block.compressed_size, offset - block_start, block.original_size,
+                            NULL, value);
+    }
+    if (block.filter == FILTER_NONE && block.codec == CODEC_SIMPLE_RLE) {
+        return query_simple_rle(block.payload, block.compressed_size, offset - block_start, block.original_size,
+                                NULL, value);
+    }
+    if (block.filter == FILTER_NONE && block.codec == CODEC_STORED &&
+        block.compressed_size == block.original_size) {
+        *value = block.payload[offset - block_start];
+        return true;
+    }
+    return frame_decompress_range(src, src_len, (size_t)offset, 1, value) == 1;
+}
+
+// DEDUP CACHE
+// Fleets send many byte-identical frames (heartbeats, idle readings). A
+// DedupCache remembers the compressed stream of recent frames, keyed by a
+// 64-bit hash of the input, so a repeat is a hash, a compare and a copy
+// instead of an encode. Each entry keeps its input and a hit compares it in
+// full, so a hash collision can only cost a miss, never wrong output. Hits
+// return exactly what byte_compress_to would write.
+//
+// The cache is a chained hash table with an LRU list, bounded by both entry
+// count and bytes (entry headers, inputs and outputs; a frame larger than
+// the byte limit is never stored). One mutex guards it, so batch workers and
+// several streams can share one cache; entries are built outside the lock.
+
+// xxHash64 with seed 0
+#define XXH64_PRIME1 11400714785074694791ULL
+#define XXH64_PRIME2 14029467366897019727ULL
+#define XXH64_PRIME3 1609587929392839161ULL
+#define XXH64_PRIME4 9650029242287828579ULL
+#define XXH64_PRIME5 2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH64_PRIME2;
+    return rotl64(acc, 31) * XXH64_PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+uint64_t hash64(const uint8_t* data, size_t size) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint64_t h;
+    
+    if (size >= 32) {
+        uint64_t v1 = XXH64_PRIME1 + XXH64_PRIME2;
+        uint64_t v2 = XXH64_PRIME2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - XXH64_PRIME1;
+        
+        while (p + 32 <= end) {
+            v1 = xxh64_round(v1, read_le64(p));
+            v2 = xxh64_round(v2, read_le64(p + 8));
+            v3 = xxh64_round(v3, read_le64(p + 16));
+            v4 = xxh64_round(v4, read_le64(p + 24));
+            p += 32;
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = XXH64_PRIME5;
+    }
+    
+    h += (uint64_t)size;
+    
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, read_le64(p));
+        h = rotl64(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read_le32(p) * XXH64_PRIME1;
+        h = rotl64(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * XXH64_PRIME5;
+        h = rotl64(h, 11) * XXH64_PRIME1;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH64_PRIME2;
+    h ^= h >> 29;
+    h *= XXH64_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct DedupEntry {
+    uint64_t hash;
+    struct DedupEntry* chain;   // next entry in the same bucket
+    struct DedupEntry* newer;
+    struct DedupEntry* older;
+    size_t input_size;
+    size_t output_size;
+    uint8_t data[];             // the input, then its compressed stream
+} DedupEntry;
+
+typedef struct {
+    DedupEntry** buckets;
+    size_t bucket_mask;
+    DedupEntry* newest;
+    DedupEntry* oldest;
+    size_t max_entries;
+    size_t max_bytes;
+    size_t entries;
+    size_t bytes;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t evictions;
+    pthread_mutex_t lock;
+} DedupCache;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;               // entries plus the bucket table
+} DedupStats;
+
+// Returns false if max_entries is 0 or the bucket table can't be allocated
+bool dedup_cache_init(DedupCache* cache, size_t max_entries, size_t max_bytes) {
+    size_t buckets = 16;
+    while (buckets < max_entries) buckets *= 2;
+    cache->buckets = max_entries ? (DedupEntry**)codec_alloc(buckets * sizeof(DedupEntry*)) : NULL;
+    if (!cache->buckets) return false;
+    
+    memset(cache->buckets, 0, buckets * sizeof(DedupEntry*));
+    cache->bucket_mask = buckets - 1;
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->max_entries = max_entries;
+    cache->max_bytes = max_bytes;
+    cache->entries = 0;
+    cache->bytes = 0;
+    cache->lookups = 0;
+    cache->hits = 0;
+    cache->evictions = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    return true;
+}
+
+void dedup_cache_free(DedupCache* cache) {
+    for (DedupEntry* e = cache->newest; e;) {
+        DedupEntry* older = e->older;
+        codec_free(e);
+        e = older;
+    }
+    codec_free(cache->buckets);
+    cache->buckets = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void dedup_cache_stats(DedupCache* cache, DedupStats* stats) {
+    pthread_mutex_lock(&cache->lock);
+    stats->lookups = cache->lookups;
+    stats->hits = cache->hits;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->entries;
+    stats->bytes = cache->bytes + (cache->bucket_mask + 1) * sizeof(DedupEntry*);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// The bucket link pointing at src's entry, or at the chain's terminating NULL
+static DedupEntry** dedup_find(DedupCache* cache, uint64_t hash, const uint8_t* src, size_t src_len) {
+    DedupEntry** link = &cache->buckets[hash & cache->bucket_mask];
+    while (*link && ((*link)->hash != hash || (*link)->input_size != src_len ||
+                     memcmp((*link)->data, src, src_len) != 0)) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void dedup_lru_unlink(DedupCache* cache, DedupEntry* e) {
+    if (e->newer) e->newer->older = e->older;
+    else cache->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else cache->oldest = e->newer;
+}
+
+static void dedup_lru_push(DedupCache* cache, DedupEntry* e) {
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest) cache->newest->newer = e;
+    else cache->oldest = e;
+    cache->newest = e;
+}
+
+// Copies the cached stream for src into dst. Returns its size, or 0 on a
+// miss or if dst is too small.
+static size_t dedup_fetch(DedupCache* cache, uint64_t hash, const uint8_t* src, size_t src_len,
+                          uint8_t* dst, size_t dst_cap) {
+    size_t size = 0;
+    pthread_mutex_lock(&cache->lock);
+    cache->lookups++;
+    DedupEntry* e = *dedup_find(cache, hash, src, src_len);
+    if (e && e->output_size <= dst_cap) {
+        cache->hits++;
+        dedup_lru_unlink(cache, e);
+        dedup_lru_push(cache, e);
+        memcpy(dst, e->data + e->input_size, e->output_size);
+        size = e->output_size;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    STATS_DEDUP(size > 0, src_len);
+    return size;
+}
+
+// Remembers stream as src's compressed form, evicting the least recently
+// used entries until both limits hold again
+static void dedup_store(DedupCache* cache, uint64_t hash, const uint8_t* src, size_t src_len,
+                        const uint8_t* stream, size_t stream_len) {
+    size_t size = sizeof(DedupEntry) + src_len + stream_len;
+    if (size > cache->max_bytes) return;
+    DedupEntry* e = (DedupEntry*)codec_alloc(size);
+    if (!e) return;
+    e->hash = hash;
+    e->input_size = src_len;
+    e->output_size = stream_len;
+    memcpy(e->data, src, src_len);
+    memcpy(e->data + src_len, stream, stream_len);
+    
+    pthread_mutex_lock(&cache->lock);
+    DedupEntry** link = dedup_find(cache, hash, src, src_len);
+    if (*link) {
+        // Another thread stored the same frame first
+        pthread_mutex_unlock(&cache->lock);
+        codec_free(e);
+        return;
+    }
+    e->chain = NULL;
+    *link = e;
+    dedup_lru_push(cache, e);
+    cache->entries++;
+    cache->bytes += size;
+    
+    while (cache->entries > cache->max_entries || cache->bytes > cache->max_bytes) {
+        DedupEntry* victim = cache->oldest;
+        DedupEntry** victim_link = &cache->buckets[victim->hash & cache->bucket_mask];
+        while (*victim_link != victim) victim_link = &(*victim_link)->chain;
+        *victim_link = victim->chain;
+        dedup_lru_unlink(cache, victim);
+        cache->entries--;
+        cache->bytes -= sizeof(DedupEntry) + victim->input_size + victim->output_size;
+        cache->evictions++;
+        codec_free(victim);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// byte_compress_to through the cache
+size_t dedup_compress_to(DedupCache* cache, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    if (!src || src_len == 0 || !dst) return 0;
+    
+    uint64_t hash = hash64(src, src_len);
+    size_t size = dedup_fetch(cache, hash, src, src_len, dst, dst_cap);
+    if (size > 0) return size;
+    
+    size = advanced_compress_to(src, src_len, dst, dst_cap);
+    if (size > 0) dedup_store(cache, hash, src, src_len, dst, size);
+    return size;
+}
+
+// BATCH API
+// Many small independent frames in one call. Each frame is an ordinary
+// advanced stream, identical to byte_compress_to's. Workers claim
+// BATCH_CHUNK frames at a time from a shared counter and keep one match
+// finder for all of them, reset by clearing only the heads the last frame
+// touched, so a 24-byte frame no longer pays for a 16 KB table clear, a
+// malloc or a call through a function pointer.
+//
+// out[i].data and out[i].capacity give frame i's output buffer; on return
+// out[i].size is the bytes written, or 0 if frame i failed (bad input or too
+// small a buffer). Both calls return how many frames succeeded.
+// byte_compress_batch_dedup looks every frame up in a DedupCache first.
+
+#define BATCH_CHUNK 64
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+} BatchInput;
+
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t size;
+} BatchOutput;
+
+typedef struct {
+    const BatchInput* in;
+    BatchOutput* out;
+    size_t count;
+    bool compress;
+    DedupCache* cache;
+    size_t next_frame;
+    size_t succeeded;
+    pthread_mutex_t lock;
+} BatchJob;
+
+static void* batch_worker(void* arg) {
+    BatchJob* job = (BatchJob*)arg;
+    MatchFinder* mf = job->compress ? (MatchFinder*)codec_alloc(sizeof(MatchFinder)) : NULL;
+    if (mf) match_finder_init(mf);
+    size_t succeeded = 0;
+    
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        size_t first = job->next_frame;
+        job->next_frame += BATCH_CHUNK;
+        pthread_mutex_unlock(&job->lock);
+        if (first >= job->count) break;
+        
+        size_t last = first + BATCH_CHUNK < job->count ? first + BATCH_CHUNK : job->count;
+        for (size_t i = first; i < last; i++) {
+            const BatchInput* in = &job->in[i];
+            BatchOutput* out = &job->out[i];
+            out->size = 0;
+            if (!in->data || in->size == 0 || !out->data) continue;
+            
+            if (!job->compress) {
+                out->size = advanced_decompress_to(in->data, in->size, out->data, out->capacity);
+            } else if (mf) {
+                uint64_t hash = job->cache ? hash64(in->data, in->size) : 0;
+                if (job->cache) out->size = dedup_fetch(job->cache, hash, in->data, in->size,
+                                                        out->data, out->capacity);
+                if (out->size == 0) {
+                    out->size = advanced_encode_range(in->data, 0, in->size, out->data, out->capacity,
+                                                      mf, PROBE_ALL);
+                    match_finder_reset(mf, in->data);
+                    if (job->cache && out->size > 0) {
+                        dedup_store(job->cache, hash, in->data, in->size, out->data, out->size);
+                    }
+                }
+            }
+            if (out->size > 0) succeeded++;
+        }
+    }
+    
+    pthread_mutex_lock(&job->lock);
+    job->succeeded += succeeded;
+    pthread_mutex_unlock(&job->lock);
+    codec_free(mf);
+    return NULL;
+}
+
+// threads: 0 = one per CPU; a batch is never split finer than BATCH_CHUNK
+static size_t batch_run(const BatchInput* in, size_t n, BatchOutput* out, size_t threads, bool compress,
+                        DedupCache* cache) {
+    if (!in || !out || n == 0) return 0;
+    
+    BatchJob job;
+    job.in = in;
+    job.out = out;
+    job.count = n;
+    job.compress = compress;
+    job.cache = cache;
+    job.next_frame = 0;
+    job.succeeded = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    
+    if (threads == 0) threads = frame_default_threads();
+    size_t chunks = (n + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    if (threads > chunks) threads = chunks;
+    run_workers(batch_worker, &job, threads);
+    
+    pthread_mutex_destroy(&job.lock);
+    return job.succeeded;
+}
+
+size_t byte_compress_batch(const BatchInput* in, size_t n, BatchOutput* out, size_t threads) {
+    return batch_run(in, n, out, threads, true, NULL);
+}
+
+size_t byte_compress_batch_dedup(const BatchInput* in, size_t n, BatchOutput* out, size_t threads,
+                                 DedupCache* cache) {
+    return batch_run(in, n, out, threads, true, cache);
+}
+
+size_t byte_decompress_batch(const BatchInput* in, size_t n, BatchOutput* out, size_t threads) {
+    return batch_run(in, n, out, threads, false, NULL);
+}
+
+// STREAMING API
+// Incremental versions of advanced_compress_to / advanced_decompress_to that
+// accept input in arbitrary chunks and write into arbitrarily sized output
+// buffers. The encoder holds back only the last ADVANCED_LOOKAHEAD bytes, so
+// every token it emits is the one the one-shot encoder would have picked at
+// that position: without flushes the stream is byte-identical to
+// advanced_compress_to over the concatenated input. Both sides keep the last
+// MATCH_WINDOW_SIZE bytes so back-references work across chunks and flushes.
+//
+// update, flush and end return true once all input has been taken and no
+// output is left waiting for space; on false, call again with a fresh output
+// buffer.
+
+#define STREAM_WINDOW_SIZE  (2 * MATCH_WINDOW_SIZE)
+#define STREAM_HISTORY_SIZE (2 * MATCH_WINDOW_SIZE)
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+} StreamInput;
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t pos;
+} StreamOutput;
+
+typedef struct {
+    uint8_t window[STREAM_WINDOW_SIZE];
+    size_t start;
+    size_t end;
+    MatchFinder matcher;
+    uint8_t pending[ADVANCED_MAX_TOKEN_SIZE];
+    size_t pending_pos;
+    size_t pending_len;
+} StreamEncoder;
+
+typedef struct {
+    uint8_t partial[ADVANCED_MAX_TOKEN_SIZE];
+    size_t partial_len;
+    uint8_t history[STREAM_HISTORY_SIZE];
+    size_t history_len;     // decoded bytes kept for back-references
+    size_t delivered;       // history[delivered, history_len) is still owed
+    bool started;           // a first token was decoded, so no v2 header
+} StreamDecoder;
+
+// Copies as much of a pending buffer as fits. Returns true once it is empty.
+static bool stream_drain(const uint8_t* pending, size_t* pending_pos, size_t* pending_len,
+                         StreamOutput* out) {
+    size_t left = *pending_len - *pending_pos;
+    size_t room = out->size - out->pos;
+    size_t take = left < room ? left : room;
+    
+    memcpy(out->data + out->pos, pending + *pending_pos, take);
+    out->pos += take;
+    *pending_pos += take;
+    
+    if (*pending_pos < *pending_len) return false;
+    *pending_pos = 0;
+    *pending_len = 0;
+    return true;
+}
+
+void stream_encoder_init(StreamEncoder* s) {
+    s->start = 0;
+    s->end = 0;
+    match_finder_init(&s->matcher);
+    s->pending_pos = 0;
+    s->pending_len = 0;
+}
+
+// Emits every buffered token whose choice can no longer change, or all of
+// them when final is set
+static bool stream_encode_window(StreamEncoder* s, StreamOutput* out, bool final) {
+    if (!stream_drain(s->pending, &s->pending_pos, &s->pending_len, out)) return false;
+    
+    while (s->start < s->end && (final || s->start + ADVANCED_LOOKAHEAD <= s->end)) {
+        if (out->size - out->pos >= ADVANCED_MAX_TOKEN_SIZE) {
+            s->start += advanced_encode_token(s->window, s->start, s->end,
+                                              out->data, &out->pos, out->size, &s->matcher, PROBE_ALL);
+        } else {
+            // Too little room to encode in place: stage the token
+            s->start += advanced_encode_token(s->window, s->start, s->end,
+                                              s->pending, &s->pending_len, sizeof(s->pending),
+                                              &s->matcher, PROBE_ALL);
+            if (!stream_drain(s->pending, &s->pending_pos, &s->pending_len, out)) return false;
+        }
+    }
+    return true;
+}
+
+// Appends as much of data as fits in the window. Returns the bytes taken.
+static size_t stream_window_fill(StreamEncoder* s, const uint8_t* data, size_t size) {
+    // Keep the match window plus the undecided tail (< ADVANCED_LOOKAHEAD)
+    if (s->end == STREAM_WINDOW_SIZE) {
+        size_t keep = s->start < MATCH_WINDOW_SIZE ? s->start : MATCH_WINDOW_SIZE;
+        size_t shift = s->start - keep;
+        memmove(s->window, s->window + shift, s->end - shift);
+        s->start -= shift;
+        s->end -= shift;
+        s->matcher.base += shift;
+    }
+    
+    size_t room = STREAM_WINDOW_SIZE - s->end;
+    size_t take = size < room ? size : room;
+    memcpy(s->window + s->end, data, take);
+    s->end += take;
+    return take;
+}
+
+bool stream_encoder_update(StreamEncoder* s, StreamInput* in, StreamOutput* out) {
+    while (true) {
+        if (!stream_encode_window(s, out, false)) return false;
+        if (in->pos == in->size) return true;
+        in->pos += stream_window_fill(s, in->data + in->pos, in->size - in->pos);
+    }
+}
+
+// Encodes everything buffered so far. Tokens never span a flush point, but
+// later matches may still reach back past it.
+bool stream_encoder_flush(StreamEncoder* s, StreamOutput* out) {
+    return stream_encode_window(s, out, true);
+}
+
+// Adds one frame to the stream as its own byte_compress_to stream, through
+// cache if it is set, after flushing anything buffered. The frame's tokens
+// are self-contained, so a cache hit is spliced in without running the
+// encoder. Later tokens don't reference into the frame. Needs
+// byte_compress_bound(size) bytes of room after the flush; with less it
+// returns false having taken nothing, so call again with more space.
+bool stream_encoder_frame(StreamEncoder* s, DedupCache* cache, const uint8_t* frame, size_t size,
+                          StreamOutput* out) {
+    if (!stream_encoder_flush(s, out)) return false;
+    if (size == 0) return true;
+    if (out->size - out->pos < advanced_compress_bound(size)) return false;
+    
+    uint8_t* dst = out->data + out->pos;
+    size_t room = out->size - out->pos;
+    size_t written = cache ? dedup_compress_to(cache, frame, size, dst, room)
+                           : advanced_compress_to(frame, size, dst, room);
+    if (written == 0) return false;
+    out->pos += written;
+    
+    // The decoder's history holds the frame, so the window must too
+    for (size_t taken = 0; taken < size; s->start = s->end) {
+        taken += stream_window_fill(s, frame + taken, size - taken);
+    }
+    s->matcher.next_insert = s->matcher.base + s->end;
+    return true;
+}
+
+// Flushes the last tokens. Once it returns true the encoder can be reused
+// for a new stream.
+bool stream_encoder_end(StreamEncoder* s, StreamOutput* out) {
+    if (!stream_encoder_flush(s, out)) return false;
+    stream_encoder_init(s);
+    return true;
+}
+
+void stream_decoder_init(StreamDecoder* d) {
+    d->partial_len = 0;
+    d->history_len = 0;
+    d->delivered = 0;
+    d->started = false;
+}
+
+// Copies decoded bytes the caller hasn't received yet. Returns true once
+// none are left.
+static bool stream_deliver(StreamDecoder* d, StreamOutput* out) {
+    size_t left = d->history_len - d->delivered;
+    size_t room = out->size - out->pos;
+    size_t take = left < room ? left : room;
+    
+    memcpy(out->data + out->pos, d->history + d->delivered, take);
+    out->pos += take;
+    d->delivered += take;
+    return d->delivered == d->history_len;
+}
+
+// Every token is decoded into the history first, then delivered. A
+// back-reference outside the history stops the decoder with the token
+// unconsumed, so stream_decoder_end reports false. The decoder reads format
+// v1 only: v2 tokens have no length cap to bound the history by, so a v2
+// header (a zero-length literal, which no v1 encoder emits, then the
+// version) stops it the same way.
+bool stream_decoder_update(StreamDecoder* d, StreamInput* in, StreamOutput* out) {
+    while (true) {
+        if (!stream_deliver(d, out)) return false;
+        
+        const uint8_t* token;
+        size_t token_size = 0;
+        size_t output_size = 0;
+        
+        if (d->partial_len > 0) {
+            // Top up the token carried over from the previous chunk
+            while (true) {
+                bool known = advanced_token_info(d->partial, d->partial_len, &token_size, &output_size);
+                if (known && d->partial_len >= token_size) break;
+                if (in->pos == in->size) return true;
+                
+                size_t need = known ? token_size - d->partial_len : 1;
+                size_t take = in->size - in->pos < need ? in->size - in->pos : need;
+                memcpy(d->partial + d->partial_len, in->data + in->pos, take);
+                d->partial_len += take;
+                in->pos += take;
+            }
+            token = d->partial;
+        } else {
+            size_t available = in->size - in->pos;
+            if (available == 0) return true;
+            
+            if (!advanced_token_info(in->data + in->pos, available, &token_size, &output_size) ||
+                token_size > available) {
+                memcpy(d->partial, in->data + in->pos, available);
+                d->partial_len = available;
+                in->pos = in->size;
+                return true;
+            }
+            token = in->data + in->pos;
+        }
+        
+        if (!d->started && token[0] == MODE_LITERAL && output_size == 0) {
+            // The byte after the first token tells a v2 header apart. A v2
+            // header stays parked whole, so every later call stops here too
+            if (token != d->partial) {
+                memcpy(d->partial, token, token_size);
+                d->partial_len = token_size;
+                in->pos += token_size;
+            }
+            if (d->partial_len == token_size) {
+                if (in->pos == in->size) return true;
+                if (in->data[in->pos] == ADVANCED_FORMAT_V2) d->partial[d->partial_len++] = in->data[in->pos++];
+            }
+            if (d->partial_len > token_size) return true;
+            token = d->partial;
+        }
+        d->started = true;
+        
+        // Slide the history once a full token might not fit
+        if (d->history_len + ADVANCED_MAX_TOKEN_OUTPUT > STREAM_HISTORY_SIZE) {
+            memmove(d->history, d->history + d->history_len - MATCH_WINDOW_SIZE, MATCH_WINDOW_SIZE);
+            d->history_len = MATCH_WINDOW_SIZE;
+            d->delivered = MATCH_WINDOW_SIZE;
+        }
+        
+        if (!advanced_decode_token(token, d->history, d->history_len)) {
+            // A token that fails to decode stays parked, so the decoder stops here
+            if (token != d->partial) {
+                memcpy(d->partial, token, token_size);
+                d->partial_len = token_size;
+                in->pos += token_size;
+            }
+            return true;
+        }
+        d->history_len += output_size;
+        
+        if (token == d->partial) d->partial_len = 0;
+        else in->pos += token_size;
+    }
+}
+
+// Returns true if the stream ended on a token boundary with nothing left
+// to deliver
+bool stream_decoder_end(StreamDecoder* d) {
+    return d->partial_len == 0 && d->delivered == d->history_len;
+}
+
+// SCATTER-GATHER
+// Compression and decompression over iovec lists, for payloads that arrive as
+// chains of buffers. Both run the streaming codec over the segments in order,
+// so runs, deltas and matches straddle segment boundaries exactly as they
+// would in one buffer: the output is byte-identical to byte_compress_to over
+// the concatenated input, and fills the out segments in order, splitting
+// tokens wherever a segment ends. The stream_ forms take caller-owned state,
+// so a hot path reuses one encoder or decoder and allocates nothing; the
+// byte_ forms allocate it per call. One input and one output segment go
+// straight to the one-shot codec, which reads both formats. Split streams
+// must be v1, which is what both compressors write: the streaming decoder
+// stops on a v2 header, so a v2 stream split on either side returns 0.
+//
+// All return the bytes written across the out segments, or 0 if the input is
+// empty, corrupt or a split v2 stream, or the output doesn't fit.
+
+// Opens the next non-empty out segment. Returns false when none are left.
+static bool iov_next_output(const struct iovec* out, size_t out_count, size_t* next, StreamOutput* sink) {
+    while (*next < out_count && out[*next].iov_len == 0) (*next)++;
+    if (*next == out_count) return false;
+    
+    sink->data = (uint8_t*)out[*next].iov_base;
+    sink->size = out[*next].iov_len;
+    sink->pos = 0;
+    (*next)++;
+    return true;
+}
+
+size_t stream_compress_iov(StreamEncoder* s, const struct iovec* in, size_t in_count,
+                           const struct iovec* out, size_t out_count) {
+    if (in_count == 1 && out_count == 1) {
+        return advanced_compress_to((const uint8_t*)in[0].iov_base, in[0].iov_len,
+                                    (uint8_t*)out[0].iov_base, out[0].iov_len);
+    }
+    
+    size_t in_size = 0;
+    for (size_t i = 0; i < in_count; i++) in_size += in[i].iov_len;
+    size_t next = 0;
+    StreamOutput sink;
+    if (in_size == 0 || !iov_next_output(out, out_count, &next, &sink)) return 0;
+    
+    stream_encoder_init(s);
+    size_t written = 0;
+    for (size_t i = 0; i < in_count; i++) {
+        StreamInput source = {(const uint8_t*)in[i].iov_base, in[i].iov_len, 0};
+        
+        // A false return means this out segment is full
+        while (!stream_encoder_update(s, &source, &sink)) {
+            written += sink.pos;
+            if (!iov_next_output(out, out_count, &next, &sink)) return 0;
+        }
+    }
+    while (!stream_encoder_end(s, &sink)) {
+        written += sink.pos;
+        if (!iov_next_output(out, out_count, &next, &sink)) return 0;
+    }
+    return written + sink.pos;
+}
+
+size_t stream_decompress_iov(StreamDecoder* d, const struct iovec* in, size_t in_count,
+                             const struct iovec* out, size_t out_count) {
+    if (in_count == 1 && out_count == 1) {
+        return advanced_decompress_to((const uint8_t*)in[0].iov_base, in[0].iov_len,
+                                      (uint8_t*)out[0].iov_base, out[0].iov_len);
+    }
+    
+    size_t next = 0;
+    StreamOutput sink;
+    if (!iov_next_output(out, out_count, &next, &sink)) return 0;
+    
+    stream_decoder_init(d);
+    size_t written = 0;
+    for (size_t i = 0; i < in_count; i++) {
+        StreamInput source = {(const uint8_t*)in[i].iov_base, in[i].iov_len, 0};
+        while (!stream_decoder_update(d, &source, &sink)) {
+            written += sink.pos;
+            if (!iov_next_output(out, out_count, &next, &sink)) return 0;
+        }
+    }
+    return stream_decoder_end(d) ? written + sink.pos : 0;
+}
+
+size_t byte_compress_iov(const struct iovec* in, size_t in_count, const struct iovec* out, size_t out_count) {
+    if (in_count == 1 && out_count == 1) return stream_compress_iov(NULL, in, in_count, out, out_count);
+    
+    StreamEncoder* s = (StreamEncoder*)codec_alloc(sizeof(StreamEncoder));
+    if (!s) return 0;
+    size_t result = stream_compress_iov(s, in, in_count, out, out_count);
+    codec_free(s);
+    return result;
+}
+
+size_t byte_decompress_iov(const struct iovec* in, size_t in_count, const struct iovec* out, size_t out_count) {
+    if (in_count == 1 && out_count == 1) return stream_decompress_iov(NULL, in, in_count, out, out_count);
+    
+    StreamDecoder* d = (StreamDecoder*)codec_alloc(sizeof(StreamDecoder));
+    if (!d) return 0;
+    size_t result = stream_decompress_iov(d, in, in_count, out, out_count);
+    codec_free(d);
+    return result;
+}
+
+// DICTIONARY
+// Small frames have too little history of their own for back-references, but
+// a device's frames mostly repeat each other: the same headers, the same field
+// layouts. A dictionary is content trained from sample frames that both sides
+// treat as if it came just before every frame, so matches can reach back into
+// it. The output is an ordinary advanced stream whose offsets may point past
+// the frame start into the dictionary; it decodes only with the same one.
+//
+// common_values[] stays fixed: an EXT_COMMON_VAL token costs two bytes, the
+// same as an RLE token of that value, so trained values would save nothing.
+// Frequent values end up in the dictionary content instead, inside the
+// segments that carry them.
+
+#define DICT_MAX_SIZE      16384   // leaves half the match window to the frame
+#define DICT_SEGMENT_SIZE  64
+#define DICT_HASH_BITS     16
+#define DICT_REGISTRY_SIZE 16
+#define DICT_NO_STRING     UINT32_MAX
+
+typedef struct {
+    uint32_t id;            // checksum32 of the content, never 0
+    size_t size;
+    uint8_t content[DICT_MAX_SIZE];
+    MatchFinder finder;     // content already inserted; copied for each frame
+} Dictionary;
+
+// Loads dictionary content, such as the output of a dictionary_train run
+// saved with the firmware. Returns false if size is 0 or over DICT_MAX_SIZE.
+bool dictionary_load(Dictionary* dict, const uint8_t* content, size_t size) {
+    if (!dict || !content || size == 0 || size > DICT_MAX_SIZE) return false;
+    
+    memmove(dict->content, content, size);
+    dict->size = size;
+    dict->id = checksum32(content, size);
+    if (dict->id == 0) dict->id = 1;
+    
+    // A position needs 4 bytes to hash; the last three are inserted by the
+    // first search into each frame, once the frame's bytes follow them
+    match_finder_init(&dict->finder);
+    if (size > 3) match_finder_insert(&dict->finder, dict->content, size - 3);
+    return true;
+}
+
+static inline uint32_t dict_hash(const uint8_t* p) {
+    uint64_t v = 0;
+    memcpy(&v, p, MATCH_MIN_LENGTH);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - DICT_HASH_BITS));
+}
+
+// Other samples a string occurs in: one seen in a single sample scores 0
+static inline uint32_t dict_score(uint32_t string, const uint32_t* counts) {
+    return string == DICT_NO_STRING || counts[string] < 2 ? 0 : counts[string] - 1;
+}
+
+// Builds a dictionary of up to dict_size bytes from sample_count samples laid
+// end to end in samples. Every MATCH_MIN_LENGTH-byte string is counted once
+// per sample it occurs in; the samples are cut into one epoch per
+// DICT_SEGMENT_SIZE bytes of dictionary, and each epoch gives up the segment
+// whose strings occur in the most other samples. Strings already taken score
+// nothing afterwards, so segments don't repeat each other. Returns the
+// dictionary size, or 0 if nothing recurs or allocation fails.
+size_t dictionary_train(const uint8_t* samples, const size_t* sample_sizes, size_t sample_count,
+                        size_t dict_size, Dictionary* dict) {
+    if (!samples || !sample_sizes || !dict) return 0;
+    if (dict_size > DICT_MAX_SIZE) dict_size = DICT_MAX_SIZE;
+    
+    size_t total = 0;
+    for (size_t s = 0; s < sample_count; s++) total += sample_sizes[s];
+    if (total < DICT_SEGMENT_SIZE || dict_size < DICT_SEGMENT_SIZE) return 0;
+    
+    // strings[p] is the hash of the string at p, or DICT_NO_STRING where that
+    // string runs off the end of its sample or repeats one earlier in it
+    uint32_t* counts = (uint32_t*)codec_calloc((size_t)1 << DICT_HASH_BITS, sizeof(uint32_t));
+    uint32_t* last_sample = (uint32_t*)codec_calloc((size_t)1 << DICT_HASH_BITS, sizeof(uint32_t));
+    uint32_t* strings = (uint32_t*)codec_alloc(total * sizeof(uint32_t));
+    size_t size = 0;
+    
+    if (counts && last_sample && strings) {
+        size_t offset = 0;
+        for (size_t s = 0; s < sample_count; s++) {
+            for (size_t p = 0; p < sample_sizes[s]; p++) {
+                uint32_t h = DICT_NO_STRING;
+                if (p + MATCH_MIN_LENGTH <= sample_sizes[s]) {
+                    h = dict_hash(samples + offset + p);
+                    if (last_sample[h] == s + 1) {
+                        h = DICT_NO_STRING;
+                    } else {
+                        last_sample[h] = (uint32_t)(s + 1);
+                        counts[h]++;
+                    }
+                }
+                strings[offset + p] = h;
+            }
+            offset += sample_sizes[s];
+        }
+        
+        size_t epoch = total / (dict_size / DICT_SEGMENT_SIZE);
+        if (epoch < DICT_SEGMENT_SIZE) epoch = DICT_SEGMENT_SIZE;
+        
+        for (size_t start = 0; start + DICT_SEGMENT_SIZE <= total && size + DICT_SEGMENT_SIZE <= dict_size;
+             start += epoch) {
+            size_t last_start = start + epoch < total ? start + epoch - DICT_SEGMENT_SIZE
+                                                      : total - DICT_SEGMENT_SIZE;
+            
+            // Sliding sum over the strings starting inside each window
+            uint64_t score = 0;
+            for (size_t p = start; p < start + DICT_SEGMENT_SIZE; p++) score += dict_score(strings[p], counts);
+            uint64_t best_score = score;
+            size_t best = start;
+            for (size_t w = start + 1; w <= last_start; w++) {
+                score += dict_score(strings[w + DICT_SEGMENT_SIZE - 1], counts);
+                score -= dict_score(strings[w - 1], counts);
+                if (score > best_score) {
+                    best_score = score;
+                    best = w;
+                }
+            }
+            if (best_score == 0) continue;
+            
+            memcpy(dict->content + size, samples + best, DICT_SEGMENT_SIZE);
+            size += DICT_SEGMENT_SIZE;
+            for (size_t p = best; p < best + DICT_SEGMENT_SIZE; p++) {
+                if (strings[p] != DICT_NO_STRING) counts[strings[p]] = 0;
+            }
+        }
+    }
+    
+    codec_free(counts);
+    codec_free(last_sample);
+    codec_free(strings);
+    return size > 0 && dictionary_load(dict, dict->content, size) ? size : 0;
+}
+
+// Compresses src as if dict's content came just before it. Same bound as
+// advanced_compress_to; returns 0 if dict is NULL or the output doesn't fit.
+size_t dictionary_compress_to(const Dictionary* dict, const uint8_t* src, size_t src_len,
+                              uint8_t* dst, size_t dst_cap) {
+    if (!dict || !src || !dst || src_len == 0) return 0;
+    
+    uint8_t* joined = (uint8_t*)codec_alloc(dict->size + src_len);
+    if (!joined) return 0;
+    memcpy(joined, dict->content, dict->size);
+    memcpy(joined + dict->size, src, src_len);
+    
+    // Only the heads and the chains of content positions are live
+    MatchFinder mf;
+    memcpy(mf.head, dict->finder.head, sizeof(mf.head));
+    memcpy(mf.prev, dict->finder.prev, dict->size * sizeof(mf.prev[0]));
+    mf.base = 0;
+    mf.next_insert = dict->finder.next_insert;
+    
+    size_t result = advanced_encode_range(joined, dict->size, dict->size + src_len,
+                                          dst, dst_cap, &mf, PROBE_ALL);
+    codec_free(joined);
+    return result;
+}
+
+// Decodes a dictionary_compress_to stream with the same dictionary. Returns 0
+// for a corrupt stream, a reference past the start of the dictionary or too
+// small an output.
+size_t dictionary_decompress_to(const Dictionary* dict, const uint8_t* src, size_t src_len,
+                                uint8_t* dst, size_t dst_cap) {
+    if (!dict || !src || !dst || src_len == 0) return 0;
+    
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    
+    while (in_pos < src_len) {
+        const uint8_t* token = &src[in_pos];
+        size_t token_size, output_size;
+        if (!advanced_token_info(token, src_len - in_pos, &token_size, &output_size) ||
+            token_size > src_len - in_pos || output_size > dst_cap - out_pos) return 0;
+        
+        size_t offset = token[0] == EXT_MATCH ? token[2] | ((size_t)token[3] << 8) : 0;
+        if (offset > out_pos) {
+            // Starts in the dictionary and may run on into the frame
+            if (offset >= MATCH_WINDOW_SIZE || offset - out_pos > dict->size) return 0;
+            size_t from_dict = offset - out_pos < output_size ? offset - out_pos : output_size;
+            memcpy(&dst[out_pos], dict->content + dict->size - (offset - out_pos), from_dict);
+            match_copy(dst, out_pos + from_dict, offset, output_size - from_dict);
+        } else if (!advanced_decode_token(token, dst, out_pos)) {
+            return 0;
+        }
+        
+        in_pos += token_size;
+        out_pos += output_size;
+    }
+    
+    return out_pos;
+}
+
+// Registered dictionaries, looked up by id. Registration isn't thread-safe:
+// register before compressing from several threads, and keep each dictionary
+// alive while it is registered.
+static const Dictionary* dictionary_registry[DICT_REGISTRY_SIZE];
+
+// Returns false if the registry is full; registering an id again replaces it
+bool dictionary_register(const Dictionary* dict) {
+    if (!dict || dict->size == 0) return false;
+    
+    int free_slot = -1;
+    for (int i = 0; i < DICT_REGISTRY_SIZE; i++) {
+        if (dictionary_registry[i] && dictionary_registry[i]->id == dict->id) {
+            dictionary_registry[i] = dict;
+            return true;
+        }
+        if (!dictionary_registry[i] && free_slot < 0) free_slot = i;
+    }
+    if (free_slot < 0) return false;
+    dictionary_registry[free_slot] = dict;
+    return true;
+}
+
+void dictionary_unregister(uint32_t dict_id) {
+    for (int i = 0; i < DICT_REGISTRY_SIZE; i++) {
+        if (dictionary_registry[i] && dictionary_registry[i]->id == dict_id) dictionary_registry[i] = NULL;
+    }
+}
+
+const Dictionary* dictionary_find(uint32_t dict_id) {
+    for (int i = 0; i < DICT_REGISTRY_SIZE; i++) {
+        if (dictionary_registry[i] && dictionary_registry[i]->id == dict_id) return dictionary_registry[i];
+    }
+    return NULL;
+}
+
+// Id-based entry points; an unregistered id returns 0
+size_t byte_compress_dict_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                             uint32_t dict_id) {
+    return dictionary_compress_to(dictionary_find(dict_id), src, src_len, dst, dst_cap);
+}
+
+size_t byte_decompress_dict_to(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                               uint32_t dict_id) {
+    return dictionary_decompress_to(dictionary_find(dict_id), src, src_len, dst, dst_cap);
+}
+
+// FILE COMPRESSION
+// Whole files in the framed format, for the command line. Compression is
+// pipelined over a ring of FILE_PIPELINE_DEPTH window slots: each slot maps
+// its window ahead of time with MADV_WILLNEED so the kernel reads it in while
+// earlier windows compress, the calling thread compresses the windows in
+// order with the block engine (on opts->threads threads), and a writer thread
+// writes each finished window behind it. A slot's output buffer is reused
+// once written, so nothing is allocated per window and at most DEPTH windows
+// are mapped at once. Index entries are collected as the windows are
+// compressed and appended at the end, so the file is byte-identical to
+// frame_compress over the whole input. Decompression maps the frame one
+// window at a time.
+
+#define FILE_WINDOW_SIZE    (16 * 1024 * 1024)
+#define FILE_WINDOW_BLOCKS  1024
+#define FILE_PIPELINE_DEPTH 3
+
+typedef struct {
+    void* base;
+    size_t length;
+} FileMapping;
+
+typedef struct {
+    FrameBlock block;
+    size_t offset;          // where the block lands in the window's output
+} FileBlock;
+
+typedef struct {
+    const FrameHeader* header;
+    const FileBlock* blocks;
+    size_t block_count;
+    uint8_t* dst;
+    size_t next_block;
+    bool failed;
+    pthread_mutex_t lock;
+} FileDecodeJob;
+
+typedef struct {
+    FileMapping map;
+    const uint8_t* input;   // window mapped ahead, NULL once compressed
+    size_t length;
+    uint8_t* output;
+    size_t written;
+    bool pending;           // output waiting for the writer
+} FileSlot;
+
+typedef struct {
+    FileSlot slots[FILE_PIPELINE_DEPTH];
+    size_t slot_count;
+    size_t window;          // input bytes per window
+    size_t window_count;
+    int in_fd;
+    int out_fd;
+    uint64_t in_size;
+    bool failed;
+    int error;              // errno of the step that failed, if any
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FilePipeline;
+
+// FILE_WINDOW_SIZE worth of blocks, but never more than FILE_WINDOW_BLOCKS
+static size_t file_window_blocks(size_t block_size) {
+    size_t blocks = FILE_WINDOW_SIZE / block_size;
+    if (blocks > FILE_WINDOW_BLOCKS) blocks = FILE_WINDOW_BLOCKS;
+    return blocks > 0 ? blocks : 1;
+}
+
+// Maps length bytes of fd from offset read-only. mmap wants a page-aligned
+// offset, so the mapping starts at the page boundary below it.
+static const uint8_t* file_map(int fd, uint64_t offset, size_t length, FileMapping* map) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    size_t lead = (size_t)(offset % page);
+    map->length = lead + length;
+    map->base = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, (off_t)(offset - lead));
+    if (map->base == MAP_FAILED) return NULL;
+    madvise(map->base, map->length, MADV_SEQUENTIAL);
+    return (const uint8_t*)map->base + lead;
+}
+
+static void file_unmap(FileMapping* map) {
+    munmap(map->base, map->length);
+}
+
+static bool file_write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// Opens a regular input file and truncates or creates the output
+static bool file_open(const char* in_path, const char* out_path, int* in_fd, int* out_fd,
+                      uint64_t* in_size) {
+    struct stat st;
+    *in_fd = open(in_path, O_RDONLY);
+    if (*in_fd < 0) return false;
+    if (fstat(*in_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(*in_fd);
+        return false;
+    }
+    
+    *out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (*out_fd < 0) {
+        close(*in_fd);
+        return false;
+    }
+    *in_size = (uint64_t)st.st_size;
+    return true;
+}
+
+// Closes both files; a failed run removes its partial output
+static bool file_close(int in_fd, int out_fd, const char* out_path, bool ok) {
+    close(in_fd);
+    if (close(out_fd) != 0) ok = false;
+    if (!ok) unlink(out_path);
+    return ok;
+}
+
+// Maps window k into its slot and asks for it to be read in the background
+static bool file_pipeline_map(FilePipeline* p, size_t k) {
+    FileSlot* slot = &p->slots[k % p->slot_count];
+    uint64_t offset = (uint64_t)k * p->window;
+    slot->length = p->in_size - offset < p->window ? (size_t)(p->in_size - offset) : p->window;
+    slot->input = file_map(p->in_fd, offset, slot->length, &slot->map);
+    if (slot->input) madvise(slot->map.base, slot->map.length, MADV_WILLNEED);
+    return slot->input != NULL;
+}
+
+// Waits until slot's pending flag reads pending. Returns false once either
+// side has failed.
+static bool file_pipeline_wait(FilePipeline* p, FileSlot* slot, bool pending) {
+    pthread_mutex_lock(&p->lock);
+    while (slot->pending != pending && !p->failed) pthread_cond_wait(&p->changed, &p->lock);
+    bool failed = p->failed;
+    pthread_mutex_unlock(&p->lock);
+    return !failed;
+}
+
+// Sets slot's pending flag, or with no slot just records a failure
+static void file_pipeline_post(FilePipeline* p, FileSlot* slot, bool pending, bool ok) {
+    int error = errno;
+    pthread_mutex_lock(&p->lock);
+    if (slot) slot->pending = pending;
+    if (!ok && !p->failed) {
+        p->failed = true;
+        p->error = error;
+    }
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void* file_pipeline_writer(void* arg) {
+    FilePipeline* p = (FilePipeline*)arg;
+    for (size_t k = 0; k < p->window_count; k++) {
+        FileSlot* slot = &p->slots[k % p->slot_count];
+        if (!file_pipeline_wait(p, slot, true)) break;
+        file_pipeline_post(p, slot, false, file_write_all(p->out_fd, slot->output, slot->written));
+    }
+    return NULL;
+}
+
+// Compresses the file at in_path into a frame at out_path (NULL opts means
+// defaults). *out_size, if given, receives the frame size. Returns false on
+// any read, write or compression failure.
+bool file_compress(const char* in_path, const char* out_path, const FrameOptions* opts,
+                   uint64_t* out_size) {
+    FrameOptions defaults;
+    if (!opts) {
+        frame_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (opts->block_size == 0 || opts->block_size > UINT32_MAX) return false;
+    
+    FilePipeline p;
+    if (!file_open(in_path, out_path, &p.in_fd, &p.out_fd, &p.in_size)) return false;
+    
+    // A file smaller than a window gets a slot its own size
+    p.window = file_window_blocks(opts->block_size) * opts->block_size;
+    p.window_count = (size_t)((p.in_size + p.window - 1) / p.window);
+    p.slot_count = p.window_count < FILE_PIPELINE_DEPTH ? p.window_count : FILE_PIPELINE_DEPTH;
+    p.failed = false;
+    p.error = 0;
+    size_t slot_cap = frame_compress_bound(p.in_size < p.window ? (size_t)p.in_size : p.window, opts);
+    uint64_t block_count = (p.in_size + opts->block_size - 1) / opts->block_size;
+    
+    bool ok = true;
+    for (size_t i = 0; i < p.slot_count; i++) {
+        p.slots[i].input = NULL;
+        p.slots[i].pending = false;
+        p.slots[i].output = (uint8_t*)codec_alloc(slot_cap);
+        ok = ok && p.slots[i].output;
+    }
+    for (size_t k = 0; ok && k < p.slot_count; k++) ok = file_pipeline_map(&p, k);
+    uint8_t* index = NULL;
+    if (ok && opts->index) {
+        ok = block_count <= UINT32_MAX;
+        if (ok) index = (uint8_t*)codec_alloc((size_t)block_count * FRAME_INDEX_ENTRY_SIZE +
+                                              FRAME_INDEX_FOOTER_SIZE);
+        ok = index != NULL;
+    }
+    
+    uint8_t frame_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    ok = ok && frame_write_header(frame_header, sizeof(frame_header), opts, p.in_size) &&
+         frame_read_header(frame_header, sizeof(frame_header), &header) &&
+         file_write_all(p.out_fd, frame_header, sizeof(frame_header));
+    uint64_t frame_pos = FRAME_HEADER_SIZE;
+    size_t entries = 0;
+    
+    pthread_t writer;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+    bool writer_started = ok && pthread_create(&writer, NULL, file_pipeline_writer, &p) == 0;
+    ok = ok && writer_started;
+    
+    for (size_t k = 0; ok && k < p.window_count; k++) {
+        FileSlot* slot = &p.slots[k % p.slot_count];
+        if (!file_pipeline_wait(&p, slot, false)) break;
+        slot->written = frame_compress_blocks(slot->input, slot->length, slot->output, slot_cap, opts);
+        file_unmap(&slot->map);
+        slot->input = NULL;
+        bool compressed = slot->written > 0;
+        
+        // Index entries come from the block headers just written
+        uint64_t original_offset = (uint64_t)k * p.window;
+        for (size_t pos = 0; compressed && index && pos < slot->written; entries++) {
+            size_t block_pos = pos;
+            FrameBlock block;
+            compressed = frame_read_block(slot->output, slot->written, pos, &header, &block, &pos);
+            if (!compressed) break;
+            write_le64(index + entries * FRAME_INDEX_ENTRY_SIZE, frame_pos + block_pos);
+            write_le64(index + entries * FRAME_INDEX_ENTRY_SIZE + 8, original_offset);
+            original_offset += block.original_size;
+        }
+        frame_pos += slot->written;
+        
+        // The slot's next window starts reading while this one is written
+        errno = 0;
+        if (compressed && k + p.slot_count < p.window_count) compressed = file_pipeline_map(&p, k + p.slot_count);
+        file_pipeline_post(&p, slot, true, compressed);
+    }
+    
+    if (writer_started) pthread_join(writer, NULL);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+    ok = ok && !p.failed;
+    
+    uint8_t end[FRAME_END_MARK_SIZE];
+    ok = ok && frame_write_end(end, sizeof(end)) && file_write_all(p.out_fd, end, sizeof(end));
+    frame_pos += FRAME_END_MARK_SIZE;
+    if (ok && index) {
+        size_t index_size = entries * FRAME_INDEX_ENTRY_SIZE + FRAME_INDEX_FOOTER_SIZE;
+        frame_write_index_footer(index + entries * FRAME_INDEX_ENTRY_SIZE, (uint32_t)entries);
+        ok = file_write_all(p.out_fd, index, index_size);
+        frame_pos += index_size;
+    }
+    
+    for (size_t i = 0; i < p.slot_count; i++) {
+        if (p.slots[i].input) file_unmap(&p.slots[i].map);
+        codec_free(p.slots[i].output);
+    }
+    codec_free(index);
+    if (ok && out_size) *out_size = frame_pos;
+    if (p.failed) errno = p.error;
+    return file_close(p.in_fd, p.out_fd, out_path, ok);
+}
+
+static void* file_decode_worker(void* arg) {
+    FileDecodeJob* job = (FileDecodeJob*)arg;
+    
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next_block++;
+        bool stop = job->failed || i >= job->block_count;
+        pthread_mutex_unlock(&job->lock);
+        if (stop) break;
+        
+        const FileBlock* b = &job->blocks[i];
+        if (frame_decode_block(job->header, &b->block, job->dst + b->offset,
+                               b->block.original_size) == 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = true;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Decodes the frame at in_path into out_path on threads workers (0 = one per
+// CPU). The frame is mapped a window of blocks at a time, the same way
+// file_compress reads its input, and the block headers are walked, so the
+// index isn't needed. *out_size, if given, receives the decoded size. Returns
+// false if the frame is truncated, corrupt or fails a checksum.
+bool file_decompress(const char* in_path, const char* out_path, size_t threads, uint64_t* out_size) {
+    int in_fd, out_fd;
+    uint64_t in_size;
+    if (!file_open(in_path, out_path, &in_fd, &out_fd, &in_size)) return false;
+    if (threads == 0) threads = frame_default_threads();
+    
+    FrameHeader header;
+    FileMapping map;
+    const uint8_t* src = in_size >= FRAME_HEADER_SIZE ? file_map(in_fd, 0, FRAME_HEADER_SIZE, &map) : NULL;
+    bool ok = src && frame_read_header(src, FRAME_HEADER_SIZE, &header);
+    if (src) file_unmap(&map);
+    if (!ok) return file_close(in_fd, out_fd, out_path, false);
+    
+    // A window of input holds at most window_blocks blocks that are no larger
+    // than the data they encode, plus the end mark
+    size_t window_blocks = file_window_blocks(header.block_size);
+    size_t span = window_blocks * (FRAME_BLOCK_HEADER_SIZE + FRAME_CHECKSUM_SIZE + header.block_size) +
+                  FRAME_END_MARK_SIZE;
+    uint8_t* buffer = (uint8_t*)codec_alloc(window_blocks * header.block_size);
+    FileBlock* blocks = (FileBlock*)codec_alloc(window_blocks * sizeof(FileBlock));
+    ok = buffer && blocks;
+    
+    uint64_t pos = FRAME_HEADER_SIZE;
+    uint64_t decoded = 0;
+    bool done = false;
+    
+    while (ok && !done) {
+        size_t length = in_size - pos < span ? (size_t)(in_size - pos) : span;
+        src = pos < in_size ? file_map(in_fd, pos, length, &map) : NULL;
+        if (!src) {
+            ok = false;
+            break;
+        }
+        
+        size_t local = 0;
+        size_t count = 0;
+        size_t produced = 0;
+        while (count < window_blocks) {
+            FrameBlock* block = &blocks[count].block;
+            if (!frame_read_block(src, length, local, &header, block, &local)) break;
+            if (block->original_size == 0) {
+                done = true;
+                break;
+            }
+            blocks[count++].offset = produced;
+            produced += block->original_size;
+        }
+        
+        FileDecodeJob job;
+        job.header = &header;
+        job.blocks = blocks;
+        job.block_count = count;
+        job.dst = buffer;
+        job.next_block = 0;
+        job.failed = false;
+        pthread_mutex_init(&job.lock, NULL);
+        run_workers(file_decode_worker, &job, threads < count ? threads : count);
+        pthread_mutex_destroy(&job.lock);
+        file_unmap(&map);
+        
+        // Nothing parsed before the end mark means the next block is cut off
+        ok = (count > 0 || done) && !job.failed && file_write_all(out_fd, buffer, produced);
+        pos += local;
+        decoded += produced;
+    }
+    
+    ok = ok && decoded == header.content_size;
+    codec_free(buffer);
+    codec_free(blocks);
+    if (ok && out_size) *out_size = decoded;
+    return file_close(in_fd, out_fd, out_path, ok);
+}
+
+// COMPREHENSIVE TESTING SUITE
+
+typedef struct {
+    const char* name;
+    size_t (*compress)(uint8_t*, size_t);
+    size_t (*decompress)(uint8_t*, size_t);
+} Algorithm;
+
+typedef struct {
+    const char* name;
+    uint8_t* data;
+    size_t size;
+    const char* description;
+} TestCase;
+
+typedef struct {
+    double compression_ratio;
+    double compression_time_ms;
+    double decompression_time_ms;
+    bool verified;
+    size_t compressed_size;
+    size_t original_size;
+} TestResult;
+
+// Performance timer: wall clock from the monotonic clock, which has
+// nanosecond resolution and never jumps. clock() counted CPU time in coarse
+// ticks and added up across threads.
+double get_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Generate test data patterns
+uint8_t* generate_pattern(const char* type, size_t size) {
+    uint8_t* data = (uint8_t*)malloc(size);
+    if (!data) return NULL;
+    
+    if (strcmp(type, "zeros") == 0) {
+        memset(data, 0x00, size);
+    }
+    else if (strcmp(type, "random") == 0) {
+        for (size_t i = 0; i < size; i++) {
+            data[i] = rand() & 0x7F;
+        }
+    }
+    else if (strcmp(type, "runs") == 0) {
+        size_t pos = 0;
+        while (pos < size) {
+            uint8_t value = rand() & 0x7F;
+            size_t run_len = (rand() % 10) + 1;
+            for (size_t i = 0; i < run_len && pos < size; i++, pos++) {
+                data[pos] = value;
+            }
+        }
+    }
+    else if (strcmp(type, "sequence") == 0) {
+        for (size_t i = 0; i < size; i++) {
+            data[i] = (i % 128);
+        }
+    }
+    else if (strcmp(type, "pattern") == 0) {
+        uint8_t pattern[] = {0x12, 0x34, 0x56, 0x78};
+        for (size_t i = 0; i < size; i++) {
+            data[i] = pattern[i % 4];
+        }
+    }
+    else if (strcmp(type, "mixed") == 0) {
+        size_t pos = 0;
+        while (pos < size) {
+            int choice = rand() % 4;
+            size_t chunk_size = (rand() % 20) + 5;
+            
+            for (size_t i = 0; i < chunk_size && pos < size; i++, pos++) {
+                if (choice == 0) data[pos] = 0x00;
+                else if (choice == 1) data[pos] = pos & 0x7F;
+                else if (choice == 2) data[pos] = (pos / 3) & 0x7F;
+                else data[pos] = rand() & 0x7F;
+            }
+        }
+    }
+    else if (strcmp(type, "bursts") == 0) {
+        // Short noisy bursts in front of long runs: the shape that stresses
+        // the literal scan
+        size_t pos = 0;
+        while (pos < size) {
+            size_t burst = (rand() % 3) + 1;
+            for (size_t i = 0; i < burst && pos < size; i++, pos++) {
+                data[pos] = (uint8_t)(rand() | 0x80);
+            }
+            
+            uint8_t value = (uint8_t)(rand() | 0x80);
+            size_t run_len = (rand() % 4000) + 100;
+            for (size_t i = 0; i < run_len && pos < size; i++, pos++) {
+                data[pos] = value;
+            }
+        }
+    }
+    else if (strcmp(type, "nibbles") == 0) {
+        for (size_t i = 0; i < size; i++) {
+            data[i] = rand() & 0x0F;
+        }
+    }
+    else if (strcmp(type, "sensor16") == 0 || strcmp(type, "sensor32") == 0) {
+        // Little-endian samples of a slow random walk, as an ADC or a
+        // counter logs them: small steps around a large offset
+        bool wide = type[6] == '3';
+        uint32_t value = wide ? 0x00123456 : 0x4000;
+        size_t width = wide ? 4 : 2;
+        for (size_t i = 0; i < size; i++) {
+            if (i % width == 0) value += (uint32_t)(rand() % 33) - 16;
+            data[i] = (uint8_t)(value >> (8 * (i % width)));
+        }
+    }
+    else if (strcmp(type, "skewed") == 0) {
+        // 7-bit readings with most of the weight on small values, like
+        // telemetry counters: no runs or sequences, but far from uniform
+        for (size_t i = 0; i < size; i++) {
+            data[i] = (uint8_t)(((rand() % 16) * (rand() % 8)) & 0x7F);
+        }
+    }
+    
+    return data;
+}
+
+// One small device frame: a fixed header naming the device, a message type
+// and sequence byte, then key=value fields whose keys depend on the type and
+// whose values change from frame to frame
+void generate_device_frame(uint8_t* frame, size_t size) {
+    static const uint8_t header[] = {0xA5, 0x5A, 0x02, 0x00, 'G', 'R', 'M', '-', '0', '0', '4', '2'};
+    static const char* keys[] = {"lat=", "lon=", "alt=", "hr=", "spd=", "bat=", "tmp=", "cad="};
+    uint8_t record[sizeof(header) + 256];
+    size_t pos = sizeof(header);
+    unsigned type = (unsigned)(rand() % 4);
+    
+    memcpy(record, header, sizeof(header));
+    record[pos++] = (uint8_t)(0x10 + type);
+    record[pos++] = (uint8_t)rand();
+    for (unsigned field = 0; pos < size; field++) {
+        const char* key = keys[(type * 3 + field) % 8];
+        size_t key_length = strlen(key);
+        memcpy(&record[pos], key, key_length);
+        pos += key_length;
+        for (int digit = 0; digit < 3; digit++) record[pos++] = (uint8_t)('0' + rand() % 10);
+        record[pos++] = ';';
+    }
+    memcpy(frame, record, size);
+}
+
+// Run single test
+TestResult run_single_test(Algorithm* algo, uint8_t* original_data, size_t size) {
+    TestResult result = {0};
+    result.original_size = size;
+    
+    // Make working copies
+    uint8_t* compress_buffer = (uint8_t*)malloc(size * 2);
+    uint8_t* verify_buffer = (uint8_t*)malloc(size * 2);
+    
+    if (!compress_buffer || !verify_buffer) {
+        free(compress_buffer);
+        free(verify_buffer);
+        return result;
+    }
+    
+    memcpy(compress_buffer, original_data, size);
+    
+    // Compress
+    double start_time = get_time_ms();
+    size_t compressed_size = algo->compress(compress_buffer, size);
+    result.compression_time_ms = get_time_ms() - start_time;
+    result.compressed_size = compressed_size;
+    
+    // Calculate compression ratio
+    result.compression_ratio = (1.0 - (double)compressed_size / size) * 100.0;
+    
+    // Decompress
+    memcpy(verify_buffer, compress_buffer, compressed_size);
+    start_time = get_time_ms();
+    size_t decompressed_size = algo->decompress(verify_buffer, compressed_size);
+    result.decompression_time_ms = get_time_ms() - start_time;
+    
+    // Verify
+    result.verified = (decompressed_size == size) && 
+                     (memcmp(original_data, verify_buffer, size) == 0);
+    
+    free(compress_buffer);
+    free(verify_buffer);
+    
+    return result;
+}
+
+// Decodes into dst with a guard band just past dst_cap and reports whether
+// the decoder left the guard untouched. dst must have dst_cap + 64 bytes.
+bool decode_within_capacity(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap,
+                            size_t* result) {
+    memset(dst + dst_cap, 0xA5, 64);
+    *result = advanced_decompress_to(src, src_len, dst, dst_cap);
+    
+    for (size_t i = 0; i < 64; i++) {
+        if (dst[dst_cap + i] != 0xA5) return false;
+    }
+    return *result <= dst_cap;
+}
+
+// Pipelines for the specialized pipeline test: everything on (which must
+// match advanced_compress_to), deltas with short literals and one common
+// value, and literals alone
+static ADVANCED_PIPELINE(pipeline_full_to, PROBE_DELTA | PROBE_NIBBLE | PROBE_MATCH, true, true, 0xFF, 63)
+static ADVANCED_PIPELINE(pipeline_delta_short_to, PROBE_DELTA, true, true, 0x01, 16)
+static ADVANCED_PIPELINE(pipeline_literal_to, 0, false, false, 0x00, 63)
+
+// The same encode with the pipeline only known at run time
+static size_t pipeline_compress_runtime(AdvancedPipeline pipe, const uint8_t* data_ptr, size_t data_size,
+                                        uint8_t* output, size_t output_capacity) {
+    MatchFinder mf;
+    match_finder_init(&mf);
+    size_t out_pos = 0;
+    for (size_t in_pos = 0; in_pos < data_size;) {
+        size_t consumed = pipeline_encode_token(data_ptr, in_pos, data_size, output, &out_pos,
+                                                output_capacity, &mf, pipe);
+        if (consumed == 0) return 0;
+        in_pos += consumed;
+    }
+    return out_pos;
+}
+
+// Longest literal in a v1 stream
+static size_t longest_literal(const uint8_t* stream, size_t size) {
+    size_t longest = 0;
+    for (size_t pos = 0; pos < size;) {
+        size_t token_size, output_size;
+        if (!advanced_token_info(stream + pos, size - pos, &token_size, &output_size)) break;
+        if (token_table[stream[pos]].kind == TOKEN_LITERAL && output_size > longest) longest = output_size;
+        pos += token_size;
+    }
+    return longest;
+}
+
+// Splits data into a chain of 1 to max_segment byte segments, every eighth
+// one empty. Returns the segment count.
+static size_t iov_split(uint8_t* data, size_t size, size_t max_segment, struct iovec* iov) {
+    size_t count = 0;
+    for (size_t pos = 0; pos < size; count++) {
+        size_t length = count % 8 == 7 ? 0 : 1 + (size_t)rand() % max_segment;
+        if (length > size - pos) length = size - pos;
+        iov[count].iov_base = data + pos;
+        iov[count].iov_len = length;
+        pos += length;
+    }
+    return count;
+}
+
+// Tokens in an advanced stream of either format
+static size_t count_tokens(const uint8_t* stream, size_t size) {
+    bool v2 = is_v2_stream(stream, size);
+    size_t count = 0;
+    for (size_t pos = v2 ? V2_HEADER_SIZE : 0; pos < size; count++) {
+        size_t control_size, token_size, output_size;
+        bool known = v2 ? v2_token_info(stream + pos, size - pos, &control_size, &token_size, &output_size)
+                        : advanced_token_info(stream + pos, size - pos, &token_size, &output_size);
+        if (!known) break;
+        pos += token_size;
+    }
+    return count;
+}
+
+// Forwards to a BumpArena and counts the calls that reach it
+typedef struct {
+    BumpArena arena;
+    size_t allocations;
+} CountingArena;
+
+static void* counting_arena_alloc(void* ctx, size_t size) {
+    CountingArena* counting = (CountingArena*)ctx;
+    __atomic_add_fetch(&counting->allocations, 1, __ATOMIC_RELAXED);
+    return bump_arena_alloc(&counting->arena, size);
+}
+
+// Starts measuring one call: empties the arena and clears its peak
+static void counting_arena_restart(CountingArena* counting) {
+    bump_arena_init(&counting->arena, counting->arena.memory, counting->arena.capacity);
+    counting->allocations = 0;
+}
+
+static void print_allocation_row(const char* call, const CountingArena* counting) {
+    printf("   %-42s %12zu %8zu\n", call, counting->arena.peak, counting->allocations);
+}
+
+// Print comparison table
+void print_comparison_header() {
+    printf("\n╔════════════════════════════╦═══════════════════╦═══════════════════╦═══════════╦═══════════╗\n");
+    printf("║ Test Case                  ║ Simple RLE        ║ Advanced Multi    ║ Winner    ║ Advantage ║\n");
+    printf("╠════════════════════════════╬═══════════════════╬═══════════════════╬═══════════╬═══════════╣\n");
+}
+
+void print_comparison_row(const char* test_name, TestResult* simple, TestResult* advanced) {
+    const char* winner = "Draw";
+    double advantage = 0;
+    
+    if (simple->compression_ratio > advanced->compression_ratio + 0.1) {
+        winner = "Simple";
+        advantage = simple->compression_ratio - advanced->compression_ratio;
+    } else if (advanced->compression_ratio > simple->compression_ratio + 0.1) {
+        winner = "Advanced";
+        advantage = advanced->compression_ratio - simple->compression_ratio;
+    }
+    
+    printf("║ %-26s ║ %6.1f%% (%4zu B) ║ %6.1f%% (%4zu B) ║ %-9s ║ %+6.1f%%  ║\n",
+           test_name,
+           simple->compression_ratio, simple->compressed_size,
+           advanced->compression_ratio, advanced->compressed_size,
+           winner, advantage);
+}
+
+void print_comparison_footer() {
+    printf("╚════════════════════════════╩═══════════════════╩═══════════════════╩═══════════╩═══════════╝\n");
+}
+
+// BENCHMARK HARNESS
+// ./compress -b times compress and decompress for every generate_pattern
+// pattern at sizes from 16 B up to -s (256 MB by default), then framed
+// compression and decompression of `mixed` at 1, 2, 4, ... threads. Each case
+// is warmed up first, then timed as up to BENCH_SAMPLES samples on the
+// monotonic clock. A sample batches enough calls to last BENCH_SAMPLE_MS, so
+// small inputs aren't dominated by the clock reads; large ones stop after
+// BENCH_CASE_MS with at least BENCH_MIN_SAMPLES samples. Results are the
+// median, 99th percentile and fastest time per call, printed as a table, CSV
+// (-f csv) or JSON (-f json) for tracking from release to release.
+//
+// ./compress -b dir runs the same measurements on the files in dir instead,
+// so codecs and levels can be compared on real data next to a memcpy
+// baseline.
+
+#define BENCH_SAMPLES      51
+#define BENCH_MIN_SAMPLES  3
+#define BENCH_WARMUP_MS    20.0
+#define BENCH_SAMPLE_MS    2.0
+#define BENCH_CASE_MS      500.0
+#define BENCH_MIN_SIZE     16
+#define BENCH_MAX_SIZE     ((size_t)256 * 1024 * 1024)
+
+#define BENCH_TABLE 0
+#define BENCH_CSV   1
+#define BENCH_JSON  2
+
+// One timed call: reads src, writes dst, returns the bytes written or 0.
+// state carries whatever the call needs besides its buffers.
+typedef size_t (*BenchFn)(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap);
+
+typedef struct {
+    const char* codec;
+    const char* pattern;
+    const char* operation;
+    size_t size;            // uncompressed bytes per call
+    size_t threads;
+    size_t output_size;     // bytes written by the last call
+    size_t calls;           // calls per sample
+    size_t samples;
+    double median_ns;
+    double p99_ns;
+    double min_ns;
+} BenchResult;
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Times fn on one input and fills the timing fields of result
+static void bench_measure(BenchFn fn, void* state, const uint8_t* src, size_t src_len,
+                          uint8_t* dst, size_t dst_cap, BenchResult* result) {
+    // Warm caches, branch predictors and the allocator, and estimate the
+    // time per call from the warmup itself
+    size_t warmup_calls = 0;
+    double start = get_time_ms();
+    double elapsed;
+    do {
+        result->output_size = fn(state, src, src_len, dst, dst_cap);
+        warmup_calls++;
+        elapsed = get_time_ms() - start;
+    } while (elapsed < BENCH_WARMUP_MS);
+    
+    double per_call = elapsed / warmup_calls;
+    size_t calls = per_call >= BENCH_SAMPLE_MS ? 1 : (size_t)(BENCH_SAMPLE_MS / per_call) + 1;
+    double samples[BENCH_SAMPLES];
+    size_t count = 0;
+    
+    double case_start = get_time_ms();
+    while (count < BENCH_SAMPLES &&
+           (count < BENCH_MIN_SAMPLES || get_time_ms() - case_start < BENCH_CASE_MS)) {
+        double sample_start = get_time_ms();
+        for (size_t i = 0; i < calls; i++) {
+            result->output_size = fn(state, src, src_len, dst, dst_cap);
+        }
+        samples[count++] = (get_time_ms() - sample_start) * 1e6 / calls;
+    }
+    
+    // Nearest-rank percentiles
+    qsort(samples, count, sizeof(double), compare_doubles);
+    result->calls = calls;
+    result->samples = count;
+    result->median_ns = samples[count / 2];
+    result->p99_ns = samples[(count * 99 + 99) / 100 - 1];
+    result->min_ns = samples[0];
+}
+
+static double bench_mb_per_s(const BenchResult* result) {
+    return result->size / 1048576.0 / (result->median_ns / 1e9);
+}
+
+// Prints a pattern or file name as a CSV field or JSON string
+static void bench_print_name(int format, const char* name) {
+    bool quote = format == BENCH_JSON || strpbrk(name, ",\"\r\n") != NULL;
+    if (quote) putchar('"');
+    for (const char* c = name; *c; c++) {
+        if (format == BENCH_CSV && *c == '"') {
+            printf("\"\"");
+        } else if (format == BENCH_JSON && (*c == '"' || *c == '\\')) {
+            printf("\\%c", *c);
+        } else if (format == BENCH_JSON && (unsigned char)*c < 0x20) {
+            printf("\\u%04x", (unsigned char)*c);
+        } else {
+            putchar(*c);
+        }
+    }
+    if (quote) putchar('"');
+}
+
+static void bench_print_header(int format) {
+    if (format == BENCH_CSV) {
+        printf("codec,pattern,operation,size,threads,output_size,calls,samples,median_ns,p99_ns,min_ns,mb_per_s\n");
+    } else if (format == BENCH_JSON) {
+        printf("{\n  \"clock\": \"CLOCK_MONOTONIC\",\n  \"cpus\": %zu,\n  \"results\": [", frame_default_threads());
+    } else {
+        printf("%-12s %-16s %-10s %10s %3s %12s %12s %12s %10s %7s\n", "Codec", "Pattern", "Operation",
+               "Size", "Thr", "Median ns", "p99 ns", "Min ns", "MB/s", "Ratio");
+    }
+}
+
+static void bench_print_row(int format, const BenchResult* r, bool first) {
+    // Ratio is always compressed over original size
+    double ratio = strcmp(r->operation, "compress") == 0 ? (double)r->output_size / r->size : 0;
+    if (format == BENCH_CSV) {
+        printf("%s,", r->codec);
+        bench_print_name(format, r->pattern);
+        printf(",%s,%zu,%zu,%zu,%zu,%zu,%.1f,%.1f,%.1f,%.2f\n", r->operation, r->size, r->threads,
+               r->output_size, r->calls, r->samples, r->median_ns, r->p99_ns, r->min_ns, bench_mb_per_s(r));
+    } else if (format == BENCH_JSON) {
+        printf("%s\n    {\"codec\": \"%s\", \"pattern\": ", first ? "" : ",", r->codec);
+        bench_print_name(format, r->pattern);
+        printf(", \"operation\": \"%s\", \"size\": %zu, \"threads\": %zu, \"output_size\": %zu, "
+               "\"calls\": %zu, \"samples\": %zu, \"median_ns\": %.1f, \"p99_ns\": %.1f, "
+               "\"min_ns\": %.1f, \"mb_per_s\": %.2f}", r->operation, r->size, r->threads,
+               r->output_size, r->calls, r->samples, r->median_ns, r->p99_ns, r->min_ns, bench_mb_per_s(r));
+    } else {
+        printf("%-12s %-16s %-10s %10zu %3zu %12.0f %12.0f %12.0f %10.1f ", r->codec, r->pattern,
+               r->operation, r->size, r->threads, r->median_ns, r->p99_ns, r->min_ns, bench_mb_per_s(r));
+        if (ratio > 0) printf("%6.1f%%\n", ratio * 100);
+        else printf("%7s\n", "-");
+    }
+    fflush(stdout);
+}
+
+static void bench_print_footer(int format) {
+    if (format == BENCH_JSON) printf("\n  ]\n}\n");
+}
+
+// Adapters from each codec to BenchFn. Levels and thread counts travel in
+// state. memcpy is the baseline: no codec can beat the cost of moving the bytes.
+static size_t bench_memcpy(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    if (dst_cap < src_len) return 0;
+    memcpy(dst, src, src_len);
+    return src_len;
+}
+
+static size_t bench_simple_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return simple_rle_compress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_simple_decompress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return simple_rle_decompress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_advanced_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return byte_compress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_level_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    return advanced_compress_level_to(src, src_len, dst, dst_cap, *(const int*)state);
+}
+
+static size_t bench_v2_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return advanced_compress_v2_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_advanced_decompress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return advanced_decompress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_entropy_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return entropy_compress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_entropy_decompress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    (void)state;
+    return entropy_decompress_to(src, src_len, dst, dst_cap);
+}
+
+static size_t bench_frame_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    FrameOptions opts;
+    frame_options_init(&opts);
+    opts.threads = *(const size_t*)state;
+    return frame_compress(src, src_len, dst, dst_cap, &opts);
+}
+
+// Frame with FILTER_AUTO. state is the thread count.
+static size_t bench_filtered_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    FrameOptions opts;
+    frame_options_init(&opts);
+    opts.threads = *(const size_t*)state;
+    opts.filter = FILTER_AUTO;
+    return frame_compress(src, src_len, dst, dst_cap, &opts);
+}
+
+static size_t bench_frame_decompress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    return frame_decompress_parallel(src, src_len, dst, dst_cap, *(const size_t*)state);
+}
+
+// The in-place context API, including the copy the caller needs to keep its
+// input. state is the CodecContext.
+static size_t bench_context_compress(void* state, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+    if (dst_cap < src_len) return 0;
+    memcpy(dst, src, src_len);
+    return byte_compress_ctx((CodecContext*)state, dst, src_len);
+}
+
+typedef struct {
+    const char* name;
+    BenchFn compress;
+    BenchFn decompress;
+    void* state;            // passed to both
+    size_t threads;         // reported with the results
+} BenchCodec;
+
+// Output capacity that fits every benchmarked codec's worst case
+static size_t bench_capacity(size_t size) {
+    size_t capacity = frame_compress_bound(size, NULL);
+    if (capacity < advanced_compress_v2_bound(size)) capacity = advanced_compress_v2_bound(size);
+    if (capacity < simple_rle_compress_bound(size)) capacity = simple_rle_compress_bound(size);
+    if (capacity < entropy_compress_bound(size)) capacity = entropy_compress_bound(size);
+    return capacity;
+}
+
+// Compresses once to get the decoder's input, then times both directions and
+// prints them. results, if given, receives the compress and decompress rows.
+static bool bench_codec_pair(const BenchCodec* codec, const char* pattern, const uint8_t* input, size_t size,
+                             uint8_t* packed, size_t packed_cap, uint8_t* output, int format, bool* first,
+                             BenchResult results[2]) {
+    BenchResult result = {codec->name, pattern, "compress", size, codec->threads, 0, 0, 0, 0, 0, 0};
+    size_t packed_size = codec->compress(codec->state, input, size, packed, packed_cap);
+    bool ok = packed_size > 0 && codec->decompress(codec->state, packed, packed_size, output, size) == size &&
+              memcmp(output, input, size) == 0;
+    if (!ok) {
+        fprintf(stderr, "benchmark: %s round trip failed on %zu bytes of %s\n", codec->name, size, pattern);
+        return false;
+    }
+    
+    bench_measure(codec->compress, codec->state, input, size, packed, packed_cap, &result);
+    bench_print_row(format, &result, *first);
+    *first = false;
+    if (results) results[0] = result;
+    
+    result.operation = "decompress";
+    bench_measure(codec->decompress, codec->state, packed, packed_size, output, size, &result);
+    result.output_size = size;
+    bench_print_row(format, &result, false);
+    if (results) results[1] = result;
+    return true;
+}
+
+// Runs the whole benchmark. Returns false if a buffer couldn't be allocated
+// or a round trip failed.
+static bool run_benchmark(int format, size_t max_size, size_t max_threads) {
+    static const char* patterns[] = {"zeros", "runs", "sequence", "pattern", "nibbles",
+                                     "mixed", "random", "skewed", "bursts", "sensor16", "sensor32"};
+    static size_t single_thread = 1;
+    static const BenchCodec codecs[] = {
+        {"simple_rle", bench_simple_compress, bench_simple_decompress, NULL, 1},
+        {"advanced", bench_advanced_compress, bench_advanced_decompress, NULL, 1},
+        {"advanced_v2", bench_v2_compress, bench_advanced_decompress, NULL, 1},
+        {"filtered", bench_filtered_compress, bench_frame_decompress, &single_thread, 1},
+    };
+    if (max_size < BENCH_MIN_SIZE) max_size = BENCH_MIN_SIZE;
+    if (max_threads == 0) max_threads = frame_default_threads();
+    
+    size_t capacity = bench_capacity(max_size);
+    uint8_t* packed = (uint8_t*)malloc(capacity);
+    uint8_t* output = (uint8_t*)malloc(max_size);
+    bool ok = packed && output;
+    bool first = true;
+    
+    bench_print_header(format);
+    for (size_t p = 0; ok && p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        for (size_t size = BENCH_MIN_SIZE; ok && size <= max_size; size *= 16) {
+            srand(1);
+            uint8_t* input = generate_pattern(patterns[p], size);
+            ok = input != NULL;
+            for (size_t c = 0; ok && c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+                ok = bench_codec_pair(&codecs[c], patterns[p], input, size, packed, capacity,
+                                      output, format, &first, NULL);
+            }
+            free(input);
+        }
+    }
+    
+    // Thread scaling on 16 MB, or less if -s caps the size below that
+    size_t scaling_size = max_size < 16 * 1024 * 1024 ? max_size : 16 * 1024 * 1024;
+    BenchCodec frame = {"frame", bench_frame_compress, bench_frame_decompress, &frame.threads, 1};
+    srand(1);
+    uint8_t* input = ok ? generate_pattern("mixed", scaling_size) : NULL;
+    ok = ok && input;
+    for (; ok && frame.threads <= max_threads; frame.threads *= 2) {
+        ok = bench_codec_pair(&frame, "mixed", input, scaling_size, packed, capacity,
+                              output, format, &first, NULL);
+    }
+    bench_print_footer(format);
+    
+    free(input);
+    free(packed);
+    free(output);
+    return ok;
+}
+
+typedef struct {
+    char* name;
+    uint8_t* data;
+    size_t size;
+} CorpusFile;
+
+static void corpus_free(CorpusFile* files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(files[i].name);
+        free(files[i].data);
+    }
+    free(files);
+}
+
+// Reads every non-empty regular file directly inside dir into memory, in name
+// order, keeping the first max_size bytes of larger ones. Hidden files are
+// skipped. Returns the file count (0 if dir can't be read or has no such
+// files); free *files with corpus_free.
+static size_t corpus_load(const char* dir, size_t max_size, CorpusFile** files) {
+    struct dirent** entries;
+    int entry_count = scandir(dir, &entries, NULL, alphasort);
+    *files = NULL;
+    if (entry_count < 0) return 0;
+    
+    size_t count = 0;
+    *files = (CorpusFile*)calloc(entry_count > 0 ? (size_t)entry_count : 1, sizeof(CorpusFile));
+    for (int e = 0; e < entry_count; e++) {
+        const char* name = entries[e]->d_name;
+        size_t path_length = strlen(dir) + strlen(name) + 2;
+        char* path = (char*)malloc(path_length);
+        int fd = -1;
+        struct stat st;
+        
+        if (*files && path && name[0] != '.') {
+            snprintf(path, path_length, "%s/%s", dir, name);
+            fd = open(path, O_RDONLY);
+        }
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_t size = (uint64_t)st.st_size < max_size ? (size_t)st.st_size : max_size;
+            CorpusFile* file = &(*files)[count];
+            FileMapping map;
+            const uint8_t* mapped = file_map(fd, 0, size, &map);
+            file->name = strdup(name);
+            file->data = (uint8_t*)malloc(size);
+            file->size = size;
+            if (mapped && file->name && file->data) {
+                memcpy(file->data, mapped, size);
+                count++;
+            } else {
+                free(file->name);
+                free(file->data);
+            }
+            if (mapped) file_unmap(&map);
+        }
+        if (fd >= 0) close(fd);
+        free(path);
+        free(entries[e]);
+    }
+    free(entries);
+    
+    if (count == 0) {
+        free(*files);
+        *files = NULL;
+    }
+    return count;
+}
+
+// Benchmarks every codec and level on each file in dir, then prints corpus
+// totals per codec: all the files' bytes over the sum of their median times.
+// Returns false if dir has no readable files, a buffer couldn't be allocated
+// or a round trip failed.
+static bool run_corpus_benchmark(const char* dir, int format, size_t max_size, size_t threads) {
+    static int levels[] = {COMPRESS_LEVEL_FAST, COMPRESS_LEVEL_DEFAULT, COMPRESS_LEVEL_MAX};
+    CorpusFile* files;
+    size_t file_count = corpus_load(dir, max_size, &files);
+    if (file_count == 0) {
+        fprintf(stderr, "benchmark: no readable files in %s\n", dir);
+        return false;
+    }
+    if (threads == 0) threads = frame_default_threads();
+    
+    BenchCodec codecs[] = {
+        {"memcpy", bench_memcpy, bench_memcpy, NULL, 1},
+        {"simple_rle", bench_simple_compress, bench_simple_decompress, NULL, 1},
+        {"advanced_l1", bench_level_compress, bench_advanced_decompress, &levels[0], 1},
+        {"advanced_l2", bench_level_compress, bench_advanced_decompress, &levels[1], 1},
+        {"advanced_l3", bench_level_compress, bench_advanced_decompress, &levels[2], 1},
+        {"advanced_v2", bench_v2_compress, bench_advanced_decompress, NULL, 1},
+        {"entropy", bench_entropy_compress, bench_entropy_decompress, NULL, 1},
+        {"frame", bench_frame_compress, bench_frame_decompress, &threads, threads},
+        {"filtered", bench_filtered_compress, bench_frame_decompress, &threads, threads},
+    };
+    const size_t codec_count = sizeof(codecs) / sizeof(codecs[0]);
+    BenchResult totals[sizeof(codecs) / sizeof(codecs[0])][2];
+    
+    size_t largest = 0;
+    for (size_t f = 0; f < file_count; f++) {
+        if (files[f].size > largest) largest = files[f].size;
+    }
+    size_t capacity = bench_capacity(largest);
+    uint8_t* packed = (uint8_t*)malloc(capacity);
+    uint8_t* output = (uint8_t*)malloc(largest);
+    bool ok = packed && output;
+    bool first = true;
+    
+    bench_print_header(format);
+    for (size_t c = 0; c < codec_count; c++) {
+        for (int op = 0; op < 2; op++) {
+            BenchResult total = {codecs[c].name, "(total)", op ? "decompress" : "compress", 0,
+                                 codecs[c].threads, 0, 0, 0, 0, 0, 0};
+            totals[c][op] = total;
+        }
+    }
+    for (size_t f = 0; ok && f < file_count; f++) {
+        for (size_t c = 0; ok && c < codec_count; c++) {
+            BenchResult results[2];
+            ok = bench_codec_pair(&codecs[c], files[f].name, files[f].data, files[f].size,
+                                  packed, capacity, output, format, &first, results);
+            for (int op = 0; ok && op < 2; op++) {
+                totals[c][op].size += results[op].size;
+                totals[c][op].output_size += results[op].output_size;
+                totals[c][op].median_ns += results[op].median_ns;
+                totals[c][op].p99_ns += results[op].p99_ns;
+                totals[c][op].min_ns += results[op].min_ns;
+            }
+        }
+    }
+    for (size_t c = 0; ok && file_count > 1 && c < codec_count; c++) {
+        bench_print_row(format, &totals[c][0], false);
+        bench_print_row(format, &totals[c][1], false);
+    }
+    bench_print_footer(format);
+    
+    free(packed);
+    free(output);
+    corpus_free(files, file_count);
+    return ok;
+}
+
+// Main testing function
+void run_comprehensive_tests() {
+    printf("\n");
+    printf("════════════════════════════════════════════════════════════════════════\n");
+    printf("           COMPRESSION ALGORITHM PERFORMANCE COMPARISON                \n");
+    printf("════════════════════════════════════════════════════════════════════════\n");
+    
+    Algorithm algorithms[] = {
+        {"Simple RLE", simple_rle_compress, simple_rle_decompress},
+        {"Advanced Multi-Strategy", advanced_compress, advanced_decompress}
+    };
+    
+    // Test with original example
+    uint8_t original_example[] = { 
+        0x03, 0x74, 0x04, 0x04, 0x04, 0x35, 0x35, 0x64,
+        0x64, 0x64, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x56, 0x45, 0x56, 0x56, 0x56, 0x09, 0x09, 0x09 
+    };
+    
+    printf("\n1. ORIGINAL EXAMPLE TEST\n");
+    printf("   ─────────────────────\n");
+    
+    for (int a = 0; a < 2; a++) {
+        uint8_t* test_data = (uint8_t*)malloc(sizeof(original_example));
+        memcpy(test_data, original_example, sizeof(original_example));
+        
+        TestResult result = run_single_test(&algorithms[a], original_example, sizeof(original_example));
+        
+        printf("   %s:\n", algorithms[a].name);
+        printf("   • Compression: %zu → %zu bytes (%.1f%% saved)\n",
+               result.original_size, result.compressed_size, result.compression_ratio);
+        printf("   • Time: %.3f ms compress, %.3f ms decompress\n",
+               result.compression_time_ms, result.decompression_time_ms);
+        printf("   • Verification: %s\n", result.verified ? "✓ PASSED" : "✗ FAILED");
+        
+        free(test_data);
+    }
+    
+    // Pattern-based tests
+    const char* patterns[] = {
+        "zeros", "runs", "sequence", "pattern", "nibbles", "mixed", "random"
+    };
+    const char* descriptions[] = {
+        "All zeros",
+        "Random runs",
+        "Incrementing",
+        "Repeating pattern",
+        "Small values <16",
+        "Mixed patterns",
+        "Random data"
+    };
+    
+    printf("\n2. PATTERN-BASED PERFORMANCE TESTS (256 bytes each)\n");
+    printf("   ────────────────────────────────────────────────\n");
+    
+    print_comparison_header();
+    
+    double total_simple_ratio = 0;
+    double total_advanced_ratio = 0;
+    int test_count = 0;
+    
+    for (int p = 0; p < 7; p++) {
+        uint8_t* test_data = generate_pattern(patterns[p], 256);
+        if (!test_data) continue;
+        
+        TestResult simple_result = run_single_test(&algorithms[0], test_data, 256);
+        TestResult advanced_result = run_single_test(&algorithms[1], test_data, 256);
+        
+        print_comparison_row(descriptions[p], &simple_result, &advanced_result);
+        
+        total_simple_ratio += simple_result.compression_ratio;
+        total_advanced_ratio += advanced_result.compression_ratio;
+        test_count++;
+        
+        free(test_data);
+    }
+    
+    print_comparison_footer();
+    
+    // Size scaling tests
+    printf("\n3. SIZE SCALING TESTS (Mixed Pattern)\n");
+    printf("   ──────────────────────────────────\n");
+    
+    size_t sizes[] = {16, 64, 256, 1024, 4096};
+    
+    print_comparison_header();
+    
+    for (int s = 0; s < 5; s++) {
+        uint8_t* test_data = generate_pattern("mixed", sizes[s]);
+        if (!test_data) continue;
+        
+        TestResult simple_result = run_single_test(&algorithms[0], test_data, sizes[s]);
+        TestResult advanced_result = run_single_test(&algorithms[1], test_data, sizes[s]);
+        
+        char test_name[32];
+        snprintf(test_name, sizeof(test_name), "%zu bytes", sizes[s]);
+        print_comparison_row(test_name, &simple_result, &advanced_result);
+        
+        free(test_data);
+    }
+    
+    print_comparison_footer();
+    
+    // Speed benchmark
+    printf("\n4. SPEED BENCHMARK (median and p99 per call on a 256-byte buffer)\n");
+    printf("   ────────────────────────────────────────────────────────────────\n");
+    
+    uint8_t* bench_data = generate_pattern("mixed", 256);
+    size_t bench_capacity = simple_rle_compress_bound(256) + advanced_compress_bound(256);
+    uint8_t* bench_packed = (uint8_t*)malloc(bench_capacity);
+    uint8_t* bench_output = (uint8_t*)malloc(256);
+    CodecContext bench_ctx;
+    codec_context_init(&bench_ctx);
+    
+    BenchCodec speed_cases[] = {
+        {"Simple RLE", bench_simple_compress, bench_simple_decompress, NULL, 1},
+        {"Advanced Multi-Strategy", bench_advanced_compress, bench_advanced_decompress, NULL, 1},
+        // Same workload through a reused context (no per-call allocation)
+        {"Advanced Multi-Strategy (reused context)", bench_context_compress, bench_advanced_decompress,
+         &bench_ctx, 1},
+    };
+    
+    for (size_t c = 0; c < sizeof(speed_cases) / sizeof(speed_cases[0]); c++) {
+        BenchResult compress_result = {speed_cases[c].name, "mixed", "compress", 256, 1, 0, 0, 0, 0, 0, 0};
+        BenchResult decompress_result = compress_result;
+        decompress_result.operation = "decompress";
+        
+        bench_measure(speed_cases[c].compress, speed_cases[c].state, bench_data, 256,
+                      bench_packed, bench_capacity, &compress_result);
+        bench_measure(speed_cases[c].decompress, speed_cases[c].state, bench_packed,
+                      compress_result.output_size, bench_output, 256, &decompress_result);
+        
+        printf("   %s:\n", speed_cases[c].name);
+        printf("   • Compression: %.3f μs median, %.3f μs p99 per operation (%zu samples)\n",
+               compress_result.median_ns / 1000, compress_result.p99_ns / 1000, compress_result.samples);
+        printf("   • Decompression: %.3f μs median, %.3f μs p99 per operation\n",
+               decompress_result.median_ns / 1000, decompress_result.p99_ns / 1000);
+        printf("   • Throughput: %.2f MB/s, %.0f frames/s compressing; %.2f MB/s decompressing\n",
+               bench_mb_per_s(&compress_result), 1e9 / compress_result.median_ns,
+               bench_mb_per_s(&decompress_result));
+    }
+    printf("   • Full suite: ./compress -b [-f csv|json]\n");
+    
+    codec_context_free(&bench_ctx);
+    free(bench_data);
+    free(bench_packed);
+    free(bench_output);
+    
+    // Context API round trips
+    printf("\n5. CONTEXT API TEST (one context reused for every frame)\n");
+    printf("   ─────────────────────────────────────────────────────\n");
+    
+    CodecContext ctx;
+    codec_context_init(&ctx);
+    bool ctx_verified = true;
+    size_t ctx_frames = 0;
+    uint8_t* warm_scratch = NULL;
+    size_t warm_capacity = 0;
+    unsigned int ctx_seed = (unsigned int)rand();
+    
+    for (int round = 0; round < 2; round++) {
+        // Both rounds see the same frames
+        srand(ctx_seed);
+        for (int p = 0; p < 7; p++) {
+            for (int s = 0; s < 5; s++) {
+                uint8_t* test_data = generate_pattern(patterns[p], sizes[s]);
+                if (!test_data) continue;
+                
+                uint8_t* buffer = (uint8_t*)malloc(sizes[s] * 2);
+                memcpy(buffer, test_data, sizes[s]);
+                
+                size_t compressed = byte_compress_ctx(&ctx, buffer, sizes[s]);
+                size_t restored = byte_decompress_ctx(&ctx, buffer, compressed);
+                
+                ctx_verified = ctx_verified && restored == sizes[s] &&
+                               memcmp(buffer, test_data, sizes[s]) == 0;
+                ctx_frames++;
+                
+                free(buffer);
+                free(test_data);
+            }
+        }
+        // The first round sizes the scratch buffer; the second must reuse it
+        if (round == 0) {
+            warm_scratch = ctx.scratch;
+            warm_capacity = ctx.scratch_capacity;
+        }
+    }
+    
+    bool ctx_reused = ctx.scratch == warm_scratch && ctx.scratch_capacity == warm_capacity;
+    bool ctx_bounded = ctx.scratch_capacity <= advanced_compress_bound(sizes[4]);
+    printf("   • Frames round-tripped: %zu\n", ctx_frames);
+    printf("   • Scratch capacity after warmup: %zu bytes\n", ctx.scratch_capacity);
+    printf("   • Verification: %s\n", ctx_verified ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Steady-state allocations: %s\n", ctx_reused ? "✓ PASSED (none)" : "✗ FAILED");
+    printf("   • Scratch bounded by largest frame: %s\n", ctx_bounded ? "✓ PASSED" : "✗ FAILED");
+    
+    codec_context_free(&ctx);
+    
+    // Out-of-place API: output buffers sized exactly by the bound functions
+    printf("\n6. OUT-OF-PLACE API TEST (dst sized by byte_compress_bound)\n");
+    printf("   ─────────────────────────────────────────────────────────\n");
+    
+    bool to_verified = true;
+    bool size_query_ok = true;
+    
+    for (int p = 0; p < 7; p++) {
+        for (int s = 0; s < 5; s++) {
+            uint8_t* test_data = generate_pattern(patterns[p], sizes[s]);
+            if (!test_data) continue;
+            
+            size_t bound = byte_compress_bound(sizes[s]);
+            uint8_t* packed = (uint8_t*)malloc(bound);
+            uint8_t* restored = (uint8_t*)malloc(sizes[s]);
+            
+            size_t compressed = byte_compress_to(test_data, sizes[s], packed, bound);
+            size_query_ok = size_query_ok && byte_decompressed_size(packed, compressed) == sizes[s];
+            size_t restored_size = byte_decompress_to(packed, compressed, restored, sizes[s]);
+            
+            to_verified = to_verified && compressed > 0 && restored_size == sizes[s] &&
+                          memcmp(restored, test_data, sizes[s]) == 0;
+            
+            free(packed);
+            free(restored);
+            free(test_data);
+        }
+    }
+    
+    // Worst-case inputs must land exactly on the bounds. Each advanced group
+    // is a 1-byte literal and a 3-byte delta run, distinct from every other
+    // group so no back-reference applies.
+    uint8_t worst_simple[300];
+    uint8_t worst_advanced[300];
+    for (size_t i = 0; i < sizeof(worst_simple); i++) {
+        size_t group = i / 4;
+        worst_simple[i] = (i % 3 == 0) ? 0xFF : (uint8_t)(i / 3);
+        worst_advanced[i] = (i % 4 == 0) ? (uint8_t)(0x80 | group)
+                                         : (uint8_t)(0x10 + group + i % 4);
+    }
+    
+    uint8_t worst_out[512];
+    size_t simple_worst = simple_rle_compress_to(worst_simple, sizeof(worst_simple),
+                                                 worst_out, sizeof(worst_out));
+    size_t advanced_worst = advanced_compress_to(worst_advanced, sizeof(worst_advanced),
+                                                 worst_out, sizeof(worst_out));
+    bool bounds_exact = simple_worst == simple_rle_compress_bound(sizeof(worst_simple)) &&
+                        advanced_worst == advanced_compress_bound(sizeof(worst_advanced));
+    
+    // One byte short of the decoded size must be rejected, not overrun
+    uint8_t* short_data = generate_pattern("mixed", 1024);
+    uint8_t* short_packed = (uint8_t*)malloc(byte_compress_bound(1024));
+    uint8_t* short_out = (uint8_t*)malloc(1023);
+    size_t short_compressed = byte_compress_to(short_data, 1024, short_packed, byte_compress_bound(1024));
+    bool short_rejected = byte_decompress_to(short_packed, short_compressed, short_out, 1023) == 0;
+    free(short_data);
+    free(short_packed);
+    free(short_out);
+    
+    printf("   • Round trips: %s\n", to_verified ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Decompressed size query: %s\n", size_query_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Worst case (300 B): simple %zu B, advanced %zu B: %s\n",
+           simple_worst, advanced_worst, bounds_exact ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Undersized output rejected: %s\n", short_rejected ? "✓ PASSED" : "✗ FAILED");
+    
+    // Framed block format on a multi-megabyte input
+    printf("\n7. FRAMED FORMAT TEST (4 MB mixed input, 64 KB blocks)\n");
+    printf("   ──────────────────────────────────────────────────\n");
+    
+    size_t frame_input_size = 4 * 1024 * 1024;
+    uint8_t* frame_input = generate_pattern("mixed", frame_input_size);
+    uint8_t* frame_restored = (uint8_t*)malloc(frame_input_size);
+    
+    const char* frame_codec_names[] = {"Simple RLE", "Advanced", "Advanced + entropy", "Auto (per block)"};
+    uint8_t frame_codecs[] = {CODEC_SIMPLE_RLE, CODEC_ADVANCED, CODEC_ENTROPY, CODEC_AUTO};
+    
+    for (int c = 0; c < 4; c++) {
+        FrameOptions opts;
+        frame_options_init(&opts);
+        opts.codec = frame_codecs[c];
+        
+        size_t frame_cap = frame_compress_bound(frame_input_size, &opts);
+        uint8_t* frame = (uint8_t*)malloc(frame_cap);
+        
+        double start = get_time_ms();
+        size_t frame_size = frame_compress(frame_input, frame_input_size, frame, frame_cap, &opts);
+        double compress_time = get_time_ms() - start;
+        
+        start = get_time_ms();
+        size_t restored = frame_decompress(frame, frame_size, frame_restored, frame_input_size);
+        double decompress_time = get_time_ms() - start;
+        
+        bool frame_ok = restored == frame_input_size &&
+                        memcmp(frame_restored, frame_input, frame_input_size) == 0 &&
+                        frame_content_size(frame, frame_size) == frame_input_size;
+        
+        // Decode a single block from the middle of the frame
+        size_t block_index = 37;
+        size_t block_size = frame_decompress_block(frame, frame_size, block_index,
+                                                   frame_restored, opts.block_size);
+        bool block_ok = block_size == opts.block_size &&
+                        memcmp(frame_restored, frame_input + block_index * opts.block_size,
+                               opts.block_size) == 0;
+        
+        // Flip one payload byte; the checksum must catch it
+        frame[frame_size / 2] ^= 0x01;
+        bool corrupt_rejected = frame_decompress(frame, frame_size, frame_restored,
+                                                 frame_input_size) == 0;
+        
+        printf("   %s:\n", frame_codec_names[c]);
+        printf("   • Frame: %zu → %zu bytes (%.1f%% saved)\n", frame_input_size, frame_size,
+               (1.0 - (double)frame_size / frame_input_size) * 100.0);
+        printf("   • Time: %.2f ms compress, %.2f ms decompress\n", compress_time, decompress_time);
+        printf("   • Round trip: %s\n", frame_ok ? "✓ PASSED" : "✗ FAILED");
+        printf("   • Single block decode: %s\n", block_ok ? "✓ PASSED" : "✗ FAILED");
+        printf("   • Corruption detected: %s\n", corrupt_rejected ? "✓ PASSED" : "✗ FAILED");
+        
+        free(frame);
+    }
+    
+    free(frame_input);
+    free(frame_restored);
+    
+    // Block-parallel compression
+    printf("\n8. PARALLEL COMPRESSION TEST (16 MB mixed input, 256 KB blocks)\n");
+    printf("   ──────────────────────────────────────────────────────────\n");
+    
+    size_t par_input_size = 16 * 1024 * 1024;
+    uint8_t* par_input = generate_pattern("mixed", par_input_size);
+    uint8_t* par_restored = (uint8_t*)malloc(par_input_size);
+    
+    FrameOptions par_opts;
+    frame_options_init(&par_opts);
+    par_opts.block_size = 256 * 1024;
+    
+    size_t par_cap = frame_compress_bound(par_input_size, &par_opts);
+    uint8_t* serial_frame = (uint8_t*)malloc(par_cap);
+    uint8_t* par_frame = (uint8_t*)malloc(par_cap);
+    
+    double serial_start = get_time_ms();
+    size_t serial_size = frame_compress(par_input, par_input_size, serial_frame, par_cap, &par_opts);
+    double serial_time = get_time_ms() - serial_start;
+    
+    printf("   • %zu CPU(s) online\n", frame_default_threads());
+    printf("   • 1 thread: %.2f ms (%.1f MB/s)\n", serial_time,
+           par_input_size / (serial_time * 1000.0));
+    
+    size_t thread_counts[] = {2, 4, 8, 0};
+    bool par_identical = true;
+    
+    for (int t = 0; t < 4; t++) {
+        par_opts.threads = thread_counts[t];
+        
+        double start = get_time_ms();
+        size_t par_size = frame_compress(par_input, par_input_size, par_frame, par_cap, &par_opts);
+        double elapsed = get_time_ms() - start;
+        
+        par_identical = par_identical && par_size == serial_size &&
+                        memcmp(par_frame, serial_frame, serial_size) == 0;
+        
+        size_t shown = thread_counts[t] ? thread_counts[t] : frame_default_threads();
+        printf("   • %zu thread%s%s: %.2f ms (%.1f MB/s, %.2fx)\n", shown, shown == 1 ? "" : "s",
+               thread_counts[t] ? "" : " (auto)", elapsed,
+               par_input_size / (elapsed * 1000.0), serial_time / elapsed);
+    }
+    
+    bool par_ok = frame_decompress(par_frame, serial_size, par_restored, par_input_size) == par_input_size &&
+                  memcmp(par_restored, par_input, par_input_size) == 0;
+    
+    printf("   • Output identical to serial: %s\n", par_identical ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Round trip: %s\n", par_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    // Block index: parallel whole-frame decode and point reads
+    printf("\n9. BLOCK INDEX TEST (parallel decode and range reads on the 16 MB frame)\n");
+    printf("   ───────────────────────────────────────────────────────────────────\n");
+    
+    double full_start = get_time_ms();
+    frame_decompress(serial_frame, serial_size, par_restored, par_input_size);
+    double full_time = get_time_ms() - full_start;
+    printf("   • Serial decode: %.2f ms (%.1f MB/s)\n", full_time,
+           par_input_size / (full_time * 1000.0));
+    
+    bool par_decode_ok = true;
+    for (int t = 0; t < 4; t++) {
+        memset(par_restored, 0xAA, par_input_size);
+        
+        double start = get_time_ms();
+        size_t restored = frame_decompress_parallel(serial_frame, serial_size, par_restored,
+                                                    par_input_size, thread_counts[t]);
+        double elapsed = get_time_ms() - start;
+        
+        par_decode_ok = par_decode_ok && restored == par_input_size &&
+                        memcmp(par_restored, par_input, par_input_size) == 0;
+        
+        size_t shown = thread_counts[t] ? thread_counts[t] : frame_default_threads();
+        printf("   • %zu thread%s%s: %.2f ms (%.1f MB/s, %.2fx)\n", shown, shown == 1 ? "" : "s",
+               thread_counts[t] ? "" : " (auto)", elapsed,
+               par_input_size / (elapsed * 1000.0), full_time / elapsed);
+    }
+    
+    // Random point reads of up to 4 KB, including ones that straddle blocks
+    uint8_t range_buffer[4096];
+    bool range_ok = true;
+    double range_start = get_time_ms();
+    for (int i = 0; i < 1000; i++) {
+        size_t length = (size_t)(rand() % sizeof(range_buffer)) + 1;
+        size_t offset = ((size_t)rand() * 4099) % (par_input_size - length);
+        if (i == 0) offset = par_opts.block_size - length / 2;
+        
+        range_ok = range_ok &&
+                   frame_decompress_range(serial_frame, serial_size, offset, length, range_buffer) == length &&
+                   memcmp(range_buffer, par_input + offset, length) == 0;
+    }
+    double range_time = get_time_ms() - range_start;
+    bool range_rejected = frame_decompress_range(serial_frame, serial_size, par_input_size - 10, 20,
+                                                 range_buffer) == 0;
+    
+    // A header claiming 4 GB blocks doesn't size the scratch: the read must
+    // fit a 1 MB arena
+    uint8_t* inflated_frame = (uint8_t*)malloc(serial_size);
+    memcpy(inflated_frame, serial_frame, serial_size);
+    write_le32(inflated_frame + 6, 0xFFFFFFFF);
+    BumpArena range_arena;
+    bump_arena_init(&range_arena, malloc(1 << 20), 1 << 20);
+    CodecAllocator range_allocator = bump_arena_allocator(&range_arena);
+    codec_set_allocator(&range_allocator);
+    size_t straddle = par_opts.block_size - 100;
+    bool range_bounded = frame_decompress_range(inflated_frame, serial_size, straddle, 200, range_buffer) == 200 &&
+                         memcmp(range_buffer, par_input + straddle, 200) == 0;
+    codec_set_allocator(NULL);
+    free(range_arena.memory);
+    free(inflated_frame);
+    
+    printf("   • Parallel decode: %s\n", par_decode_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • 1000 range reads: %.2f ms (%.3f ms each vs %.2f ms full decode): %s\n",
+           range_time, range_time / 1000, full_time, range_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Out-of-bounds range rejected: %s\n", range_rejected ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Scratch sized from the block, not the header: %s\n", range_bounded ? "✓ PASSED" : "✗ FAILED");
+    
+    free(serial_frame);
+    free(par_frame);
+    free(par_input);
+    free(par_restored);
+    
+    // Streaming: feed input in random chunks through small output buffers
+    printf("\n10. STREAMING API TEST (1 MB mixed input, random chunk and buffer sizes)\n");
+    printf("   ─────────────────────────────────────────────────────────────────\n");
+    
+    size_t stream_size = 1024 * 1024;
+    uint8_t* stream_input = generate_pattern("mixed", stream_size);
+    size_t stream_cap = advanced_compress_bound(stream_size);
+    uint8_t* one_shot = (uint8_t*)malloc(stream_cap);
+    uint8_t* streamed = (uint8_t*)malloc(stream_cap);
+    uint8_t* stream_restored = (uint8_t*)malloc(stream_size);
+    size_t one_shot_size = advanced_compress_to(stream_input, stream_size, one_shot, stream_cap);
+    
+    StreamEncoder* encoder = (StreamEncoder*)malloc(sizeof(StreamEncoder));
+    StreamDecoder* decoder = (StreamDecoder*)malloc(sizeof(StreamDecoder));
+    
+    // Encode with a flush every flush_every input chunks (0 = never)
+    size_t flush_intervals[] = {0, 7};
+    bool stream_identical = false;
+    bool stream_ok = true;
+    
+    for (int f = 0; f < 2; f++) {
+        stream_encoder_init(encoder);
+        StreamOutput out = {streamed, 0, 0};
+        size_t fed = 0;
+        size_t chunks = 0;
+        double start = get_time_ms();
+        
+        while (true) {
+            size_t chunk = (size_t)(rand() % 5000) + 1;
+            if (chunk > stream_size - fed) chunk = stream_size - fed;
+            StreamInput in = {stream_input + fed, chunk, 0};
+            bool last = fed + chunk == stream_size;
+            bool flush = flush_intervals[f] && ++chunks % flush_intervals[f] == 0;
+            
+            while (true) {
+                out.size = out.pos + (size_t)(rand() % 100) + 1;
+                if (out.size > stream_cap) out.size = stream_cap;
+                bool done = stream_encoder_update(encoder, &in, &out);
+                if (done && last) done = stream_encoder_end(encoder, &out);
+                else if (done && flush) done = stream_encoder_flush(encoder, &out);
+                if (done) break;
+            }
+            
+            fed += chunk;
+            if (last) break;
+        }
+        double encode_time = get_time_ms() - start;
+        size_t streamed_size = out.pos;
+        
+        if (f == 0) {
+            stream_identical = streamed_size == one_shot_size &&
+                               memcmp(streamed, one_shot, one_shot_size) == 0;
+        }
+        
+        // Decode the stream back in random chunks as well
+        stream_decoder_init(decoder);
+        StreamOutput dec_out = {stream_restored, 0, 0};
+        size_t consumed = 0;
+        start = get_time_ms();
+        
+        while (consumed < streamed_size) {
+            size_t chunk = (size_t)(rand() % 5000) + 1;
+            if (chunk > streamed_size - consumed) chunk = streamed_size - consumed;
+            StreamInput in = {streamed + consumed, chunk, 0};
+            
+            bool done = false;
+            while (!done && dec_out.pos < stream_size) {
+                dec_out.size = dec_out.pos + (size_t)(rand() % 300) + 1;
+                if (dec_out.size > stream_size) dec_out.size = stream_size;
+                done = stream_decoder_update(decoder, &in, &dec_out);
+            }
+            if (!done) break;
+            consumed += chunk;
+        }
+        double decode_time = get_time_ms() - start;
+        
+        stream_ok = stream_ok && consumed == streamed_size && stream_decoder_end(decoder) &&
+                    dec_out.pos == stream_size &&
+                    memcmp(stream_restored, stream_input, stream_size) == 0;
+        
+        printf("   • %s: %zu → %zu bytes, %.2f ms encode, %.2f ms decode\n",
+               f == 0 ? "No flushes" : "Flush every 7 chunks", stream_size, streamed_size,
+               encode_time, decode_time);
+    }
+    
+    // A format v2 stream stops the decoder however its header is split,
+    // while a v1 stream may still start with a zero-length literal
+    bool stream_formats = true;
+    size_t v2_stream_size = advanced_compress_v2_to(stream_input, 4096, streamed, stream_cap);
+    size_t v2_chunks[] = {1, 2, v2_stream_size};
+    for (int c = 0; c < 3; c++) {
+        size_t chunk = v2_chunks[c];
+        stream_decoder_init(decoder);
+        StreamOutput v2_out = {stream_restored, stream_size, 0};
+        for (size_t fed = 0; fed < v2_stream_size; fed += chunk) {
+            StreamInput in = {streamed + fed, fed + chunk < v2_stream_size ? chunk : v2_stream_size - fed, 0};
+            stream_decoder_update(decoder, &in, &v2_out);
+        }
+        stream_formats = stream_formats && !stream_decoder_end(decoder) && v2_out.pos == 0;
+    }
+    streamed[0] = MODE_LITERAL;
+    memcpy(streamed + 1, one_shot, one_shot_size);
+    stream_decoder_init(decoder);
+    StreamInput led_in = {streamed, 1, 0};
+    StreamOutput led_out = {stream_restored, stream_size, 0};
+    stream_formats = stream_formats && stream_decoder_update(decoder, &led_in, &led_out);
+    led_in = (StreamInput){streamed + 1, one_shot_size, 0};
+    stream_formats = stream_formats && stream_decoder_update(decoder, &led_in, &led_out) &&
+                     stream_decoder_end(decoder) && led_out.pos == stream_size &&
+                     memcmp(stream_restored, stream_input, stream_size) == 0;
+    
+    printf("   • State: %zu bytes encoder, %zu bytes decoder\n",
+           sizeof(StreamEncoder), sizeof(StreamDecoder));
+    printf("   • Identical to one-shot output: %s\n", stream_identical ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Chunked round trips: %s\n", stream_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • v2 header stops the decoder, v1 read as before: %s\n", stream_formats ? "✓ PASSED" : "✗ FAILED");
+    
+    free(encoder);
+    free(decoder);
+    free(stream_input);
+    free(one_shot);
+    free(streamed);
+    free(stream_restored);
+    
+    // Encoder time must grow linearly with input size
+    printf("\n11. LINEAR-TIME REGRESSION TEST (advanced codec, 1 KB → 16 MB)\n");
+    printf("   ───────────────────────────────────────────────────────\n");
+    
+    const char* linear_patterns[] = {"mixed", "bursts", "random"};
+    size_t linear_sizes[] = {1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024};
+    size_t linear_max = linear_sizes[4];
+    uint8_t* linear_output = (uint8_t*)malloc(advanced_compress_bound(linear_max));
+    bool linear_ok = true;
+    
+    for (int p = 0; p < 3; p++) {
+        uint8_t* linear_input = generate_pattern(linear_patterns[p], linear_max);
+        double ns_per_byte[5];
+        
+        // Every size encodes 16 MB in total; best of two passes
+        for (int s = 0; s < 5; s++) {
+            size_t size = linear_sizes[s];
+            size_t reps = linear_max / size;
+            double best = 0;
+            
+            for (int pass = 0; pass < 2; pass++) {
+                double start = get_time_ms();
+                for (size_t r = 0; r < reps; r++) {
+                    advanced_compress_to(linear_input + (r * size) % linear_max, size,
+                                         linear_output, advanced_compress_bound(size));
+                }
+                double elapsed = get_time_ms() - start;
+                if (pass == 0 || elapsed < best) best = elapsed;
+            }
+            ns_per_byte[s] = best * 1e6 / (double)linear_max;
+        }
+        
+        // Cache effects alone stay well inside 4x
+        bool pattern_ok = ns_per_byte[4] <= ns_per_byte[0] * 4.0;
+        linear_ok = linear_ok && pattern_ok;
+        
+        printf("   • %-6s ns/byte:", linear_patterns[p]);
+        for (int s = 0; s < 5; s++) printf(" %.2f", ns_per_byte[s]);
+        printf(" (16 MB / 1 KB = %.2fx)\n", ns_per_byte[4] / ns_per_byte[0]);
+        
+        free(linear_input);
+    }
+    
+    free(linear_output);
+    printf("   • Linear scaling: %s\n", linear_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    // Vectorized run detection against the scalar kernel
+    printf("\n12. SIMD RUN DETECTION TEST (16 MB of burst-then-run input)\n");
+    printf("   ──────────────────────────────────────────────────────\n");
+    
+    typedef struct {
+        const char* name;
+        RunLengthFn fn;
+    } RunKernel;
+    
+    RunKernel run_kernels[4];
+    int run_kernel_count = 0;
+    run_kernels[run_kernel_count++] = (RunKernel){"scalar", run_length_scalar};
+#if defined(RUN_KERNELS_X86)
+    if (__builtin_cpu_supports("sse2")) run_kernels[run_kernel_count++] = (RunKernel){"sse2", run_length_sse2};
+    if (__builtin_cpu_supports("avx2")) run_kernels[run_kernel_count++] = (RunKernel){"avx2", run_length_avx2};
+#elif defined(RUN_KERNELS_NEON)
+    run_kernels[run_kernel_count++] = (RunKernel){"neon", run_length_neon};
+#endif
+    
+    size_t run_input_size = 16 * 1024 * 1024;
+    uint8_t* run_input = generate_pattern("bursts", run_input_size);
+    uint8_t* run_zeros = (uint8_t*)calloc(run_input_size, 1);
+    size_t simple_cap = simple_rle_compress_bound(run_input_size);
+    size_t advanced_cap = advanced_compress_bound(run_input_size);
+    uint8_t* simple_reference = (uint8_t*)malloc(simple_cap);
+    uint8_t* advanced_reference = (uint8_t*)malloc(advanced_cap);
+    uint8_t* run_output = (uint8_t*)malloc(advanced_cap);
+    
+    count_run(run_input, 1);
+    RunLengthFn selected_kernel = run_length_impl;
+    printf("   • Selected kernel: %s\n", run_length_kernel);
+    
+    bool kernels_agree = true;
+    bool kernel_output_identical = true;
+    size_t simple_reference_size = 0;
+    size_t advanced_reference_size = 0;
+    
+    for (int k = 0; k < run_kernel_count; k++) {
+        RunLengthFn kernel = run_kernels[k].fn;
+        
+        // Random probes, including limits that end inside a vector block
+        for (int i = 0; i < 100000; i++) {
+            size_t offset = ((size_t)rand() * 4099) % (run_input_size - 512);
+            size_t limit = (size_t)(rand() % 511) + 1;
+            kernels_agree = kernels_agree &&
+                            kernel(run_input + offset, limit) == run_length_scalar(run_input + offset, limit);
+        }
+        
+        // Scan rate over 16 MB of zeros in zero-run-sized steps
+        double start = get_time_ms();
+        size_t scanned = 0;
+        for (size_t pos = 0; pos + 255 <= run_input_size; pos += 255) {
+            scanned += kernel(run_zeros + pos, 255);
+        }
+        double scan_time = get_time_ms() - start;
+        
+        // Both codecs with this kernel forced; the scalar pass is the reference
+        run_length_impl = kernel;
+        uint8_t* simple_target = k == 0 ? simple_reference : run_output;
+        start = get_time_ms();
+        size_t simple_size = simple_rle_compress_to(run_input, run_input_size, simple_target, simple_cap);
+        double simple_time = get_time_ms() - start;
+        
+        if (k == 0) simple_reference_size = simple_size;
+        kernel_output_identical = kernel_output_identical && simple_size == simple_reference_size &&
+                                  memcmp(simple_target, simple_reference, simple_size) == 0;
+        
+        uint8_t* advanced_target = k == 0 ? advanced_reference : run_output;
+        start = get_time_ms();
+        size_t advanced_size = advanced_compress_to(run_input, run_input_size, advanced_target, advanced_cap);
+        double advanced_time = get_time_ms() - start;
+        run_length_impl = selected_kernel;
+        
+        if (k == 0) advanced_reference_size = advanced_size;
+        kernel_output_identical = kernel_output_identical && advanced_size == advanced_reference_size &&
+                                  memcmp(advanced_target, advanced_reference, advanced_size) == 0;
+        
+        printf("   • %-6s: scan %.2f GB/s, Simple RLE %.1f MB/s, Advanced %.1f MB/s\n",
+               run_kernels[k].name, scanned / (scan_time * 1e6),
+               run_input_size / (simple_time * 1000.0), run_input_size / (advanced_time * 1000.0));
+    }
+    
+    printf("   • Kernels agree with scalar: %s\n", kernels_agree ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Compressed output identical for every kernel: %s\n",
+           kernel_output_identical ? "✓ PASSED" : "✗ FAILED");
+    
+    free(run_input);
+    free(run_zeros);
+    free(simple_reference);
+    free(advanced_reference);
+    free(run_output);
+    
+    // Decode kernels: agreement with the scalar references, then throughput
+    printf("\n13. DECODE KERNEL TEST (16 MB of output per token type)\n");
+    printf("   ──────────────────────────────────────────────────\n");
+    
+    uint8_t kernel_in[512];
+    uint8_t kernel_out[2][1024];
+    bool decode_kernels_agree = true;
+    for (size_t i = 0; i < sizeof(kernel_in); i++) kernel_in[i] = (uint8_t)rand();
+    
+    for (size_t length = 1; length <= 62; length++) {
+        nibble_unpack(kernel_in, length, kernel_out[0]);
+        nibble_unpack_scalar(kernel_in, length, kernel_out[1]);
+        decode_kernels_agree = decode_kernels_agree && memcmp(kernel_out[0], kernel_out[1], length) == 0;
+    }
+    for (int start = 0; start < 128; start++) {
+        for (int delta = -15; delta <= 15; delta++) {
+            for (size_t length = 3; length <= 31; length++) {
+                delta_fill((uint8_t)start, delta, length, kernel_out[0]);
+                delta_fill_scalar((uint8_t)start, delta, length, kernel_out[1]);
+                decode_kernels_agree = decode_kernels_agree &&
+                                       memcmp(kernel_out[0], kernel_out[1], length) == 0;
+            }
+        }
+    }
+    for (size_t length = 1; length <= 15; length++) {
+        for (size_t repeat = 0; repeat <= 15; repeat++) {
+            pattern_fill(kernel_in, length, repeat, kernel_out[0]);
+            pattern_fill_scalar(kernel_in, length, repeat, kernel_out[1]);
+            decode_kernels_agree = decode_kernels_agree &&
+                                   memcmp(kernel_out[0], kernel_out[1], length * repeat) == 0;
+        }
+    }
+    for (int i = 0; i < 10000; i++) {
+        size_t period = (size_t)(rand() % 256) + 1;
+        size_t length = (size_t)(rand() % 512) + 1;
+        memcpy(kernel_out[0], kernel_in, period);
+        memcpy(kernel_out[1], kernel_in, period);
+        repeat_copy(kernel_out[0], period, period, length);
+        repeat_copy_scalar(kernel_out[1], period, period, length);
+        decode_kernels_agree = decode_kernels_agree &&
+                               memcmp(kernel_out[0], kernel_out[1], period + length) == 0;
+    }
+    
+    // Streams made of a single token type, built directly
+    const char* token_names[] = {"Nibble (62 B)", "Delta (31 B)", "Pattern", "Match (255 B)"};
+    size_t token_target = 16 * 1024 * 1024;
+    uint8_t* token_stream = (uint8_t*)malloc(token_target);
+    uint8_t* token_output = (uint8_t*)malloc(token_target + 256);
+    bool token_ok = true;
+    
+    for (int t = 0; t < 4; t++) {
+        size_t stream_len = 0;
+        size_t expected = 0;
+        
+        if (t == 3) {
+            // Matches need something to refer back to
+            token_stream[stream_len++] = MODE_LITERAL | 63;
+            for (int i = 0; i < 63; i++) token_stream[stream_len++] = (uint8_t)rand();
+            expected = 63;
+        }
+        
+        while (expected < token_target) {
+            if (t == 0) {
+                token_stream[stream_len++] = MODE_NIBBLE | 62;
+                for (int i = 0; i < 31; i++) token_stream[stream_len++] = (uint8_t)rand();
+                expected += 62;
+            } else if (t == 1) {
+                token_stream[stream_len++] = MODE_DELTA | 31;
+                token_stream[stream_len++] = (uint8_t)(rand() & 0x7F);
+                token_stream[stream_len++] = (uint8_t)(rand() % 31 + 1);
+                expected += 31;
+            } else if (t == 2) {
+                size_t pattern_len = (size_t)(rand() % 15) + 1;
+                token_stream[stream_len++] = EXT_PATTERN;
+                token_stream[stream_len++] = (uint8_t)((pattern_len << 4) | 15);
+                for (size_t i = 0; i < pattern_len; i++) token_stream[stream_len++] = (uint8_t)rand();
+                expected += pattern_len * 15;
+            } else {
+                size_t offset = (size_t)(rand() % 63) + 1;
+                token_stream[stream_len++] = EXT_MATCH;
+                token_stream[stream_len++] = 255;
+                token_stream[stream_len++] = (uint8_t)offset;
+                token_stream[stream_len++] = 0;
+                expected += 255;
+            }
+        }
+        
+        double best = 0;
+        size_t decoded = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            double start = get_time_ms();
+            decoded = advanced_decompress_to(token_stream, stream_len, token_output, token_target + 256);
+            double elapsed = get_time_ms() - start;
+            if (pass == 0 || elapsed < best) best = elapsed;
+        }
+        token_ok = token_ok && decoded == expected;
+        
+        printf("   • %-14s %.2f GB/s\n", token_names[t], decoded / (best * 1e6));
+    }
+    
+    printf("   • Kernels agree with scalar: %s\n", decode_kernels_agree ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Token streams decoded: %s\n", token_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    // The mixed generator switches token type every few bytes, so this is
+    // where dispatch cost shows rather than copy speed
+    uint8_t* mixed_data = generate_pattern("mixed", token_target);
+    size_t mixed_capacity = advanced_compress_bound(token_target);
+    uint8_t* mixed_stream = (uint8_t*)malloc(mixed_capacity);
+    size_t mixed_size = advanced_compress_to(mixed_data, token_target, mixed_stream, mixed_capacity);
+    
+    double mixed_best = 0;
+    size_t mixed_decoded = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        double start = get_time_ms();
+        mixed_decoded = advanced_decompress_to(mixed_stream, mixed_size, token_output, token_target);
+        double elapsed = get_time_ms() - start;
+        if (pass == 0 || elapsed < mixed_best) mixed_best = elapsed;
+    }
+    bool mixed_ok = mixed_decoded == token_target && memcmp(mixed_data, token_output, token_target) == 0;
+    
+    printf("   • %-14s %.0f MB/s\n", "Mixed stream", token_target / (mixed_best * 1000));
+    printf("   • Mixed stream decoded: %s\n", mixed_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    free(mixed_data);
+    free(mixed_stream);
+    free(token_stream);
+    free(token_output);
+    
+    // Hardened decoder
+    printf("\n14. HARDENED DECODER TEST (truncated, corrupted and undersized input)\n");
+    printf("   ──────────────────────────────────────────────────────────────────\n");
+    
+    size_t hard_size = 4096;
+    uint8_t* hard_data = generate_pattern("mixed", hard_size);
+    size_t hard_capacity = advanced_compress_bound(hard_size);
+    uint8_t* hard_stream = (uint8_t*)malloc(hard_capacity);
+    uint8_t* hard_damaged = (uint8_t*)malloc(hard_capacity);
+    uint8_t* hard_output = (uint8_t*)malloc(hard_size + 64);
+    size_t hard_compressed = advanced_compress_to(hard_data, hard_size, hard_stream, hard_capacity);
+    
+    // Cutting the stream at a token boundary decodes a prefix of the input;
+    // cutting it anywhere else must be rejected
+    bool truncation_ok = true;
+    for (size_t cut = 1; cut < hard_compressed; cut++) {
+        size_t decoded = 0;
+        bool contained = decode_within_capacity(hard_stream, cut, hard_output, hard_size, &decoded);
+        truncation_ok = truncation_ok && contained &&
+                        (decoded == 0 || memcmp(hard_output, hard_data, decoded) == 0);
+    }
+    
+    bool corruption_ok = true;
+    for (int trial = 0; trial < 5000; trial++) {
+        memcpy(hard_damaged, hard_stream, hard_compressed);
+        int flips = rand() % 4 + 1;
+        for (int f = 0; f < flips; f++) hard_damaged[rand() % hard_compressed] = (uint8_t)rand();
+        
+        size_t decoded = 0;
+        corruption_ok = corruption_ok &&
+                        decode_within_capacity(hard_damaged, hard_compressed, hard_output, hard_size, &decoded);
+    }
+    
+    bool undersized_ok = true;
+    for (size_t cap = 0; cap < hard_size; cap++) {
+        size_t decoded = 0;
+        bool contained = decode_within_capacity(hard_stream, hard_compressed, hard_output, cap, &decoded);
+        undersized_ok = undersized_ok && contained && decoded == 0;
+    }
+    
+    size_t hard_decoded = 0;
+    bool exact_ok = decode_within_capacity(hard_stream, hard_compressed, hard_output, hard_size, &hard_decoded) &&
+                    hard_decoded == hard_size && memcmp(hard_output, hard_data, hard_size) == 0;
+    
+    printf("   • Every truncation (%zu cuts): %s\n", hard_compressed - 1,
+           truncation_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • 5000 corrupted streams stay in bounds: %s\n", corruption_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Every undersized output rejected: %s\n", undersized_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Exact-size output round trip: %s\n", exact_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    free(hard_data);
+    free(hard_stream);
+    free(hard_damaged);
+    free(hard_output);
+    
+    // Entropy stage
+    printf("\n15. ENTROPY STAGE TEST (Huffman-coded token stream)\n");
+    printf("   ────────────────────────────────────────────────\n");
+    
+    const char* entropy_patterns[] = {
+        "zeros", "runs", "sequence", "pattern", "nibbles", "mixed", "random", "skewed"
+    };
+    bool entropy_round_trips = true;
+    
+    for (int p = 0; p < 8; p++) {
+        for (int s = 0; s < 5; s++) {
+            uint8_t* test_data = generate_pattern(entropy_patterns[p], sizes[s]);
+            size_t bound = entropy_compress_bound(sizes[s]);
+            uint8_t* packed = (uint8_t*)malloc(bound);
+            uint8_t* restored = (uint8_t*)malloc(sizes[s]);
+            
+            size_t compressed = entropy_compress_to(test_data, sizes[s], packed, bound);
+            size_t restored_size = entropy_decompress_to(packed, compressed, restored, sizes[s]);
+            entropy_round_trips = entropy_round_trips && compressed > 0 && restored_size == sizes[s] &&
+                                  memcmp(restored, test_data, sizes[s]) == 0;
+            
+            free(test_data);
+            free(packed);
+            free(restored);
+        }
+    }
+    
+    // Never more than one byte over the advanced stream, and the literal
+    // fallback on skewed input must actually shrink
+    size_t entropy_test_size = 64 * 1024;
+    size_t entropy_bound = entropy_compress_bound(entropy_test_size);
+    uint8_t* entropy_packed = (uint8_t*)malloc(entropy_bound);
+    bool entropy_never_worse = true;
+    bool entropy_pays = false;
+    
+    for (int p = 5; p < 8; p++) {
+        uint8_t* test_data = generate_pattern(entropy_patterns[p], entropy_test_size);
+        size_t advanced_size = advanced_compress_to(test_data, entropy_test_size, entropy_packed, entropy_bound);
+        size_t entropy_size = entropy_compress_to(test_data, entropy_test_size, entropy_packed, entropy_bound);
+        entropy_never_worse = entropy_never_worse && entropy_size <= advanced_size + 1;
+        if (p == 7) entropy_pays = entropy_size < advanced_size * 9 / 10;
+        
+        printf("   • %-8s 64 KB: advanced %6zu B, + entropy %6zu B\n",
+               entropy_patterns[p], advanced_size, entropy_size);
+        free(test_data);
+    }
+    free(entropy_packed);
+    
+    // The Huffman stage alone, on 16 MB of skewed bytes
+    size_t huf_size = 16 * 1024 * 1024;
+    uint8_t* huf_input = generate_pattern("skewed", huf_size);
+    uint8_t* huf_packed = (uint8_t*)malloc(huf_size + HUF_HEADER_SIZE);
+    uint8_t* huf_output = (uint8_t*)malloc(huf_size);
+    size_t huf_compressed = huf_compress_to(huf_input, huf_size, huf_packed, huf_size + HUF_HEADER_SIZE,
+                                            huf_size + HUF_HEADER_SIZE);
+    
+    double huf_best = 0;
+    size_t huf_decoded = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        double start = get_time_ms();
+        huf_decoded = huf_decompress_to(huf_packed, huf_compressed, huf_output, huf_size);
+        double elapsed = get_time_ms() - start;
+        if (pass == 0 || elapsed < huf_best) huf_best = elapsed;
+    }
+    bool huf_ok = huf_decoded == huf_size && memcmp(huf_input, huf_output, huf_size) == 0;
+    
+    printf("   • Huffman stage: %.2f bits/byte, decode %.2f GB/s\n",
+           huf_compressed * 8.0 / huf_size, huf_size / (huf_best * 1e6));
+    printf("   • Round trips: %s\n", entropy_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Never more than 1 B over advanced: %s\n", entropy_never_worse ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Skewed literals saved over 10%%: %s\n", entropy_pays ? "✓ PASSED" : "✗ FAILED");
+    printf("   • 16 MB Huffman round trip: %s\n", huf_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    free(huf_input);
+    free(huf_packed);
+    free(huf_output);
+    
+    // Block analyzer
+    printf("\n16. BLOCK ANALYZER TEST (4 MB frames, auto codec against fixed codecs)\n");
+    printf("   ────────────────────────────────────────────────────────────────────\n");
+    
+    const char* auto_patterns[] = {"runs", "nibbles", "mixed", "random"};
+    // Codec the analyzer should settle on for most blocks of each pattern;
+    // the 7-bit random bytes only shrink as format v2 bit-pack tokens
+    uint8_t auto_expected[] = {CODEC_SIMPLE_RLE, CODEC_ADVANCED, CODEC_ADVANCED, CODEC_ADVANCED};
+    size_t auto_input_size = 4 * 1024 * 1024;
+    uint8_t* auto_restored = (uint8_t*)malloc(auto_input_size);
+    bool auto_round_trips = true;
+    bool auto_choices_ok = true;
+    bool auto_never_worse = true;
+    
+    for (int p = 0; p < 4; p++) {
+        uint8_t* auto_input = generate_pattern(auto_patterns[p], auto_input_size);
+        size_t best_fixed = 0;
+        double fixed_time = 0;
+        size_t auto_size = 0;
+        double auto_time = 0;
+        size_t codec_blocks[4] = {0};
+        
+        for (int c = 0; c < 3; c++) {
+            FrameOptions opts;
+            frame_options_init(&opts);
+            opts.codec = c == 0 ? CODEC_SIMPLE_RLE : c == 1 ? CODEC_ADVANCED : CODEC_AUTO;
+            opts.index = false;
+            
+            size_t frame_cap = frame_compress_bound(auto_input_size, &opts);
+            uint8_t* frame = (uint8_t*)malloc(frame_cap);
+            double start = get_time_ms();
+            size_t frame_size = frame_compress(auto_input, auto_input_size, frame, frame_cap, &opts);
+            double elapsed = get_time_ms() - start;
+            
+            if (c < 2) {
+                if (c == 0 || frame_size < best_fixed) best_fixed = frame_size;
+                if (c == 1) fixed_time = elapsed;
+            } else {
+                auto_size = frame_size;
+                auto_time = elapsed;
+                
+                FrameHeader header;
+                FrameBlock block;
+                size_t pos = FRAME_HEADER_SIZE;
+                frame_read_header(frame, frame_size, &header);
+                while (frame_read_block(frame, frame_size, pos, &header, &block, &pos) &&
+                       block.original_size > 0) {
+                    if (block.codec < 4) codec_blocks[block.codec]++;
+                }
+                
+                auto_round_trips = auto_round_trips &&
+                                   frame_decompress(frame, frame_size, auto_restored, auto_input_size) == auto_input_size &&
+                                   memcmp(auto_restored, auto_input, auto_input_size) == 0;
+            }
+            free(frame);
+        }
+        
+        size_t blocks = codec_blocks[0] + codec_blocks[1] + codec_blocks[2] + codec_blocks[3];
+        auto_choices_ok = auto_choices_ok && codec_blocks[auto_expected[p]] * 10 >= blocks * 9;
+        // Sampling may miss a little; allow 2% over the better fixed codec
+        auto_never_worse = auto_never_worse && auto_size * 100 <= best_fixed * 102;
+        
+        printf("   • %-8s auto %8zu B in %5.1f ms (best fixed %8zu B, advanced %5.1f ms)"
+               " — stored/simple/advanced blocks %zu/%zu/%zu\n",
+               auto_patterns[p], auto_size, auto_time, best_fixed, fixed_time,
+               codec_blocks[CODEC_STORED], codec_blocks[CODEC_SIMPLE_RLE], codec_blocks[CODEC_ADVANCED]);
+        free(auto_input);
+    }
+    free(auto_restored);
+    
+    printf("   • Round trips: %s\n", auto_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Expected codec on 90%% of blocks: %s\n", auto_choices_ok ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Within 2%% of the better fixed codec: %s\n", auto_never_worse ? "✓ PASSED" : "✗ FAILED");
+    
+    // Compression levels
+    printf("\n17. COMPRESSION LEVELS TEST (256 KB per pattern)\n");
+    printf("   ──────────────────────────────────────────────\n");
+    
+    size_t level_size = 256 * 1024;
+    size_t level_bound = advanced_compress_bound(level_size);
+    uint8_t* level_packed = (uint8_t*)malloc(level_bound);
+    uint8_t* level_restored = (uint8_t*)malloc(level_size);
+    bool level_round_trips = true;
+    bool level_max_smallest = true;
+    
+    printf("   %-8s %14s %18s %18s %18s\n", "Pattern", "Simple RLE", "Level 1", "Level 2", "Level 3");
+    for (int p = 0; p < 8; p++) {
+        uint8_t* test_data = generate_pattern(entropy_patterns[p], level_size);
+        
+        uint8_t* simple_copy = (uint8_t*)malloc(level_size * 2);
+        memcpy(simple_copy, test_data, level_size);
+        double start = get_time_ms();
+        size_t simple_size = simple_rle_compress(simple_copy, level_size);
+        double simple_time = get_time_ms() - start;
+        free(simple_copy);
+        printf("   %-8s %7zu %4.0f MB/s", entropy_patterns[p], simple_size, level_size / (simple_time * 1e3 + 1e-9));
+        
+        size_t level_sizes[COMPRESS_LEVEL_MAX + 1] = {0};
+        for (int level = COMPRESS_LEVEL_FAST; level <= COMPRESS_LEVEL_MAX; level++) {
+            start = get_time_ms();
+            size_t compressed = byte_compress_level_to(test_data, level_size, level_packed, level_bound, level);
+            double elapsed = get_time_ms() - start;
+            size_t restored = byte_decompress_to(level_packed, compressed, level_restored, level_size);
+            
+            level_round_trips = level_round_trips && compressed > 0 && restored == level_size &&
+                                memcmp(level_restored, test_data, level_size) == 0;
+            level_sizes[level] = compressed;
+            printf(" %7zu %5.0f MB/s", compressed, level_size / (elapsed * 1e3 + 1e-9));
+        }
+        printf("\n");
+        
+        level_max_smallest = level_max_smallest &&
+                             level_sizes[COMPRESS_LEVEL_MAX] <= level_sizes[COMPRESS_LEVEL_DEFAULT] &&
+                             level_sizes[COMPRESS_LEVEL_MAX] <= level_sizes[COMPRESS_LEVEL_FAST];
+        free(test_data);
+    }
+    
+    // Runs and matches crossing the 64 KB cuts of a 1 MB parse
+    const char* cut_patterns[] = {"zeros", "sequence", "pattern"};
+    size_t cut_size = 1024 * 1024;
+    uint8_t* cut_packed = (uint8_t*)malloc(advanced_compress_bound(cut_size));
+    for (int p = 0; p < 3; p++) {
+        uint8_t* test_data = generate_pattern(cut_patterns[p], cut_size);
+        size_t greedy = advanced_compress_level_to(test_data, cut_size, cut_packed, advanced_compress_bound(cut_size),
+                                                   COMPRESS_LEVEL_DEFAULT);
+        size_t optimal = advanced_compress_level_to(test_data, cut_size, cut_packed, advanced_compress_bound(cut_size),
+                                                    COMPRESS_LEVEL_MAX);
+        level_max_smallest = level_max_smallest && optimal > 0 && optimal <= greedy;
+        free(test_data);
+    }
+    free(cut_packed);
+    
+    // Short inputs at every level, in place
+    for (int level = COMPRESS_LEVEL_FAST; level <= COMPRESS_LEVEL_MAX; level++) {
+        for (int s = 0; s < 5; s++) {
+            uint8_t* test_data = generate_pattern("mixed", sizes[s]);
+            uint8_t* buffer = (uint8_t*)malloc(advanced_compress_bound(sizes[s]));
+            memcpy(buffer, test_data, sizes[s]);
+            
+            size_t compressed = byte_compress_level(buffer, sizes[s], level);
+            level_round_trips = level_round_trips && byte_decompress(buffer, compressed) == sizes[s] &&
+                                memcmp(buffer, test_data, sizes[s]) == 0;
+            free(test_data);
+            free(buffer);
+        }
+    }
+    free(level_packed);
+    free(level_restored);
+    
+    printf("   • Round trips at every level: %s\n", level_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Level 3 smallest: %s\n", level_max_smallest ? "✓ PASSED" : "✗ FAILED");
+    
+    // Dictionary
+    printf("\n18. DICTIONARY TEST (4 KB trained on 2,000 device frames)\n");
+    printf("   ───────────────────────────────────────────────────────\n");
+    
+    size_t dict_sample_count = 2000;
+    size_t* dict_sample_sizes = (size_t*)malloc(dict_sample_count * sizeof(size_t));
+    uint8_t* dict_samples = (uint8_t*)malloc(dict_sample_count * 256);
+    size_t dict_samples_total = 0;
+    for (size_t i = 0; i < dict_sample_count; i++) {
+        dict_sample_sizes[i] = 16 + rand() % 241;
+        generate_device_frame(dict_samples + dict_samples_total, dict_sample_sizes[i]);
+        dict_samples_total += dict_sample_sizes[i];
+    }
+    
+    Dictionary* dict = (Dictionary*)malloc(sizeof(Dictionary));
+    double train_start = get_time_ms();
+    size_t dict_size = dictionary_train(dict_samples, dict_sample_sizes, dict_sample_count, 4096, dict);
+    double train_time = get_time_ms() - train_start;
+    bool dict_registered = dict_size > 0 && dictionary_register(dict);
+    printf("   • Trained %zu B from %zu B of samples in %.1f ms\n", dict_size, dict_samples_total, train_time);
+    
+    size_t dict_frame_sizes[] = {16, 64, 256};
+    bool dict_round_trips = dict_registered;
+    bool dict_pays = dict_registered;
+    bool dict_required = dict_registered;
+    
+    for (int s = 0; s < 3 && dict_registered; s++) {
+        size_t frame_size = dict_frame_sizes[s];
+        uint8_t frame[256], packed[512], restored[256];
+        size_t plain_total = 0, dict_total = 0;
+        
+        for (int i = 0; i < 1000; i++) {
+            generate_device_frame(frame, frame_size);
+            plain_total += advanced_compress_to(frame, frame_size, packed, sizeof(packed));
+            size_t compressed = byte_compress_dict_to(frame, frame_size, packed, sizeof(packed), dict->id);
+            dict_total += compressed;
+            
+            dict_round_trips = dict_round_trips && compressed > 0 &&
+                               byte_decompress_dict_to(packed, compressed, restored, frame_size, dict->id) == frame_size &&
+                               memcmp(restored, frame, frame_size) == 0;
+            if (i == 0) {
+                // References into the dictionary don't resolve without it
+                dict_required = dict_required && advanced_decompress_to(packed, compressed, restored, frame_size) == 0;
+            }
+        }
+        
+        printf("   • %3zu B frames: no dictionary %5.1f%% of original, with dictionary %5.1f%%\n",
+               frame_size, 100.0 * plain_total / (1000 * frame_size), 100.0 * dict_total / (1000 * frame_size));
+        dict_pays = dict_pays && dict_total * 10 < plain_total * 8;
+    }
+    
+    // Saved content loads back to the same dictionary; unknown ids are refused
+    Dictionary* reloaded = (Dictionary*)malloc(sizeof(Dictionary));
+    uint8_t id_frame[64], id_packed[128];
+    generate_device_frame(id_frame, sizeof(id_frame));
+    bool dict_ids_ok = dict_registered && dictionary_load(reloaded, dict->content, dict->size) &&
+                       reloaded->id == dict->id &&
+                       byte_compress_dict_to(id_frame, sizeof(id_frame), id_packed, sizeof(id_packed), dict->id + 1) == 0;
+    dictionary_unregister(dict->id);
+    dict_ids_ok = dict_ids_ok && dictionary_register(reloaded) &&
+                  byte_compress_dict_to(id_frame, sizeof(id_frame), id_packed, sizeof(id_packed), dict->id) ==
+                  dictionary_compress_to(dict, id_frame, sizeof(id_frame), id_packed, sizeof(id_packed));
+    dictionary_unregister(reloaded->id);
+    
+    printf("   • Round trips: %s\n", dict_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Over 20%% smaller with the dictionary: %s\n", dict_pays ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Plain decoder refuses dictionary streams: %s\n", dict_required ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Reload, register and id lookup: %s\n", dict_ids_ok ? "✓ PASSED" : "✗ FAILED");
+    
+    free(dict_samples);
+    free(dict_sample_sizes);
+    free(dict);
+    free(reloaded);
+    
+    // Batch API
+    printf("\n19. BATCH API TEST (10,000 device frames per batch)\n");
+    printf("   ────────────────────────────────────────────────\n");
+    
+    size_t batch_count = 10000;
+    size_t batch_slot = advanced_compress_bound(256);
+    size_t batch_threads = frame_default_threads();
+    BatchInput* batch_in = (BatchInput*)malloc(batch_count * sizeof(BatchInput));
+    BatchOutput* batch_out = (BatchOutput*)malloc(batch_count * sizeof(BatchOutput));
+    BatchInput* batch_packed = (BatchInput*)malloc(batch_count * sizeof(BatchInput));
+    BatchOutput* batch_restored = (BatchOutput*)malloc(batch_count * sizeof(BatchOutput));
+    uint8_t* batch_frames = (uint8_t*)malloc(batch_count * 256);
+    uint8_t* batch_arena = (uint8_t*)malloc(batch_count * batch_slot);
+    uint8_t* batch_looped = (uint8_t*)malloc(batch_count * batch_slot);
+    uint8_t* batch_decoded = (uint8_t*)malloc(batch_count * 256);
+    bool batch_identical = true;
+    bool batch_round_trips = true;
+    
+    // 24 bytes is the original example's size; the second batch spans the
+    // whole range a gateway sees
+    const char* batch_names[] = {"24-byte", "24-256 byte"};
+    size_t batch_min[] = {24, 24};
+    size_t batch_max[] = {24, 256};
+    for (int c = 0; c < 2; c++) {
+        size_t batch_bytes = 0;
+        for (size_t i = 0; i < batch_count; i++) {
+            size_t size = batch_min[c] + rand() % (batch_max[c] - batch_min[c] + 1);
+            generate_device_frame(batch_frames + i * 256, size);
+            batch_in[i] = (BatchInput){batch_frames + i * 256, size};
+            batch_out[i] = (BatchOutput){batch_arena + i * batch_slot, batch_slot, 0};
+            batch_bytes += size;
+        }
+        
+        // One call per frame, as the gateway does without the batch API
+        double batch_start = get_time_ms();
+        for (size_t i = 0; i < batch_count; i++) {
+            byte_compress_to(batch_in[i].data, batch_in[i].size, batch_looped + i * batch_slot, batch_slot);
+        }
+        double looped_time = get_time_ms() - batch_start;
+        
+        batch_start = get_time_ms();
+        size_t batch_ok = byte_compress_batch(batch_in, batch_count, batch_out, 1);
+        double batch_time = get_time_ms() - batch_start;
+        
+        batch_start = get_time_ms();
+        batch_ok += byte_compress_batch(batch_in, batch_count, batch_out, batch_threads);
+        double threaded_time = get_time_ms() - batch_start;
+        
+        batch_identical = batch_identical && batch_ok == 2 * batch_count;
+        for (size_t i = 0; i < batch_count && batch_identical; i++) {
+            uint8_t* looped = batch_looped + i * batch_slot;
+            size_t looped_size = byte_compress_to(batch_in[i].data, batch_in[i].size, looped, batch_slot);
+            batch_identical = looped_size == batch_out[i].size && memcmp(looped, batch_out[i].data, looped_size) == 0;
+            batch_packed[i] = (BatchInput){batch_out[i].data, batch_out[i].size};
+            batch_restored[i] = (BatchOutput){batch_decoded + i * 256, batch_in[i].size, 0};
+        }
+        
+        batch_start = get_time_ms();
+        size_t decoded_ok = byte_decompress_batch(batch_packed, batch_count, batch_restored, 1);
+        double decode_time = get_time_ms() - batch_start;
+        
+        batch_round_trips = batch_round_trips && decoded_ok == batch_count;
+        for (size_t i = 0; i < batch_count && batch_round_trips; i++) {
+            batch_round_trips = batch_restored[i].size == batch_in[i].size &&
+                                memcmp(batch_restored[i].data, batch_in[i].data, batch_in[i].size) == 0;
+        }
+        
+        printf("   %s frames:\n", batch_names[c]);
+        printf("   • byte_compress_to per frame: %8.0f frames/s, %6.1f MB/s\n",
+               batch_count / (looped_time / 1000), batch_bytes / (looped_time * 1000));
+        printf("   • Batch, 1 thread:            %8.0f frames/s, %6.1f MB/s\n",
+               batch_count / (batch_time / 1000), batch_bytes / (batch_time * 1000));
+        printf("   • Batch, %2zu threads:         %8.0f frames/s, %6.1f MB/s\n", batch_threads,
+               batch_count / (threaded_time / 1000), batch_bytes / (threaded_time * 1000));
+        printf("   • Batch decode, 1 thread:     %8.0f frames/s, %6.1f MB/s\n",
+               batch_count / (decode_time / 1000), batch_bytes / (decode_time * 1000));
+    }
+    
+    // A frame whose buffer is too small is the only one to come back empty
+    batch_out[7].capacity = 4;
+    bool batch_isolated = byte_compress_batch(batch_in, batch_count, batch_out, batch_threads) == batch_count - 1 &&
+                          batch_out[7].size == 0 && batch_out[8].size > 0;
+    
+    printf("   • Identical to byte_compress_to: %s\n", batch_identical ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Round trips: %s\n", batch_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Undersized frame is the only one left empty: %s\n", batch_isolated ? "✓ PASSED" : "✗ FAILED");
+    
+    free(batch_in);
+    free(batch_out);
+    free(batch_packed);
+    free(batch_restored);
+    free(batch_frames);
+    free(batch_arena);
+    free(batch_looped);
+    free(batch_decoded);
+    
+    // Allocator hooks
+    printf("\n20. ALLOCATOR HOOKS TEST (every codec allocation from one bump arena)\n");
+    printf("   ──────────────────────────────────────────────────────────────────\n");
+    
+    size_t arena_capacity = 64 * 1024 * 1024;
+    CountingArena counting;
+    bump_arena_init(&counting.arena, malloc(arena_capacity), arena_capacity);
+    counting.allocations = 0;
+    CodecAllocator counting_allocator = {counting_arena_alloc, bump_arena_free, &counting};
+    
+    size_t hook_size = 1024 * 1024;
+    size_t hook_capacity = frame_compress_bound(hook_size, NULL);
+    uint8_t* hook_input = generate_pattern("mixed", hook_size);
+    uint8_t* hook_packed = (uint8_t*)malloc(hook_capacity);
+    uint8_t* hook_restored = (uint8_t*)malloc(hook_size);
+    uint8_t hook_frame[512];
+    bool hook_round_trips = true;
+    size_t packed_size;
+    
+    codec_set_allocator(&counting_allocator);
+    printf("   %-42s %12s %8s\n", "Call", "Peak bytes", "Allocs");
+    
+    memcpy(hook_frame, hook_input, 256);
+    counting_arena_restart(&counting);
+    packed_size = simple_rle_compress(hook_frame, 256);
+    print_allocation_row("simple_rle_compress (256 B)", &counting);
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips && simple_rle_decompress(hook_frame, packed_size) == 256 &&
+                       memcmp(hook_frame, hook_input, 256) == 0;
+    print_allocation_row("simple_rle_decompress (256 B)", &counting);
+    
+    counting_arena_restart(&counting);
+    packed_size = byte_compress(hook_frame, 256);
+    print_allocation_row("byte_compress (256 B)", &counting);
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips && byte_decompress(hook_frame, packed_size) == 256 &&
+                       memcmp(hook_frame, hook_input, 256) == 0;
+    print_allocation_row("byte_decompress (256 B)", &counting);
+    
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips &&
+                       byte_compress_level_to(hook_input, 64 * 1024, hook_packed, hook_capacity, COMPRESS_LEVEL_MAX) > 0;
+    print_allocation_row("byte_compress_level_to (64 KB, level 3)", &counting);
+    
+    counting_arena_restart(&counting);
+    packed_size = entropy_compress_to(hook_input, 64 * 1024, hook_packed, hook_capacity);
+    print_allocation_row("entropy_compress_to (64 KB)", &counting);
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips && entropy_decompress_to(hook_packed, packed_size, hook_restored, 64 * 1024) == 64 * 1024 &&
+                       memcmp(hook_restored, hook_input, 64 * 1024) == 0;
+    print_allocation_row("entropy_decompress_to (64 KB)", &counting);
+    
+    FrameOptions hook_opts;
+    frame_options_init(&hook_opts);
+    hook_opts.threads = 4;
+    counting_arena_restart(&counting);
+    packed_size = frame_compress(hook_input, hook_size, hook_packed, hook_capacity, &hook_opts);
+    print_allocation_row("frame_compress (1 MB, 4 threads)", &counting);
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips &&
+                       frame_decompress_range(hook_packed, packed_size, 1000, 100000, hook_restored) == 100000 &&
+                       memcmp(hook_restored, hook_input + 1000, 100000) == 0;
+    print_allocation_row("frame_decompress_range (100 KB)", &counting);
+    
+    BatchInput hook_batch_in[64];
+    BatchOutput hook_batch_out[64];
+    for (int i = 0; i < 64; i++) {
+        hook_batch_in[i] = (BatchInput){hook_input + i * 64, 64};
+        hook_batch_out[i] = (BatchOutput){hook_packed + i * 128, 128, 0};
+    }
+    counting_arena_restart(&counting);
+    hook_round_trips = hook_round_trips && byte_compress_batch(hook_batch_in, 64, hook_batch_out, 1) == 64;
+    print_allocation_row("byte_compress_batch (64 x 64 B)", &counting);
+    
+    // An arena too small for the scratch buffer fails the call cleanly
+    uint8_t tiny_arena[64];
+    BumpArena small;
+    bump_arena_init(&small, tiny_arena, sizeof(tiny_arena));
+    CodecAllocator small_allocator = bump_arena_allocator(&small);
+    codec_set_allocator(&small_allocator);
+    memcpy(hook_frame, hook_input, 256);
+    bool hook_exhaustion = byte_compress(hook_frame, 256) == 256 && simple_rle_compress(hook_frame, 256) == 256 &&
+                           memcmp(hook_frame, hook_input, 256) == 0;
+    
+    codec_set_allocator(NULL);
+    free(counting.arena.memory);
+    free(hook_input);
+    free(hook_packed);
+    free(hook_restored);
+    
+    printf("   • Round trips with the arena installed: %s\n", hook_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Exhausted arena leaves the input untouched: %s\n", hook_exhaustion ? "✓ PASSED" : "✗ FAILED");
+    
+    // File compression
+    printf("\n21. FILE COMPRESSION TEST (5 MB mixed file, 2 KB blocks in 2 MB windows)\n");
+    printf("   ───────────────────────────────────────────────────────────────────────\n");
+    
+    size_t file_size = 5 * 1024 * 1024 + 1234;
+    uint8_t* file_input = generate_pattern("mixed", file_size);
+    uint8_t* file_expected = (uint8_t*)malloc(file_size * 2);
+    uint8_t* file_read_back = (uint8_t*)malloc(file_size * 2);
+    char raw_path[] = "/tmp/compress_raw_XXXXXX";
+    char packed_path[] = "/tmp/compress_packed_XXXXXX";
+    char restored_path[] = "/tmp/compress_restored_XXXXXX";
+    int raw_fd = mkstemp(raw_path);
+    close(mkstemp(packed_path));
+    close(mkstemp(restored_path));
+    bool file_written = raw_fd >= 0 && file_write_all(raw_fd, file_input, file_size);
+    if (raw_fd >= 0) close(raw_fd);
+    bool file_identical = file_written;
+    bool file_round_trips = file_written;
+    
+    printf("   Level   Frame size   Ratio     Compress   Decompress\n");
+    for (int level = COMPRESS_LEVEL_FAST; level <= COMPRESS_LEVEL_MAX; level++) {
+        FrameOptions opts;
+        frame_options_init(&opts);
+        opts.block_size = 2048;
+        opts.level = level;
+        opts.threads = 4;
+        
+        uint64_t frame_size = 0;
+        uint64_t restored_size = 0;
+        double start = get_time_ms();
+        bool compressed = file_compress(raw_path, packed_path, &opts, &frame_size);
+        double compress_ms = get_time_ms() - start;
+        start = get_time_ms();
+        bool decompressed = file_decompress(packed_path, restored_path, 4, &restored_size);
+        double decompress_ms = get_time_ms() - start;
+        
+        // The windowed writer must produce exactly frame_compress's frame
+        size_t expected_size = frame_compress(file_input, file_size, file_expected, file_size * 2, &opts);
+        FILE* f = fopen(packed_path, "rb");
+        size_t read_size = f ? fread(file_read_back, 1, file_size * 2, f) : 0;
+        if (f) fclose(f);
+        file_identical = file_identical && compressed && frame_size == expected_size &&
+                         read_size == expected_size && memcmp(file_read_back, file_expected, expected_size) == 0;
+        
+        f = fopen(restored_path, "rb");
+        read_size = f ? fread(file_read_back, 1, file_size * 2, f) : 0;
+        if (f) fclose(f);
+        file_round_trips = file_round_trips && decompressed && restored_size == file_size &&
+                           read_size == file_size && memcmp(file_read_back, file_input, file_size) == 0;
+        
+        printf("   %-7d %-12llu %5.1f%%   %6.1f MB/s  %6.1f MB/s\n", level, (unsigned long long)frame_size,
+               100.0 * frame_size / file_size, file_size / 1048576.0 / (compress_ms / 1000.0),
+               file_size / 1048576.0 / (decompress_ms / 1000.0));
+    }
+    
+    // 1 KB blocks make 1 MB windows, so every pipeline slot is read,
+    // compressed and written more than once, the last window short
+    FrameOptions recycle_opts;
+    frame_options_init(&recycle_opts);
+    recycle_opts.block_size = 1024;
+    recycle_opts.threads = 2;
+    uint64_t recycle_size = 0;
+    size_t recycle_expected = frame_compress(file_input, file_size, file_expected, file_size * 2, &recycle_opts);
+    bool file_recycled = file_written && file_compress(raw_path, packed_path, &recycle_opts, &recycle_size) &&
+                         recycle_size == recycle_expected;
+    FILE* recycle_file = fopen(packed_path, "rb");
+    size_t recycle_read = recycle_file ? fread(file_read_back, 1, file_size * 2, recycle_file) : 0;
+    if (recycle_file) fclose(recycle_file);
+    file_recycled = file_recycled && recycle_read == recycle_expected &&
+                    memcmp(file_read_back, file_expected, recycle_expected) == 0;
+    
+    // A frame cut short is rejected and leaves no output behind
+    bool file_truncation = truncate(packed_path, 1000) == 0 &&
+                           !file_decompress(packed_path, restored_path, 4, NULL) &&
+                           access(restored_path, F_OK) != 0;
+    
+    // An empty file still gets a complete frame
+    uint64_t empty_frame = 0;
+    uint64_t empty_restored = 1;
+    bool file_empty = truncate(raw_path, 0) == 0 &&
+                      file_compress(raw_path, packed_path, NULL, &empty_frame) &&
+                      empty_frame == frame_compress(file_input, 0, file_expected, file_size, NULL) &&
+                      file_decompress(packed_path, restored_path, 1, &empty_restored) && empty_restored == 0;
+    
+    unlink(raw_path);
+    unlink(packed_path);
+    unlink(restored_path);
+    free(file_input);
+    free(file_expected);
+    free(file_read_back);
+    
+    printf("   • Files identical to frame_compress output: %s\n", file_identical ? "✓ PASSED" : "✗ FAILED");
+    printf("   • File round trips at every level: %s\n", file_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Pipeline slots recycled, output identical: %s\n", file_recycled ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Truncated frame rejected, output removed: %s\n", file_truncation ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Empty file round trip: %s\n", file_empty ? "✓ PASSED" : "✗ FAILED");
+    
+    // Format v2
+    printf("\n22. FORMAT V2 TEST (wide lengths, one opcode range per token kind)\n");
+    printf("   ────────────────────────────────────────────────────────────────\n");
+    
+    // Sparse telemetry: a 64-byte record every 64 KB, zeros in between
+    size_t v2_size = 16 * 1024 * 1024;
+    size_t v2_capacity = advanced_compress_v2_bound(v2_size);
+    uint8_t* v2_record = generate_pattern("mixed", 64);
+    uint8_t* v2_stream = (uint8_t*)malloc(v2_capacity);
+    uint8_t* v2_output = (uint8_t*)malloc(v2_size + 64);
+    const char* v2_patterns[] = {"sparse", "zeros", "bursts", "mixed", "random"};
+    bool v2_round_trips = true;
+    size_t sparse_tokens[2] = {0, 0};
+    
+    printf("   %-8s %-22s %-22s %s\n", "Pattern", "v1 bytes / tokens", "v2 bytes / tokens", "Decode v1 → v2");
+    for (int p = 0; p < 5; p++) {
+        uint8_t* input;
+        if (p == 0) {
+            input = (uint8_t*)calloc(v2_size, 1);
+            for (size_t offset = 0; offset < v2_size; offset += 65536) memcpy(input + offset, v2_record, 64);
+        } else {
+            input = generate_pattern(v2_patterns[p], v2_size);
+        }
+        
+        size_t sizes[2], tokens[2];
+        double decode_mb_s[2];
+        for (int v = 0; v < 2; v++) {
+            sizes[v] = v == 0 ? advanced_compress_to(input, v2_size, v2_stream, v2_capacity)
+                              : advanced_compress_v2_to(input, v2_size, v2_stream, v2_capacity);
+            tokens[v] = count_tokens(v2_stream, sizes[v]);
+            
+            double start = get_time_ms();
+            size_t decoded = 0;
+            for (int r = 0; r < 4; r++) decoded = advanced_decompress_to(v2_stream, sizes[v], v2_output, v2_size);
+            decode_mb_s[v] = 4 * v2_size / 1048576.0 / ((get_time_ms() - start) / 1000.0);
+            v2_round_trips = v2_round_trips && decoded == v2_size && memcmp(v2_output, input, v2_size) == 0 &&
+                             advanced_decompressed_size(v2_stream, sizes[v]) == v2_size;
+        }
+        if (p == 0) {
+            sparse_tokens[0] = tokens[0];
+            sparse_tokens[1] = tokens[1];
+        }
+        
+        printf("   %-8s %9zu / %-10zu %9zu / %-10zu %6.0f → %.0f MB/s\n", v2_patterns[p],
+               sizes[0], tokens[0], sizes[1], tokens[1], decode_mb_s[0], decode_mb_s[1]);
+        free(input);
+    }
+    
+    // Every pattern and size round trips within the bound
+    const char* v2_all[] = {"zeros", "runs", "sequence", "pattern", "nibbles", "mixed", "random", "skewed", "bursts"};
+    size_t v2_sizes[] = {1, 2, 3, 7, 64, 1000, 65536};
+    for (int p = 0; p < 9; p++) {
+        for (int s = 0; s < 7; s++) {
+            uint8_t* input = generate_pattern(v2_all[p], v2_sizes[s]);
+            size_t packed = advanced_compress_v2_to(input, v2_sizes[s], v2_stream, advanced_compress_v2_bound(v2_sizes[s]));
+            v2_round_trips = v2_round_trips && packed > 0 &&
+                             byte_decompress_to(v2_stream, packed, v2_output, v2_sizes[s]) == v2_sizes[s] &&
+                             memcmp(v2_output, input, v2_sizes[s]) == 0;
+            free(input);
+        }
+    }
+    
+    // Old archives: v1 streams and version 1 frames still decode
+    uint8_t* v2_input = generate_pattern("mixed", 256 * 1024);
+    size_t v1_packed = byte_compress_to(v2_input, 256 * 1024, v2_stream, v2_capacity);
+    bool v1_readable = v1_packed > 0 && v2_stream[0] != MODE_LITERAL &&
+                       byte_decompress_to(v2_stream, v1_packed, v2_output, 256 * 1024) == 256 * 1024 &&
+                       memcmp(v2_output, v2_input, 256 * 1024) == 0;
+    bool frame_versions = true;
+    for (int format = ADVANCED_FORMAT_V1; format <= ADVANCED_FORMAT_V2; format++) {
+        FrameOptions opts;
+        frame_options_init(&opts);
+        opts.codec = CODEC_ADVANCED;
+        opts.format = format;
+        size_t framed = frame_compress(v2_input, 256 * 1024, v2_stream, v2_capacity, &opts);
+        frame_versions = frame_versions && framed > 0 &&
+                         v2_stream[4] == (format == ADVANCED_FORMAT_V2 ? FRAME_VERSION : FRAME_VERSION_V1) &&
+                         frame_decompress(v2_stream, framed, v2_output, 256 * 1024) == 256 * 1024 &&
+                         memcmp(v2_output, v2_input, 256 * 1024) == 0;
+    }
+    
+    // Hardening: reserved opcodes, every truncation and corrupted streams
+    size_t v2_packed = advanced_compress_v2_to(v2_input, 4096, v2_stream, v2_capacity);
+    uint8_t* v2_damaged = (uint8_t*)malloc(v2_packed);
+    bool v2_hardened = true;
+    for (int control = V2_RESERVED; control <= 0xFF; control++) {
+        uint8_t reserved[8] = {MODE_LITERAL, ADVANCED_FORMAT_V2, (uint8_t)control, 0, 0, 0, 0, 0};
+        size_t decoded = 0;
+        v2_hardened = v2_hardened && decode_within_capacity(reserved, sizeof(reserved), v2_output, 4096, &decoded) &&
+                      decoded == 0;
+    }
+    for (size_t cut = V2_HEADER_SIZE + 1; cut < v2_packed; cut++) {
+        size_t decoded = 0;
+        v2_hardened = v2_hardened && decode_within_capacity(v2_stream, cut, v2_output, 4096, &decoded) &&
+                      (decoded == 0 || memcmp(v2_output, v2_input, decoded) == 0);
+    }
+    for (int trial = 0; trial < 5000; trial++) {
+        memcpy(v2_damaged, v2_stream, v2_packed);
+        for (int f = rand() % 4; f >= 0; f--) {
+            v2_damaged[V2_HEADER_SIZE + rand() % (v2_packed - V2_HEADER_SIZE)] = (uint8_t)rand();
+        }
+        size_t decoded = 0;
+        v2_hardened = v2_hardened && decode_within_capacity(v2_damaged, v2_packed, v2_output, 4096, &decoded);
+    }
+    
+    free(v2_record);
+    free(v2_stream);
+    free(v2_output);
+    free(v2_input);
+    free(v2_damaged);
+    
+    printf("   • Sparse data: %zu v1 tokens → %zu v2 tokens: %s\n", sparse_tokens[0], sparse_tokens[1],
+           sparse_tokens[1] * 16 <= sparse_tokens[0] ? "✓ PASSED" : "✗ FAILED");
+    printf("   • v2 round trips within advanced_compress_v2_bound: %s\n", v2_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • v1 streams and version 1 frames still decode: %s\n",
+           v1_readable && frame_versions ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Reserved opcodes, truncations and corruption stay in bounds: %s\n",
+           v2_hardened ? "✓ PASSED" : "✗ FAILED");
+    
+    // Corpus mode
+    printf("\n23. CORPUS MODE TEST (directory of sample files, 8 KB cap)\n");
+    printf("   ─────────────────────────────────────────────────────────\n");
+    
+    char corpus_dir[] = "/tmp/compress_corpus_XXXXXX";
+    bool corpus_created = mkdtemp(corpus_dir) != NULL;
+    struct {
+        const char* name;
+        const char* pattern;
+        size_t size;
+    } corpus_samples[] = {
+        {"b_runs", "runs", 3000},
+        {"a_mixed", "mixed", 10000},    // longer than the cap
+        {".hidden", "random", 100},
+        {"empty", "zeros", 0},
+    };
+    const size_t sample_count = sizeof(corpus_samples) / sizeof(corpus_samples[0]);
+    uint8_t* sample_data[sizeof(corpus_samples) / sizeof(corpus_samples[0])] = {NULL};
+    char corpus_path[256];
+    
+    for (size_t i = 0; corpus_created && i < sample_count; i++) {
+        snprintf(corpus_path, sizeof(corpus_path), "%s/%s", corpus_dir, corpus_samples[i].name);
+        if (corpus_samples[i].size > 0) {
+            sample_data[i] = generate_pattern(corpus_samples[i].pattern, corpus_samples[i].size);
+        }
+        int fd = open(corpus_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        corpus_created = fd >= 0 && (corpus_samples[i].size == 0 || (sample_data[i] &&
+                         file_write_all(fd, sample_data[i], corpus_samples[i].size)));
+        if (fd >= 0) close(fd);
+    }
+    snprintf(corpus_path, sizeof(corpus_path), "%s/subdir", corpus_dir);
+    corpus_created = corpus_created && mkdir(corpus_path, 0755) == 0;
+    
+    CorpusFile* corpus_files = NULL;
+    size_t corpus_count = corpus_created ? corpus_load(corpus_dir, 8192, &corpus_files) : 0;
+    bool corpus_selected = corpus_count == 2 && strcmp(corpus_files[0].name, "a_mixed") == 0 &&
+                           strcmp(corpus_files[1].name, "b_runs") == 0;
+    bool corpus_contents = corpus_selected && corpus_files[0].size == 8192 && corpus_files[1].size == 3000 &&
+                           memcmp(corpus_files[0].data, sample_data[1], 8192) == 0 &&
+                           memcmp(corpus_files[1].data, sample_data[0], 3000) == 0;
+    
+    CorpusFile* missing_files = NULL;
+    snprintf(corpus_path, sizeof(corpus_path), "%s/missing", corpus_dir);
+    bool corpus_missing = corpus_load(corpus_path, 8192, &missing_files) == 0 && missing_files == NULL;
+    
+    for (size_t i = 0; i < corpus_count; i++) {
+        printf("   • %-8s %5zu bytes\n", corpus_files[i].name, corpus_files[i].size);
+    }
+    corpus_free(corpus_files, corpus_count);
+    for (size_t i = 0; i < sample_count; i++) {
+        snprintf(corpus_path, sizeof(corpus_path), "%s/%s", corpus_dir, corpus_samples[i].name);
+        unlink(corpus_path);
+        free(sample_data[i]);
+    }
+    snprintf(corpus_path, sizeof(corpus_path), "%s/subdir", corpus_dir);
+    rmdir(corpus_path);
+    rmdir(corpus_dir);
+    
+    printf("   • Regular non-empty files only, in name order: %s\n", corpus_selected ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Contents read back, capped at the size limit: %s\n", corpus_contents ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Missing directory loads nothing: %s\n", corpus_missing ? "✓ PASSED" : "✗ FAILED");
+    
+    // Encoder statistics
+    printf("\n24. ENCODER STATISTICS TEST (64 KB mixed, v1 and v2 at each level)\n");
+    printf("   ─────────────────────────────────────────────────────────────────\n");
+    
+    size_t stats_size = 64 * 1024;
+    uint8_t* stats_input = generate_pattern("mixed", stats_size);
+    size_t stats_capacity = advanced_compress_v2_bound(stats_size);
+    uint8_t* stats_plain = (uint8_t*)malloc(stats_capacity);
+    uint8_t* stats_counted = (uint8_t*)malloc(stats_capacity);
+    EncoderStats stats;
+    encoder_stats_reset(&stats);
+    bool stats_enabled = encoder_stats_attach(&stats);
+    encoder_stats_attach(NULL);
+    bool stats_consistent = true;
+    bool stats_identical = true;
+    
+    for (int format = ADVANCED_FORMAT_V1; format <= ADVANCED_FORMAT_V2; format++) {
+        for (int level = COMPRESS_LEVEL_FAST; level <= COMPRESS_LEVEL_MAX; level++) {
+            FrameOptions opts;
+            frame_options_init(&opts);
+            opts.level = level;
+            opts.format = format;
+            
+            // The bare payload encoder, without the block analyzer's trial
+            size_t plain_size = frame_advanced_payload(stats_input, stats_size, stats_plain,
+                                                       stats_capacity, &opts, PROBE_ALL);
+            encoder_stats_reset(&stats);
+            encoder_stats_attach(&stats);
+            size_t counted_size = frame_advanced_payload(stats_input, stats_size, stats_counted,
+                                                         stats_capacity, &opts, PROBE_ALL);
+            encoder_stats_attach(NULL);
+            stats_identical = stats_identical && counted_size == plain_size &&
+                              memcmp(stats_plain, stats_counted, plain_size) == 0;
+            
+            uint64_t tokens = 0, covered = 0, written = 0;
+            for (int k = 0; k < TOKEN_KIND_COUNT; k++) {
+                tokens += stats.tokens[k];
+                covered += stats.bytes_covered[k];
+                written += stats.bytes_written[k];
+            }
+            for (int s = 0; s < STAGE_COUNT; s++) {
+                stats_consistent = stats_consistent && stats.hits[s] <= stats.attempts[s];
+            }
+            
+            if (stats_enabled) {
+                // A level 3 parse also tries the greedy one, and a level 3 v2
+                // block tries both after the v2 stream; each gives up once it
+                // can't beat the stream so far
+                size_t header = is_v2_stream(stats_counted, counted_size) ? V2_HEADER_SIZE : 0;
+                size_t passes = level < COMPRESS_LEVEL_MAX ? 1 : format == ADVANCED_FORMAT_V2 ? 3 : 2;
+                stats_consistent = stats_consistent && counted_size > 0 &&
+                                   (passes > 1 ? covered > stats_size && covered <= passes * stats_size :
+                                            covered == stats_size && written + header == counted_size &&
+                                            tokens == count_tokens(stats_counted, counted_size));
+                printf("   • v%d level %d: %6llu tokens, %5.1f%% of bytes in literals, "
+                       "%llu delta / %llu nibble / %llu match hits\n", format, level, (unsigned long long)tokens,
+                       covered ? 100.0 * stats.bytes_covered[TOKEN_LITERAL] / covered : 0.0,
+                       (unsigned long long)stats.hits[STAGE_DELTA], (unsigned long long)stats.hits[STAGE_NIBBLE],
+                       (unsigned long long)stats.hits[STAGE_MATCH_SEARCH]);
+            } else {
+                stats_consistent = stats_consistent && tokens == 0 && covered == 0 && written == 0;
+            }
+        }
+    }
+    free(stats_input);
+    free(stats_plain);
+    free(stats_counted);
+    
+    if (stats_enabled) {
+        printf("   • Counts match the stream (bytes in, bytes out, tokens): %s\n",
+               stats_consistent ? "✓ PASSED" : "✗ FAILED");
+    } else {
+        printf("   • Compiled out (build with -DCODEC_STATS), nothing counted: %s\n",
+               stats_consistent ? "✓ PASSED" : "✗ FAILED");
+    }
+    printf("   • Output unchanged with statistics attached: %s\n", stats_identical ? "✓ PASSED" : "✗ FAILED");
+    
+    // Element filters
+    printf("\n25. ELEMENT FILTERS TEST (1 MB sensor frames, bit-pack widths 1-7)\n");
+    printf("   ─────────────────────────────────────────────────────────────────\n");
+    
+    // Kernels against the scalar reference, at every alignment of the tail
+    uint8_t* filter_src = (uint8_t*)malloc(4096);
+    uint8_t* filter_out = (uint8_t*)malloc(4096);
+    uint8_t* filter_ref = (uint8_t*)malloc(4096);
+    uint8_t* filter_back = (uint8_t*)malloc(4096);
+    bool filter_kernels = true;
+    for (int trial = 0; trial < 500; trial++) {
+        size_t size = (size_t)(rand() % 4096);
+        uint8_t filter = (uint8_t)(1 + trial % (FILTER_COUNT - 1));
+        for (size_t i = 0; i < size; i++) filter_src[i] = (uint8_t)rand();
+        
+        size_t width = filter_width(filter);
+        size_t count = size / width;
+        bool delta = filter == FILTER_DELTA16 || filter == FILTER_DELTA32;
+        filter_encode_scalar(filter_src, 0, count, width, delta, 0, filter_ref);
+        memcpy(filter_ref + count * width, filter_src + count * width, size - count * width);
+        filter_apply(filter, filter_src, size, filter_out);
+        filter_undo(filter, filter_out, size, filter_back);
+        filter_kernels = filter_kernels && memcmp(filter_out, filter_ref, size) == 0 &&
+                         memcmp(filter_back, filter_src, size) == 0;
+    }
+    free(filter_src);
+    free(filter_out);
+    free(filter_ref);
+    free(filter_back);
+    
+    // Frames through each filter: smaller on sensor data, no worse on bytes
+    const char* filter_patterns[] = {"sensor16", "sensor32", "mixed"};
+    size_t filter_size = 1024 * 1024;
+    uint8_t* filter_restored = (uint8_t*)malloc(filter_size);
+    bool filter_round_trips = true;
+    bool filter_versions = true;
+    bool filter_gains = true;
+    bool filter_auto_best = true;
+    for (int p = 0; p < 3; p++) {
+        srand(7);
+        uint8_t* filter_input = generate_pattern(filter_patterns[p], filter_size);
+        size_t sizes[FILTER_COUNT + 1];
+        
+        printf("   • %-8s", filter_patterns[p]);
+        for (int f = 0; f <= FILTER_COUNT; f++) {
+            FrameOptions opts;
+            frame_options_init(&opts);
+            opts.filter = f == FILTER_COUNT ? FILTER_AUTO : (uint8_t)f;
+            size_t frame_cap = frame_compress_bound(filter_size, &opts);
+            uint8_t* frame = (uint8_t*)malloc(frame_cap);
+            sizes[f] = frame_compress(filter_input, filter_size, frame, frame_cap, &opts);
+            
+            filter_round_trips = filter_round_trips && sizes[f] > 0 &&
+                                 frame_decompress(frame, sizes[f], filter_restored, filter_size) == filter_size &&
+                                 memcmp(filter_restored, filter_input, filter_size) == 0;
+            filter_versions = filter_versions &&
+                              frame[4] == (f == FILTER_NONE ? FRAME_VERSION : FRAME_VERSION_FILTERS);
+            free(frame);
+            printf(" %s %zu", f == FILTER_COUNT ? "auto" : filter_names[f], sizes[f]);
+        }
+        printf("\n");
+        
+        size_t best = sizes[FILTER_NONE];
+        for (int f = 0; f < FILTER_COUNT; f++) {
+            if (sizes[f] < best) best = sizes[f];
+        }
+        // The matching delta filter at least halves a smooth signal
+        size_t matched = p == 0 ? sizes[FILTER_DELTA16] : p == 1 ? sizes[FILTER_DELTA32] : sizes[FILTER_NONE];
+        filter_gains = filter_gains && matched * 2 <= sizes[FILTER_NONE] * (p < 2 ? 1 : 2);
+        // Sampling may miss a little; allow 2% over the best fixed filter
+        filter_auto_best = filter_auto_best && sizes[FILTER_COUNT] * 100 <= best * 102;
+        free(filter_input);
+    }
+    free(filter_restored);
+    
+    // Filter bits are only valid in version 3 frames, and only up to FILTER_COUNT
+    uint8_t* filter_frame_input = generate_pattern("sensor16", 4096);
+    uint8_t filter_frame[8192];
+    FrameOptions filter_opts;
+    frame_options_init(&filter_opts);
+    filter_opts.index = false;
+    size_t filter_framed = frame_compress(filter_frame_input, 4096, filter_frame, sizeof(filter_frame), &filter_opts);
+    FrameHeader filter_header;
+    FrameBlock filter_block;
+    size_t filter_next;
+    frame_read_header(filter_frame, filter_framed, &filter_header);
+    filter_frame[FRAME_HEADER_SIZE + 8] |= FILTER_DELTA16 << 4;
+    bool filter_rejected = !frame_read_block(filter_frame, filter_framed, FRAME_HEADER_SIZE, &filter_header,
+                                             &filter_block, &filter_next);
+    filter_header.version = FRAME_VERSION_FILTERS;
+    filter_rejected = filter_rejected && frame_read_block(filter_frame, filter_framed, FRAME_HEADER_SIZE,
+                                                          &filter_header, &filter_block, &filter_next) &&
+                      filter_block.filter == FILTER_DELTA16;
+    filter_frame[FRAME_HEADER_SIZE + 8] |= 0xF0;
+    filter_rejected = filter_rejected && !frame_read_block(filter_frame, filter_framed, FRAME_HEADER_SIZE,
+                                                           &filter_header, &filter_block, &filter_next);
+    free(filter_frame_input);
+    
+    // Bit-pack tokens at each width: values with no runs or delta starts to
+    // end the stretch early, except a 3-byte run every 100 bytes in the odd
+    // rounds, which keeps the tokens short enough for the unchecked loop
+    uint8_t bitpack_input[4096];
+    uint8_t bitpack_stream[8192];
+    uint8_t bitpack_output[4096 + 64];
+    bool bitpack_round_trips = true;
+    bool bitpack_widths = true;
+    for (unsigned width = 1; width <= 7; width++) {
+        size_t size = 1024 + (size_t)(rand() % 3072);
         for (size_t i = 0; i < size; i++) {
-            data[i] = rand() & 0x7F;
+            do {
+                bitpack_input[i] = (uint8_t)(rand() & ((1 << width) - 1));
+            } while (i >= 2 && ((bitpack_input[i] == bitpack_input[i - 1] && bitpack_input[i] == bitpack_input[i - 2]) ||
+                                starts_delta_sequence(bitpack_input[i - 2], bitpack_input[i - 1], bitpack_input[i])));
+        }
+        for (size_t i = 100; width % 2 && i + 3 < size; i += 100) {
+            memset(bitpack_input + i, bitpack_input[i - 1], 3);
         }
+        size_t packed = advanced_compress_v2_to(bitpack_input, size, bitpack_stream, sizeof(bitpack_stream));
+        size_t decoded = 0;
+        bitpack_round_trips = bitpack_round_trips && packed > 0 &&
+                              decode_within_capacity(bitpack_stream, packed, bitpack_output, size, &decoded) &&
+                              decoded == size && memcmp(bitpack_output, bitpack_input, size) == 0;
+        
+        size_t packed_bytes = 0;
+        for (size_t pos = V2_HEADER_SIZE; pos < packed;) {
+            size_t control_size, token_size, output_size;
+            if (!v2_token_info(bitpack_stream + pos, packed - pos, &control_size, &token_size, &output_size)) break;
+            // At width 4 nibble tokens cost a byte less
+            uint8_t kind = bitpack_stream[pos] & ~V2_LENGTH_MASK;
+            if ((kind == V2_BITPACK && bitpack_stream[pos + control_size - 1] == width) ||
+                (kind == V2_NIBBLE && width == 4)) packed_bytes += output_size;
+            pos += token_size;
+        }
+        bitpack_widths = bitpack_widths && packed_bytes * 2 >= size;
     }
-    else if (strcmp(type, "runs") == 0) {
-        size_t pos = 0;
-        while (pos < size) {
-            uint8_t value = rand() & 0x7F;
-            size_t run_len = (rand() % 10) + 1;
-            for (size_t i = 0; i < run_len && pos < size; i++, pos++) {
-                data[pos] = value;
-            }
+    
+    // Bit-pack widths 0 and 8 are rejected like reserved control bytes, near
+    // the end of the stream and far enough from it for the unchecked loop
+    bool bitpack_hardened = true;
+    for (int width = 0; width <= 8; width += 8) {
+        uint8_t bad[512] = {MODE_LITERAL, ADVANCED_FORMAT_V2, V2_BITPACK, (uint8_t)width};
+        for (size_t bad_size = 16; bad_size <= sizeof(bad); bad_size += sizeof(bad) - 16) {
+            size_t decoded = 0;
+            bitpack_hardened = bitpack_hardened && decode_within_capacity(bad, bad_size, bitpack_output, 4096, &decoded) &&
+                               decoded == 0;
         }
     }
-    else if (strcmp(type, "sequence") == 0) {
-        for (size_t i = 0; i < size; i++) {
-            data[i] = (i % 128);
+    
+    printf("   • SSE2 kernels match scalar, filters invert: %s\n", filter_kernels ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Frame round trips through every filter: %s\n", filter_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Version 3 header only when filtering: %s\n", filter_versions ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Delta filters halve sensor frames: %s\n", filter_gains ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Auto within 2%% of the best filter: %s\n", filter_auto_best ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Filter bits rejected before version 3: %s\n", filter_rejected ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Bit-pack round trips at widths 1-7: %s\n",
+           bitpack_round_trips && bitpack_widths ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Bit-pack widths 0 and 8 rejected: %s\n", bitpack_hardened ? "✓ PASSED" : "✗ FAILED");
+    
+    // Specialized pipelines
+    printf("\n26. SPECIALIZED PIPELINE TEST (constant strategy sets against the generic encoder)\n");
+    printf("   ─────────────────────────────────────────────────────────────────────────────────\n");
+    
+    const char* pipe_patterns[] = {"zeros", "runs", "sequence", "pattern", "nibbles", "mixed", "random", "skewed", "bursts"};
+    static const AdvancedPipeline pipe_configs[] = {
+        {PROBE_DELTA | PROBE_NIBBLE | PROBE_MATCH, true, true, 0xFF, 63},
+        {PROBE_DELTA, true, true, 0x01, 16},
+        {0, false, false, 0x00, 63},
+        {PROBE_NIBBLE, true, false, 0x00, 63},
+    };
+    size_t (*pipe_fns[])(const uint8_t*, size_t, uint8_t*, size_t) = {
+        pipeline_full_to, pipeline_delta_short_to, pipeline_literal_to, advanced_compress_zero_nibble_to
+    };
+    size_t pipe_size = 64 * 1024;
+    size_t pipe_cap = advanced_compress_bound(pipe_size);
+    uint8_t* pipe_packed = (uint8_t*)malloc(pipe_cap);
+    uint8_t* pipe_reference = (uint8_t*)malloc(pipe_cap);
+    uint8_t* pipe_output = (uint8_t*)malloc(pipe_size + 64);
+    bool pipe_full_exact = true;
+    bool pipe_runtime_exact = true;
+    bool pipe_round_trips = true;
+    bool pipe_literal_caps = true;
+    
+    for (int p = 0; p < 9; p++) {
+        srand(11);
+        uint8_t* pipe_input = generate_pattern(pipe_patterns[p], pipe_size);
+        size_t generic = advanced_compress_to(pipe_input, pipe_size, pipe_reference, pipe_cap);
+        size_t full = pipeline_full_to(pipe_input, pipe_size, pipe_packed, pipe_cap);
+        pipe_full_exact = pipe_full_exact && full == generic && memcmp(pipe_packed, pipe_reference, full) == 0;
+        
+        for (int c = 0; c < 4; c++) {
+            size_t packed = pipe_fns[c](pipe_input, pipe_size, pipe_packed, pipe_cap);
+            size_t runtime = pipeline_compress_runtime(pipe_configs[c], pipe_input, pipe_size, pipe_reference, pipe_cap);
+            size_t decoded = 0;
+            pipe_runtime_exact = pipe_runtime_exact && packed == runtime &&
+                                 memcmp(pipe_packed, pipe_reference, packed) == 0;
+            pipe_round_trips = pipe_round_trips && packed > 0 &&
+                               decode_within_capacity(pipe_packed, packed, pipe_output, pipe_size, &decoded) &&
+                               decoded == pipe_size && memcmp(pipe_output, pipe_input, pipe_size) == 0;
+            pipe_literal_caps = pipe_literal_caps && longest_literal(pipe_packed, packed) <= pipe_configs[c].literal_cap;
         }
+        free(pipe_input);
     }
-    else if (strcmp(type, "pattern") == 0) {
-        uint8_t pattern[] = {0x12, 0x34, 0x56, 0x78};
-        for (size_t i = 0; i < size; i++) {
-            data[i] = pattern[i % 4];
+    
+    // Only literals: one full-length literal per 63 bytes
+    uint8_t* pipe_zeros = generate_pattern("zeros", pipe_size);
+    size_t literal_only = pipeline_literal_to(pipe_zeros, pipe_size, pipe_packed, pipe_cap);
+    pipe_literal_caps = pipe_literal_caps && literal_only == pipe_size + (pipe_size + 62) / 63 &&
+                        count_tokens(pipe_packed, literal_only) == (pipe_size + 62) / 63;
+    free(pipe_zeros);
+    free(pipe_packed);
+    free(pipe_reference);
+    free(pipe_output);
+    
+    // The firmware case: zero runs between stretches of small values
+    size_t sparse_size = 16 * 1024 * 1024;
+    size_t sparse_cap = advanced_compress_bound(sparse_size);
+    uint8_t* sparse_input = (uint8_t*)malloc(sparse_size);
+    uint8_t* sparse_packed = (uint8_t*)malloc(sparse_cap);
+    uint8_t* sparse_output = (uint8_t*)malloc(sparse_size);
+    srand(11);
+    for (size_t pos = 0; pos < sparse_size;) {
+        for (size_t z = 10 + (size_t)(rand() % 200); z > 0 && pos < sparse_size; z--) sparse_input[pos++] = 0;
+        for (size_t k = 10 + (size_t)(rand() % 100); k > 0 && pos < sparse_size; k--) {
+            sparse_input[pos++] = (uint8_t)(rand() & 0x0F);
         }
     }
-    else if (strcmp(type, "mixed") == 0) {
-        size_t pos = 0;
-        while (pos < size) {
-            int choice = rand() % 4;
-            size_t chunk_size = (rand() % 20) + 5;
+    
+    double pipe_start = get_time_ms();
+    size_t sparse_generic = advanced_compress_to(sparse_input, sparse_size, sparse_packed, sparse_cap);
+    double generic_ms = get_time_ms() - pipe_start;
+    pipe_start = get_time_ms();
+    size_t sparse_specialized = advanced_compress_zero_nibble_to(sparse_input, sparse_size, sparse_packed, sparse_cap);
+    double specialized_ms = get_time_ms() - pipe_start;
+    bool sparse_round_trip = sparse_specialized > 0 &&
+                             advanced_decompress_to(sparse_packed, sparse_specialized, sparse_output, sparse_size) == sparse_size &&
+                             memcmp(sparse_output, sparse_input, sparse_size) == 0;
+    
+    printf("   • 16 MB zero runs + nibbles: generic %zu B at %.0f MB/s, zero/nibble pipeline %zu B at %.0f MB/s\n",
+           sparse_generic, sparse_size / 1048576.0 / (generic_ms / 1000.0),
+           sparse_specialized, sparse_size / 1048576.0 / (specialized_ms / 1000.0));
+    free(sparse_input);
+    free(sparse_packed);
+    free(sparse_output);
+    
+    printf("   • All-strategy pipeline identical to advanced_compress_to: %s\n", pipe_full_exact ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Constant pipelines match the same pipeline at run time: %s\n", pipe_runtime_exact ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Round trips through advanced_decompress_to: %s\n", pipe_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Literal caps respected: %s\n", pipe_literal_caps ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Zero/nibble pipeline faster, within 2%% of generic size: %s\n",
+           sparse_round_trip && specialized_ms < generic_ms && sparse_specialized * 100 <= sparse_generic * 102 ?
+           "✓ PASSED" : "✗ FAILED");
+    
+    // Scatter-gather
+    printf("\n27. SCATTER-GATHER TEST (segment chains against one contiguous buffer)\n");
+    printf("   ─────────────────────────────────────────────────────────────────────\n");
+    
+    // Segments down to one byte, so every token kind straddles boundaries
+    const char* sg_patterns[] = {"runs", "sequence", "nibbles", "mixed", "random"};
+    size_t sg_segments[] = {1, 7, 1500};
+    size_t sg_size = 64 * 1024;
+    size_t sg_cap = byte_compress_bound(sg_size);
+    uint8_t* sg_expected = (uint8_t*)malloc(sg_cap);
+    uint8_t* sg_packed = (uint8_t*)malloc(sg_cap);
+    uint8_t* sg_restored = (uint8_t*)malloc(sg_size);
+    struct iovec* sg_in = (struct iovec*)malloc(2 * sg_cap * sizeof(struct iovec));
+    struct iovec* sg_out = (struct iovec*)malloc(2 * sg_cap * sizeof(struct iovec));
+    bool sg_identical = true;
+    bool sg_round_trips = true;
+    bool sg_short_output = true;
+    bool sg_truncated = true;
+    srand(27);
+    
+    for (int p = 0; p < 5; p++) {
+        uint8_t* sg_input = generate_pattern(sg_patterns[p], sg_size);
+        size_t expected = byte_compress_to(sg_input, sg_size, sg_expected, sg_cap);
+        
+        for (int g = 0; g < 3; g++) {
+            size_t in_count = iov_split(sg_input, sg_size, sg_segments[g], sg_in);
+            size_t out_count = iov_split(sg_packed, sg_cap, sg_segments[2 - g] * 3, sg_out);
+            memset(sg_packed, 0xAA, sg_cap);
+            size_t packed = byte_compress_iov(sg_in, in_count, sg_out, out_count);
+            sg_identical = sg_identical && packed == expected && memcmp(sg_packed, sg_expected, expected) == 0;
             
-            for (size_t i = 0; i < chunk_size && pos < size; i++, pos++) {
-                if (choice == 0) data[pos] = 0x00;
-                else if (choice == 1) data[pos] = pos & 0x7F;
-                else if (choice == 2) data[pos] = (pos / 3) & 0x7F;
-                else data[pos] = rand() & 0x7F;
-            }
+            in_count = iov_split(sg_packed, packed, sg_segments[g] * 2, sg_in);
+            out_count = iov_split(sg_restored, sg_size, sg_segments[2 - g], sg_out);
+            size_t restored = byte_decompress_iov(sg_in, in_count, sg_out, out_count);
+            sg_round_trips = sg_round_trips && restored == sg_size && memcmp(sg_restored, sg_input, sg_size) == 0;
+            
+            // One byte short of room on either side fails
+            in_count = iov_split(sg_input, sg_size, sg_segments[g], sg_in);
+            out_count = iov_split(sg_packed, expected - 1, sg_segments[2 - g], sg_out);
+            sg_short_output = sg_short_output && byte_compress_iov(sg_in, in_count, sg_out, out_count) == 0;
+            memcpy(sg_packed, sg_expected, expected);
+            in_count = iov_split(sg_packed, expected, sg_segments[g], sg_in);
+            out_count = iov_split(sg_restored, sg_size - 1, sg_segments[2 - g], sg_out);
+            sg_short_output = sg_short_output && byte_decompress_iov(sg_in, in_count, sg_out, out_count) == 0;
+            
+            // A stream missing its last byte ends mid-token
+            in_count = iov_split(sg_packed, expected - 1, sg_segments[g], sg_in);
+            out_count = iov_split(sg_restored, sg_size, sg_segments[2 - g], sg_out);
+            sg_truncated = sg_truncated && byte_decompress_iov(sg_in, in_count, sg_out, out_count) == 0;
         }
+        free(sg_input);
     }
-    else if (strcmp(type, "nibbles") == 0) {
-        for (size_t i = 0; i < size; i++) {
-            data[i] = rand() & 0x0F;
+    
+    // A v2 stream decodes whole, through the one-shot codec, and returns 0
+    // split on either side, since the streaming decoder reads v1 only. Read
+    // as v1, the small ones would decode to the wrong bytes
+    const char* sg_v2_patterns[] = {"mixed", "nibbles", "zeros"};
+    size_t sg_v2_sizes[] = {64 * 1024, 16, 100};
+    uint8_t* sg_v2 = (uint8_t*)malloc(advanced_compress_v2_bound(sg_size));
+    bool sg_v2_split = true;
+    for (int p = 0; p < 3; p++) {
+        uint8_t* sg_input = generate_pattern(sg_v2_patterns[p], sg_v2_sizes[p]);
+        size_t sg_v2_size = advanced_compress_v2_to(sg_input, sg_v2_sizes[p], sg_v2,
+                                                    advanced_compress_v2_bound(sg_v2_sizes[p]));
+        struct iovec whole = {sg_v2, sg_v2_size};
+        struct iovec restored = {sg_restored, sg_size};
+        sg_v2_split = sg_v2_split && byte_decompress_iov(&whole, 1, &restored, 1) == sg_v2_sizes[p] &&
+                      memcmp(sg_restored, sg_input, sg_v2_sizes[p]) == 0;
+        for (int g = 0; g < 3; g++) {
+            size_t in_count = iov_split(sg_v2, sg_v2_size, sg_segments[g], sg_in);
+            if (in_count > 1) sg_v2_split = sg_v2_split && byte_decompress_iov(sg_in, in_count, &restored, 1) == 0;
+            size_t out_count = iov_split(sg_restored, sg_v2_sizes[p], sg_segments[g], sg_out);
+            if (out_count > 1) sg_v2_split = sg_v2_split && byte_decompress_iov(&whole, 1, sg_out, out_count) == 0;
         }
+        free(sg_input);
     }
+    free(sg_v2);
     
-    return data;
-}
-
-// Run single test
-TestResult run_single_test(Algorithm* algo, uint8_t* original_data, size_t size) {
-    TestResult result = {0};
-    result.original_size = size;
+    // Network-sized chains: 64 KB messages in 1500-byte segments, coalesced
+    // into one buffer and compressed, or compressed in place with one reused
+    // encoder
+    size_t msg_size = 64 * 1024;
+    size_t msg_total = 16 * 1024 * 1024;
+    uint8_t* msg_input = generate_pattern("mixed", msg_total);
+    uint8_t* msg_coalesced = (uint8_t*)malloc(msg_size);
+    size_t msg_segments = (msg_size + 1499) / 1500;
+    struct iovec* msg_in = (struct iovec*)malloc(msg_segments * sizeof(struct iovec));
+    StreamEncoder* msg_encoder = (StreamEncoder*)malloc(sizeof(StreamEncoder));
+    size_t coalesced_bytes = 0;
+    size_t gathered_bytes = 0;
     
-    // Make working copies
-    uint8_t* compress_buffer = (uint8_t*)malloc(size * 2);
-    uint8_t* verify_buffer = (uint8_t*)malloc(size * 2);
+    double sg_start = get_time_ms();
+    for (size_t m = 0; m < msg_total; m += msg_size) {
+        size_t pos = 0;
+        for (size_t i = 0; i < msg_segments; i++) {
+            size_t length = msg_size - i * 1500 < 1500 ? msg_size - i * 1500 : 1500;
+            memcpy(msg_coalesced + pos, msg_input + m + i * 1500, length);
+            pos += length;
+        }
+        coalesced_bytes += byte_compress_to(msg_coalesced, msg_size, sg_packed, sg_cap);
+    }
+    double coalesce_ms = get_time_ms() - sg_start;
     
-    if (!compress_buffer || !verify_buffer) {
-        free(compress_buffer);
-        free(verify_buffer);
-        return result;
+    struct iovec msg_out = {sg_packed, sg_cap};
+    sg_start = get_time_ms();
+    for (size_t m = 0; m < msg_total; m += msg_size) {
+        for (size_t i = 0; i < msg_segments; i++) {
+            msg_in[i].iov_base = msg_input + m + i * 1500;
+            msg_in[i].iov_len = msg_size - i * 1500 < 1500 ? msg_size - i * 1500 : 1500;
+        }
+        gathered_bytes += stream_compress_iov(msg_encoder, msg_in, msg_segments, &msg_out, 1);
     }
+    double gather_ms = get_time_ms() - sg_start;
     
-    memcpy(compress_buffer, original_data, size);
+    printf("   • 64 KB messages in 1500 B segments: coalesce + compress %.0f MB/s, iovec %.0f MB/s\n",
+           msg_total / 1048576.0 / (coalesce_ms / 1000.0), msg_total / 1048576.0 / (gather_ms / 1000.0));
+    free(msg_input);
+    free(msg_coalesced);
+    free(msg_in);
+    free(msg_encoder);
+    free(sg_expected);
+    free(sg_packed);
+    free(sg_restored);
+    free(sg_in);
+    free(sg_out);
     
-    // Compress
-    double start_time = get_time_ms();
-    size_t compressed_size = algo->compress(compress_buffer, size);
-    result.compression_time_ms = get_time_ms() - start_time;
-    result.compressed_size = compressed_size;
+    printf("   • Identical to byte_compress_to on the joined input: %s\n",
+           sg_identical && gathered_bytes == coalesced_bytes ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Round trips across input and output chains: %s\n", sg_round_trips ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Output one byte short rejected: %s\n", sg_short_output ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Truncated stream rejected: %s\n", sg_truncated ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Split v2 streams return 0, whole ones decode: %s\n", sg_v2_split ? "✓ PASSED" : "✗ FAILED");
     
-    // Calculate compression ratio
-    result.compression_ratio = (1.0 - (double)compressed_size / size) * 100.0;
+    // Compressed-domain queries
+    printf("\n28. COMPRESSED-DOMAIN QUERY TEST (aggregates and point reads from tokens)\n");
+    printf("   ────────────────────────────────────────────────────────────────────────\n");
     
-    // Decompress
-    memcpy(verify_buffer, compress_buffer, compressed_size);
-    start_time = get_time_ms();
-    size_t decompressed_size = algo->decompress(verify_buffer, compressed_size);
-    result.decompression_time_ms = get_time_ms() - start_time;
+    const char* query_patterns[] = {"zeros", "runs", "sequence", "pattern", "nibbles", "mixed",
+                                    "random", "skewed", "bursts"};
+    size_t query_size = 256 * 1024;
+    size_t query_cap = advanced_compress_v2_bound(query_size);
+    uint8_t* query_packed = (uint8_t*)malloc(query_cap);
+    bool query_summaries = true;
+    bool query_points = true;
+    bool query_rejects = true;
+    srand(28);
     
-    // Verify
-    result.verified = (decompressed_size == size) && 
-                     (memcmp(original_data, verify_buffer, size) == 0);
+    for (int p = 0; p < 9; p++) {
+        uint8_t* input = generate_pattern(query_patterns[p], query_size);
+        ByteSummary expected;
+        memset(&expected, 0, sizeof(expected));
+        summary_add_bytes(expected.histogram, input, query_size);
+        summary_finish(&expected);
+        
+        for (int format = ADVANCED_FORMAT_V1; format <= ADVANCED_FORMAT_V2; format++) {
+            size_t packed = format == ADVANCED_FORMAT_V1
+                ? advanced_compress_to(input, query_size, query_packed, query_cap)
+                : advanced_compress_v2_to(input, query_size, query_packed, query_cap);
+            ByteSummary summary;
+            query_summaries = query_summaries && advanced_summarize(query_packed, packed, &summary) &&
+                              memcmp(&summary, &expected, sizeof(summary)) == 0;
+            
+            for (int k = 0; k < 200; k++) {
+                size_t offset = k == 0 ? query_size - 1 : (size_t)rand() % query_size;
+                uint8_t value = 0;
+                query_points = query_points && advanced_byte_at(query_packed, packed, offset, &value) &&
+                               value == input[offset];
+            }
+            uint8_t value;
+            query_rejects = query_rejects && !advanced_byte_at(query_packed, packed, query_size, &value) &&
+                            !advanced_summarize(query_packed, packed - 1, &summary);
+        }
+        free(input);
+    }
     
-    free(compress_buffer);
-    free(verify_buffer);
+    // v2 tokens longer than the match window, each followed by a
+    // back-reference into its tail: a periodic stretch (high bytes, so one
+    // overlapping match rather than bit-packed), a zero run, a delta
+    // sequence, bit-packed and nibble bytes
+    size_t qlong_size = 0;
+    uint8_t* qlong_input = (uint8_t*)malloc(512 * 1024);
+    for (int part = 0; part < 5; part++) {
+        uint8_t* stretch = qlong_input + qlong_size;
+        size_t stretch_size = 40003 + (size_t)part * 1001;
+        for (size_t i = 0; i < stretch_size; i++) {
+            // Packed values with no run or delta start to end the token
+            do {
+                stretch[i] = part == 0 ? (uint8_t)("periodic"[i % 7] | 0x80) :
+                             part == 1 ? 0 :
+                             part == 2 ? (uint8_t)((5 + i * 3) & 0x7F) :
+                             part == 3 ? (uint8_t)(rand() & 0x7F) : (uint8_t)(rand() & 0x0F);
+            } while (part >= 3 && i >= 2 && ((stretch[i] == stretch[i - 1] && stretch[i] == stretch[i - 2]) ||
+                                             starts_delta_sequence(stretch[i - 2], stretch[i - 1], stretch[i])));
+        }
+        qlong_size += stretch_size;
+        uint8_t* noise = generate_pattern("mixed", 300);
+        memcpy(qlong_input + qlong_size, noise, 300);
+        free(noise);
+        qlong_size += 300;
+        memcpy(qlong_input + qlong_size, qlong_input + qlong_size - 1500, 1200);
+        qlong_size += 1200;
+    }
+    size_t qlong_packed = advanced_compress_v2_to(qlong_input, qlong_size, query_packed, query_cap);
+    ByteSummary qlong_expected, qlong_summary;
+    memset(&qlong_expected, 0, sizeof(qlong_expected));
+    summary_add_bytes(qlong_expected.histogram, qlong_input, qlong_size);
+    summary_finish(&qlong_expected);
+    query_summaries = query_summaries && advanced_summarize(query_packed, qlong_packed, &qlong_summary) &&
+                      memcmp(&qlong_summary, &qlong_expected, sizeof(qlong_summary)) == 0;
+    for (int k = 0; k < 2000; k++) {
+        size_t offset = (size_t)rand() % qlong_size;
+        uint8_t value = 0;
+        query_points = query_points && advanced_byte_at(query_packed, qlong_packed, offset, &value) &&
+                       value == qlong_input[offset];
+    }
+    free(qlong_input);
     
-    return result;
-}
-
-// Print comparison table
-void print_comparison_header() {
-    printf("\n╔════════════════════════════╦═══════════════════╦═══════════════════╦═══════════╦═══════════╗\n");
-    printf("║ Test Case                  ║ Simple RLE        ║ Advanced Multi    ║ Winner    ║ Advantage ║\n");
-    printf("╠════════════════════════════╬═══════════════════╬═══════════════════╬═══════════╬═══════════╣\n");
-}
-
-void print_comparison_row(const char* test_name, TestResult* simple, TestResult* advanced) {
-    const char* winner = "Draw";
-    double advantage = 0;
+    // A 100-byte frame block whose v2 payload is one 3 GB run fails on the
+    // declared size, with no allocation it could size; the bare stream is
+    // answered without expanding the run
+    uint8_t qbomb[40] = {FRAME_MAGIC_0, FRAME_MAGIC_1, FRAME_MAGIC_2, FRAME_MAGIC_3, FRAME_VERSION};
+    write_le32(qbomb + 6, 100);
+    write_le64(qbomb + 10, 100);
+    uint8_t* qbomb_block = qbomb + FRAME_HEADER_SIZE;
+    uint8_t* qbomb_stream = qbomb_block + FRAME_BLOCK_HEADER_SIZE;
+    size_t qbomb_stream_len = V2_HEADER_SIZE;
+    qbomb_stream[0] = MODE_LITERAL;
+    qbomb_stream[1] = ADVANCED_FORMAT_V2;
+    uint64_t qbomb_run = 3ULL << 30;
+    qbomb_stream_len += v2_put_control(qbomb_stream + qbomb_stream_len, V2_RUN, (size_t)qbomb_run);
+    qbomb_stream[qbomb_stream_len++] = 0x42;
+    write_le32(qbomb_block, 100);
+    write_le32(qbomb_block + 4, (uint32_t)qbomb_stream_len);
+    qbomb_block[8] = CODEC_ADVANCED;
+    size_t qbomb_len = FRAME_HEADER_SIZE + FRAME_BLOCK_HEADER_SIZE + qbomb_stream_len + FRAME_END_MARK_SIZE;
     
-    if (simple->compression_ratio > advanced->compression_ratio + 0.1) {
-        winner = "Simple";
-        advantage = simple->compression_ratio - advanced->compression_ratio;
-    } else if (advanced->compression_ratio > simple->compression_ratio + 0.1) {
-        winner = "Advanced";
-        advantage = advanced->compression_ratio - simple->compression_ratio;
-    }
+    BumpArena query_arena;
+    bump_arena_init(&query_arena, malloc(1 << 20), 1 << 20);
+    CodecAllocator query_allocator = bump_arena_allocator(&query_arena);
+    codec_set_allocator(&query_allocator);
+    ByteSummary qbomb_summary;
+    uint8_t qbomb_value = 0;
+    bool query_limited = !frame_summarize(qbomb, qbomb_len, &qbomb_summary) &&
+                         advanced_summarize(qbomb_stream, qbomb_stream_len, &qbomb_summary) &&
+                         qbomb_summary.length == qbomb_run && qbomb_summary.histogram[0x42] == qbomb_run &&
+                         advanced_byte_at(qbomb_stream, qbomb_stream_len, qbomb_run - 1, &qbomb_value) &&
+                         qbomb_value == 0x42 && query_arena.peak < (1 << 20);
+    codec_set_allocator(NULL);
+    free(query_arena.memory);
+    query_limited = query_limited && frame_decompress(qbomb, qbomb_len, query_packed, query_cap) == 0;
     
-    printf("║ %-26s ║ %6.1f%% (%4zu B) ║ %6.1f%% (%4zu B) ║ %-9s ║ %+6.1f%%  ║\n",
-           test_name,
-           simple->compression_ratio, simple->compressed_size,
-           advanced->compression_ratio, advanced->compressed_size,
-           winner, advantage);
-}
-
-void print_comparison_footer() {
-    printf("╚════════════════════════════╩═══════════════════╩═══════════════════╩═══════════╩═══════════╝\n");
-}
-
-// Main testing function
-void run_comprehensive_tests() {
-    printf("\n");
-    printf("════════════════════════════════════════════════════════════════════════\n");
-    printf("           COMPRESSION ALGORITHM PERFORMANCE COMPARISON                \n");
-    printf("════════════════════════════════════════════════════════════════════════\n");
+    // A simple RLE block ending on a run control byte, with no value byte and
+    // no end mark after it, is rejected without reading past the frame
+    size_t qcut_len = FRAME_HEADER_SIZE + FRAME_BLOCK_HEADER_SIZE + 1;
+    uint8_t* qcut = (uint8_t*)calloc(1, qcut_len);
+    memcpy(qcut, qbomb, 4);
+    qcut[4] = FRAME_VERSION_V1;
+    write_le32(qcut + 6, 1);
+    write_le64(qcut + 10, 1);
+    write_le32(qcut + FRAME_HEADER_SIZE, 1);
+    write_le32(qcut + FRAME_HEADER_SIZE + 4, 1);
+    qcut[FRAME_HEADER_SIZE + 8] = CODEC_SIMPLE_RLE;
+    qcut[qcut_len - 1] = RLE_FLAG | 1;
+    ByteSummary qcut_summary;
+    query_limited = query_limited && !frame_summarize(qcut, qcut_len, &qcut_summary);
+    free(qcut);
     
-    Algorithm algorithms[] = {
-        {"Simple RLE", simple_rle_compress, simple_rle_decompress},
-        {"Advanced Multi-Strategy", advanced_compress, advanced_decompress}
-    };
+    // Frames: mixed codecs and filtered blocks, read through the index
+    size_t qframe_size = 2 * 1024 * 1024;
+    uint8_t* qframe_input = (uint8_t*)malloc(qframe_size);
+    uint8_t* qframe_parts[] = {generate_pattern("mixed", qframe_size / 4), generate_pattern("random", qframe_size / 4),
+                               generate_pattern("sensor16", qframe_size / 4), generate_pattern("zeros", qframe_size / 4)};
+    for (int i = 0; i < 4; i++) {
+        memcpy(qframe_input + i * (qframe_size / 4), qframe_parts[i], qframe_size / 4);
+        free(qframe_parts[i]);
+    }
+    FrameOptions qframe_opts;
+    frame_options_init(&qframe_opts);
+    qframe_opts.codec = CODEC_AUTO;
+    qframe_opts.filter = FILTER_AUTO;
+    size_t qframe_cap = frame_compress_bound(qframe_size, &qframe_opts);
+    uint8_t* qframe = (uint8_t*)malloc(qframe_cap);
+    size_t qframe_len = frame_compress(qframe_input, qframe_size, qframe, qframe_cap, &qframe_opts);
     
-    // Test with original example
-    uint8_t original_example[] = { 
-        0x03, 0x74, 0x04, 0x04, 0x04, 0x35, 0x35, 0x64,
-        0x64, 0x64, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x56, 0x45, 0x56, 0x56, 0x56, 0x09, 0x09, 0x09 
-    };
+    ByteSummary qframe_expected, qframe_summary;
+    memset(&qframe_expected, 0, sizeof(qframe_expected));
+    summary_add_bytes(qframe_expected.histogram, qframe_input, qframe_size);
+    summary_finish(&qframe_expected);
+    bool query_frames = frame_summarize(qframe, qframe_len, &qframe_summary) &&
+                        memcmp(&qframe_summary, &qframe_expected, sizeof(qframe_summary)) == 0;
+    for (int k = 0; k < 1000; k++) {
+        size_t offset = k == 0 ? qframe_size - 1 : (size_t)rand() % qframe_size;
+        uint8_t value = 0;
+        query_frames = query_frames && frame_byte_at(qframe, qframe_len, offset, &value) &&
+                       value == qframe_input[offset];
+    }
+    uint8_t qframe_value;
+    query_frames = query_frames && !frame_byte_at(qframe, qframe_len, qframe_size, &qframe_value);
     
-    printf("\n1. ORIGINAL EXAMPLE TEST\n");
-    printf("   ─────────────────────\n");
+    // Simple RLE blocks with literals between the runs
+    qframe_opts.codec = CODEC_SIMPLE_RLE;
+    qframe_opts.filter = FILTER_NONE;
+    qframe_len = frame_compress(qframe_input, qframe_size, qframe, qframe_cap, &qframe_opts);
+    query_frames = query_frames && frame_summarize(qframe, qframe_len, &qframe_summary) &&
+                   memcmp(&qframe_summary, &qframe_expected, sizeof(qframe_summary)) == 0;
+    for (int k = 0; k < 1000; k++) {
+        size_t offset = (size_t)rand() % qframe_size;
+        uint8_t value = 0;
+        query_frames = query_frames && frame_byte_at(qframe, qframe_len, offset, &value) &&
+                       value == qframe_input[offset];
+    }
+    free(qframe_input);
+    free(qframe);
     
-    for (int a = 0; a < 2; a++) {
-        uint8_t* test_data = (uint8_t*)malloc(sizeof(original_example));
-        memcpy(test_data, original_example, sizeof(original_example));
-        
-        TestResult result = run_single_test(&algorithms[a], original_example, sizeof(original_example));
-        
-        printf("   %s:\n", algorithms[a].name);
-        printf("   • Compression: %zu → %zu bytes (%.1f%% saved)\n",
-               result.original_size, result.compressed_size, result.compression_ratio);
-        printf("   • Time: %.3f ms compress, %.3f ms decompress\n",
-               result.compression_time_ms, result.decompression_time_ms);
-        printf("   • Verification: %s\n", result.verified ? "✓ PASSED" : "✗ FAILED");
+    // Scan speed against decompress-then-scan on 16 MB frames with the
+    // default options (v2 and simple RLE blocks), plus an index for point
+    // reads
+    size_t qscan_size = 16 * 1024 * 1024;
+    FrameOptions qscan_opts;
+    frame_options_init(&qscan_opts);
+    qscan_opts.index = true;
+    size_t qscan_cap = frame_compress_bound(qscan_size, &qscan_opts);
+    uint8_t* qscan_output = (uint8_t*)malloc(qscan_size);
+    uint8_t* qscan_packed = (uint8_t*)malloc(qscan_cap);
+    const char* qscan_patterns[] = {"zeros", "sparse", "bursts", "runs", "mixed"};
+    double qscan_speedup[5];
+    printf("   Pattern    Decompress+scan   Summarize   Speedup\n");
+    for (int p = 0; p < 5; p++) {
+        uint8_t* input = generate_pattern(qscan_patterns[p], qscan_size);
+        size_t packed = frame_compress(input, qscan_size, qscan_packed, qscan_cap, &qscan_opts);
+        free(input);
         
-        free(test_data);
+        ByteSummary scanned, summarized;
+        double q_start = get_time_ms();
+        memset(&scanned, 0, sizeof(scanned));
+        size_t decoded = frame_decompress(qscan_packed, packed, qscan_output, qscan_size);
+        summary_add_bytes(scanned.histogram, qscan_output, decoded);
+        summary_finish(&scanned);
+        double scan_ms = get_time_ms() - q_start;
+        q_start = get_time_ms();
+        query_summaries = query_summaries && frame_summarize(qscan_packed, packed, &summarized) &&
+                          memcmp(&summarized, &scanned, sizeof(scanned)) == 0;
+        double summarize_ms = get_time_ms() - q_start;
+        qscan_speedup[p] = scan_ms / summarize_ms;
+        for (int k = 0; k < 200; k++) {
+            size_t offset = ((size_t)rand() * 4099) % qscan_size;
+            uint8_t value = 0;
+            query_frames = query_frames && frame_byte_at(qscan_packed, packed, offset, &value) &&
+                           value == qscan_output[offset];
+        }
+        printf("   %-10s %8.0f MB/s     %6.0f MB/s  %5.1fx\n", qscan_patterns[p],
+               qscan_size / 1048576.0 / (scan_ms / 1000.0), qscan_size / 1048576.0 / (summarize_ms / 1000.0),
+               qscan_speedup[p]);
     }
+    free(qscan_output);
+    free(qscan_packed);
+    free(query_packed);
     
-    // Pattern-based tests
-    const char* patterns[] = {
-        "zeros", "runs", "sequence", "pattern", "nibbles", "mixed", "random"
-    };
-    const char* descriptions[] = {
-        "All zeros",
-        "Random runs",
-        "Incrementing",
-        "Repeating pattern",
-        "Small values <16",
-        "Mixed patterns",
-        "Random data"
-    };
+    printf("   • Summaries match a scan of the input (v1 and v2): %s\n", query_summaries ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Byte at offset matches the input: %s\n", query_points ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Out-of-range offsets and truncated streams rejected: %s\n", query_rejects ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Oversized and cut-off blocks rejected safely: %s\n", query_limited ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Frame summary and indexed byte reads over mixed codecs and filters: %s\n",
+           query_frames ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Zero and burst frames summarized 2x faster than decompress-then-scan: %s\n",
+           qscan_speedup[0] > 2.0 && qscan_speedup[2] > 2.0 ? "✓ PASSED" : "✗ FAILED");
     
-    printf("\n2. PATTERN-BASED PERFORMANCE TESTS (256 bytes each)\n");
-    printf("   ────────────────────────────────────────────────\n");
+    // Test 29: Dedup cache
+    printf("\n29. DEDUP CACHE TEST (repeated frames served from an LRU of compressed streams)\n");
+    printf("   ──────────────────────────────────────────────────────────────────────────────\n");
     
-    print_comparison_header();
+    const uint8_t hash_abc[] = {'a', 'b', 'c'};
+    bool dedup_hash = hash64(NULL, 0) == 0xEF46DB3751D8E999ULL && hash64(hash_abc, 3) == 0x44BC2CF5AD770999ULL;
     
-    double total_simple_ratio = 0;
-    double total_advanced_ratio = 0;
-    int test_count = 0;
+    // A fleet of devices: most frames are one of a few heartbeats
+    const size_t fleet_count = 20000;
+    const size_t fleet_kinds = 32;
+    BatchInput* fleet_in = (BatchInput*)malloc(fleet_count * sizeof(BatchInput));
+    BatchOutput* fleet_plain = (BatchOutput*)malloc(fleet_count * sizeof(BatchOutput));
+    BatchOutput* fleet_cached = (BatchOutput*)malloc(fleet_count * sizeof(BatchOutput));
+    uint8_t* heartbeats[32];
+    size_t heartbeat_size[32];
+    bool heartbeat_seen[32] = {false};
+    size_t fleet_repeats = 0;
+    srand(29);
+    for (size_t k = 0; k < fleet_kinds; k++) {
+        heartbeat_size[k] = 64 + rand() % 448;
+        heartbeats[k] = generate_pattern(k % 2 ? "mixed" : "pattern", heartbeat_size[k]);
+    }
+    for (size_t i = 0; i < fleet_count; i++) {
+        if (rand() % 10 == 0) {
+            size_t size = 64 + rand() % 448;
+            uint8_t* frame = generate_pattern("mixed", size);
+            for (size_t b = 0; b < size; b += 16) frame[b] ^= (uint8_t)rand();
+            fleet_in[i].data = frame;
+            fleet_in[i].size = size;
+        } else {
+            size_t k = rand() % fleet_kinds;
+            fleet_in[i].data = heartbeats[k];
+            fleet_in[i].size = heartbeat_size[k];
+            if (heartbeat_seen[k]) fleet_repeats++;
+            heartbeat_seen[k] = true;
+        }
+        size_t bound = byte_compress_bound(fleet_in[i].size);
+        fleet_plain[i].data = (uint8_t*)malloc(bound);
+        fleet_plain[i].capacity = bound;
+        fleet_cached[i].data = (uint8_t*)malloc(bound);
+        fleet_cached[i].capacity = bound;
+    }
     
-    for (int p = 0; p < 7; p++) {
-        uint8_t* test_data = generate_pattern(patterns[p], 256);
-        if (!test_data) continue;
-        
-        TestResult simple_result = run_single_test(&algorithms[0], test_data, 256);
-        TestResult advanced_result = run_single_test(&algorithms[1], test_data, 256);
-        
-        print_comparison_row(descriptions[p], &simple_result, &advanced_result);
-        
-        total_simple_ratio += simple_result.compression_ratio;
-        total_advanced_ratio += advanced_result.compression_ratio;
-        test_count++;
-        
-        free(test_data);
+    DedupCache fleet_cache;
+    bool dedup_fleet = dedup_cache_init(&fleet_cache, 1024, 1 << 20);
+    double d_start = get_time_ms();
+    size_t plain_ok = byte_compress_batch(fleet_in, fleet_count, fleet_plain, 1);
+    double plain_ms = get_time_ms() - d_start;
+    d_start = get_time_ms();
+    size_t cached_ok = byte_compress_batch_dedup(fleet_in, fleet_count, fleet_cached, 1, &fleet_cache);
+    double cached_ms = get_time_ms() - d_start;
+    dedup_fleet = dedup_fleet && plain_ok == fleet_count && cached_ok == fleet_count;
+    for (size_t i = 0; dedup_fleet && i < fleet_count; i++) {
+        dedup_fleet = fleet_cached[i].size == fleet_plain[i].size &&
+                      memcmp(fleet_cached[i].data, fleet_plain[i].data, fleet_plain[i].size) == 0;
     }
+    // A heartbeat comes round every few dozen frames, long before the LRU
+    // would evict it, so every repeat is a hit. The timing is shown only:
+    // one pass on a shared machine is too noisy to fail on
+    DedupStats fleet_stats;
+    dedup_cache_stats(&fleet_cache, &fleet_stats);
+    bool dedup_served = fleet_stats.lookups == fleet_count && fleet_stats.hits == fleet_repeats;
+    printf("   %zu frames: %.0f/ms plain, %.0f/ms cached (%.1fx), %.1f%% hits, %zu entries in %zu KB\n",
+           fleet_count, fleet_count / plain_ms, fleet_count / cached_ms, plain_ms / cached_ms,
+           100.0 * fleet_stats.hits / fleet_stats.lookups, fleet_stats.entries, fleet_stats.bytes / 1024);
     
-    print_comparison_footer();
+    // Several workers sharing the warm cache still match the plain batch
+    for (size_t i = 0; i < fleet_count; i++) fleet_cached[i].size = 0;
+    bool dedup_shared = byte_compress_batch_dedup(fleet_in, fleet_count, fleet_cached, 4, &fleet_cache) == fleet_count;
+    for (size_t i = 0; dedup_shared && i < fleet_count; i++) {
+        dedup_shared = fleet_cached[i].size == fleet_plain[i].size &&
+                       memcmp(fleet_cached[i].data, fleet_plain[i].data, fleet_plain[i].size) == 0;
+    }
+    dedup_cache_free(&fleet_cache);
     
-    // Size scaling tests
-    printf("\n3. SIZE SCALING TESTS (Mixed Pattern)\n");
-    printf("   ──────────────────────────────────\n");
+    // Four entries at most: frame 0 is used again before frame 4 arrives, so
+    // frame 1 is the one evicted
+    DedupCache small_cache;
+    DedupStats small_stats;
+    uint8_t dedup_buffer[2048];
+    bool dedup_bounded = dedup_cache_init(&small_cache, 4, 1 << 20);
+    for (size_t k = 0; dedup_bounded && k < 5; k++) {
+        if (k == 4) dedup_compress_to(&small_cache, heartbeats[0], heartbeat_size[0], dedup_buffer, sizeof(dedup_buffer));
+        dedup_bounded = dedup_compress_to(&small_cache, heartbeats[k], heartbeat_size[k], dedup_buffer,
+                                          sizeof(dedup_buffer)) > 0;
+    }
+    dedup_cache_stats(&small_cache, &small_stats);
+    dedup_bounded = dedup_bounded && small_stats.entries == 4 && small_stats.evictions == 1 && small_stats.hits == 1;
+    dedup_compress_to(&small_cache, heartbeats[0], heartbeat_size[0], dedup_buffer, sizeof(dedup_buffer));
+    dedup_compress_to(&small_cache, heartbeats[1], heartbeat_size[1], dedup_buffer, sizeof(dedup_buffer));
+    dedup_cache_stats(&small_cache, &small_stats);
+    dedup_bounded = dedup_bounded && small_stats.hits == 2 && small_stats.evictions == 2;
+    dedup_cache_free(&small_cache);
     
-    size_t sizes[] = {16, 64, 256, 1024, 4096};
+    // A byte budget of about two frames
+    size_t budget = 2 * (sizeof(DedupEntry) + 2 * 512);
+    dedup_bounded = dedup_bounded && dedup_cache_init(&small_cache, 64, budget);
+    for (size_t k = 0; dedup_bounded && k < fleet_kinds; k++) {
+        dedup_compress_to(&small_cache, heartbeats[k], heartbeat_size[k], dedup_buffer, sizeof(dedup_buffer));
+        dedup_cache_stats(&small_cache, &small_stats);
+        dedup_bounded = small_stats.entries >= 1 && small_stats.bytes <= budget + 64 * sizeof(DedupEntry*);
+    }
+    // A frame over the whole budget compresses but is never kept
+    uint8_t* oversized = generate_pattern("mixed", 4096);
+    size_t oversized_bound = byte_compress_bound(4096);
+    uint8_t* oversized_out = (uint8_t*)malloc(oversized_bound);
+    DedupStats oversized_stats;
+    dedup_bounded = dedup_bounded && dedup_compress_to(&small_cache, oversized, 4096, oversized_out, oversized_bound) > 0 &&
+                    dedup_compress_to(&small_cache, oversized, 4096, oversized_out, oversized_bound) > 0;
+    dedup_cache_stats(&small_cache, &oversized_stats);
+    dedup_bounded = dedup_bounded && oversized_stats.entries == small_stats.entries &&
+                    oversized_stats.hits == small_stats.hits;
+    dedup_cache_free(&small_cache);
+    free(oversized_out);
+    free(oversized);
     
-    print_comparison_header();
+    // Same hash with different contents is a miss, never the other frame's stream
+    DedupCache collide_cache;
+    bool dedup_collision = dedup_cache_init(&collide_cache, 16, 1 << 16);
+    uint8_t frame_a[256], frame_b[256];
+    uint8_t* collide_source = generate_pattern("mixed", 256);
+    memcpy(frame_a, collide_source, 256);
+    memcpy(frame_b, collide_source, 256);
+    frame_b[255] ^= 1;
+    free(collide_source);
+    size_t stream_a = advanced_compress_to(frame_a, 256, dedup_buffer, sizeof(dedup_buffer));
+    uint64_t shared_hash = hash64(frame_a, 256);
+    dedup_store(&collide_cache, shared_hash, frame_a, 256, dedup_buffer, stream_a);
+    dedup_collision = dedup_collision &&
+                      dedup_fetch(&collide_cache, shared_hash, frame_b, 256, dedup_buffer, sizeof(dedup_buffer)) == 0 &&
+                      dedup_fetch(&collide_cache, shared_hash, frame_a, 255, dedup_buffer, sizeof(dedup_buffer)) == 0 &&
+                      dedup_fetch(&collide_cache, shared_hash, frame_a, 256, dedup_buffer, sizeof(dedup_buffer)) == stream_a;
+    // ... and so is a hit whose stream doesn't fit the caller's buffer
+    dedup_collision = dedup_collision &&
+                      dedup_fetch(&collide_cache, shared_hash, frame_a, 256, dedup_buffer, stream_a - 1) == 0;
+    dedup_cache_free(&collide_cache);
     
-    for (int s = 0; s < 5; s++) {
-        uint8_t* test_data = generate_pattern("mixed", sizes[s]);
-        if (!test_data) continue;
-        
-        TestResult simple_result = run_single_test(&algorithms[0], test_data, sizes[s]);
-        TestResult advanced_result = run_single_test(&algorithms[1], test_data, sizes[s]);
-        
-        char test_name[32];
-        snprintf(test_name, sizeof(test_name), "%zu bytes", sizes[s]);
-        print_comparison_row(test_name, &simple_result, &advanced_result);
-        
-        free(test_data);
+    // Frames spliced into a stream between ordinary updates
+    DedupCache stream_cache;
+    StreamEncoder* frame_encoder = (StreamEncoder*)malloc(sizeof(StreamEncoder));
+    StreamDecoder* frame_decoder = (StreamDecoder*)malloc(sizeof(StreamDecoder));
+    size_t frame_total = 0;
+    uint8_t* frame_expected = (uint8_t*)malloc(1 << 20);
+    size_t frame_packed_cap = byte_compress_bound(1 << 20);
+    uint8_t* frame_packed = (uint8_t*)malloc(frame_packed_cap);
+    uint8_t* frame_decoded = (uint8_t*)malloc(1 << 20);
+    uint8_t* filler = generate_pattern("mixed", 2000);
+    bool dedup_stream = dedup_cache_init(&stream_cache, 64, 1 << 20);
+    stream_encoder_init(frame_encoder);
+    StreamOutput frame_out = {frame_packed, frame_packed_cap, 0};
+    for (size_t i = 0; dedup_stream && i < 400; i++) {
+        if (i % 3 == 0) {
+            StreamInput update = {filler, 1000 + i, 0};
+            dedup_stream = stream_encoder_update(frame_encoder, &update, &frame_out);
+            memcpy(frame_expected + frame_total, filler, update.size);
+            frame_total += update.size;
+        }
+        size_t k = i % 5;
+        dedup_stream = dedup_stream &&
+                       stream_encoder_frame(frame_encoder, &stream_cache, heartbeats[k], heartbeat_size[k], &frame_out);
+        memcpy(frame_expected + frame_total, heartbeats[k], heartbeat_size[k]);
+        frame_total += heartbeat_size[k];
     }
+    dedup_stream = dedup_stream && stream_encoder_flush(frame_encoder, &frame_out);
     
-    print_comparison_footer();
-    
-    // Speed benchmark
-    printf("\n4. SPEED BENCHMARK (10000 iterations on 256-byte buffer)\n");
-    printf("   ─────────────────────────────────────────────────────\n");
+    // Too little room: nothing is taken, so the call can be repeated
+    stream_encoder_init(frame_encoder);
+    StreamOutput tight = {dedup_buffer, 8, 0};
+    dedup_stream = dedup_stream &&
+                   !stream_encoder_frame(frame_encoder, &stream_cache, heartbeats[0], heartbeat_size[0], &tight) &&
+                   tight.pos == 0;
     
-    uint8_t* bench_data = generate_pattern("mixed", 256);
-    uint8_t* work_buffer = (uint8_t*)malloc(512);
+    StreamInput frame_in = {frame_packed, frame_out.pos, 0};
+    StreamOutput frame_back = {frame_decoded, 1 << 20, 0};
+    stream_decoder_init(frame_decoder);
+    dedup_stream = dedup_stream && stream_decoder_update(frame_decoder, &frame_in, &frame_back) &&
+                   stream_decoder_end(frame_decoder) && frame_back.pos == frame_total &&
+                   memcmp(frame_decoded, frame_expected, frame_total) == 0;
+    memset(frame_decoded, 0, frame_total);
+    dedup_stream = dedup_stream &&
+                   advanced_decompress_to(frame_packed, frame_out.pos, frame_decoded, 1 << 20) == frame_total &&
+                   memcmp(frame_decoded, frame_expected, frame_total) == 0;
+    DedupStats stream_stats;
+    dedup_cache_stats(&stream_cache, &stream_stats);
+    dedup_stream = dedup_stream && stream_stats.hits == 400 - 5;
+    dedup_cache_free(&stream_cache);
+    free(filler);
+    free(frame_decoded);
+    free(frame_packed);
+    free(frame_expected);
+    free(frame_decoder);
+    free(frame_encoder);
     
-    for (int a = 0; a < 2; a++) {
-        memcpy(work_buffer, bench_data, 256);
-        
-        double start = get_time_ms();
-        for (int i = 0; i < 10000; i++) {
-            memcpy(work_buffer, bench_data, 256);
-            algorithms[a].compress(work_buffer, 256);
+    // Hits show up in the encoder statistics of the thread that looked them up
+    EncoderStats dedup_counts;
+    encoder_stats_reset(&dedup_counts);
+    bool dedup_counted = true;
+    if (encoder_stats_attach(&dedup_counts)) {
+        DedupCache counted_cache;
+        dedup_counted = dedup_cache_init(&counted_cache, 16, 1 << 16);
+        for (size_t i = 0; dedup_counted && i < 10; i++) {
+            dedup_counted = dedup_compress_to(&counted_cache, heartbeats[i % 2], heartbeat_size[i % 2], dedup_buffer,
+                                              sizeof(dedup_buffer)) > 0;
         }
-        double compress_time = get_time_ms() - start;
-        
-        printf("   %s:\n", algorithms[a].name);
-        printf("   • Compression: %.2f ms total, %.4f μs per operation\n",
-               compress_time, compress_time * 1000 / 10000);
-        printf("   • Throughput: %.2f MB/s\n", 
-               (256.0 * 10000) / (compress_time * 1000));
+        encoder_stats_attach(NULL);
+        dedup_counted = dedup_counted && dedup_counts.dedup_lookups == 10 && dedup_counts.dedup_hits == 8 &&
+                        dedup_counts.dedup_bytes == 4 * (heartbeat_size[0] + heartbeat_size[1]);
+        dedup_cache_free(&counted_cache);
     }
     
-    free(bench_data);
-    free(work_buffer);
+    for (size_t i = 0; i < fleet_count; i++) {
+        bool shared = false;
+        for (size_t k = 0; k < fleet_kinds && !shared; k++) shared = fleet_in[i].data == heartbeats[k];
+        if (!shared) free((uint8_t*)fleet_in[i].data);
+        free(fleet_plain[i].data);
+        free(fleet_cached[i].data);
+    }
+    for (size_t k = 0; k < fleet_kinds; k++) free(heartbeats[k]);
+    free(fleet_cached);
+    free(fleet_plain);
+    free(fleet_in);
+    
+    printf("   • XXH64 test vectors: %s\n", dedup_hash ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Cached batch output identical to byte_compress_batch: %s\n", dedup_fleet ? "✓ PASSED" : "✗ FAILED");
+    printf("   • One cache shared by batch workers: %s\n", dedup_shared ? "✓ PASSED" : "✗ FAILED");
+    printf("   • LRU eviction and entry/byte limits: %s\n", dedup_bounded ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Same hash, different frame is a miss: %s\n", dedup_collision ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Frames spliced into a stream round-trip: %s\n", dedup_stream ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Hits counted in encoder statistics: %s\n", dedup_counted ? "✓ PASSED" : "✗ FAILED");
+    printf("   • Every repeated heartbeat served from the cache: %s\n",
+           dedup_served && dedup_fleet ? "✓ PASSED" : "✗ FAILED");
     
     // Summary
-    printf("\n5. SUMMARY & RECOMMENDATIONS\n");
-    printf("   ─────────────────────────\n");
+    printf("\n30. SUMMARY & RECOMMENDATIONS\n");
+    printf("   ────────────────────────────\n");
     
     double avg_simple = total_simple_ratio / test_count;
     double avg_advanced = total_advanced_ratio / test_count;
@@ -713,8 +9230,111 @@ void run_comprehensive_tests() {
     printf("\n════════════════════════════════════════════════════════════════════════\n");
 }
 
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if invalid.
+static size_t parse_size(const char* text) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    if (*end == 'K' || *end == 'k') value <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') value <<= 20, end++;
+    else if (*end == 'G' || *end == 'g') value <<= 30, end++;
+    return *end ? 0 : (size_t)value;
+}
+
+// Command line: compress -c|-d [-l level] [-F filter] [-T threads] input output
+//               compress -b [-f table|csv|json] [-s max_size] [-T threads] [corpus_dir]
+static int run_cli(int argc, char** argv) {
+    const char* usage = "usage: %s -c|-d [-l level] [-F filter] [-T threads] input output\n"
+                        "       %s -b [-f table|csv|json] [-s max_size] [-T threads] [corpus_dir]\n"
+                        "  -c         compress input into a frame\n"
+                        "  -d         decompress a frame\n"
+                        "  -b         run the benchmark suite, on the files in corpus_dir if given\n"
+                        "  -l level   1 fast, 2 default, 3 smallest\n"
+                        "  -F filter  none (default), shuffle16, shuffle32, delta16, delta32 or auto\n"
+                        "  -T threads worker threads, 0 = one per CPU (default)\n"
+                        "  -f format  benchmark output format (default table)\n"
+                        "  -s size    largest benchmark input, K/M/G suffixes (default 256M)\n";
+    int mode = 0;
+    int format = BENCH_TABLE;
+    size_t max_size = BENCH_MAX_SIZE;
+    FrameOptions opts;
+    frame_options_init(&opts);
+    opts.threads = 0;
+    
+    int option;
+    while ((option = getopt(argc, argv, "cdbl:F:T:f:s:")) != -1) {
+        char* end;
+        if (option == 'c' || option == 'd' || option == 'b') {
+            mode = option;
+        } else if (option == 'l') {
+            long level = strtol(optarg, &end, 10);
+            if (*end || level < COMPRESS_LEVEL_FAST || level > COMPRESS_LEVEL_MAX) mode = '?';
+            opts.level = (int)level;
+        } else if (option == 'F') {
+            opts.filter = strcmp(optarg, "auto") == 0 ? FILTER_AUTO : FILTER_COUNT;
+            for (uint8_t f = FILTER_NONE; f < FILTER_COUNT; f++) {
+                if (strcmp(optarg, filter_names[f]) == 0) opts.filter = f;
+            }
+            if (opts.filter == FILTER_COUNT) mode = '?';
+        } else if (option == 'T') {
+            long threads = strtol(optarg, &end, 10);
+            if (*end || threads < 0) mode = '?';
+            opts.threads = (size_t)threads;
+        } else if (option == 'f') {
+            if (strcmp(optarg, "table") == 0) format = BENCH_TABLE;
+            else if (strcmp(optarg, "csv") == 0) format = BENCH_CSV;
+            else if (strcmp(optarg, "json") == 0) format = BENCH_JSON;
+            else mode = '?';
+        } else if (option == 's') {
+            max_size = parse_size(optarg);
+            if (max_size == 0) mode = '?';
+        } else {
+            mode = '?';
+        }
+        if (mode == '?') break;
+    }
+    if (mode == 'b' && argc - optind <= 1) {
+        bool ok = optind == argc ? run_benchmark(format, max_size, opts.threads)
+                                 : run_corpus_benchmark(argv[optind], format, max_size, opts.threads);
+        if (ok) return 0;
+        fprintf(stderr, "%s: benchmark failed\n", argv[0]);
+        return 1;
+    }
+    if ((mode != 'c' && mode != 'd') || argc - optind != 2) {
+        fprintf(stderr, usage, argv[0], argv[0]);
+        return 2;
+    }
+    
+    const char* in_path = argv[optind];
+    const char* out_path = argv[optind + 1];
+    struct stat st;
+    uint64_t in_size = stat(in_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+    uint64_t out_size = 0;
+    
+    errno = 0;
+    double start = get_time_ms();
+    bool ok = mode == 'c' ? file_compress(in_path, out_path, &opts, &out_size)
+                          : file_decompress(in_path, out_path, opts.threads, &out_size);
+    double seconds = (get_time_ms() - start) / 1000.0;
+    
+    if (!ok) {
+        fprintf(stderr, "%s: %s failed: %s\n", argv[0], mode == 'c' ? "compression" : "decompression",
+                errno ? strerror(errno) : "corrupt or truncated frame");
+        return 1;
+    }
+    
+    uint64_t original = mode == 'c' ? in_size : out_size;
+    printf("%s -> %s: %llu -> %llu bytes (%.1f%%), %.1f MB/s\n", in_path, out_path,
+           (unsigned long long)in_size, (unsigned long long)out_size,
+           in_size ? 100.0 * out_size / in_size : 0.0,
+           seconds > 0 ? original / 1048576.0 / seconds : 0.0);
+    return 0;
+}
+
 // Main function
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1) return run_cli(argc, argv);
+    
     // Seed random number generator
     srand(time(NULL));
     